@@ -8,11 +8,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifdef WIN32
 #include <winsock2.h>
 #define NO_CLIENT_LONG_LONG
+#define SHUT_RDWR SD_BOTH
 #endif
 
 #include "mysql.h"
@@ -28,6 +48,15 @@
 #define LUASQL_CURSOR_MYSQL "MySQL cursor"
 #define LUASQL_STATEMENT "MySQL statement"
 #define LUASQL_STATEMENT_CURSOR "MySQL statement cursor"
+#define LUASQL_SCAN_MYSQL "MySQL scan"
+#define LUASQL_ROW_MYSQL "MySQL row"
+#define LUASQL_ROUTER_MYSQL "MySQL router"
+#define LUASQL_BINLOG_MYSQL "MySQL binlog stream"
+
+#ifndef CR_NEW_STMT_METADATA  /* client libraries that lack it */
+#define CR_NEW_STMT_METADATA 2057
+#endif
+#define LUASQL_ER_QUERY_TIMEOUT 3024  /* MAX_EXECUTION_TIME exceeded */
 
 /* For compat with old version 4.0 */
 #if (MYSQL_VERSION_ID < 40100) 
@@ -61,16 +90,194 @@
 
 #endif
 
+/*
+** TLS sessions of the servers an environment connected to, keyed by
+** user@host:port, so that later connections can resume them.
+*/
+typedef struct tls_session {
+	char               *key;
+	char               *data;      /* serialized by mysql_get_ssl_session_data */
+	struct tls_session *next;
+} tls_session;
+
+typedef struct {
+	pthread_mutex_t lock;          /* scan workers connect from their threads */
+	tls_session    *list;
+} tls_cache;
+
+/*
+** Database time spent on behalf of one call site.
+*/
+typedef struct {
+	lua_Integer calls;
+	long long   client_ns;         /* inside the client library */
+	long long   convert_ns;        /* turning rows into Lua values */
+	lua_Integer rows;
+	lua_Integer bytes;
+} prof_site;
+
+#define PROF_MAXDEPTH 32
+
+/*
+** Call-site profile of an environment, collected while profiling is on.
+*/
+typedef struct {
+	short      on;
+	int        depth;              /* Lua frames that make up a call site */
+	int        every;              /* profile one call in every */
+	unsigned int tick;
+	int        index;              /* reference to call site -> position in sites */
+	int        nsites, size;
+	prof_site *sites;
+} profiler;
+
+/*
+** State of one profiled call, on the stack of its method so that nested
+** calls keep their own; site is -1 when the call is not profiled.
+*/
+typedef struct {
+	int        site;
+	long long  start;
+	long long  mark;               /* when the call got its row, 0 if not yet */
+	lua_Integer rows, bytes;       /* returned by the call */
+} prof_call;
+
 typedef struct {
 	short      closed;
+	short      lib;                /* holds a reference to the client library */
+	tls_cache  tls;
+	profiler   prof;
 } env_data;
 
+/*
+** Everything needed to open another connection like an existing one.
+*/
+typedef struct {
+	char          *host, *user, *password, *db, *unix_socket;
+	unsigned int   port;
+	unsigned long  client_flag;
+	unsigned int   ssl_mode;       /* SSL_MODE_*, 0 for the library default */
+	char          *ssl_ca, *ssl_capath, *ssl_cert, *ssl_key, *ssl_cipher, *tls_version;
+	unsigned int   connect_timeout; /* seconds, 0 for the library default */
+	short          session_reuse;  /* resume TLS sessions through tls */
+	tls_cache     *tls;            /* session cache of the environment */
+} conn_params;
+
+/*
+** Counters reported by conn:stats().
+*/
+typedef struct {
+	lua_Integer batch_commits;     /* batches committed */
+	lua_Integer batch_statements;  /* statements in committed batches */
+	lua_Integer batch_rollbacks;   /* batches rolled back after an error */
+	lua_Integer last_batch;        /* statements in the last committed batch */
+	lua_Integer reconnects;        /* connections replaced after a loss */
+	lua_Integer reprepares;        /* statements prepared again after one */
+	lua_Integer result_rebuilds;   /* statement result buffers built anew */
+	lua_Integer retries;           /* reads retried after one */
+	lua_Integer timeouts;          /* calls given up at their deadline */
+} conn_stats;
+
+struct stmt_data;
+struct stmt_cur_data;
+struct row_store;
+struct watch;
+
 typedef struct {
 	short      closed;
 	int        env;                /* reference to environment */
+	env_data  *envp;               /* environment object, kept alive by env */
 	MYSQL     *my_conn;
+	short      streaming;          /* an unbuffered cursor is reading from my_conn */
+	conn_params params;            /* parameters used by env_connect */
+	short      autocommit;         /* autocommit mode set by the user */
+	int        batch_rows;         /* autobatch: statements per commit, 0 if off */
+	int        batch_ms;           /* autobatch: age past which the next statement commits */
+	int        batch_pending;      /* statements run in the open batch */
+	short      batch_open;         /* the batch transaction was started */
+	long long  batch_start;        /* when the open batch started, in ms */
+	int        batch_report;       /* reference to the commit callback */
+	int        batch_error;        /* reference to its last error, LUA_NOREF for none */
+	short      reconnect;          /* reconnect when the server goes away */
+	unsigned int epoch;            /* bumped on every reconnect */
+	struct stmt_data *stmts;       /* live statements of the connection */
+	unsigned long max_packet;      /* server max_allowed_packet, 0 if unknown */
+	int        prepare_after;      /* runs of a query before it is prepared, 0 never */
+	int        sqlcache;           /* reference to sql -> run count or statement */
+	int        sqlcache_size;      /* entries in the cache table */
+	short      temporal;           /* temporal mode of new cursors */
+	short      json;               /* new cursors decode JSON columns */
+	struct stmt_cur_data *pending; /* statement cursor with result sets left to read */
+	int        outstanding;        /* cursors open on the connection */
+	size_t     max_result_bytes;   /* memory a buffered result may use, 0 no limit */
+	short      spill;              /* results past the limit go to a file */
+	long long  result_mem;         /* bytes held by open cursors */
+	long long  result_disk;        /* bytes open cursors spilled to files */
+	lua_Integer timeout_ms;        /* default deadline of calls, 0 for none */
+	MYSQL     *control;            /* sends KILL QUERY, opened when first needed */
+	struct watch *watch;           /* deadline of the blocking call, if any */
+	conn_stats stats;
 } conn_data;
 
+/*
+** Deadline of a blocking call.  The call arms a watch on its own stack
+** before it blocks in the client library and disarms it when that
+** returns; nothing between may raise a Lua error.
+*/
+typedef struct watch {
+	long long     deadline;        /* now_ms () when the call is given up */
+	conn_data    *conn;            /* NULL if not armed */
+	atomic_int    fired;           /* the call was interrupted */
+	short         firing;          /* the thread is interrupting it */
+	struct watch *next;
+} watch;
+
+/*
+** A batch of rows copied out of a result set by the read-ahead worker.
+** Every cell is NUL terminated; a NULL cell pointer is an SQL NULL.
+*/
+typedef struct {
+	int            nrows;          /* rows in the batch */
+	int            rowcap;         /* rows the arrays can hold */
+	char         **cells;          /* nrows * numcols pointers into data */
+	size_t        *offsets;        /* cell offsets while the batch is filled */
+	unsigned long *lengths;        /* nrows * numcols cell lengths */
+	char          *data;
+	size_t         datalen, datasize;
+} row_batch;
+
+/*
+** Background reader of an unbuffered result set.  The worker thread is
+** the single producer and the Lua thread the single consumer of a ring
+** of row batches; positions are atomic so neither side takes the lock
+** unless it has to sleep on a full or empty ring.
+*/
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	atomic_int      waiters;       /* threads sleeping on cond */
+} ra_signal;
+
+typedef struct {
+	MYSQL_RES      *res;
+	MYSQL          *my_conn;
+	int             numcols;
+	int             depth;         /* number of batches in the ring */
+	int             batchrows;     /* rows per batch */
+	row_batch      *ring;
+	atomic_uint     head;          /* batches published by the worker */
+	atomic_uint     tail;          /* batches released by the consumer */
+	atomic_int      done;          /* worker has finished */
+	atomic_int      cancel;        /* consumer asked the worker to stop */
+	unsigned int    my_errno;      /* error reported by the worker */
+	char            errmsg[256];
+	int             holding;       /* consumer holds ring[tail % depth] */
+	int             pos;           /* next row of the held batch */
+	pthread_t       thread;
+	ra_signal      *sig;           /* where both sides sleep */
+	ra_signal       own;
+} readahead_data;
+
 typedef struct {
 	short      closed;
 	int        conn;               /* reference to connection */
@@ -78,9 +285,52 @@ typedef struct {
 	int        colnames, coltypes; /* reference to column information tables */
 	MYSQL_RES *my_res;
 	MYSQL 	  *my_conn;
+	conn_data *connp;              /* connection object, kept alive by conn */
+	short      streaming;          /* result comes from mysql_use_result */
+	readahead_data *ra;            /* background reader, if any */
+	int        ra_depth, ra_batchrows; /* reader settings, kept for later result sets */
+	MYSQL_ROW  row;                /* current row */
+	unsigned long *lengths;        /* lengths of the current row */
+	unsigned int generation;       /* bumped whenever row is replaced */
+	int        colindex;           /* reference to name -> position table */
+	short      temporal;           /* how temporal columns are returned */
+	short      json;               /* decode JSON columns */
+	struct row_store *store;       /* rows kept by the driver, if any */
+	long long  mem, disk;          /* bytes accounted to the connection */
+	lua_Integer timeout_ms;        /* deadline of each fetch of a streaming cursor */
 } cur_data;
 
+struct scan_data;
+
+/*
+** One key range of a parallel scan, read by its own thread over its own
+** connection into its own ring.
+*/
 typedef struct {
+	readahead_data   ra;
+	struct scan_data *scan;
+	long long        lo, hi;       /* inclusive key range */
+	short            started;      /* thread was created */
+	short            eof;          /* consumer has seen the end */
+} scan_part;
+
+typedef struct scan_data {
+	short       closed;
+	int         numcols;           /* columns seen by the caller */
+	int         colnames;          /* reference to column names */
+	short       ordered;           /* return rows in key order */
+	short       named;             /* rows are keyed by column name */
+	int         current;           /* partition read last */
+	int         nparts;
+	int         pagesize;          /* rows per keyset page */
+	char       *table, *key, *columns, *where;
+	int         env;               /* reference to the environment, whose TLS cache the workers use */
+	conn_params params;
+	ra_signal   sig;               /* shared by every partition */
+	scan_part  *parts;
+} scan_data;
+
+typedef struct stmt_cur_data {
 	short      closed;
 	MYSQL_STMT *stmt;
 	int        num_fields;          
@@ -91,27 +341,321 @@ typedef struct {
 	unsigned long *lengths ;
 	bool *is_null;
 	int stmt_ref;  // Reference to the connection in Lua registry
+	struct stmt_data *owner;  /* statement the cursor reads from */
+	unsigned int generation;  /* bumped on every fetch */
+	int colindex;             /* reference to name -> position table */
+	int colnames, coltypes;   /* reference to column information tables */
+	short temporal;           /* how temporal columns are returned */
+	short json;               /* decode JSON columns */
+	struct row_store *store;  /* rows kept by the driver, if any */
+	long long mem, disk;      /* bytes accounted to the connection */
+	short borrowed;           /* the buffers belong to owner */
 } stmt_cur_data;
 
+/*
+** A column value owned by a copied row.  data is NULL for SQL NULL.
+*/
+typedef struct {
+	enum enum_field_types type;
+	unsigned long         length;
+	char                 *data;
+	short                 binary;     /* data is a MYSQL_TIME */
+	unsigned int          decimals;   /* of temporal values */
+} row_cell;
+
+#define ROW_CURSOR      0   /* view of a cursor's current row */
+#define ROW_STMT_CURSOR 1   /* view of a statement cursor's current row */
+#define ROW_COPY        2   /* owns its values */
+
+/*
+** Row proxy returned by fetch("l").  Columns are turned into Lua values
+** only when they are indexed.  A view is valid until its cursor moves.
+*/
+typedef struct {
+	short          closed;
+	short          kind;
+	void          *cur;            /* cursor viewed */
+	int            curref;         /* reference to the cursor (views) */
+	int            colindex;       /* reference to name -> position table */
+	unsigned int   generation;     /* cursor row the view refers to */
+	int            numcols;
+	short          temporal;       /* copies: how temporal columns are returned */
+	short          json;           /* copies: decode JSON columns */
+	row_cell      *cells;          /* copies: numcols cells then the data */
+} row_data;
+
+#define SQLCACHE_MAX 1024  /* queries counted per connection */
 
+/*
+** Growable NUL terminated buffer for building SQL text.
+*/
 typedef struct {
+	char  *data;
+	size_t len, size;
+	short  oom;                    /* an allocation failed */
+} sqlbuf;
+
+/*
+** Rows of a buffered result kept by the driver rather than the client
+** library, so that their size can be bounded.  A cell is stored as a
+** 4 byte length (STORE_NULL for SQL NULL), its bytes and a NUL.  Rows
+** stay in memory until the limit is reached and then move to an
+** unlinked temporary file; only the row offsets stay in memory.
+*/
+#define STORE_NULL 0xFFFFFFFFu
+
+typedef struct row_store {
+	int            numcols;
+	sqlbuf         mem;            /* rows, or only the row being added once spilled */
+	FILE          *file;           /* spill file, NULL while rows fit in memory */
+	uint64_t      *offsets;        /* start of each row; offsets[nrows] is the end */
+	uint64_t       nrows, cap;
+	uint64_t       pos;            /* next row to read */
+	uint64_t       filepos;        /* where the file is positioned for reading */
+	sqlbuf         row;            /* row read back from the file */
+	char         **cells;          /* current row */
+	unsigned long *lengths;
+	size_t         limit;          /* memory allowed, 0 for no limit */
+	short          spill;          /* spill past the limit instead of failing */
+} row_store;
+
+static atomic_llong result_mem_total;   /* bytes held by all open cursors */
+static atomic_llong result_disk_total;  /* bytes they spilled to files */
+
+/*
+** The client library is shared by every Lua state of the process.  It
+** is initialized with the first environment and ended with the last
+** one.  Threads that use it get their library state set up once per
+** library generation and released when they exit.
+*/
+static pthread_mutex_t lib_lock = PTHREAD_MUTEX_INITIALIZER;
+static int lib_refs;                    /* environments alive in the process */
+static uintptr_t lib_generation;        /* bumped by every mysql_library_init */
+static pthread_once_t lib_once = PTHREAD_ONCE_INIT;
+static pthread_key_t lib_thread_key;    /* generation the thread was set up in */
+
+
+typedef struct stmt_data {
     short closed;
     MYSQL_STMT *stmt;
     MYSQL_BIND *params;
     unsigned int num_params;
     int conn;  // Reference to the connection in Lua registry
+    conn_data *connp;  /* connection object, kept alive by conn */
+    char *sql;  /* statement text, kept to prepare it again */
+    unsigned long sql_len;
+    unsigned int epoch;  /* connection epoch the handle belongs to */
+    short params_bound;  /* params were given to mysql_stmt_bind_param */
+    stmt_cur_data *cursor;  /* open cursor on the handle, if any */
+    struct stmt_data *next, *prev;  /* list of statements of connp */
+
+    /* result buffers kept across executions and lent to each cursor */
+    MYSQL_RES *meta;  /* result metadata, NULL until a result set is seen */
+    int num_fields;
+    MYSQL_BIND *bind;
+    char **row_data;
+    unsigned long *lengths;
+    bool *is_null;
 
     // Added persistent storage for parameter values
     struct {
-        int integer; 
+        long long integer;
         double number;
         char boolean;
+        MYSQL_TIME time;
         char *str;
         unsigned long size;
     } *params_data;
 
 } stmt_data;
 
+/*
+** A replica behind a router.
+*/
+typedef struct {
+	int        conn;               /* reference to the connection */
+	conn_data *connp;
+	short      healthy;            /* cleared by router:check when down or lagging */
+	long long  lag;                /* seconds behind the primary, -1 if unknown */
+	char      *synced;             /* GTID set the replica is known to have applied */
+} router_replica;
+
+/*
+** Splits reads across replicas and sends everything else to a primary.
+*/
+typedef struct {
+	short      closed;
+	int        primary;            /* reference to the primary connection */
+	conn_data *primaryp;
+	int        nreplicas;
+	router_replica *replicas;
+	int        next;               /* first replica tried on ties */
+	short      read_your_writes;   /* replicas wait for the last write's GTIDs */
+	double     gtid_timeout;       /* seconds a replica may take to catch up */
+	long long  max_lag;            /* lag in seconds that ejects a replica */
+	short      tracking;           /* the primary reports GTIDs of its commits */
+	unsigned int track_epoch;      /* primary epoch + 1 tracking was set up in, 0 never */
+	char      *gtid;               /* GTID set of the last write, NULL if none */
+} router_data;
+
+#if MYSQL_VERSION_ID >= 80000 && !defined(MARIADB_BASE_VERSION)
+#define LUASQL_BINLOG
+#endif
+
+#if defined(__linux__)
+#define LUASQL_MULTIPLEX
+#endif
+
+/*
+** A query of env:multiplex, sent on its own connection.
+*/
+typedef struct {
+	conn_data  *conn;
+	const char *sql;               /* anchored in the queries table */
+	size_t      len;
+	lua_Integer timeout;           /* ms, 0 for none */
+	long long   start, deadline;   /* ms, deadline 0 for none */
+	short       killed;            /* the deadline passed and it was interrupted */
+} mux_query;
+
+#ifdef LUASQL_BINLOG
+/*
+** The GTIDs of one source server: sorted, disjoint intervals [start, end).
+*/
+typedef struct {
+	unsigned char uuid[16];
+	int        n, size;
+	int64_t   *iv;                 /* start and end of each interval */
+} gtid_source;
+
+typedef struct {
+	int          n, size;
+	gtid_source *sources;
+} gtid_set;
+
+/*
+** A table as described by the last table map event with its id.
+*/
+typedef struct {
+	uint64_t   id;
+	char      *schema, *name;
+	int        ncols;
+	unsigned char *types;
+	unsigned int  *meta;           /* type metadata of each column */
+	unsigned char *unsig;          /* numeric column declared UNSIGNED */
+	char     **colnames;           /* NULL without binlog_row_metadata=FULL */
+	short      wanted;             /* passes the tables filter */
+} binlog_table;
+
+/*
+** A replication stream decoding the row events of the binary log.
+*/
+typedef struct {
+	short      closed;
+	int        env;                /* reference to the environment */
+	MYSQL     *my_conn;            /* connection dedicated to the stream */
+	MYSQL_RPL  rpl;
+	short      dumping;            /* mysql_binlog_open succeeded */
+	int        checksum;           /* bytes of checksum after each event */
+	unsigned char posthdr[64];     /* post-header length of each event type */
+	int        ntables;
+	binlog_table *tables;
+	int        filter;             /* reference to the set of wanted tables, LUA_NOREF for all */
+	int        batch;              /* changes collected before a call returns */
+	long long  idle_ms;            /* longest wait to return a partial batch */
+	short      temporal;           /* temporal mode of the values */
+	short      json;               /* decode JSON columns */
+	char      *error;              /* failure held back to return a batch first */
+	short      ended;              /* the server ended the stream */
+	char      *file;               /* binlog being read */
+	char      *commitfile;         /* binlog and end of the last commit read */
+	uint64_t   commitpos;
+	short      gtids;              /* executed is known */
+	gtid_set   executed;           /* transactions read so far */
+	short      intrx;              /* between BEGIN and its commit */
+	short      hasgtid;            /* the transaction being read has a GTID */
+	unsigned char uuid[16];
+	int64_t    gno;
+} binlog_data;
+#endif
+
+static void lib_thread_exit (void *arg) {
+	pthread_mutex_lock (&lib_lock);
+	if (lib_refs > 0 && (uintptr_t)arg == lib_generation)
+		mysql_thread_end ();
+	pthread_mutex_unlock (&lib_lock);
+}
+
+
+static void lib_makekey (void) {
+	pthread_key_create (&lib_thread_key, lib_thread_exit);
+}
+
+
+/*
+** Set up the library state of the calling thread if it was not yet.
+** Return 0, or -1 on failure.
+*/
+static int lib_thread (void) {
+	uintptr_t generation;
+	pthread_once (&lib_once, lib_makekey);
+	pthread_mutex_lock (&lib_lock);
+	generation = lib_refs > 0 ? lib_generation : 0;
+	pthread_mutex_unlock (&lib_lock);
+	if (generation == 0 || (uintptr_t)pthread_getspecific (lib_thread_key) == generation)
+		return 0;
+	if (mysql_thread_init ())
+		return -1;
+	pthread_setspecific (lib_thread_key, (void *)generation);
+	return 0;
+}
+
+
+/*
+** Release the library state of the calling thread now instead of when
+** it exits.
+*/
+static void lib_thread_end (void) {
+	pthread_once (&lib_once, lib_makekey);
+	if (pthread_getspecific (lib_thread_key) != NULL) {
+		lib_thread_exit (pthread_getspecific (lib_thread_key));
+		pthread_setspecific (lib_thread_key, NULL);
+	}
+}
+
+
+/*
+** Take a reference to the client library, initializing it if this is
+** the first one.  Return 0, or -1 on failure.
+*/
+static int lib_acquire (void) {
+	int status = 0;
+	pthread_mutex_lock (&lib_lock);
+	if (lib_refs == 0) {
+		if (mysql_library_init (0, NULL, NULL) != 0)
+			status = -1;
+		else
+			lib_generation++;
+	}
+	if (status == 0)
+		lib_refs++;
+	pthread_mutex_unlock (&lib_lock);
+	return status == 0 ? lib_thread () : -1;
+}
+
+
+static void watch_stop (void);
+
+static void lib_release (void) {
+	pthread_mutex_lock (&lib_lock);
+	if (--lib_refs == 0) {
+		watch_stop (); /* no connection is left to time */
+		mysql_library_end ();
+	}
+	pthread_mutex_unlock (&lib_lock);
+}
+
+
 /*
 ** Check for valid environment.
 */
@@ -146,757 +690,8952 @@ static cur_data *getcursor (lua_State *L) {
 
 
 /*
-** Push the value of #i field of #tuple row.
+** Monotonic clock in nanoseconds.
 */
-static void pushvalue (lua_State *L, void *row, long int len) {
-	if (row == NULL)
-		lua_pushnil (L);
-	else
-		lua_pushlstring (L, row, len);
+static long long now_ns (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 
 /*
-** Get the internal database type of the given column.
+** Append a stack frame to a call site: the function name if known, and
+** where it is.  Semicolons separate frames in the folded format.
 */
-static char *getcolumntype (enum enum_field_types type) {
+static void prof_addframe (luaL_Buffer *b, lua_Debug *ar) {
+	char frame[LUA_IDSIZE + 96];
+	int i, n;
+	if (ar->currentline > 0)
+		n = snprintf (frame, sizeof(frame), ar->name ? "%s (%s:%d)" : "%.0s%s:%d",
+			ar->name ? ar->name : "", ar->short_src, ar->currentline);
+	else
+		n = snprintf (frame, sizeof(frame), "%s", ar->name ? ar->name : ar->short_src);
+	if (n >= (int)sizeof(frame))
+		n = (int)sizeof(frame) - 1;
+	for (i = 0; i < n; i++)
+		if (frame[i] == ';')
+			frame[i] = ',';
+	luaL_addlstring (b, frame, n);
+}
 
-	switch (type) {
-		case MYSQL_TYPE_VAR_STRING: case MYSQL_TYPE_STRING:
-			return "string";
-		case MYSQL_TYPE_DECIMAL: case MYSQL_TYPE_SHORT: case MYSQL_TYPE_LONG:
-		case MYSQL_TYPE_FLOAT: case MYSQL_TYPE_DOUBLE: case MYSQL_TYPE_LONGLONG:
-		case MYSQL_TYPE_INT24: case MYSQL_TYPE_YEAR: case MYSQL_TYPE_TINY: 
-			return "number";
-		case MYSQL_TYPE_TINY_BLOB: case MYSQL_TYPE_MEDIUM_BLOB:
-		case MYSQL_TYPE_LONG_BLOB: case MYSQL_TYPE_BLOB:
-			return "binary";
-		case MYSQL_TYPE_DATE: case MYSQL_TYPE_NEWDATE:
-			return "date";
-		case MYSQL_TYPE_DATETIME:
-			return "datetime";
-		case MYSQL_TYPE_TIME:
-			return "time";
-		case MYSQL_TYPE_TIMESTAMP:
-			return "timestamp";
-		case MYSQL_TYPE_ENUM: case MYSQL_TYPE_SET:
-			return "set";
-		case MYSQL_TYPE_NULL:
-			return "null";
-		default:
-			return "undefined";
+
+/*
+** Find or add the call site of the running driver call: the Lua frames
+** above it, outermost first, then the call itself.  Return its position,
+** or -1 if it cannot be added.
+*/
+static int prof_getsite (lua_State *L, profiler *p, const char *op) {
+	lua_Debug ar[PROF_MAXDEPTH];
+	luaL_Buffer b;
+	int n, i, site;
+	for (n = 0; n < p->depth && lua_getstack (L, n + 1, &ar[n]); n++)
+		lua_getinfo (L, "Sln", &ar[n]);
+	luaL_buffinit (L, &b);
+	for (i = n - 1; i >= 0; i--) {
+		prof_addframe (&b, &ar[i]);
+		luaL_addchar (&b, ';');
+	}
+	luaL_addstring (&b, "mysql.");
+	luaL_addstring (&b, op);
+	luaL_pushresult (&b);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, p->index);
+	lua_pushvalue (L, -2);
+	lua_rawget (L, -2);
+	if (lua_isinteger (L, -1))
+		site = (int)lua_tointeger (L, -1);
+	else {
+		if (p->nsites == p->size) {
+			int size = p->size ? p->size * 2 : 64;
+			prof_site *sites = (prof_site *)realloc (p->sites, size * sizeof(prof_site));
+			if (sites == NULL) {
+				lua_pop (L, 3);
+				return -1;
+			}
+			p->sites = sites;
+			p->size = size;
+		}
+		site = p->nsites++;
+		memset (&p->sites[site], 0, sizeof(prof_site));
+		lua_pushvalue (L, -3);
+		lua_pushinteger (L, site);
+		lua_rawset (L, -4);
 	}
+	lua_pop (L, 3);
+	return site;
 }
 
 
 /*
-** Creates the lists of fields names and fields types.
+** Start timing a call named op if profiling is on and the call is
+** sampled.  Costs a flag test otherwise.
 */
-static void create_colinfo (lua_State *L, cur_data *cur) {
-	MYSQL_FIELD *fields;
-	char typename[50];
+static void prof_begin (lua_State *L, env_data *env, const char *op, prof_call *pc) {
+	profiler *p = &env->prof;
+	pc->site = -1;
+	if (!p->on || ++p->tick % p->every != 0)
+		return;
+	pc->site = prof_getsite (L, p, op);
+	pc->mark = 0;
+	pc->rows = pc->bytes = 0;
+	pc->start = now_ns ();
+}
+
+
+/*
+** The fetch profiled by pc, if any, got its row from the client
+** library: what follows is conversion.  Count the row and its bytes.
+*/
+static void prof_row (prof_call *pc, const unsigned long *lengths, int n) {
 	int i;
-	fields = mysql_fetch_fields(cur->my_res);
-	lua_newtable (L); /* names */
-	lua_newtable (L); /* types */
-	for (i = 1; i <= cur->numcols; i++) {
-		lua_pushstring (L, fields[i-1].name);
-		lua_rawseti (L, -3, i);
-		sprintf (typename, "%.20s(%ld)", getcolumntype (fields[i-1].type), fields[i-1].length);
-		lua_pushstring(L, typename);
-		lua_rawseti (L, -2, i);
-	}
-	/* Stores the references in the cursor structure */
-	cur->coltypes = luaL_ref (L, LUA_REGISTRYINDEX);
-	cur->colnames = luaL_ref (L, LUA_REGISTRYINDEX);
+	if (pc == NULL || pc->site < 0)
+		return;
+	pc->mark = now_ns ();
+	pc->rows++;
+	for (i = 0; i < n; i++)
+		pc->bytes += (lua_Integer)lengths[i];
 }
 
 
 /*
-** Closes the cursos and nullify all structure fields.
+** Charge a finished call to its site, scaled up by the sampling rate.
+** Return nres so that a method can end with it.
 */
-static void cur_nullify (lua_State *L, cur_data *cur) {
-	/* Nullify structure fields. */
-	cur->closed = 1;
-	mysql_free_result(cur->my_res);
-	luaL_unref (L, LUA_REGISTRYINDEX, cur->conn);
-	luaL_unref (L, LUA_REGISTRYINDEX, cur->colnames);
-	luaL_unref (L, LUA_REGISTRYINDEX, cur->coltypes);
+static int prof_end (env_data *env, prof_call *pc, int nres) {
+	profiler *p = &env->prof;
+	prof_site *s;
+	long long end;
+	if (pc->site < 0 || pc->site >= p->nsites)
+		return nres;
+	end = now_ns ();
+	s = &p->sites[pc->site];
+	s->calls += p->every;
+	if (pc->mark >= pc->start) {
+		s->client_ns += (pc->mark - pc->start) * p->every;
+		s->convert_ns += (end - pc->mark) * p->every;
+	}
+	else
+		s->client_ns += (end - pc->start) * p->every;
+	s->rows += pc->rows * p->every;
+	s->bytes += pc->bytes * p->every;
+	return nres;
 }
 
-void stmt_cur_nullify(stmt_cur_data *cur) {
-    if (!cur) return;
-	if (cur->closed) return;
-	cur->closed = 1;
-    for (int i = 0; i < cur->num_fields; i++) {
-        free(cur->row_data[i]);
-    }
-    if (cur->my_res) {
-        mysql_free_result(cur->my_res);
-    }
+
+static void prof_reset (lua_State *L, profiler *p) {
+	luaL_unref (L, LUA_REGISTRYINDEX, p->index);
+	p->index = LUA_NOREF;
+	free (p->sites);
+	p->sites = NULL;
+	p->nsites = p->size = 0;
 }
 
-	
+
 /*
-** Get another row of the given cursor.
+** Read an integer field of the options table at index t.
 */
-static int cur_fetch (lua_State *L) {
-	cur_data *cur = getcursor (L);
-	MYSQL_RES *res = cur->my_res;
-	unsigned long *lengths;
-	MYSQL_ROW row = mysql_fetch_row(res);
-	if (row == NULL) {
-		cur_nullify (L, cur);
-		lua_pushnil(L);  /* no more results */
-		return 1;
+static lua_Integer opt_integer (lua_State *L, int t, const char *name, lua_Integer def) {
+	lua_Integer v = def;
+	if (lua_istable (L, t)) {
+		lua_getfield (L, t, name);
+		if (!lua_isnil (L, -1)) {
+			if (!lua_isinteger (L, -1))
+				luaL_error (L, LUASQL_PREFIX"option '%s' must be an integer", name);
+			v = lua_tointeger (L, -1);
+		}
+		lua_pop (L, 1);
 	}
-	lengths = mysql_fetch_lengths(res);
+	return v;
+}
 
-	if (lua_istable (L, 2)) {
-		const char *opts = luaL_optstring (L, 3, "n");
-		if (strchr (opts, 'n') != NULL) {
-			/* Copy values to numerical indices */
-			int i;
-			for (i = 0; i < cur->numcols; i++) {
-				pushvalue (L, row[i], lengths[i]);
-				lua_rawseti (L, 2, i+1);
-			}
-		}
-		if (strchr (opts, 'a') != NULL) {
-			int i;
-			/* Check if colnames exists */
-			if (cur->colnames == LUA_NOREF)
-		        create_colinfo(L, cur);
-			lua_rawgeti (L, LUA_REGISTRYINDEX, cur->colnames);/* Push colnames*/
-	
-			/* Copy values to alphanumerical indices */
-			for (i = 0; i < cur->numcols; i++) {
-				lua_rawgeti(L, -1, i+1); /* push the field name */
 
-				/* Actually push the value */
-				pushvalue (L, row[i], lengths[i]);
-				lua_rawset (L, 2);
-			}
-			/* lua_pop(L, 1);  Pops colnames table. Not needed */
+/*
+** Read a number field of the options table at index t.
+*/
+static lua_Number opt_number (lua_State *L, int t, const char *name, lua_Number def) {
+	lua_Number v = def;
+	if (lua_istable (L, t)) {
+		lua_getfield (L, t, name);
+		if (!lua_isnil (L, -1)) {
+			if (!lua_isnumber (L, -1))
+				luaL_error (L, LUASQL_PREFIX"option '%s' must be a number", name);
+			v = lua_tonumber (L, -1);
 		}
-		lua_pushvalue(L, 2);
-		return 1; /* return table */
+		lua_pop (L, 1);
 	}
-	else {
-		int i;
-		luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
-		for (i = 0; i < cur->numcols; i++)
-			pushvalue (L, row[i], lengths[i]);
-		return cur->numcols; /* return #numcols values */
+	return v;
+}
+
+
+/*
+** Read a boolean field of the options table at index t.
+*/
+static int opt_boolean (lua_State *L, int t, const char *name, int def) {
+	int v = def;
+	if (lua_istable (L, t)) {
+		lua_getfield (L, t, name);
+		if (!lua_isnil (L, -1))
+			v = lua_toboolean (L, -1);
+		lua_pop (L, 1);
 	}
+	return v;
 }
 
-static int stmt_cur_fields (lua_State *L) {
-	stmt_cur_data *cur = (stmt_cur_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_CURSOR);
-	lua_newtable(L);  
-	for (int i = 0; i < cur->num_fields; i++) {
-		lua_pushinteger(L, i+1);
-		lua_pushstring(L, cur->fields[i].name);
-		lua_settable(L, -3);
-	}
-	return 1;
-}
 
-static int stmt_cur_fetch (lua_State *L) {
-	stmt_cur_data *cur = (stmt_cur_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_CURSOR);
-	if (mysql_stmt_fetch(cur->stmt)) {
-		stmt_cur_nullify(cur);
-		lua_pushnil(L);  /* no more results */
-		return 1;
-	}
-	const char *opts = luaL_optstring (L, 2, "n");
-	lua_newtable(L);  
-	for (int i = 0; i < cur->num_fields; i++) {
-		if (strchr (opts, 'n') != NULL){
-			lua_pushinteger(L, i+1);
-		} else{
-			lua_pushstring(L, cur->fields[i].name);
-		}
-		if (cur->is_null[i]) {
-			lua_pushnil(L);
-		} else {
-			cur->row_data[i][cur->lengths[i]] = '\0';
-			lua_pushstring(L, cur->row_data[i]);
+/*
+** Read a string field of the options table at index t.
+*/
+static const char *opt_string (lua_State *L, int t, const char *name, const char *def) {
+	const char *v = def;
+	if (lua_istable (L, t)) {
+		lua_getfield (L, t, name);
+		if (!lua_isnil (L, -1)) {
+			if (lua_type (L, -1) != LUA_TSTRING)
+				luaL_error (L, LUASQL_PREFIX"option '%s' must be a string", name);
+			v = lua_tostring (L, -1);
 		}
-		lua_settable(L, -3);
+		lua_pop (L, 1); /* the string is still anchored in the options table */
 	}
-	return 1;
+	return v;
 }
 
+
 /*
-** Get the next result from multiple statements
+** Format an SQL statement into a newly allocated string.
 */
-static int cur_next_result (lua_State *L) {
-	cur_data *cur = getcursor (L);
-	MYSQL* con = cur->my_conn;
-	int status;
-	if(mysql_more_results(con)){
-		status = mysql_next_result(con);
-		if(status == 0){
-			mysql_free_result(cur->my_res);
-			cur->my_res = mysql_store_result(con);
-			if(cur->my_res != NULL){
-				lua_pushboolean(L, 1);
-				return 1;
-			}else{
-				lua_pushboolean(L, 0);
-				lua_pushinteger(L, mysql_errno(con));
-				lua_pushstring(L, mysql_error(con));
-				return 3;
-			}
-		}else{
-			lua_pushboolean(L, 0);
-			lua_pushinteger(L, status);
-			switch(status){
-				case CR_COMMANDS_OUT_OF_SYNC:
-					lua_pushliteral(L, "CR_COMMANDS_OUT_OF_SYNC");
-				break;
-				case CR_SERVER_GONE_ERROR:
-					lua_pushliteral(L, "CR_SERVER_GONE_ERROR");
-				break;
-				case CR_SERVER_LOST:
-					lua_pushliteral(L, "CR_SERVER_LOST");
-				break;
-				case CR_UNKNOWN_ERROR:
-					lua_pushliteral(L, "CR_UNKNOWN_ERROR");
-				break;
-				default:
-					lua_pushliteral(L, "Unknown");
-			}
-			return 3;
-		}
-	}else{
-		lua_pushboolean(L, 0);
-		lua_pushinteger(L, -1);
-		return 2;
-	}
+static char *sql_format (const char *fmt, ...) {
+	va_list ap;
+	int len;
+	char *sql;
+	va_start (ap, fmt);
+	len = vsnprintf (NULL, 0, fmt, ap);
+	va_end (ap);
+	if (len < 0 || (sql = (char *)malloc (len + 1)) == NULL)
+		return NULL;
+	va_start (ap, fmt);
+	vsnprintf (sql, len + 1, fmt, ap);
+	va_end (ap);
+	return sql;
 }
 
+
 /*
-** Check if next result is available
+** JSON values.  JSON null is represented by the light userdata NULL,
+** exported as the module field "null".
 */
-static int cur_has_next_result (lua_State *L) {
-	cur_data *cur = getcursor (L);
-	lua_pushboolean(L, mysql_more_results(cur->my_conn));
-	return 1;
+#define JSON_MAXDEPTH 256
+
+typedef struct {
+	lua_State  *L;
+	const char *start, *p, *end;
+	int         depth;
+} json_reader;
+
+static void json_fail (json_reader *r, const char *what) {
+	luaL_error (r->L, LUASQL_PREFIX"invalid JSON column (%s at offset %d)", what, (int)(r->p - r->start));
 }
 
+#define JSON_ONES  ((uint64_t)0x0101010101010101ULL)
+#define JSON_HIGHS ((uint64_t)0x8080808080808080ULL)
 
 /*
-** Cursor object collector function
+** Find the first '"', '\' or control character at or after p.  Plain
+** bytes are skipped eight at a time with a word-wide test.
 */
-static int cur_gc (lua_State *L) {
-	cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUASQL_CURSOR_MYSQL);
-	if (cur != NULL && !(cur->closed))
-		cur_nullify (L, cur);
-	return 0;
+static const char *json_scanstring (const char *p, const char *end) {
+	while (end - p >= 8) {
+		uint64_t w, q, b, c;
+		memcpy (&w, p, 8);
+		q = w ^ (JSON_ONES * '"');
+		b = w ^ (JSON_ONES * '\\');
+		c = (q - JSON_ONES) & ~q;          /* high bit set where w had '"' */
+		c |= (b - JSON_ONES) & ~b;         /* ... or '\' */
+		c |= (w - JSON_ONES * 0x20) & ~w;  /* ... or a byte below 0x20 */
+		if (c & JSON_HIGHS)
+			break;
+		p += 8;
+	}
+	while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+		p++;
+	return p;
 }
 
+static void json_skipspace (json_reader *r) {
+	while (r->p < r->end && (*r->p == ' ' || *r->p == '\n' || *r->p == '\r' || *r->p == '\t'))
+		r->p++;
+}
+
+static unsigned long json_hex4 (json_reader *r) {
+	unsigned long v = 0;
+	int i;
+	if (r->end - r->p < 4)
+		json_fail (r, "truncated escape");
+	for (i = 0; i < 4; i++) {
+		int c = (unsigned char)*r->p++;
+		v <<= 4;
+		if (c >= '0' && c <= '9') v |= c - '0';
+		else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+		else json_fail (r, "bad escape");
+	}
+	return v;
+}
 
 /*
-** Close the cursor on top of the stack.
-** Return 1
+** Push the string starting after its opening quote.
 */
-static int cur_close (lua_State *L) {
-	cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUASQL_CURSOR_MYSQL);
-	luaL_argcheck (L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
-	if (cur->closed) {
-		lua_pushboolean (L, 0);
-		lua_pushstring(L, "cursor is already closed");
-		return 2;
+static void json_string (json_reader *r) {
+	const char *s = r->p;
+	luaL_Buffer b;
+	r->p = json_scanstring (r->p, r->end);
+	if (r->p < r->end && *r->p == '"') { /* no escapes: the common case */
+		lua_pushlstring (r->L, s, r->p - s);
+		r->p++;
+		return;
 	}
-	cur_nullify (L, cur);
-	lua_pushboolean (L, 1);
-	return 1;
+	luaL_buffinit (r->L, &b);
+	for (;;) {
+		luaL_addlstring (&b, s, r->p - s);
+		if (r->p >= r->end || (unsigned char)*r->p < 0x20)
+			json_fail (r, "unterminated string");
+		if (*r->p++ == '"')
+			break;
+		if (r->p >= r->end)
+			json_fail (r, "unterminated string");
+		switch (*r->p++) {
+			case '"': luaL_addchar (&b, '"'); break;
+			case '\\': luaL_addchar (&b, '\\'); break;
+			case '/': luaL_addchar (&b, '/'); break;
+			case 'b': luaL_addchar (&b, '\b'); break;
+			case 'f': luaL_addchar (&b, '\f'); break;
+			case 'n': luaL_addchar (&b, '\n'); break;
+			case 'r': luaL_addchar (&b, '\r'); break;
+			case 't': luaL_addchar (&b, '\t'); break;
+			case 'u': {
+				unsigned long c = json_hex4 (r);
+				char utf8[4];
+				if (c >= 0xD800 && c <= 0xDBFF && r->end - r->p >= 6 && r->p[0] == '\\' && r->p[1] == 'u') {
+					unsigned long lo;
+					r->p += 2;
+					lo = json_hex4 (r);
+					if (lo < 0xDC00 || lo > 0xDFFF)
+						json_fail (r, "bad surrogate pair");
+					c = 0x10000 + ((c - 0xD800) << 10) + (lo - 0xDC00);
+				}
+				if (c < 0x80)
+					luaL_addchar (&b, (char)c);
+				else if (c < 0x800) {
+					utf8[0] = (char)(0xC0 | (c >> 6));
+					utf8[1] = (char)(0x80 | (c & 0x3F));
+					luaL_addlstring (&b, utf8, 2);
+				}
+				else if (c < 0x10000) {
+					utf8[0] = (char)(0xE0 | (c >> 12));
+					utf8[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+					utf8[2] = (char)(0x80 | (c & 0x3F));
+					luaL_addlstring (&b, utf8, 3);
+				}
+				else {
+					utf8[0] = (char)(0xF0 | (c >> 18));
+					utf8[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+					utf8[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+					utf8[3] = (char)(0x80 | (c & 0x3F));
+					luaL_addlstring (&b, utf8, 4);
+				}
+				break;
+			}
+			default:
+				json_fail (r, "bad escape");
+		}
+		s = r->p;
+		r->p = json_scanstring (r->p, r->end);
+	}
+	luaL_pushresult (&b);
 }
 
-static int stmt_cur_gc (lua_State *L) {
-	stmt_cur_data *cur = (stmt_cur_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_CURSOR);
-	if (cur != NULL && !(cur->closed))
-		stmt_cur_nullify(cur);
-	return 0;
+static void json_number (json_reader *r) {
+	char num[64];
+	const char *s = r->p;
+	while (r->p < r->end && (isdigit ((unsigned char)*r->p) || *r->p == '-' || *r->p == '+' ||
+		*r->p == '.' || *r->p == 'e' || *r->p == 'E'))
+		r->p++;
+	if (r->p - s >= (long)sizeof(num) || r->p == s)
+		json_fail (r, "bad number");
+	memcpy (num, s, r->p - s);
+	num[r->p - s] = '\0';
+	if (lua_stringtonumber (r->L, num) == 0)
+		json_fail (r, "bad number");
+}
+
+static void json_literal (json_reader *r, const char *word, size_t len) {
+	if ((size_t)(r->end - r->p) < len || memcmp (r->p, word, len) != 0)
+		json_fail (r, "unexpected character");
+	r->p += len;
 }
 
+static void json_value (json_reader *r) {
+	lua_Integer n;
+	json_skipspace (r);
+	if (r->p >= r->end)
+		json_fail (r, "unexpected end");
+	switch (*r->p) {
+		case '{':
+			if (++r->depth > JSON_MAXDEPTH)
+				json_fail (r, "nesting too deep");
+			luaL_checkstack (r->L, 3, LUASQL_PREFIX"JSON nesting too deep");
+			r->p++;
+			lua_newtable (r->L);
+			json_skipspace (r);
+			if (r->p < r->end && *r->p == '}')
+				r->p++;
+			else for (;;) {
+				json_skipspace (r);
+				if (r->p >= r->end || *r->p++ != '"')
+					json_fail (r, "expected a key");
+				json_string (r);
+				json_skipspace (r);
+				if (r->p >= r->end || *r->p++ != ':')
+					json_fail (r, "expected ':'");
+				json_value (r);
+				lua_rawset (r->L, -3);
+				json_skipspace (r);
+				if (r->p < r->end && *r->p == ',') { r->p++; continue; }
+				if (r->p < r->end && *r->p == '}') { r->p++; break; }
+				json_fail (r, "expected ',' or '}'");
+			}
+			r->depth--;
+			break;
+		case '[':
+			if (++r->depth > JSON_MAXDEPTH)
+				json_fail (r, "nesting too deep");
+			luaL_checkstack (r->L, 3, LUASQL_PREFIX"JSON nesting too deep");
+			r->p++;
+			lua_newtable (r->L);
+			json_skipspace (r);
+			if (r->p < r->end && *r->p == ']')
+				r->p++;
+			else for (n = 1;; n++) {
+				json_value (r);
+				lua_rawseti (r->L, -2, n);
+				json_skipspace (r);
+				if (r->p < r->end && *r->p == ',') { r->p++; continue; }
+				if (r->p < r->end && *r->p == ']') { r->p++; break; }
+				json_fail (r, "expected ',' or ']'");
+			}
+			r->depth--;
+			break;
+		case '"':
+			r->p++;
+			json_string (r);
+			break;
+		case 't': json_literal (r, "true", 4); lua_pushboolean (r->L, 1); break;
+		case 'f': json_literal (r, "false", 5); lua_pushboolean (r->L, 0); break;
+		case 'n': json_literal (r, "null", 4); lua_pushlightuserdata (r->L, NULL); break;
+		default:
+			json_number (r);
+	}
+}
 
 /*
-** Close the cursor on top of the stack.
-** Return 1
+** Decode a JSON document and push it as Lua values.
 */
-static int stmt_cur_close (lua_State *L) {
-	stmt_cur_data *cur = (stmt_cur_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_CURSOR);
-	luaL_argcheck (L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
-	if (cur->closed) {
-		lua_pushboolean (L, 0);
-		lua_pushstring(L, "cursor is already closed");
-		return 2;
-	}
-	stmt_cur_nullify (cur);
-	lua_pushboolean (L, 1);
-	return 1;
+static void json_decode (lua_State *L, const char *s, size_t len) {
+	json_reader r;
+	r.L = L;
+	r.start = r.p = s;
+	r.end = s + len;
+	r.depth = 0;
+	json_value (&r);
+	json_skipspace (&r);
+	if (r.p != r.end)
+		json_fail (&r, "trailing characters");
 }
 
 
 /*
-** Pushes a column information table on top of the stack.
-** If the table isn't built yet, call the creator function and stores
-** a reference to it on the cursor structure.
+** Temporal values.  Columns are decoded in C into the form chosen by
+** settemporal; parameters are sent as binary MYSQL_TIME.  Epoch values
+** treat the stored date and time as UTC.
 */
-static void _pushtable (lua_State *L, cur_data *cur, size_t off) {
-	int *ref = (int *)cur + off / sizeof(int);
+#define TEMPORAL_STRING   0
+#define TEMPORAL_EPOCH    1   /* seconds, fractional if there are microseconds */
+#define TEMPORAL_EPOCH_US 2   /* integer microseconds */
+#define TEMPORAL_TABLE    3   /* os.date("*t") style table plus usec */
 
-	/* If colnames or coltypes do not exist, create both. */
-	if (*ref == LUA_NOREF)
-		create_colinfo(L, cur);
-	
-	/* Pushes the right table (colnames or coltypes) */
-	lua_rawgeti (L, LUA_REGISTRYINDEX, *ref);
+static const char *const temporal_modes[] = {"string", "epoch", "epoch_us", "table", NULL};
+
+static int is_temporal (enum enum_field_types type) {
+	return type == MYSQL_TYPE_DATE || type == MYSQL_TYPE_NEWDATE || type == MYSQL_TYPE_DATETIME ||
+		type == MYSQL_TYPE_TIMESTAMP || type == MYSQL_TYPE_TIME;
 }
-#define pushtable(L,c,m) (_pushtable(L,c,offsetof(cur_data,m)))
 
 
 /*
-** Return the list of field names.
+** Days since 1970-01-01 of a proleptic Gregorian date, and back.
 */
-static int cur_getcolnames (lua_State *L) {
-	pushtable (L, getcursor(L), colnames);
-	return 1;
+static long long days_from_civil (long long y, unsigned int m, unsigned int d) {
+	long long era;
+	unsigned int yoe, doy, doe;
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (unsigned int)(y - era * 400);
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (long long)doe - 719468;
+}
+
+static void civil_from_days (long long z, MYSQL_TIME *t) {
+	long long era;
+	unsigned int doe, yoe, doy, mp;
+	z += 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = (unsigned int)(z - era * 146097);
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	t->day = doy - (153 * mp + 2) / 5 + 1;
+	t->month = mp < 10 ? mp + 3 : mp - 9;
+	t->year = (unsigned int)(yoe + era * 400 + (t->month <= 2));
 }
 
 
 /*
-** Return the list of field types.
+** Read at most max digits.  Return how many were read.
 */
-static int cur_getcoltypes (lua_State *L) {
-	pushtable (L, getcursor(L), coltypes);
-	return 1;
+static int temporal_digits (const char **p, const char *end, int max, unsigned long *v) {
+	int n = 0;
+	*v = 0;
+	while (*p < end && n < max && isdigit ((unsigned char)**p)) {
+		*v = *v * 10 + (unsigned long)(**p - '0');
+		(*p)++;
+		n++;
+	}
+	return n;
 }
 
 
 /*
-** Push the number of rows.
+** Parse the text form of a value: "YYYY-MM-DD[ HH:MM:SS[.ffffff]]",
+** or "[-]HHH:MM:SS[.ffffff]" when time_only is set.
+** Return 0, or -1 if s is not in that form.
 */
-static int cur_numrows (lua_State *L) {
-	lua_pushinteger (L, (lua_Number)mysql_num_rows (getcursor(L)->my_res));
-	return 1;
+static int temporal_parse (const char *s, size_t len, int time_only, MYSQL_TIME *t) {
+	const char *p = s, *end = s + len;
+	unsigned long v;
+	int n;
+	memset (t, 0, sizeof(MYSQL_TIME));
+	if (time_only) {
+		t->time_type = MYSQL_TIMESTAMP_TIME;
+		if (p < end && *p == '-') {
+			t->neg = 1;
+			p++;
+		}
+	}
+	else {
+		t->time_type = MYSQL_TIMESTAMP_DATE;
+		if (temporal_digits (&p, end, 4, &v) != 4 || p == end || *p++ != '-')
+			return -1;
+		t->year = (unsigned int)v;
+		if (temporal_digits (&p, end, 2, &v) != 2 || p == end || *p++ != '-')
+			return -1;
+		t->month = (unsigned int)v;
+		if (temporal_digits (&p, end, 2, &v) != 2)
+			return -1;
+		t->day = (unsigned int)v;
+		if (p == end)
+			return 0;
+		if (*p != ' ' && *p != 'T')
+			return -1;
+		p++;
+		t->time_type = MYSQL_TIMESTAMP_DATETIME;
+	}
+	if (temporal_digits (&p, end, time_only ? 3 : 2, &v) < 1 || p == end || *p++ != ':')
+		return -1;
+	t->hour = (unsigned int)v;
+	if (temporal_digits (&p, end, 2, &v) != 2 || p == end || *p++ != ':')
+		return -1;
+	t->minute = (unsigned int)v;
+	if (temporal_digits (&p, end, 2, &v) != 2)
+		return -1;
+	t->second = (unsigned int)v;
+	if (p < end && *p == '.') {
+		p++;
+		if ((n = temporal_digits (&p, end, 6, &v)) < 1)
+			return -1;
+		for (; n < 6; n++)
+			v *= 10;
+		t->second_part = v;
+	}
+	return p == end ? 0 : -1;
 }
 
 
 /*
-** Seeks to an arbitrary row in a query result set.
+** Write the text form of a value, with the given number of decimals
+** (more than 6 means as many as needed).  Return its length.
 */
-static int cur_seek (lua_State *L) {
-	cur_data *cur = getcursor (L);
-	lua_Integer rownum = luaL_checkinteger (L, 2);
-	mysql_data_seek (cur->my_res, rownum);
-	return 0;
+static int temporal_format (const MYSQL_TIME *t, unsigned int decimals, char *buf, size_t size) {
+	int len;
+	if (t->time_type == MYSQL_TIMESTAMP_DATE)
+		return snprintf (buf, size, "%04u-%02u-%02u", t->year, t->month, t->day);
+	if (t->time_type == MYSQL_TIMESTAMP_TIME)
+		len = snprintf (buf, size, "%s%02u:%02u:%02u", t->neg ? "-" : "", t->hour, t->minute, t->second);
+	else
+		len = snprintf (buf, size, "%04u-%02u-%02u %02u:%02u:%02u",
+			t->year, t->month, t->day, t->hour, t->minute, t->second);
+	if (decimals > 6)
+		decimals = t->second_part ? 6 : 0;
+	if (decimals > 0) {
+		unsigned long frac = t->second_part;
+		unsigned int i;
+		for (i = decimals; i < 6; i++)
+			frac /= 10;
+		len += snprintf (buf + len, size - len, ".%0*lu", (int)decimals, frac);
+	}
+	return len;
+}
+
+
+static void temporal_setfield (lua_State *L, const char *name, unsigned long v) {
+	lua_pushinteger (L, (lua_Integer)v);
+	lua_setfield (L, -2, name);
 }
 
 
 /*
-** Create a new Cursor object and push it on top of the stack.
+** Push a value in the given mode.  Zero dates have no epoch and are
+** pushed as strings in the epoch modes.
 */
-static int create_cursor (lua_State *L, MYSQL *my_conn, int conn, MYSQL_RES *result, int cols) {
-	cur_data *cur = (cur_data *)LUASQL_NEWUD(L, sizeof(cur_data));
-	luasql_setmeta (L, LUASQL_CURSOR_MYSQL);
+static void push_temporal (lua_State *L, const MYSQL_TIME *t, int mode, unsigned int decimals) {
+	char buf[64];
+	long long secs;
+	int is_time = t->time_type == MYSQL_TIMESTAMP_TIME;
+	switch (mode) {
+		case TEMPORAL_TABLE:
+			lua_createtable (L, 0, 7);
+			if (!is_time) {
+				temporal_setfield (L, "year", t->year);
+				temporal_setfield (L, "month", t->month);
+				temporal_setfield (L, "day", t->day);
+			}
+			temporal_setfield (L, "hour", t->hour);
+			temporal_setfield (L, "min", t->minute);
+			temporal_setfield (L, "sec", t->second);
+			temporal_setfield (L, "usec", t->second_part);
+			if (is_time && t->neg) {
+				lua_pushboolean (L, 1);
+				lua_setfield (L, -2, "neg");
+			}
+			return;
+		case TEMPORAL_EPOCH: case TEMPORAL_EPOCH_US:
+			if (is_time || (t->month != 0 && t->day != 0)) {
+				secs = (long long)t->hour * 3600 + t->minute * 60 + t->second;
+				if (!is_time)
+					secs += days_from_civil (t->year, t->month, t->day) * 86400;
+				if (mode == TEMPORAL_EPOCH_US) {
+					secs = secs * 1000000 + (long long)t->second_part;
+					lua_pushinteger (L, (lua_Integer)(t->neg ? -secs : secs));
+				}
+				else if (t->second_part == 0)
+					lua_pushinteger (L, (lua_Integer)(t->neg ? -secs : secs));
+				else {
+					lua_Number v = (lua_Number)secs + (lua_Number)t->second_part / 1e6;
+					lua_pushnumber (L, t->neg ? -v : v);
+				}
+				return;
+			}
+			/* fall through */
+		default:
+			lua_pushlstring (L, buf, temporal_format (t, decimals, buf, sizeof(buf)));
+	}
+}
 
-	/* fill in structure */
-	cur->closed = 0;
-	cur->conn = LUA_NOREF;
-	cur->numcols = cols;
-	cur->colnames = LUA_NOREF;
-	cur->coltypes = LUA_NOREF;
-	cur->my_res = result;
-	cur->my_conn = my_conn;
-	lua_pushvalue (L, conn);
-	cur->conn = luaL_ref (L, LUA_REGISTRYINDEX);
 
-	return 1;
+/*
+** Push a column value, decoding temporal values for the mode and JSON
+** documents if json is set.
+*/
+static void push_cell (lua_State *L, const row_cell *cell, int mode, int json) {
+	MYSQL_TIME t;
+	if (cell->data == NULL)
+		lua_pushnil (L);
+	else if (json && cell->type == MYSQL_TYPE_JSON)
+		json_decode (L, cell->data, cell->length);
+	else if (!is_temporal (cell->type) || (mode == TEMPORAL_STRING && !cell->binary))
+		lua_pushlstring (L, cell->data, cell->length);
+	else if (cell->binary) {
+		memcpy (&t, cell->data, sizeof(MYSQL_TIME));
+		push_temporal (L, &t, mode, cell->decimals);
+	}
+	else if (temporal_parse (cell->data, cell->length, cell->type == MYSQL_TYPE_TIME, &t) == 0)
+		push_temporal (L, &t, mode, cell->decimals);
+	else
+		lua_pushlstring (L, cell->data, cell->length);
 }
 
-static int create_stmt_cursor (lua_State *L, MYSQL_STMT *stmt, MYSQL_RES *result, int num_fields, MYSQL_FIELD *fields) {
-	stmt_cur_data *cur = (stmt_cur_data *)LUASQL_NEWUD(L, sizeof(stmt_cur_data));
-	luasql_setmeta (L, LUASQL_STATEMENT_CURSOR);
-
-	 // Get result metadata
-	 cur->my_res = result;
-	 cur->stmt = stmt;
-	 cur->fields = fields;
- 
-	 cur->num_fields = num_fields;
- 
-	 // Allocate memory for MYSQL_BIND array
-	 cur->bind = (MYSQL_BIND *)malloc(sizeof(MYSQL_BIND) * num_fields);
-	 cur->row_data = (char **)malloc(sizeof(char *) * num_fields);
-	 cur->lengths = (unsigned long *)malloc(sizeof(unsigned long) * num_fields);
-	 cur->is_null = (bool *)malloc(sizeof(bool) * num_fields);
- 
-	 memset(cur->bind, 0, sizeof(MYSQL_BIND) * num_fields);
- 
-	 // Allocate memory for each row data and initialize MYSQL_BIND
-	 for (int i = 0; i < num_fields; i++) {
-		 cur->row_data[i] = (char *)malloc(1024);
-		 cur->bind[i].buffer_type = MYSQL_TYPE_STRING;
-		 cur->bind[i].buffer = cur->row_data[i];
-		 cur->bind[i].buffer_length = 1024;
-		 cur->bind[i].length = &cur->lengths[i];
-		 cur->bind[i].is_null = &cur->is_null[i];
-	 }
-
-	 if (mysql_stmt_bind_result(stmt, cur->bind)) {
-		stmt_cur_nullify(cur);
-        luaL_error(L, "Couldn't bind stmt with result");
-		return 0;
-    }
- 
-	 cur->closed = 0; // Mark struct as active
-	lua_pushvalue (L, 1);
-	cur->stmt_ref = luaL_ref (L, LUA_REGISTRYINDEX);
 
-	return 1;
+static lua_Integer temporal_getfield (lua_State *L, int t, const char *name, lua_Integer def) {
+	lua_Integer v = def;
+	lua_getfield (L, t, name);
+	if (!lua_isnil (L, -1))
+		v = lua_isinteger (L, -1) ? lua_tointeger (L, -1) : -1;
+	lua_pop (L, 1);
+	return v;
 }
 
 
-static int conn_gc (lua_State *L) {
-	conn_data *conn=(conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_MYSQL);
-	if (conn != NULL && !(conn->closed)) {
-		/* Nullify structure fields. */
-		conn->closed = 1;
-		luaL_unref (L, LUA_REGISTRYINDEX, conn->env);
-		mysql_close (conn->my_conn);
-	}
-	return 0;
+/*
+** Field type a table stands for: one with a year is a date, or a
+** datetime if it also has a time of day; one with only an hour is a
+** time.  Return MYSQL_TYPE_NULL for other tables.
+*/
+static enum enum_field_types temporal_tabletype (lua_State *L, int idx) {
+	int year, hour;
+	lua_getfield (L, idx, "year");
+	year = !lua_isnil (L, -1);
+	lua_getfield (L, idx, "hour");
+	hour = !lua_isnil (L, -1);
+	lua_pop (L, 2);
+	if (year)
+		return hour ? MYSQL_TYPE_DATETIME : MYSQL_TYPE_DATE;
+	return hour ? MYSQL_TYPE_TIME : MYSQL_TYPE_NULL;
 }
 
 
 /*
-** Close a Connection object.
+** Convert the table, epoch number or string at idx to a value of the
+** given field type (MYSQL_TYPE_NULL to take it from a table).
+** Return the field type, or MYSQL_TYPE_NULL if the value does not fit.
 */
-static int conn_close (lua_State *L) {
-	conn_data *conn=(conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_MYSQL);
-	luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
-	if (conn->closed) {
-		lua_pushboolean(L, 0);
-		lua_pushstring(L, "Connection is already closed");
-		return 2;
+static enum enum_field_types temporal_tovalue (lua_State *L, int idx, enum enum_field_types type, MYSQL_TIME *t) {
+	int is_time;
+	memset (t, 0, sizeof(MYSQL_TIME));
+	if (type == MYSQL_TYPE_NULL && lua_istable (L, idx))
+		type = temporal_tabletype (L, idx);
+	if (!is_temporal (type))
+		return MYSQL_TYPE_NULL;
+	is_time = type == MYSQL_TYPE_TIME;
+	switch (lua_type (L, idx)) {
+		case LUA_TTABLE: {
+			lua_Integer v[7];
+			int i;
+			v[0] = temporal_getfield (L, idx, "year", 0);
+			v[1] = temporal_getfield (L, idx, "month", is_time ? 0 : 1);
+			v[2] = temporal_getfield (L, idx, "day", is_time ? 0 : 1);
+			v[3] = temporal_getfield (L, idx, "hour", 0);
+			v[4] = temporal_getfield (L, idx, "min", 0);
+			v[5] = temporal_getfield (L, idx, "sec", 0);
+			v[6] = temporal_getfield (L, idx, "usec", 0);
+			for (i = 0; i < 7; i++)
+				if (v[i] < 0 || v[i] > (i == 6 ? 999999 : 9999))
+					return MYSQL_TYPE_NULL;
+			t->year = (unsigned int)v[0]; t->month = (unsigned int)v[1]; t->day = (unsigned int)v[2];
+			t->hour = (unsigned int)v[3]; t->minute = (unsigned int)v[4]; t->second = (unsigned int)v[5];
+			t->second_part = (unsigned long)v[6];
+			lua_getfield (L, idx, "neg");
+			t->neg = is_time && lua_toboolean (L, -1);
+			lua_pop (L, 1);
+			break;
+		}
+		case LUA_TNUMBER: {
+			long long us, days;
+			if (lua_isinteger (L, idx))
+				us = (long long)lua_tointeger (L, idx) * 1000000;
+			else {
+				lua_Number n = lua_tonumber (L, idx);
+				if (!(n > -9.2e12 && n < 9.2e12))
+					return MYSQL_TYPE_NULL;
+				us = (long long)(n * 1e6 + (n < 0 ? -0.5 : 0.5));
+			}
+			if (is_time && us < 0) {
+				t->neg = 1;
+				us = -us;
+			}
+			else if (!is_time) {
+				days = us / 86400000000LL - (us % 86400000000LL < 0);
+				us -= days * 86400000000LL;
+				civil_from_days (days, t);
+			}
+			t->hour = (unsigned int)(us / 3600000000LL);
+			t->minute = (unsigned int)(us / 60000000 % 60);
+			t->second = (unsigned int)(us / 1000000 % 60);
+			t->second_part = (unsigned long)(us % 1000000);
+			break;
+		}
+		case LUA_TSTRING: {
+			size_t len;
+			const char *s = lua_tolstring (L, idx, &len);
+			if (temporal_parse (s, len, is_time, t) != 0)
+				return MYSQL_TYPE_NULL;
+			break;
+		}
+		default:
+			return MYSQL_TYPE_NULL;
 	}
-	
-	conn->closed = 1;
-
-	lua_pushboolean (L, 1);
-	return 1;
+	t->time_type = is_time ? MYSQL_TIMESTAMP_TIME :
+		type == MYSQL_TYPE_DATE ? MYSQL_TIMESTAMP_DATE : MYSQL_TIMESTAMP_DATETIME;
+	return type;
 }
 
+
 /*
-** Ping connection.
+** Make room for n more bytes and a terminating NUL.  A buffer that
+** failed to grow stays failed, so callers check oom once at the end.
 */
-static int conn_ping (lua_State *L) {
-	conn_data *conn=(conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_MYSQL);
-	luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
-	if (conn->closed) {
-		lua_pushboolean (L, 0);
-		return 1;
-	}
-	if (mysql_ping (conn->my_conn) == 0) {
-		lua_pushboolean (L, 1);
-		return 1;
-	} else if (mysql_errno (conn->my_conn) == CR_SERVER_GONE_ERROR) {
-		lua_pushboolean (L, 0);
-		return 1;
+static int sqlbuf_reserve (sqlbuf *b, size_t n) {
+	size_t size;
+	char *data;
+	if (b->oom)
+		return -1;
+	if (b->len + n < b->size)
+		return 0;
+	for (size = b->size ? b->size : 256; size <= b->len + n; size *= 2)
+		;
+	if ((data = (char *)realloc (b->data, size)) == NULL) {
+		b->oom = 1;
+		return -1;
 	}
-	luaL_error(L, mysql_error(conn->my_conn));
+	b->data = data;
+	b->size = size;
 	return 0;
 }
 
 
-static int escape_string (lua_State *L) {
-  size_t size, new_size;
-  conn_data *conn = getconnection (L);
-  const char *from = luaL_checklstring(L, 2, &size);
-  char *to;
-  to = (char*)malloc(sizeof(char) * (2 * size + 1));
-  if(to) {
-    new_size = mysql_real_escape_string(conn->my_conn, to, from, size);
-    lua_pushlstring(L, to, new_size);
-    free(to);
-    return 1;
-  }
-  luaL_error(L, "could not allocate escaped string");
-  return 0;
+static void sqlbuf_add (sqlbuf *b, const char *s, size_t n) {
+	if (sqlbuf_reserve (b, n) == 0) {
+		memcpy (b->data + b->len, s, n);
+		b->len += n;
+		b->data[b->len] = '\0';
+	}
 }
 
+
+static void sqlbuf_addstr (sqlbuf *b, const char *s) {
+	sqlbuf_add (b, s, strlen (s));
+}
+
+
 /*
-** Execute an SQL statement.
-** Return a Cursor object if the statement is a query, otherwise
-** return the number of tuples affected by the statement.
+** Append a backquoted identifier.  With dotted set, "db.t" becomes
+** `db`.`t`.
 */
-static int conn_execute (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	size_t st_len;
-	const char *statement = luaL_checklstring (L, 2, &st_len);
-	if (mysql_real_query(conn->my_conn, statement, st_len)) 
-		/* error executing query */
-		return luasql_failmsg(L, "error executing query. MySQL: ", mysql_error(conn->my_conn));
-	else
+static void sqlbuf_addident (sqlbuf *b, const char *name, size_t n, int dotted) {
+	size_t i;
+	sqlbuf_add (b, "`", 1);
+	for (i = 0; i < n; i++) {
+		if (name[i] == '`')
+			sqlbuf_add (b, "``", 2);
+		else if (name[i] == '.' && dotted)
+			sqlbuf_add (b, "`.`", 3);
+		else
+			sqlbuf_add (b, name + i, 1);
+	}
+	sqlbuf_add (b, "`", 1);
+}
+
+
+/*
+** What follows the backslash for each byte that needs one in a string
+** literal, 0 for the bytes copied as they are.
+*/
+static const char escape_code[256] = {
+	[0] = '0', ['\n'] = 'n', ['\r'] = 'r', [26] = 'Z',
+	['\\'] = '\\', ['\''] = '\'', ['"'] = '"'
+};
+
+
+static char *escape_byte (char *to, char c, int backslash, char quote) {
+	if (!backslash) { /* NO_BACKSLASH_ESCAPES: only the quote is doubled */
+		if (c == quote)
+			*to++ = c;
+	}
+	else if (escape_code[(unsigned char)c] != 0) {
+		*to++ = '\\';
+		c = escape_code[(unsigned char)c];
+	}
+	*to++ = c;
+	return to;
+}
+
+
+static int escape_ctz (unsigned int mask) {
+#if defined(__GNUC__)
+	return __builtin_ctz (mask);
+#else
+	int n = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+
+/*
+** Escape n bytes of from into to, which has room for 2n bytes, and
+** return the length written.  Blocks of 32 or 16 bytes are tested at
+** once for bytes that need escaping and copied whole when they have
+** none.  This is only right for character sets where every byte of a
+** multibyte character is above 0x7F, as in utf8mb4 (see escape_into).
+*/
+static size_t escape_literal (char *to, const char *from, size_t n, int backslash, char quote) {
+	char *start = to;
+	size_t i = 0;
+#if defined(__AVX2__)
+	const __m256i q32 = _mm256_set1_epi8 (quote), nul32 = _mm256_setzero_si256 (),
+		nl32 = _mm256_set1_epi8 ('\n'), cr32 = _mm256_set1_epi8 ('\r'), bs32 = _mm256_set1_epi8 ('\\'),
+		sq32 = _mm256_set1_epi8 ('\''), dq32 = _mm256_set1_epi8 ('"'), z32 = _mm256_set1_epi8 (26);
+	while (i + 32 <= n) {
+		__m256i v = _mm256_loadu_si256 ((const __m256i *)(from + i)), m;
+		unsigned int mask;
+		if (backslash)
+			m = _mm256_or_si256 (
+				_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, nul32), _mm256_cmpeq_epi8 (v, nl32)),
+					_mm256_or_si256 (_mm256_cmpeq_epi8 (v, cr32), _mm256_cmpeq_epi8 (v, bs32))),
+				_mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, sq32), _mm256_cmpeq_epi8 (v, dq32)),
+					_mm256_cmpeq_epi8 (v, z32)));
+		else
+			m = _mm256_cmpeq_epi8 (v, q32);
+		_mm256_storeu_si256 ((__m256i *)to, v);  /* to + 32 <= start + 2n */
+		if ((mask = (unsigned int)_mm256_movemask_epi8 (m)) == 0) {
+			to += 32;
+			i += 32;
+			continue;
+		}
+		to += escape_ctz (mask);
+		i += escape_ctz (mask);
+		to = escape_byte (to, from[i++], backslash, quote);
+	}
+#endif
+#if defined(__SSE2__)
 	{
-		MYSQL_RES *res = mysql_store_result(conn->my_conn);
-		unsigned int num_cols = mysql_field_count(conn->my_conn);
+	const __m128i q16 = _mm_set1_epi8 (quote), nul16 = _mm_setzero_si128 (),
+		nl16 = _mm_set1_epi8 ('\n'), cr16 = _mm_set1_epi8 ('\r'), bs16 = _mm_set1_epi8 ('\\'),
+		sq16 = _mm_set1_epi8 ('\''), dq16 = _mm_set1_epi8 ('"'), z16 = _mm_set1_epi8 (26);
+	while (i + 16 <= n) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *)(from + i)), m;
+		unsigned int mask;
+		if (backslash)
+			m = _mm_or_si128 (
+				_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, nul16), _mm_cmpeq_epi8 (v, nl16)),
+					_mm_or_si128 (_mm_cmpeq_epi8 (v, cr16), _mm_cmpeq_epi8 (v, bs16))),
+				_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, sq16), _mm_cmpeq_epi8 (v, dq16)),
+					_mm_cmpeq_epi8 (v, z16)));
+		else
+			m = _mm_cmpeq_epi8 (v, q16);
+		_mm_storeu_si128 ((__m128i *)to, v);  /* to + 16 <= start + 2n */
+		if ((mask = (unsigned int)_mm_movemask_epi8 (m)) == 0) {
+			to += 16;
+			i += 16;
+			continue;
+		}
+		to += escape_ctz (mask);
+		i += escape_ctz (mask);
+		to = escape_byte (to, from[i++], backslash, quote);
+	}
+	}
+#endif
+	for (; i < n; i++)
+		to = escape_byte (to, from[i], backslash, quote);
+	return (size_t)(to - start);
+}
 
-		if (res) { /* tuples returned */
-			return create_cursor (L, conn->my_conn, 1, res, num_cols);
+
+/*
+** Escape n bytes of from for a literal quoted by quote on the
+** connection, into to, which has room for 2n bytes.  Return the
+** length written.  Character sets whose multibyte characters may hold
+** ASCII bytes, such as sjis or gbk, go through the client library.
+*/
+static size_t escape_into (MYSQL *my_conn, char *to, const char *from, size_t n, char quote) {
+	static const char *const bytewise[] = {"utf8mb4", "utf8mb3", "utf8", "latin1", "ascii", "binary", NULL};
+	const char *cs = mysql_character_set_name (my_conn);
+	int i;
+	for (i = 0; bytewise[i] != NULL; i++)
+		if (cs != NULL && strcmp (cs, bytewise[i]) == 0)
+			return escape_literal (to, from, n,
+				!(my_conn->server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES), quote);
+#if MYSQL_VERSION_ID >= 50706 && !defined(MARIADB_BASE_VERSION)
+	return mysql_real_escape_string_quote (my_conn, to, from, n, quote);
+#else
+	return mysql_real_escape_string (my_conn, to, from, n);
+#endif
+}
+
+
+/*
+** Append a quoted string literal escaped for the connection's character
+** set.
+*/
+static void sqlbuf_addquoted (sqlbuf *b, MYSQL *my_conn, const char *s, size_t n) {
+	if (sqlbuf_reserve (b, 2 * n + 2) != 0)
+		return;
+	b->data[b->len++] = '\'';
+	b->len += escape_into (my_conn, b->data + b->len, s, n, '\'');
+	b->data[b->len++] = '\'';
+	b->data[b->len] = '\0';
+}
+
+
+static void store_free (row_store *s) {
+	if (s == NULL)
+		return;
+	if (s->file != NULL)
+		fclose (s->file);
+	free (s->mem.data);
+	free (s->row.data);
+	free (s->offsets);
+	free (s->cells);
+	free (s->lengths);
+	free (s);
+}
+
+
+static row_store *store_new (int numcols, size_t limit, int spill) {
+	row_store *s = (row_store *)calloc (1, sizeof(row_store));
+	if (s == NULL)
+		return NULL;
+	s->numcols = numcols;
+	s->limit = limit;
+	s->spill = (short)spill;
+	s->filepos = UINT64_MAX;
+	s->cells = (char **)calloc (numcols > 0 ? numcols : 1, sizeof(char *));
+	s->lengths = (unsigned long *)calloc (numcols > 0 ? numcols : 1, sizeof(unsigned long));
+	if (s->cells == NULL || s->lengths == NULL) {
+		store_free (s);
+		return NULL;
+	}
+	return s;
+}
+
+
+/*
+** Memory held by a store, and bytes it wrote to its file.
+*/
+static long long store_memory (const row_store *s) {
+	return (long long)(sizeof(row_store) + s->mem.size + s->row.size +
+		s->cap * sizeof(uint64_t) + s->numcols * (sizeof(char *) + sizeof(unsigned long)));
+}
+
+static long long store_disk (const row_store *s) {
+	return s->file != NULL ? (long long)s->offsets[s->nrows] : 0;
+}
+
+
+/*
+** Append a row; cells[i] is NULL for SQL NULL.  Return 0, -1 if memory
+** ran out or the file could not be written, or -2 if the row goes past
+** the limit and spilling is off.
+*/
+static int store_add (row_store *s, char **cells, const unsigned long *lengths) {
+	size_t base = s->mem.len;
+	uint32_t len;
+	int i;
+	if (s->nrows + 2 > s->cap) {
+		uint64_t cap = s->cap ? 2 * s->cap : 256;
+		uint64_t *offsets = (uint64_t *)realloc (s->offsets, cap * sizeof(uint64_t));
+		if (offsets == NULL)
+			return -1;
+		if (s->cap == 0)
+			offsets[0] = 0;
+		s->offsets = offsets;
+		s->cap = cap;
+	}
+	for (i = 0; i < s->numcols; i++) {
+		len = cells[i] == NULL ? STORE_NULL : (uint32_t)lengths[i];
+		sqlbuf_add (&s->mem, (const char *)&len, sizeof(len));
+		if (cells[i] != NULL)
+			sqlbuf_add (&s->mem, cells[i], lengths[i]);
+		sqlbuf_add (&s->mem, "", 1);
+	}
+	if (s->mem.oom)
+		return -1;
+	s->offsets[s->nrows + 1] = s->offsets[s->nrows] + (s->mem.len - base);
+	s->nrows++;
+	if (s->file == NULL && s->limit > 0 && (size_t)store_memory (s) > s->limit) {
+		if (!s->spill)
+			return -2;
+		if ((s->file = tmpfile ()) == NULL)
+			return -1;
+		if (fwrite (s->mem.data, 1, s->mem.len, s->file) != s->mem.len)
+			return -1;
+		free (s->mem.data);
+		memset (&s->mem, 0, sizeof(sqlbuf));
+	}
+	else if (s->file != NULL) {
+		if (fwrite (s->mem.data, 1, s->mem.len, s->file) != s->mem.len)
+			return -1;
+		s->mem.len = 0;
+	}
+	return 0;
+}
+
+
+/*
+** Read the next row into cells and lengths.  Return 1 if there is a
+** row, 0 at the end and -1 if the file could not be read.
+*/
+static int store_next (row_store *s) {
+	uint64_t start, size;
+	char *p;
+	uint32_t len;
+	int i;
+	if (s->pos >= s->nrows)
+		return 0;
+	start = s->offsets[s->pos];
+	size = s->offsets[s->pos + 1] - start;
+	if (s->file != NULL) {
+		s->row.len = 0;
+		if (sqlbuf_reserve (&s->row, size) != 0)
+			return -1;
+		if (s->filepos != start && fseeko (s->file, (off_t)start, SEEK_SET) != 0)
+			return -1;
+		if (fread (s->row.data, 1, size, s->file) != size) {
+			s->filepos = UINT64_MAX;
+			return -1;
 		}
-		else { /* mysql_use_result() returned nothing; should it have? */
-			if(num_cols == 0) { /* no tuples returned */
-            	/* query does not return data (it was not a SELECT) */
-				lua_pushinteger(L, mysql_affected_rows(conn->my_conn));
-				return 1;
-        	}
-			else /* mysql_use_result() should have returned data */
-				return luasql_failmsg(L, "error retrieving result. MySQL: ", mysql_error(conn->my_conn));
+		s->filepos = start + size;
+		p = s->row.data;
+	}
+	else
+		p = s->mem.data + start;
+	for (i = 0; i < s->numcols; i++) {
+		memcpy (&len, p, sizeof(len));
+		p += sizeof(len);
+		if (len == STORE_NULL) {
+			s->cells[i] = NULL;
+			s->lengths[i] = 0;
+			p++;
+		}
+		else {
+			s->cells[i] = p;
+			s->lengths[i] = len;
+			p += len + 1;
 		}
 	}
+	s->pos++;
+	return 1;
 }
 
 
-static int conn_prepare(lua_State *L) {
-    conn_data *conn = getconnection(L);
-    const char *sql = luaL_checkstring(L, 2);
-    
-    stmt_data *stmt = (stmt_data *)LUASQL_NEWUD(L, sizeof(stmt_data));
-    luasql_setmeta(L, LUASQL_STATEMENT);
+static void store_seek (row_store *s, uint64_t row) {
+	s->pos = row < s->nrows ? row : s->nrows;
+}
 
-    stmt->stmt = mysql_stmt_init(conn->my_conn);
-    if (!stmt->stmt) {
-        return luasql_failmsg(L, "error preparing statement. MySQL: ", mysql_error(conn->my_conn));
-    }
 
-    if (mysql_stmt_prepare(stmt->stmt, sql, strlen(sql)) != 0) {
-        return luasql_failmsg(L, "error preparing statement. MySQL: ", mysql_stmt_error(stmt->stmt));
-    }
+/*
+** Move the bytes a cursor holds from (*mem, *disk) to (mem, disk) in the
+** connection's and the process' totals.
+*/
+static void result_account (conn_data *conn, long long *mem, long long *disk, long long newmem, long long newdisk) {
+	conn->result_mem += newmem - *mem;
+	conn->result_disk += newdisk - *disk;
+	atomic_fetch_add (&result_mem_total, newmem - *mem);
+	atomic_fetch_add (&result_disk_total, newdisk - *disk);
+	*mem = newmem;
+	*disk = newdisk;
+}
 
-    stmt->num_params = mysql_stmt_param_count(stmt->stmt);
-    stmt->params = (MYSQL_BIND *)calloc(stmt->num_params, sizeof(MYSQL_BIND));
-	stmt->params_data = (typeof(stmt->params_data))calloc(stmt->num_params, sizeof(*stmt->params_data));
-    stmt->closed = 0;
-	lua_pushvalue(L, 1);
-    stmt->conn = luaL_ref(L, LUA_REGISTRYINDEX);
-    return 1; // Return statement object
+
+/*
+** Estimate the memory of a result buffered by mysql_store_result: the
+** cells, their terminators and the row arrays.  Cells are taken at the
+** widest value of their column, which mysql_store_result records, so
+** the rows are not walked.
+*/
+static long long result_bytes (MYSQL_RES *res) {
+	unsigned int n = mysql_num_fields (res), i;
+	MYSQL_FIELD *fields = mysql_fetch_fields (res);
+	long long width = (n + 1) * sizeof(char *) + 2 * sizeof(void *);
+	for (i = 0; i < n; i++)
+		width += fields[i].max_length + 1;
+	return (long long)mysql_num_rows (res) * width;
 }
 
-static int stmt_bind(lua_State *L) {
-    stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT);
-    int index = luaL_checkinteger(L, 2) - 1;  // Convert Lua 1-based index to C 0-based index
-    
-    if (index < 0 || index >= stmt->num_params) {
-        return luaL_error(L, "Invalid parameter index");
-    }
 
-    MYSQL_BIND *param = &stmt->params[index];
-    int type = lua_type(L, 3);
+/*
+** Read every row of a result opened by mysql_use_result into a new
+** store.  Return it, or NULL with the reason in errmsg.
+*/
+static row_store *store_result (conn_data *conn, MYSQL_RES *res, char *errmsg, size_t errlen) {
+	row_store *s = store_new ((int)mysql_num_fields (res), conn->max_result_bytes, conn->spill);
+	MYSQL_ROW row;
+	int status = s == NULL ? -1 : 0;
+	while (status == 0 && (row = mysql_fetch_row (res)) != NULL)
+		status = store_add (s, row, mysql_fetch_lengths (res));
+	if (status == -2)
+		snprintf (errmsg, errlen, "result exceeds max_result_bytes (%lu bytes)",
+			(unsigned long)conn->max_result_bytes);
+	else if (status == -1)
+		snprintf (errmsg, errlen, "could not buffer result: out of memory or temporary file error");
+	else if (mysql_errno (conn->my_conn))
+		snprintf (errmsg, errlen, "%s", mysql_error (conn->my_conn));
+	else
+		return s;
+	store_free (s);
+	return NULL;
+}
 
-    switch (type) {
-        case LUA_TNUMBER:
-            if (lua_isinteger(L, 3)) {
-                stmt->params_data[index].integer = lua_tointeger(L, 3);
-                param->buffer_type = MYSQL_TYPE_LONG;
-                param->buffer = &stmt->params_data[index].integer;
-                param->buffer_length = sizeof(int);
-            } else {
-                stmt->params_data[index].number = lua_tonumber(L, 3);
-                param->buffer_type = MYSQL_TYPE_DOUBLE;
-                param->buffer = &stmt->params_data[index].number;
-                param->buffer_length = sizeof(double);
-            }
-            break;
-        
-        case LUA_TSTRING:
-            stmt->params_data[index].str = strdup(lua_tostring(L, 3));
-            param->buffer_type = MYSQL_TYPE_STRING;
-            param->buffer = (void *)stmt->params_data[index].str;
-            param->buffer_length = strlen(stmt->params_data[index].str);
-            break;
-        
-        case LUA_TBOOLEAN:
-            stmt->params_data[index].boolean = lua_toboolean(L, 3);
-            param->buffer_type = MYSQL_TYPE_TINY;
-            param->buffer = &stmt->params_data[index].boolean;
-            param->buffer_length = sizeof(char);
-            break;
-        
-        case LUA_TNIL:
-            param->buffer_type = MYSQL_TYPE_NULL;
-            break;
-        
-        default:
-            return luasql_faildirect(L, "error executing query. Invalid parameter type");
-    }
 
-    if (mysql_stmt_bind_param(stmt->stmt, stmt->params)) {
-        printf("[ERROR] mysql_stmt_bind_param() failed: %s\n", mysql_stmt_error(stmt->stmt));
-        return luasql_failmsg(L, "error executing query (stmt_bind_param). MySQL: ", mysql_stmt_error(stmt->stmt));
-    }
+/*
+** Buffer the result of the last query on the connection within its
+** max_result_bytes.  Return the result, with *store set when the
+** driver keeps the rows, or NULL.  errmsg is set when the result did
+** not fit and stays empty when there is no result set.
+*/
+static MYSQL_RES *conn_storeresult (conn_data *conn, row_store **store, char *errmsg, size_t errlen) {
+	MYSQL_RES *res;
+	*store = NULL;
+	if (conn->max_result_bytes == 0)
+		return mysql_store_result (conn->my_conn);
+	if ((res = mysql_use_result (conn->my_conn)) == NULL)
+		return NULL;
+	if ((*store = store_result (conn, res, errmsg, errlen)) == NULL) {
+		mysql_free_result (res);  /* reads and drops the rest */
+		return NULL;
+	}
+	return res;
+}
+
+
+static void json_put (sqlbuf *b, const char *s, size_t n) {
+	if (b != NULL)
+		sqlbuf_add (b, s, n);
+}
+
+static void json_putstring (sqlbuf *b, const char *s, size_t n) {
+	static const char hex[] = "0123456789abcdef";
+	const char *end = s + n, *run;
+	char esc[6] = {'\\', 'u', '0', '0', 0, 0};
+	json_put (b, "\"", 1);
+	while (s < end) {
+		run = s;
+		s = json_scanstring (s, end);
+		json_put (b, run, s - run);
+		if (s >= end)
+			break;
+		if (*s == '"' || *s == '\\') {
+			esc[1] = *s;
+			json_put (b, esc, 2);
+		}
+		else {
+			esc[1] = 'u';
+			esc[4] = hex[(unsigned char)*s >> 4];
+			esc[5] = hex[*s & 0xF];
+			json_put (b, esc, 6);
+		}
+		s++;
+	}
+	json_put (b, "\"", 1);
+}
+
+/*
+** Encode the Lua value at idx as JSON into b, or only check that it can
+** be encoded when b is NULL.  A table whose keys are 1..n is an array;
+** other tables are objects with string or number keys.
+** Return 0, or -1 if some value has no JSON counterpart.
+*/
+static int json_encode (lua_State *L, int idx, sqlbuf *b, int depth) {
+	char num[64];
+	size_t len;
+	const char *s;
+	lua_Integer n, count;
+	int first;
+	idx = lua_absindex (L, idx);
+	switch (lua_type (L, idx)) {
+		case LUA_TNIL:
+			json_put (b, "null", 4);
+			return 0;
+		case LUA_TLIGHTUSERDATA:
+			if (lua_touserdata (L, idx) != NULL)
+				return -1;
+			json_put (b, "null", 4);
+			return 0;
+		case LUA_TBOOLEAN:
+			if (lua_toboolean (L, idx))
+				json_put (b, "true", 4);
+			else
+				json_put (b, "false", 5);
+			return 0;
+		case LUA_TNUMBER:
+			if (lua_isinteger (L, idx))
+				len = snprintf (num, sizeof(num), "%lld", (long long)lua_tointeger (L, idx));
+			else {
+				double d = lua_tonumber (L, idx);
+				if (!(d == d && d - d == 0)) /* NaN or infinite */
+					return -1;
+				len = snprintf (num, sizeof(num), "%.17g", d);
+			}
+			json_put (b, num, len);
+			return 0;
+		case LUA_TSTRING:
+			s = lua_tolstring (L, idx, &len);
+			json_putstring (b, s, len);
+			return 0;
+		case LUA_TTABLE:
+			break;
+		default:
+			return -1;
+	}
+	if (depth >= JSON_MAXDEPTH || !lua_checkstack (L, 3))
+		return -1; /* probably a cycle */
+	n = (lua_Integer)lua_rawlen (L, idx);
+	count = 0;
+	lua_pushnil (L);
+	while (lua_next (L, idx)) {
+		count++;
+		lua_pop (L, 1);
+	}
+	if (n > 0 && count == n) {
+		json_put (b, "[", 1);
+		for (count = 1; count <= n; count++) {
+			if (count > 1)
+				json_put (b, ",", 1);
+			lua_rawgeti (L, idx, count);
+			if (json_encode (L, -1, b, depth + 1) != 0) {
+				lua_pop (L, 1);
+				return -1;
+			}
+			lua_pop (L, 1);
+		}
+		json_put (b, "]", 1);
+		return 0;
+	}
+	json_put (b, "{", 1);
+	first = 1;
+	lua_pushnil (L);
+	while (lua_next (L, idx)) {
+		if (lua_type (L, -2) == LUA_TSTRING)
+			s = lua_tolstring (L, -2, &len);
+		else if (lua_type (L, -2) == LUA_TNUMBER) {
+			lua_pushvalue (L, -2);
+			s = lua_tolstring (L, -1, &len);
+			len = snprintf (num, sizeof(num), "%s", s);
+			s = num;
+			lua_pop (L, 1);
+		}
+		else {
+			lua_pop (L, 2);
+			return -1;
+		}
+		if (!first)
+			json_put (b, ",", 1);
+		first = 0;
+		json_putstring (b, s, len);
+		json_put (b, ":", 1);
+		if (json_encode (L, -1, b, depth + 1) != 0) {
+			lua_pop (L, 2);
+			return -1;
+		}
+		lua_pop (L, 1);
+	}
+	json_put (b, "}", 1);
+	return 0;
+}
+
+
+/*
+** Check that the value at idx can be written as an SQL literal.
+*/
+static int sql_isliteral (lua_State *L, int idx) {
+	switch (lua_type (L, idx)) {
+		case LUA_TNIL: case LUA_TBOOLEAN: case LUA_TSTRING:
+			return 1;
+		case LUA_TTABLE: {
+			MYSQL_TIME t;
+			if (temporal_tabletype (L, idx) != MYSQL_TYPE_NULL)
+				return temporal_tovalue (L, idx, MYSQL_TYPE_NULL, &t) != MYSQL_TYPE_NULL;
+			return json_encode (L, idx, NULL, 0) == 0;
+		}
+		case LUA_TLIGHTUSERDATA:
+			return lua_touserdata (L, idx) == NULL;
+		case LUA_TNUMBER:
+			if (!lua_isinteger (L, idx)) {
+				double d = lua_tonumber (L, idx);
+				return d == d && d - d == 0; /* neither NaN nor infinite */
+			}
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+
+/*
+** Append the value at idx as an SQL literal of its type.
+*/
+static void sqlbuf_addvalue (sqlbuf *b, MYSQL *my_conn, lua_State *L, int idx) {
+	char num[64];
+	size_t len;
+	const char *s;
+	MYSQL_TIME t;
+	switch (lua_type (L, idx)) {
+		case LUA_TTABLE:
+			if (temporal_tabletype (L, idx) == MYSQL_TYPE_NULL) {
+				sqlbuf json = {NULL, 0, 0, 0};
+				json_encode (L, idx, &json, 0);
+				sqlbuf_addquoted (b, my_conn, json.data ? json.data : "", json.len);
+				b->oom |= json.oom;
+				free (json.data);
+				break;
+			}
+			if (temporal_tovalue (L, idx, MYSQL_TYPE_NULL, &t) == MYSQL_TYPE_NULL) {
+				sqlbuf_add (b, "NULL", 4);
+				break;
+			}
+			num[0] = '\'';
+			len = 1 + temporal_format (&t, 7, num + 1, sizeof(num) - 2);
+			num[len++] = '\'';
+			sqlbuf_add (b, num, len);
+			break;
+		case LUA_TBOOLEAN:
+			sqlbuf_add (b, lua_toboolean (L, idx) ? "1" : "0", 1);
+			break;
+		case LUA_TNUMBER:
+			if (lua_isinteger (L, idx))
+				snprintf (num, sizeof(num), "%lld", (long long)lua_tointeger (L, idx));
+			else
+				snprintf (num, sizeof(num), "%.17g", (double)lua_tonumber (L, idx));
+			sqlbuf_addstr (b, num);
+			break;
+		case LUA_TSTRING:
+			s = lua_tolstring (L, idx, &len);
+			sqlbuf_addquoted (b, my_conn, s, len);
+			break;
+		default:
+			sqlbuf_add (b, "NULL", 4);
+	}
+}
+
+
+/*
+** Wait until pred(arg) holds.  Sleepers register in sig->waiters before
+** re-checking the predicate, so a notifier that sees no waiters can skip
+** the lock entirely.
+*/
+static void sig_wait (ra_signal *sig, int (*pred)(void *), void *arg) {
+	if (pred (arg))
+		return;
+	pthread_mutex_lock (&sig->lock);
+	atomic_fetch_add (&sig->waiters, 1);
+	while (!pred (arg))
+		pthread_cond_wait (&sig->cond, &sig->lock);
+	atomic_fetch_sub (&sig->waiters, 1);
+	pthread_mutex_unlock (&sig->lock);
+}
+
+static void sig_notify (ra_signal *sig) {
+	if (atomic_load (&sig->waiters) > 0) {
+		pthread_mutex_lock (&sig->lock);
+		pthread_cond_broadcast (&sig->cond);
+		pthread_mutex_unlock (&sig->lock);
+	}
+}
+
+static void sig_init (ra_signal *sig) {
+	pthread_mutex_init (&sig->lock, NULL);
+	pthread_cond_init (&sig->cond, NULL);
+	atomic_init (&sig->waiters, 0);
+}
+
+static void sig_destroy (ra_signal *sig) {
+	pthread_mutex_destroy (&sig->lock);
+	pthread_cond_destroy (&sig->cond);
+}
+
+static int ra_can_produce (void *arg) {
+	readahead_data *ra = (readahead_data *)arg;
+	return atomic_load (&ra->cancel) ||
+		atomic_load (&ra->head) - atomic_load (&ra->tail) < (unsigned int)ra->depth;
+}
+
+static int ra_can_consume (void *arg) {
+	readahead_data *ra = (readahead_data *)arg;
+	return atomic_load (&ra->done) || atomic_load (&ra->head) != atomic_load (&ra->tail);
+}
+
+
+/*
+** Copy up to batchrows rows of ra->res into the batch.
+** Return 0 when the result set is exhausted (or failed), 1 otherwise.
+*/
+static int ra_fill (readahead_data *ra, row_batch *b) {
+	int ncells = ra->batchrows * ra->numcols;
+	int i, more = 1;
+	b->nrows = 0;
+	b->datalen = 0;
+	if (b->rowcap < ra->batchrows) {
+		char **cells;
+		size_t *offsets;
+		unsigned long *lengths;
+		/* each block is kept on failure, so ra_release still frees it */
+		if ((cells = (char **)realloc (b->cells, sizeof(char *) * ncells)) != NULL)
+			b->cells = cells;
+		if ((offsets = (size_t *)realloc (b->offsets, sizeof(size_t) * ncells)) != NULL)
+			b->offsets = offsets;
+		if ((lengths = (unsigned long *)realloc (b->lengths, sizeof(unsigned long) * ncells)) != NULL)
+			b->lengths = lengths;
+		if (cells == NULL || offsets == NULL || lengths == NULL)
+			goto nomem;
+		b->rowcap = ra->batchrows;
+	}
+	while (b->nrows < ra->batchrows && !atomic_load (&ra->cancel)) {
+		MYSQL_ROW row = mysql_fetch_row (ra->res);
+		unsigned long *lengths;
+		size_t need = 0;
+		int base = b->nrows * ra->numcols;
+		if (row == NULL) {
+			if (mysql_errno (ra->my_conn)) {
+				ra->my_errno = mysql_errno (ra->my_conn);
+				strncpy (ra->errmsg, mysql_error (ra->my_conn), sizeof(ra->errmsg) - 1);
+			}
+			more = 0;
+			break;
+		}
+		lengths = mysql_fetch_lengths (ra->res);
+		for (i = 0; i < ra->numcols; i++)
+			need += lengths[i] + 1;
+		if (b->datalen + need > b->datasize) {
+			size_t size = b->datasize ? b->datasize : 4096;
+			char *data;
+			while (size < b->datalen + need)
+				size *= 2;
+			if ((data = (char *)realloc (b->data, size)) == NULL)
+				goto nomem;
+			b->data = data;
+			b->datasize = size;
+		}
+		for (i = 0; i < ra->numcols; i++) {
+			b->lengths[base + i] = lengths[i];
+			if (row[i] == NULL) {
+				b->offsets[base + i] = (size_t)-1;
+				continue;
+			}
+			b->offsets[base + i] = b->datalen;
+			memcpy (b->data + b->datalen, row[i], lengths[i]);
+			b->datalen += lengths[i];
+			b->data[b->datalen++] = '\0';
+		}
+		b->nrows++;
+	}
+	/* data is final now, turn offsets into pointers */
+	for (i = 0; i < b->nrows * ra->numcols; i++)
+		b->cells[i] = b->offsets[i] == (size_t)-1 ? NULL : b->data + b->offsets[i];
+	return more;
+nomem:
+	ra->my_errno = CR_OUT_OF_MEMORY;
+	strcpy (ra->errmsg, "out of memory in read-ahead buffer");
+	return 0;
+}
+
+
+/*
+** Move the rows of ra->res into the ring until the result set is
+** exhausted, the consumer cancels or an error occurs.  Return the number
+** of rows moved; *last is left pointing to the last batch published,
+** which only the producer may refill.
+*/
+static long ra_pump (readahead_data *ra, row_batch **last) {
+	long rows = 0;
+	int more = 1;
+	while (more) {
+		unsigned int head;
+		row_batch *b;
+		sig_wait (ra->sig, ra_can_produce, ra);
+		if (atomic_load (&ra->cancel))
+			break;
+		head = atomic_load (&ra->head);
+		b = &ra->ring[head % ra->depth];
+		more = ra_fill (ra, b);
+		if (b->nrows > 0) {
+			rows += b->nrows;
+			if (last)
+				*last = b;
+			atomic_store (&ra->head, head + 1);
+			sig_notify (ra->sig);
+		}
+	}
+	return rows;
+}
+
+
+/*
+** Mark the producer side as finished and wake the consumer.
+*/
+static void ra_finish (readahead_data *ra) {
+	atomic_store (&ra->done, 1);
+	sig_notify (ra->sig);
+}
+
+
+static void *ra_worker (void *arg) {
+	readahead_data *ra = (readahead_data *)arg;
+	mysql_thread_init ();
+	ra_pump (ra, NULL);
+	ra_finish (ra);
+	mysql_thread_end ();
+	return NULL;
+}
+
+
+/*
+** Prepare the ring of a reader.  If sig is NULL the reader sleeps on its
+** own signal, otherwise on one shared with other readers.
+*/
+static int ra_init (readahead_data *ra, MYSQL *my_conn, MYSQL_RES *res, int numcols, int depth, int batchrows, ra_signal *sig) {
+	memset (ra, 0, sizeof(readahead_data));
+	ra->ring = (row_batch *)calloc (depth, sizeof(row_batch));
+	if (ra->ring == NULL)
+		return -1;
+	ra->res = res;
+	ra->my_conn = my_conn;
+	ra->numcols = numcols;
+	ra->depth = depth;
+	ra->batchrows = batchrows;
+	atomic_init (&ra->head, 0);
+	atomic_init (&ra->tail, 0);
+	atomic_init (&ra->done, 0);
+	atomic_init (&ra->cancel, 0);
+	if (sig == NULL) {
+		sig_init (&ra->own);
+		sig = &ra->own;
+	}
+	ra->sig = sig;
+	return 0;
+}
+
+
+/*
+** Release the ring of a reader whose producer has stopped.
+*/
+static void ra_release (readahead_data *ra) {
+	int i;
+	for (i = 0; i < ra->depth; i++) {
+		free (ra->ring[i].cells);
+		free (ra->ring[i].offsets);
+		free (ra->ring[i].lengths);
+		free (ra->ring[i].data);
+	}
+	free (ra->ring);
+	ra->ring = NULL;
+	if (ra->sig == &ra->own)
+		sig_destroy (&ra->own);
+}
+
+
+/*
+** Start a read-ahead worker on an unbuffered result set.
+*/
+static readahead_data *ra_start (MYSQL *my_conn, MYSQL_RES *res, int numcols, int depth, int batchrows) {
+	readahead_data *ra = (readahead_data *)malloc (sizeof(readahead_data));
+	if (ra == NULL)
+		return NULL;
+	if (ra_init (ra, my_conn, res, numcols, depth, batchrows, NULL) != 0) {
+		free (ra);
+		return NULL;
+	}
+	if (pthread_create (&ra->thread, NULL, ra_worker, ra) != 0) {
+		ra_release (ra);
+		free (ra);
+		return NULL;
+	}
+	return ra;
+}
+
+
+/*
+** Stop the worker and release the ring.  The rows the worker did not
+** read are left to mysql_free_result, which drains them off the wire.
+*/
+static void ra_stop (readahead_data *ra) {
+	atomic_store (&ra->cancel, 1);
+	sig_notify (ra->sig);
+	pthread_join (ra->thread, NULL);
+	ra_release (ra);
+	free (ra);
+}
+
+
+/*
+** Hand the consumer the next row of the ring.
+** Return 1 if there is a row, 0 at the end, -1 on error and, when block
+** is false, RA_EMPTY if the worker has not published the next batch yet.
+*/
+#define RA_EMPTY (-2)
+static int ra_nextrow (readahead_data *ra, MYSQL_ROW *row, unsigned long **lengths, int block) {
+	for (;;) {
+		unsigned int tail = atomic_load (&ra->tail);
+		if (ra->holding) {
+			row_batch *b = &ra->ring[tail % ra->depth];
+			if (ra->pos < b->nrows) {
+				*row = b->cells + ra->pos * ra->numcols;
+				*lengths = b->lengths + ra->pos * ra->numcols;
+				ra->pos++;
+				return 1;
+			}
+			/* give the batch back to the worker */
+			ra->holding = 0;
+			atomic_store (&ra->tail, tail + 1);
+			sig_notify (ra->sig);
+			continue;
+		}
+		if (!block && !ra_can_consume (ra))
+			return RA_EMPTY;
+		sig_wait (ra->sig, ra_can_consume, ra);
+		if (atomic_load (&ra->head) == tail) /* worker is done */
+			return ra->my_errno ? -1 : 0;
+		ra->holding = 1;
+		ra->pos = 0;
+	}
+}
+
+
+/*
+** Push the value of #i field of #tuple row.
+*/
+static void pushvalue (lua_State *L, void *row, long int len) {
+	if (row == NULL)
+		lua_pushnil (L);
+	else
+		lua_pushlstring (L, row, len);
+}
+
+
+/*
+** Get the internal database type of the given column.
+*/
+static char *getcolumntype (enum enum_field_types type) {
+
+	switch (type) {
+		case MYSQL_TYPE_VAR_STRING: case MYSQL_TYPE_STRING:
+			return "string";
+		case MYSQL_TYPE_DECIMAL: case MYSQL_TYPE_SHORT: case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_FLOAT: case MYSQL_TYPE_DOUBLE: case MYSQL_TYPE_LONGLONG:
+		case MYSQL_TYPE_INT24: case MYSQL_TYPE_YEAR: case MYSQL_TYPE_TINY: 
+			return "number";
+		case MYSQL_TYPE_TINY_BLOB: case MYSQL_TYPE_MEDIUM_BLOB:
+		case MYSQL_TYPE_LONG_BLOB: case MYSQL_TYPE_BLOB:
+			return "binary";
+		case MYSQL_TYPE_DATE: case MYSQL_TYPE_NEWDATE:
+			return "date";
+		case MYSQL_TYPE_DATETIME:
+			return "datetime";
+		case MYSQL_TYPE_TIME:
+			return "time";
+		case MYSQL_TYPE_TIMESTAMP:
+			return "timestamp";
+		case MYSQL_TYPE_ENUM: case MYSQL_TYPE_SET:
+			return "set";
+		case MYSQL_TYPE_NULL:
+			return "null";
+		default:
+			return "undefined";
+	}
+}
+
+
+/*
+** Creates the lists of names and types of the n given fields and
+** stores references to them in *colnames and *coltypes.
+*/
+static void create_colinfo (lua_State *L, MYSQL_FIELD *fields, int n, int *colnames, int *coltypes) {
+	char typename[50];
+	int i;
+	lua_newtable (L); /* names */
+	lua_newtable (L); /* types */
+	for (i = 1; i <= n; i++) {
+		lua_pushstring (L, fields[i-1].name);
+		lua_rawseti (L, -3, i);
+		sprintf (typename, "%.20s(%ld)", getcolumntype (fields[i-1].type), fields[i-1].length);
+		lua_pushstring(L, typename);
+		lua_rawseti (L, -2, i);
+	}
+	/* Stores the references in the cursor structure */
+	*coltypes = luaL_ref (L, LUA_REGISTRYINDEX);
+	*colnames = luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
+
+/*
+** Account the memory and file space of a cursor's buffered rows to its
+** connection.
+*/
+static void cur_account (cur_data *cur) {
+	if (cur->store != NULL)
+		result_account (cur->connp, &cur->mem, &cur->disk, store_memory (cur->store), store_disk (cur->store));
+	else if (!cur->streaming && cur->my_res != NULL)
+		result_account (cur->connp, &cur->mem, &cur->disk, result_bytes (cur->my_res), 0);
+}
+
+
+/*
+** Closes the cursos and nullify all structure fields.
+*/
+static void cur_nullify (lua_State *L, cur_data *cur) {
+	/* Nullify structure fields. */
+	cur->closed = 1;
+	if (cur->ra) {
+		ra_stop (cur->ra);
+		cur->ra = NULL;
+	}
+	mysql_free_result(cur->my_res);
+	store_free (cur->store);
+	cur->store = NULL;
+	result_account (cur->connp, &cur->mem, &cur->disk, 0, 0);
+	cur->connp->outstanding--;
+	if (cur->streaming)
+		cur->connp->streaming = 0;
+	luaL_unref (L, LUA_REGISTRYINDEX, cur->conn);
+	luaL_unref (L, LUA_REGISTRYINDEX, cur->colnames);
+	luaL_unref (L, LUA_REGISTRYINDEX, cur->coltypes);
+	luaL_unref (L, LUA_REGISTRYINDEX, cur->colindex);
+}
+
+static void stmt_cur_detach (stmt_cur_data *cur);
+
+/*
+** Read and drop the result sets a CALL left after the cursor's one, so
+** the connection can run other commands.
+*/
+static void stmt_cur_drain (stmt_cur_data *cur) {
+	conn_data *conn = cur->owner->connp;
+	mysql_stmt_free_result (cur->stmt);
+	if (mysql_more_results (conn->my_conn))
+		stmt_cur_detach (cur);  /* next_result replaces the handle's fields */
+	while (mysql_more_results (conn->my_conn) && mysql_stmt_next_result (cur->stmt) == 0)
+		mysql_stmt_free_result (cur->stmt);
+	conn->pending = NULL;
+}
+
+
+/*
+** Buffer type a column is fetched as: temporal columns as binary
+** MYSQL_TIME, others as text.
+*/
+static enum enum_field_types result_buffertype (enum enum_field_types type) {
+	if (!is_temporal (type))
+		return MYSQL_TYPE_STRING;
+	return type == MYSQL_TYPE_NEWDATE ? MYSQL_TYPE_DATE : type;
+}
+
+
+/*
+** Free a set of result buffers.
+*/
+static void result_freebinds (int num_fields, MYSQL_BIND *bind, char **row_data, unsigned long *lengths, bool *is_null) {
+	if (row_data != NULL)
+		for (int i = 0; i < num_fields; i++)
+			free (row_data[i]);
+	free (row_data);
+	free (bind);
+	free (lengths);
+	free (is_null);
+}
+
+
+/*
+** Allocate result buffers for num_fields columns described by fields.
+** Text columns get 1024 bytes to start with; they grow when a longer
+** value is fetched.  Return 0, or -1 leaving what was allocated for
+** result_freebinds.
+*/
+static int result_allocbinds (MYSQL_FIELD *fields, int num_fields, MYSQL_BIND **bind, char ***row_data, unsigned long **lengths, bool **is_null) {
+	*bind = (MYSQL_BIND *)calloc (num_fields, sizeof(MYSQL_BIND));
+	*row_data = (char **)calloc (num_fields, sizeof(char *));
+	*lengths = (unsigned long *)calloc (num_fields, sizeof(unsigned long));
+	*is_null = (bool *)calloc (num_fields, sizeof(bool));
+	if (num_fields > 0 && (!*bind || !*row_data || !*lengths || !*is_null))
+		return -1;
+	for (int i = 0; i < num_fields; i++) {
+		MYSQL_BIND *b = &(*bind)[i];
+		if (((*row_data)[i] = (char *)malloc (1024)) == NULL)
+			return -1;
+		b->buffer_type = result_buffertype (fields[i].type);
+		b->buffer_length = b->buffer_type == MYSQL_TYPE_STRING ? 1024 : sizeof(MYSQL_TIME);
+		b->buffer = (*row_data)[i];
+		b->length = &(*lengths)[i];
+		b->is_null = &(*is_null)[i];
+	}
+	return 0;
+}
+
+
+/*
+** Free the result buffers a statement keeps across executions.  The
+** metadata points into the handle, so this comes before closing it.
+*/
+static void stmt_dropresult (stmt_data *stmt) {
+	result_freebinds (stmt->num_fields, stmt->bind, stmt->row_data, stmt->lengths, stmt->is_null);
+	stmt->bind = NULL;
+	stmt->row_data = NULL;
+	stmt->lengths = NULL;
+	stmt->is_null = NULL;
+	stmt->num_fields = 0;
+	if (stmt->meta != NULL) {
+		mysql_free_result (stmt->meta);
+		stmt->meta = NULL;
+	}
+}
+
+
+/*
+** Bind the result buffers of a statement for the result set it has
+** just produced.  The buffers of the previous execution are reused
+** unless the server reported a different number of columns or a
+** column changed between temporal and other types; only then are the
+** metadata and buffers built again.  Return 0, or -1 on failure.
+*/
+static int stmt_cacheresult (stmt_data *stmt) {
+	int n = (int)mysql_stmt_field_count (stmt->stmt), i = 0;
+	if (stmt->meta != NULL && n == stmt->num_fields) {
+		MYSQL_FIELD *fields = mysql_fetch_fields (stmt->meta);  /* updated by execute */
+		while (i < n && stmt->bind[i].buffer_type == result_buffertype (fields[i].type))
+			i++;
+		if (i == n)
+			return mysql_stmt_bind_result (stmt->stmt, stmt->bind) ? -1 : 0;
+	}
+	stmt_dropresult (stmt);
+	if ((stmt->meta = mysql_stmt_result_metadata (stmt->stmt)) == NULL)
+		return -1;
+	stmt->num_fields = (int)mysql_num_fields (stmt->meta);
+	if (result_allocbinds (mysql_fetch_fields (stmt->meta), stmt->num_fields,
+			&stmt->bind, &stmt->row_data, &stmt->lengths, &stmt->is_null) != 0) {
+		stmt_dropresult (stmt);
+		return -1;
+	}
+	stmt->connp->stats.result_rebuilds++;
+	return mysql_stmt_bind_result (stmt->stmt, stmt->bind) ? -1 : 0;
+}
+
+
+/*
+** Hand the buffers a cursor borrowed from its statement over to the
+** cursor, before the handle moves to another result set.  The
+** statement builds new ones on its next execution.
+*/
+static void stmt_cur_detach (stmt_cur_data *cur) {
+	stmt_data *owner = cur->owner;
+	if (!cur->borrowed || owner == NULL || owner->bind != cur->bind)
+		return;
+	cur->my_res = owner->meta;
+	cur->borrowed = 0;
+	owner->meta = NULL;
+	owner->bind = NULL;
+	owner->row_data = NULL;
+	owner->lengths = NULL;
+	owner->is_null = NULL;
+	owner->num_fields = 0;
+}
+
+
+/*
+** Free the result set buffers of a statement cursor, or give them back
+** to its statement when they were borrowed.
+*/
+static void stmt_cur_unbind (stmt_cur_data *cur) {
+	if (!cur->borrowed)
+		result_freebinds (cur->num_fields, cur->bind, cur->row_data, cur->lengths, cur->is_null);
+	cur->borrowed = 0;
+	cur->row_data = NULL;
+	cur->bind = NULL;
+	cur->lengths = NULL;
+	cur->is_null = NULL;
+	cur->num_fields = 0;
+	if (cur->my_res) {
+		mysql_free_result(cur->my_res);
+		cur->my_res = NULL;
+	}
+	store_free(cur->store);
+	cur->store = NULL;
+	if (cur->owner != NULL)
+		result_account(cur->owner->connp, &cur->mem, &cur->disk, 0, 0);
+}
+
+/*
+** Release the column information tables of a statement cursor.
+*/
+static void stmt_cur_dropcolinfo (lua_State *L, stmt_cur_data *cur) {
+	luaL_unref (L, LUA_REGISTRYINDEX, cur->colnames);
+	luaL_unref (L, LUA_REGISTRYINDEX, cur->coltypes);
+	cur->colnames = LUA_NOREF;
+	cur->coltypes = LUA_NOREF;
+}
+
+
+/*
+** Bind buffers of the cursor's own for the result set res, which is
+** not the first one of a CALL.  Return 0, or -1 on failure.
+*/
+static int stmt_cur_bind (stmt_cur_data *cur, MYSQL_RES *res) {
+	cur->my_res = res;
+	cur->fields = mysql_fetch_fields (res);
+	cur->num_fields = (int)mysql_num_fields (res);
+	cur->borrowed = 0;
+	if (result_allocbinds (cur->fields, cur->num_fields, &cur->bind, &cur->row_data, &cur->lengths, &cur->is_null) != 0)
+		return -1;
+	return mysql_stmt_bind_result (cur->stmt, cur->bind) ? -1 : 0;
+}
+
+
+/*
+** Make room for len bytes in text column #i of a statement cursor.
+** The buffer stays grown for later rows and, when borrowed, for later
+** executions of the statement.  Return 0, or -1 when out of memory.
+*/
+static int stmt_cur_grow (stmt_cur_data *cur, int i, unsigned long len) {
+	MYSQL_BIND *b = &cur->bind[i];
+	char *data;
+	if (len <= b->buffer_length)
+		return 0;
+	if (len < 2 * b->buffer_length)
+		len = 2 * b->buffer_length;
+	if ((data = (char *)realloc (cur->row_data[i], len)) == NULL)
+		return -1;
+	cur->row_data[i] = data;
+	b->buffer = data;
+	b->buffer_length = len;
+	return 0;
+}
+
+
+/*
+** Fetch the next row of a statement cursor from the handle, fetching
+** again the text columns that did not fit in their buffers.
+** Return 1 if there is a row, 0 at the end and -1 on error.
+*/
+static int stmt_cur_fetchrow (stmt_cur_data *cur) {
+	int status = mysql_stmt_fetch (cur->stmt), i, grown = 0;
+	if (status == MYSQL_NO_DATA)
+		return 0;
+	if (status == 1)
+		return -1;
+	if (status == MYSQL_DATA_TRUNCATED) {
+		for (i = 0; i < cur->num_fields; i++) {
+			MYSQL_BIND *b = &cur->bind[i];
+			if (cur->is_null[i] || b->buffer_type != MYSQL_TYPE_STRING || cur->lengths[i] <= b->buffer_length)
+				continue;
+			if (stmt_cur_grow (cur, i, cur->lengths[i]) != 0 ||
+				mysql_stmt_fetch_column (cur->stmt, b, (unsigned int)i, 0) != 0)
+				return -1;
+			grown = 1;
+		}
+		if (grown && mysql_stmt_bind_result (cur->stmt, cur->bind))
+			return -1;
+	}
+	return 1;
+}
+
+void stmt_cur_nullify(stmt_cur_data *cur) {
+    if (!cur) return;
+	if (cur->closed) return;
+	cur->closed = 1;
+	if (cur->owner != NULL && cur->owner->connp->pending == cur)
+		stmt_cur_drain(cur);
+	if (cur->owner != NULL && cur->owner->cursor == cur)
+		cur->owner->cursor = NULL;
+	if (cur->owner != NULL)
+		cur->owner->connp->outstanding--;
+	stmt_cur_unbind(cur);
+}
+
+	
+static int push_lazyrow (lua_State *L, int kind, void *cur, unsigned int generation, int numcols);
+
+
+/*
+** Describe column #i (0 based) of the current row of a cursor.
+*/
+static void cur_getcell (cur_data *cur, int i, row_cell *cell) {
+	MYSQL_FIELD *field = mysql_fetch_field_direct (cur->my_res, i);
+	cell->type = field->type;
+	cell->decimals = field->decimals;
+	cell->binary = 0;
+	cell->data = cur->row[i];
+	cell->length = cur->lengths[i];
+}
+
+
+static void cur_pushcolumn (lua_State *L, cur_data *cur, int i) {
+	row_cell cell;
+	cur_getcell (cur, i, &cell);
+	push_cell (L, &cell, cur->temporal, cur->json);
+}
+
+
+/*
+** Advance the cursor to its next row.
+** Return 1 if there is a row, 0 at the end of the result set and -1 on
+** error, leaving the error message in errmsg.
+*/
+static int cur_nextrow (cur_data *cur, MYSQL_ROW *row, unsigned long **lengths, char *errmsg, size_t errlen) {
+	int status;
+	if (cur->ra != NULL) {
+		if ((status = ra_nextrow (cur->ra, row, lengths, 1)) < 0)
+			strncpy (errmsg, cur->ra->errmsg, errlen - 1);
+		return status;
+	}
+	if (cur->store != NULL) {
+		if ((status = store_next (cur->store)) < 0)
+			strncpy (errmsg, "could not read spilled rows", errlen - 1);
+		*row = cur->store->cells;
+		*lengths = cur->store->lengths;
+		return status;
+	}
+	*row = mysql_fetch_row (cur->my_res);
+	if (*row == NULL) {
+		if (cur->streaming && mysql_errno (cur->my_conn)) {
+			strncpy (errmsg, mysql_error (cur->my_conn), errlen - 1);
+			return -1;
+		}
+		return 0;
+	}
+	*lengths = mysql_fetch_lengths (cur->my_res);
+	return 1;
+}
+
+
+static void watch_arm (watch *w, conn_data *conn, long long deadline);
+static int watch_disarm (watch *w);
+static long long deadline_after (lua_Integer timeout);
+static int timed_out (int fired, lua_Integer timeout, unsigned int err);
+
+
+/*
+** Get another row of the given cursor, profiled by pc.  A row of a
+** streaming cursor must arrive within the timeout_ms its execute was
+** given.
+*/
+static int cur_dofetch (lua_State *L, cur_data *cur, prof_call *pc) {
+	unsigned long *lengths;
+	MYSQL_ROW row;
+	char errmsg[256] = "";
+	int status, fired, timedout;
+	watch w;
+	watch_arm (&w, cur->connp, cur->streaming ? deadline_after (cur->timeout_ms) : 0);
+	status = cur_nextrow (cur, &row, &lengths, errmsg, sizeof(errmsg));
+	fired = watch_disarm (&w);
+	timedout = status < 0 && cur->streaming &&
+		timed_out (fired, cur->timeout_ms, cur->ra != NULL ? cur->ra->my_errno : mysql_errno (cur->my_conn));
+	cur->generation++;
+	if (status > 0)
+		prof_row (pc, lengths, cur->numcols);
+	if (status <= 0) {
+		cur_nullify (L, cur);
+		if (timedout) {
+			cur->connp->stats.timeouts++;
+			lua_pushnil (L);
+			lua_pushfstring (L, LUASQL_PREFIX"fetch timed out after %d ms", (int)cur->timeout_ms);
+			lua_pushliteral (L, "timeout");
+			return 3;
+		}
+		if (status < 0)
+			return luasql_failmsg (L, "error fetching row. MySQL: ", errmsg);
+		lua_pushnil(L);  /* no more results */
+		return 1;
+	}
+	cur->row = row;
+	cur->lengths = lengths;
+	if (lua_type (L, 2) == LUA_TSTRING && strchr (lua_tostring (L, 2), 'l') != NULL)
+		return push_lazyrow (L, ROW_CURSOR, cur, cur->generation, cur->numcols);
+
+	if (lua_istable (L, 2)) {
+		const char *opts = luaL_optstring (L, 3, "n");
+		if (strchr (opts, 'n') != NULL) {
+			/* Copy values to numerical indices */
+			int i;
+			for (i = 0; i < cur->numcols; i++) {
+				cur_pushcolumn (L, cur, i);
+				lua_rawseti (L, 2, i+1);
+			}
+		}
+		if (strchr (opts, 'a') != NULL) {
+			int i;
+			/* Check if colnames exists */
+			if (cur->colnames == LUA_NOREF)
+		        create_colinfo(L, mysql_fetch_fields(cur->my_res), cur->numcols, &cur->colnames, &cur->coltypes);
+			lua_rawgeti (L, LUA_REGISTRYINDEX, cur->colnames);/* Push colnames*/
+	
+			/* Copy values to alphanumerical indices */
+			for (i = 0; i < cur->numcols; i++) {
+				lua_rawgeti(L, -1, i+1); /* push the field name */
+
+				/* Actually push the value */
+				cur_pushcolumn (L, cur, i);
+				lua_rawset (L, 2);
+			}
+			/* lua_pop(L, 1);  Pops colnames table. Not needed */
+		}
+		lua_pushvalue(L, 2);
+		return 1; /* return table */
+	}
+	else {
+		int i;
+		luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
+		for (i = 0; i < cur->numcols; i++)
+			cur_pushcolumn (L, cur, i);
+		return cur->numcols; /* return #numcols values */
+	}
+}
+
+static int cur_fetch (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	env_data *env = cur->connp->envp;
+	prof_call pc;
+	prof_begin (L, env, "fetch", &pc);
+	return prof_end (env, &pc, cur_dofetch (L, cur, &pc));
+}
+
+static int stmt_cur_fields (lua_State *L) {
+	stmt_cur_data *cur = (stmt_cur_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_CURSOR);
+	lua_newtable(L);  
+	for (int i = 0; i < cur->num_fields; i++) {
+		lua_pushinteger(L, i+1);
+		lua_pushstring(L, cur->fields[i].name);
+		lua_settable(L, -3);
+	}
+	return 1;
+}
+
+/*
+** Check for valid statement cursor.
+*/
+static stmt_cur_data *getstmtcursor (lua_State *L) {
+	stmt_cur_data *cur = (stmt_cur_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_CURSOR);
+	luaL_argcheck (L, cur != NULL, 1, "cursor expected");
+	luaL_argcheck (L, !cur->closed, 1, "cursor is closed");
+	return cur;
+}
+
+
+/*
+** Describe column #i (0 based) of the current row of a statement cursor.
+*/
+static void stmt_cur_getcell (stmt_cur_data *cur, int i, row_cell *cell) {
+	cell->type = cur->fields[i].type;
+	cell->decimals = cur->fields[i].decimals;
+	cell->binary = cur->bind[i].buffer_type != MYSQL_TYPE_STRING;
+	cell->data = cur->is_null[i] ? NULL : cur->row_data[i];
+	cell->length = cell->binary ? sizeof(MYSQL_TIME) :
+		cur->lengths[i] > cur->bind[i].buffer_length ? cur->bind[i].buffer_length : cur->lengths[i];
+}
+
+
+/*
+** Account the result buffers of a statement cursor to its connection.
+** Rows buffered by mysql_stmt_store_result are estimated from the
+** column widths.
+*/
+static void stmt_cur_account (stmt_cur_data *cur) {
+	long long mem = (long long)cur->num_fields * (sizeof(MYSQL_BIND) + sizeof(char *) +
+		sizeof(unsigned long) + sizeof(bool));
+	int i;
+	for (i = 0; i < cur->num_fields; i++)
+		mem += cur->bind[i].buffer_length;
+	if (cur->store != NULL)
+		result_account (cur->owner->connp, &cur->mem, &cur->disk,
+			mem + store_memory (cur->store), store_disk (cur->store));
+	else {
+		long long width = 0;
+		for (i = 0; i < cur->num_fields; i++)
+			width += (cur->fields[i].length < 1024 ? cur->fields[i].length : 1024) + sizeof(unsigned long);
+		result_account (cur->owner->connp, &cur->mem, &cur->disk,
+			mem + (long long)mysql_stmt_num_rows (cur->stmt) * width, 0);
+	}
+}
+
+
+/*
+** Fetch every row of the current result of a statement cursor into a
+** store, within the connection's max_result_bytes.  Return 0, or -1
+** with the reason in errmsg; the rows left are dropped then.
+*/
+static int stmt_cur_spool (stmt_cur_data *cur, char *errmsg, size_t errlen) {
+	conn_data *conn = cur->owner->connp;
+	row_store *s = store_new (cur->num_fields, conn->max_result_bytes, conn->spill);
+	int status = s == NULL ? -1 : 0, fetch, i;
+	while (status == 0 && (fetch = stmt_cur_fetchrow (cur)) > 0) {
+		for (i = 0; i < cur->num_fields; i++) {
+			row_cell cell;
+			stmt_cur_getcell (cur, i, &cell);
+			s->cells[i] = (char *)cell.data;
+			s->lengths[i] = cell.length;
+		}
+		status = store_add (s, s->cells, s->lengths);
+	}
+	if (status == -2)
+		snprintf (errmsg, errlen, "result exceeds max_result_bytes (%lu bytes)",
+			(unsigned long)conn->max_result_bytes);
+	else if (status == -1)
+		snprintf (errmsg, errlen, "could not buffer result: out of memory or temporary file error");
+	else if (fetch < 0)
+		snprintf (errmsg, errlen, "%s", mysql_stmt_error (cur->stmt));
+	else {
+		cur->store = s;
+		stmt_cur_account (cur);
+		return 0;
+	}
+	store_free (s);
+	mysql_stmt_free_result (cur->stmt);
+	return -1;
+}
+
+
+/*
+** Push column #i of the current row of a statement cursor.
+*/
+static void stmt_cur_pushcolumn (lua_State *L, stmt_cur_data *cur, int i) {
+	row_cell cell;
+	stmt_cur_getcell (cur, i, &cell);
+	push_cell (L, &cell, cur->temporal, cur->json);
+}
+
+
+/*
+** Copy the current row of the store into the result buffers, where
+** mysql_stmt_fetch would have put it.  Return 0, or -1 when a buffer
+** cannot grow.
+*/
+static int stmt_cur_loadrow (stmt_cur_data *cur) {
+	int i;
+	for (i = 0; i < cur->num_fields; i++) {
+		cur->is_null[i] = cur->store->cells[i] == NULL;
+		cur->lengths[i] = cur->store->lengths[i];
+		if (cur->is_null[i])
+			continue;
+		if (cur->bind[i].buffer_type == MYSQL_TYPE_STRING && stmt_cur_grow (cur, i, cur->lengths[i]) != 0)
+			return -1;
+		memcpy (cur->row_data[i], cur->store->cells[i], cur->lengths[i]);
+	}
+	return 0;
+}
+
+
+/*
+** Advance a statement cursor to its next row.  Return 1 if there is one,
+** 0 at the end and -1 on error (see stmt_cur_errmsg).
+*/
+static int stmt_cur_nextrow (stmt_cur_data *cur) {
+	int status;
+	if (cur->store != NULL) {
+		if ((status = store_next (cur->store)) > 0 && stmt_cur_loadrow (cur) != 0)
+			return -1;
+		return status;
+	}
+	return stmt_cur_fetchrow (cur);
+}
+
+
+/*
+** Why stmt_cur_nextrow failed.
+*/
+static const char *stmt_cur_errmsg (stmt_cur_data *cur) {
+	const char *msg;
+	if (cur->store != NULL)
+		return "could not read spilled rows";
+	msg = mysql_stmt_error (cur->stmt);
+	return msg != NULL && msg[0] != '\0' ? msg : "could not allocate row buffers";
+}
+
+
+static int stmt_cur_dofetch (lua_State *L, stmt_cur_data *cur, prof_call *pc) {
+	int status = stmt_cur_nextrow (cur);
+	cur->generation++;
+	if (status <= 0) {
+		char errmsg[256] = "";
+		if (status < 0)
+			snprintf (errmsg, sizeof(errmsg), "%s", stmt_cur_errmsg (cur));
+		if (cur->owner->connp->pending != cur) /* else keep it for nextresult */
+			stmt_cur_nullify(cur);
+		if (status < 0)
+			return luasql_failmsg (L, "error fetching row. MySQL: ", errmsg);
+		lua_pushnil(L);  /* no more results */
+		return 1;
+	}
+	prof_row (pc, cur->lengths, cur->num_fields);
+	const char *opts = luaL_optstring (L, 2, "n");
+	if (strchr (opts, 'l') != NULL)
+		return push_lazyrow (L, ROW_STMT_CURSOR, cur, cur->generation, cur->num_fields);
+	lua_newtable(L);  
+	for (int i = 0; i < cur->num_fields; i++) {
+		if (strchr (opts, 'n') != NULL){
+			lua_pushinteger(L, i+1);
+		} else{
+			lua_pushstring(L, cur->fields[i].name);
+		}
+		stmt_cur_pushcolumn (L, cur, i);
+		lua_settable(L, -3);
+	}
+	return 1;
+}
+
+static int stmt_cur_fetch (lua_State *L) {
+	stmt_cur_data *cur = getstmtcursor (L);
+	env_data *env = cur->owner->connp->envp;
+	prof_call pc;
+	prof_begin (L, env, "stmt.fetch", &pc);
+	return prof_end (env, &pc, stmt_cur_dofetch (L, cur, &pc));
+}
+
+
+/*
+** C ABI of the LuaJIT FFI binding (mysql_ffi.lua).  JIT compiled loops
+** move a cursor and read its columns through these functions and the
+** row view, with no Lua C API call per row.  Structures are only ever
+** extended at the end, and LUASQL_MYSQL_FFI_VERSION is bumped when
+** they are.  A cursor is passed as the pointer and kind returned by
+** cur:rowhandle().
+*/
+#define LUASQL_MYSQL_FFI_VERSION 1
+
+#define FFI_CURSOR      0   /* cur_data */
+#define FFI_STMT_CURSOR 1   /* stmt_cur_data */
+
+typedef struct {
+	int            numcols;
+	unsigned int   generation;     /* of the cursor when filled */
+	char         **data;           /* column bytes */
+	unsigned long *lengths;
+	bool          *is_null;        /* statement cursors; NULL data marks SQL NULL otherwise */
+} luasql_mysql_row;
+
+typedef struct {
+	int year, month, day, hour, minute, second;
+	long microsecond;
+	int neg;
+} luasql_mysql_time;
+
+
+LUASQL_API int luasql_mysql_ffi_version (void) {
+	return LUASQL_MYSQL_FFI_VERSION;
+}
+
+
+/*
+** Move the cursor to its next row and describe it in row.  Return 1 if
+** there is a row, 0 at the end and -1 on error or if the cursor is
+** closed.  The cursor is left open at the end; cur:close() finishes it.
+*/
+LUASQL_API int luasql_mysql_next (void *handle, int kind, luasql_mysql_row *row) {
+	int status;
+	if (kind == FFI_STMT_CURSOR) {
+		stmt_cur_data *cur = (stmt_cur_data *)handle;
+		if (cur->closed || cur->bind == NULL)
+			return -1;
+		status = stmt_cur_nextrow (cur);
+		cur->generation++;
+
+		row->numcols = cur->num_fields;
+		row->generation = cur->generation;
+		row->data = cur->row_data;
+		row->lengths = cur->lengths;
+		row->is_null = cur->is_null;
+	}
+	else {
+		cur_data *cur = (cur_data *)handle;
+		MYSQL_ROW r = NULL;
+		unsigned long *lengths = NULL;
+		char errmsg[256] = "";
+		if (cur->closed)
+			return -1;
+		status = cur_nextrow (cur, &r, &lengths, errmsg, sizeof(errmsg));
+		cur->generation++;
+		if (status > 0) {
+			cur->row = r;
+			cur->lengths = lengths;
+		}
+		row->numcols = cur->numcols;
+		row->generation = cur->generation;
+		row->data = status > 0 ? r : NULL;
+		row->lengths = status > 0 ? lengths : NULL;
+		row->is_null = NULL;
+	}
+	return status;
+}
+
+
+/*
+** Describe column #i (0 based) of the current row.  Return 0, or -1 if
+** there is no such column.
+*/
+static int ffi_cell (void *handle, int kind, int i, row_cell *cell) {
+	if (kind == FFI_STMT_CURSOR) {
+		stmt_cur_data *cur = (stmt_cur_data *)handle;
+		if (cur->closed || i < 0 || i >= cur->num_fields)
+			return -1;
+		stmt_cur_getcell (cur, i, cell);
+	}
+	else {
+		cur_data *cur = (cur_data *)handle;
+		if (cur->closed || cur->row == NULL || i < 0 || i >= cur->numcols)
+			return -1;
+		cur_getcell (cur, i, cell);
+	}
+	return 0;
+}
+
+
+/*
+** Type of column #i, an enum_field_types value, or -1.
+*/
+LUASQL_API int luasql_mysql_coltype (void *handle, int kind, int i) {
+	if (kind == FFI_STMT_CURSOR) {
+		stmt_cur_data *cur = (stmt_cur_data *)handle;
+		return cur->closed || i < 0 || i >= cur->num_fields ? -1 : (int)cur->fields[i].type;
+	}
+	else {
+		cur_data *cur = (cur_data *)handle;
+		return cur->closed || i < 0 || i >= cur->numcols ? -1 :
+			(int)mysql_fetch_field_direct (cur->my_res, i)->type;
+	}
+}
+
+
+/*
+** Read column #i of the current row as an integer.  Return 1, or 0 when
+** it is NULL or not an integer.
+*/
+LUASQL_API int luasql_mysql_integer (void *handle, int kind, int i, long long *v) {
+	row_cell cell;
+	const char *p, *end;
+	unsigned long long n = 0;
+	int neg = 0;
+	if (ffi_cell (handle, kind, i, &cell) != 0 || cell.data == NULL || cell.binary || cell.length == 0)
+		return 0;
+	p = cell.data;
+	end = p + cell.length;
+	if (*p == '-' || *p == '+')
+		neg = *p++ == '-';
+	if (p == end)
+		return 0;
+	for (; p < end; p++) {
+		if (*p < '0' || *p > '9' || n > (ULLONG_MAX - 9) / 10)
+			return 0;
+		n = n * 10 + (unsigned long long)(*p - '0');
+	}
+	if (n > (unsigned long long)LLONG_MAX + neg)
+		return 0;
+	*v = neg ? (long long)(0 - n) : (long long)n;
+	return 1;
+}
+
+
+/*
+** Read column #i of the current row as a double.  Return 1, or 0 when
+** it is NULL or not a number.
+*/
+LUASQL_API int luasql_mysql_number (void *handle, int kind, int i, double *v) {
+	row_cell cell;
+	char buf[64], *end;
+	if (ffi_cell (handle, kind, i, &cell) != 0 || cell.data == NULL || cell.binary ||
+		cell.length == 0 || cell.length >= sizeof(buf))
+		return 0;
+	memcpy (buf, cell.data, cell.length);
+	buf[cell.length] = '\0';
+	*v = strtod (buf, &end);
+	return *end == '\0';
+}
+
+
+/*
+** Read column #i of the current row as a date or time, from the binary
+** buffer of a statement cursor or the text of a query cursor.  Return
+** 1, or 0 when it is NULL or not temporal.
+*/
+LUASQL_API int luasql_mysql_temporal (void *handle, int kind, int i, luasql_mysql_time *v) {
+	row_cell cell;
+	MYSQL_TIME t;
+	if (ffi_cell (handle, kind, i, &cell) != 0 || cell.data == NULL || !is_temporal (cell.type))
+		return 0;
+	if (cell.binary)
+		memcpy (&t, cell.data, sizeof(MYSQL_TIME));
+	else if (temporal_parse (cell.data, cell.length, cell.type == MYSQL_TYPE_TIME, &t) != 0)
+		return 0;
+	v->year = (int)t.year;
+	v->month = (int)t.month;
+	v->day = (int)t.day;
+	v->hour = (int)t.hour;
+	v->minute = (int)t.minute;
+	v->second = (int)t.second;
+	v->microsecond = (long)t.second_part;
+	v->neg = t.neg;
+	return 1;
+}
+
+
+/*
+** Push the pointer and kind the FFI binding passes to the functions
+** above.  The cursor must stay referenced while they are used.
+*/
+static int cur_rowhandle (lua_State *L) {
+	lua_pushlightuserdata (L, getcursor (L));
+	lua_pushinteger (L, FFI_CURSOR);
+	return 2;
+}
+
+
+static int stmt_cur_rowhandle (lua_State *L) {
+	lua_pushlightuserdata (L, getstmtcursor (L));
+	lua_pushinteger (L, FFI_STMT_CURSOR);
+	return 2;
+}
+
+
+/*
+** Writer of cur:export.  Rows are formatted into out, which is written
+** to the file whenever it holds flush bytes.
+*/
+typedef struct {
+	FILE       *file;
+	short       close;              /* file was opened from a path */
+	sqlbuf      out;
+	size_t      flush;
+	short       tsv;
+	const char *null;               /* text of SQL NULL */
+	size_t      nulllen;
+	int         error;              /* errno of the first failed write */
+} export_data;
+
+
+/*
+** Read the target and options of cur:export, at stack indices 2 and 3.
+** Return 0, or -1 with a message in errmsg if the file cannot be opened.
+*/
+static int export_open (lua_State *L, export_data *x, char *errmsg, size_t errlen) {
+	static const char *const formats[] = {"csv", "tsv", NULL};
+	const char *format = opt_string (L, 3, "format", "csv");
+	lua_Integer flush = opt_integer (L, 3, "buffer", 1 << 20);
+	int i;
+	memset (x, 0, sizeof(export_data));
+	for (i = 0; formats[i] != NULL && strcmp (formats[i], format) != 0; i++)
+		;
+	luaL_argcheck (L, formats[i] != NULL, 3, "format must be 'csv' or 'tsv'");
+	luaL_argcheck (L, flush > 0, 3, "invalid buffer size");
+	x->tsv = i == 1;
+	x->null = opt_string (L, 3, "null", x->tsv ? "\\N" : "");
+	x->nulllen = strlen (x->null);
+	x->flush = (size_t)flush;
+	if (lua_type (L, 2) == LUA_TSTRING) {
+		if ((x->file = fopen (lua_tostring (L, 2), "wb")) == NULL) {
+			snprintf (errmsg, errlen, "%s: %s", lua_tostring (L, 2), strerror (errno));
+			return -1;
+		}
+		x->close = 1;
+	}
+	else {
+		luaL_Stream *stream = (luaL_Stream *)luaL_testudata (L, 2, LUA_FILEHANDLE);
+#if LUA_VERSION_NUM >= 502
+		luaL_argcheck (L, stream != NULL && stream->closef != NULL, 2, "expected a path or an open file");
+#else
+		luaL_argcheck (L, stream != NULL && stream->f != NULL, 2, "expected a path or an open file");
+#endif
+		x->file = stream->f;
+	}
+	return 0;
+}
+
+static void export_flush (export_data *x) {
+	if (x->out.len > 0 && x->error == 0 && fwrite (x->out.data, 1, x->out.len, x->file) != x->out.len)
+		x->error = errno ? errno : EIO;
+	x->out.len = 0;
+}
+
+
+/*
+** Append a field.  TSV escapes tabs, line breaks, backslashes and NULs
+** with backslashes; CSV quotes fields holding separators or quotes, and
+** empty strings when NULL is written as nothing.
+*/
+static void export_field (export_data *x, const char *s, size_t n) {
+	const char *end = s + n;
+	char *p;
+	if (sqlbuf_reserve (&x->out, 2 * n + 2) != 0)
+		return;
+	p = x->out.data + x->out.len;
+	if (x->tsv) {
+		for (; s < end; s++) {
+			switch (*s) {
+				case '\t': *p++ = '\\'; *p++ = 't'; break;
+				case '\n': *p++ = '\\'; *p++ = 'n'; break;
+				case '\r': *p++ = '\\'; *p++ = 'r'; break;
+				case '\\': *p++ = '\\'; *p++ = '\\'; break;
+				case '\0': *p++ = '\\'; *p++ = '0'; break;
+				default: *p++ = *s;
+			}
+		}
+	}
+	else {
+		const char *q;
+		for (q = s; q < end; q++)
+			if (*q == ',' || *q == '"' || *q == '\n' || *q == '\r')
+				break;
+		if (q == end && (n > 0 || x->nulllen > 0)) {
+			memcpy (p, s, n);
+			p += n;
+		}
+		else {
+			*p++ = '"';
+			for (; s < end; s++) {
+				if (*s == '"')
+					*p++ = '"';
+				*p++ = *s;
+			}
+			*p++ = '"';
+		}
+	}
+	x->out.len = p - x->out.data;
+}
+
+static void export_cell (export_data *x, int i, const row_cell *cell) {
+	if (i > 0)
+		sqlbuf_add (&x->out, x->tsv ? "\t" : ",", 1);
+	if (cell->data == NULL)
+		sqlbuf_add (&x->out, x->null, x->nulllen);
+	else if (cell->binary) {
+		MYSQL_TIME t;
+		char buf[64];
+		memcpy (&t, cell->data, sizeof(MYSQL_TIME));
+		export_field (x, buf, temporal_format (&t, cell->decimals, buf, sizeof(buf)));
+	}
+	else
+		export_field (x, cell->data, cell->length);
+}
+
+static void export_endrow (export_data *x) {
+	sqlbuf_add (&x->out, "\n", 1);
+	if (x->out.len >= x->flush)
+		export_flush (x);
+}
+
+static void export_header (export_data *x, MYSQL_FIELD *fields, int n) {
+	row_cell cell;
+	int i;
+	memset (&cell, 0, sizeof(cell));
+	for (i = 0; i < n; i++) {
+		cell.data = fields[i].name;
+		cell.length = strlen (fields[i].name);
+		export_cell (x, i, &cell);
+	}
+	export_endrow (x);
+}
+
+
+/*
+** Write out what is left and close the file if export opened it.
+** Return the number of rows, or nil and a message.
+*/
+static int export_finish (lua_State *L, export_data *x, lua_Integer rows, const char *errmsg) {
+	int oom = x->out.oom;
+	export_flush (x);
+	free (x->out.data);
+	if (x->close) {
+		if (fclose (x->file) != 0 && x->error == 0)
+			x->error = errno ? errno : EIO;
+	}
+	else if (fflush (x->file) != 0 && x->error == 0)
+		x->error = errno ? errno : EIO;
+	if (errmsg != NULL)
+		return luasql_failmsg (L, "error exporting rows. MySQL: ", errmsg);
+	if (oom)
+		return luasql_faildirect (L, "could not allocate export buffer");
+	if (x->error != 0)
+		return luasql_failmsg (L, "error writing export: ", strerror (x->error));
+	lua_pushinteger (L, rows);
+	return 1;
+}
+
+
+/*
+** Write the remaining rows of a cursor to a file as CSV or TSV.
+**     cur:export(path_or_file, {format="csv"|"tsv", header=true,
+**                               null=text, buffer=bytes})
+** No Lua values are made for the rows.  The cursor is closed at the end,
+** as after its last fetch.  Return the number of rows written.
+*/
+static int cur_export (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	export_data x;
+	char errmsg[256] = "";
+	MYSQL_ROW row;
+	unsigned long *lengths;
+	lua_Integer rows = 0;
+	int status, i;
+	if (export_open (L, &x, errmsg, sizeof(errmsg)) != 0)
+		return luasql_faildirect (L, errmsg);
+	if (opt_boolean (L, 3, "header", 1))
+		export_header (&x, mysql_fetch_fields (cur->my_res), cur->numcols);
+	while (!x.out.oom && x.error == 0 &&
+		(status = cur_nextrow (cur, &row, &lengths, errmsg, sizeof(errmsg))) > 0) {
+		row_cell cell;
+		cur->row = row;
+		cur->lengths = lengths;
+		for (i = 0; i < cur->numcols; i++) {
+			cur_getcell (cur, i, &cell);
+			export_cell (&x, i, &cell);
+		}
+		export_endrow (&x);
+		rows++;
+	}
+	cur->generation++;
+	cur_nullify (L, cur);
+	return export_finish (L, &x, rows, errmsg[0] != '\0' ? errmsg : NULL);
+}
+
+static int stmt_cur_export (lua_State *L) {
+	stmt_cur_data *cur = getstmtcursor (L);
+	export_data x;
+	char errmsg[256] = "";
+	lua_Integer rows = 0;
+	int status = 0, i;
+	if (export_open (L, &x, errmsg, sizeof(errmsg)) != 0)
+		return luasql_faildirect (L, errmsg);
+	if (opt_boolean (L, 3, "header", 1))
+		export_header (&x, cur->fields, cur->num_fields);
+	while (!x.out.oom && x.error == 0 && (status = stmt_cur_nextrow (cur)) > 0) {
+		row_cell cell;
+		for (i = 0; i < cur->num_fields; i++) {
+			stmt_cur_getcell (cur, i, &cell);
+			export_cell (&x, i, &cell);
+		}
+		export_endrow (&x);
+		rows++;
+	}
+	cur->generation++;
+	if (status < 0)
+		snprintf (errmsg, sizeof(errmsg), "%s", stmt_cur_errmsg (cur));
+	if (cur->owner->connp->pending != cur) /* else keep it for nextresult */
+		stmt_cur_nullify (cur);
+	return export_finish (L, &x, rows, errmsg[0] != '\0' ? errmsg : NULL);
+}
+
+/*
+** Move to the next result set of a CALL.  Return true and whether it
+** holds the OUT parameters, or false when there are no more.
+*/
+static int stmt_cur_nextresult (lua_State *L) {
+	stmt_cur_data *cur = getstmtcursor (L);
+	conn_data *conn = cur->owner->connp;
+	MYSQL_RES *res;
+	int status;
+	cur->generation++;
+	luaL_unref (L, LUA_REGISTRYINDEX, cur->colindex);
+	cur->colindex = LUA_NOREF;
+	stmt_cur_dropcolinfo (L, cur);
+	stmt_cur_detach (cur);  /* the statement's buffers describe the first result set */
+	while (conn->pending == cur && mysql_more_results (conn->my_conn)) {
+		stmt_cur_unbind (cur);
+		mysql_stmt_free_result (cur->stmt);
+		if ((status = mysql_stmt_next_result (cur->stmt)) != 0) {
+			conn->pending = NULL;
+			if (status < 0)
+				break;
+			lua_pushboolean (L, 0);
+			lua_pushinteger (L, mysql_stmt_errno (cur->stmt));
+			lua_pushstring (L, mysql_stmt_error (cur->stmt));
+			return 3;
+		}
+		if (mysql_stmt_field_count (cur->stmt) == 0)
+			continue; /* status of the CALL itself */
+		if ((conn->max_result_bytes == 0 && mysql_stmt_store_result (cur->stmt)) ||
+			(res = mysql_stmt_result_metadata (cur->stmt)) == NULL) {
+			lua_pushboolean (L, 0);
+			lua_pushinteger (L, mysql_stmt_errno (cur->stmt));
+			lua_pushstring (L, mysql_stmt_error (cur->stmt));
+			stmt_cur_drain (cur);
+			return 3;
+		}
+		if (stmt_cur_bind (cur, res) != 0) {
+			stmt_cur_drain (cur);
+			return luaL_error (L, LUASQL_PREFIX"could not bind result set");
+		}
+		if (conn->max_result_bytes == 0)
+			stmt_cur_account (cur);
+		else {
+			char errmsg[256] = "";
+			if (stmt_cur_spool (cur, errmsg, sizeof(errmsg)) != 0) {
+				stmt_cur_drain (cur);
+				lua_pushboolean (L, 0);
+				lua_pushinteger (L, mysql_stmt_errno (cur->stmt));
+				lua_pushstring (L, errmsg);
+				return 3;
+			}
+		}
+		if (!mysql_more_results (conn->my_conn))
+			conn->pending = NULL;
+		lua_pushboolean (L, 1);
+		lua_pushboolean (L, (conn->my_conn->server_status & SERVER_PS_OUT_PARAMS) != 0);
+		return 2;
+	}
+	conn->pending = conn->pending == cur ? NULL : conn->pending;
+	lua_pushboolean (L, 0);
+	lua_pushinteger (L, -1);
+	return 2;
+}
+
+static int stmt_cur_hasnextresult (lua_State *L) {
+	stmt_cur_data *cur = getstmtcursor (L);
+	conn_data *conn = cur->owner->connp;
+	lua_pushboolean (L, conn->pending == cur && mysql_more_results (conn->my_conn));
+	return 1;
+}
+
+static int stmt_cur_settemporal (lua_State *L) {
+	stmt_cur_data *cur = getstmtcursor (L);
+	cur->temporal = (short)luaL_checkoption (L, 2, NULL, temporal_modes);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+static int stmt_cur_setjson (lua_State *L) {
+	stmt_cur_data *cur = getstmtcursor (L);
+	cur->json = (short)lua_toboolean (L, 2);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+/*
+** Push a table mapping column names to positions, building it on first
+** use and caching it in *ref.
+*/
+static void push_colindex (lua_State *L, int *ref, MYSQL_FIELD *fields, int numcols) {
+	int i;
+	if (*ref == LUA_NOREF) {
+		lua_createtable (L, 0, numcols);
+		for (i = 0; i < numcols; i++) {
+			lua_pushstring (L, fields[i].name);
+			lua_pushinteger (L, i + 1);
+			lua_rawset (L, -3);
+		}
+		*ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti (L, LUA_REGISTRYINDEX, *ref);
+}
+
+
+/*
+** Create a row proxy viewing the current row of the cursor at index 1.
+*/
+static int push_lazyrow (lua_State *L, int kind, void *cur, unsigned int generation, int numcols) {
+	row_data *row;
+	if (kind == ROW_CURSOR) {
+		cur_data *c = (cur_data *)cur;
+		push_colindex (L, &c->colindex, mysql_fetch_fields (c->my_res), numcols);
+	}
+	else {
+		stmt_cur_data *c = (stmt_cur_data *)cur;
+		push_colindex (L, &c->colindex, c->fields, numcols);
+	}
+	row = (row_data *)LUASQL_NEWUD (L, sizeof(row_data));
+	row->closed = 0;
+	row->kind = kind;
+	row->cur = cur;
+	row->generation = generation;
+	row->numcols = numcols;
+	row->temporal = TEMPORAL_STRING;
+	row->json = 0;
+	row->cells = NULL;
+	luasql_setmeta (L, LUASQL_ROW_MYSQL);
+	lua_insert (L, -2);
+	row->colindex = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_pushvalue (L, 1);
+	row->curref = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+** Check that a view still refers to the current row of its cursor.
+*/
+static void row_checkvalid (lua_State *L, row_data *row) {
+	int valid;
+	if (row->kind == ROW_CURSOR) {
+		cur_data *c = (cur_data *)row->cur;
+		valid = !c->closed && c->generation == row->generation;
+	}
+	else {
+		stmt_cur_data *c = (stmt_cur_data *)row->cur;
+		valid = !c->closed && c->generation == row->generation;
+	}
+	if (!valid)
+		luaL_error (L, LUASQL_PREFIX"row is no longer valid (use row:copy() to keep it)");
+}
+
+
+/*
+** Get the value of column #i (0 based) and push it.
+*/
+static void row_pushcolumn (lua_State *L, row_data *row, int i) {
+	switch (row->kind) {
+		case ROW_CURSOR:
+			cur_pushcolumn (L, (cur_data *)row->cur, i);
+			break;
+		case ROW_STMT_CURSOR:
+			stmt_cur_pushcolumn (L, (stmt_cur_data *)row->cur, i);
+			break;
+		default:
+			push_cell (L, &row->cells[i], row->temporal, row->json);
+	}
+}
+
+
+/*
+** Describe column #i (0 based) of a row without converting it.
+*/
+static void row_getcell (row_data *row, int i, row_cell *cell) {
+	if (row->kind == ROW_CURSOR)
+		cur_getcell ((cur_data *)row->cur, i, cell);
+	else if (row->kind == ROW_STMT_CURSOR)
+		stmt_cur_getcell ((stmt_cur_data *)row->cur, i, cell);
+	else
+		*cell = row->cells[i];
+}
+
+
+/*
+** Decoding modes of a row: its cursor's, or the ones it was copied with.
+*/
+static void row_modes (row_data *row, short *temporal, short *json) {
+	if (row->kind == ROW_CURSOR) {
+		*temporal = ((cur_data *)row->cur)->temporal;
+		*json = ((cur_data *)row->cur)->json;
+	}
+	else if (row->kind == ROW_STMT_CURSOR) {
+		*temporal = ((stmt_cur_data *)row->cur)->temporal;
+		*json = ((stmt_cur_data *)row->cur)->json;
+	}
+	else {
+		*temporal = row->temporal;
+		*json = row->json;
+	}
+}
+
+
+/*
+** Copy the values of a row into a new row that owns them.
+*/
+static int row_copy (lua_State *L) {
+	row_data *row = (row_data *)luaL_checkudata (L, 1, LUASQL_ROW_MYSQL);
+	row_data *copy;
+	row_cell cell;
+	size_t total = 0;
+	char *data;
+	int i;
+	if (row->kind != ROW_COPY)
+		row_checkvalid (L, row);
+	for (i = 0; i < row->numcols; i++) {
+		row_getcell (row, i, &cell);
+		if (cell.data != NULL)
+			total += cell.length;
+	}
+	copy = (row_data *)LUASQL_NEWUD (L, sizeof(row_data) + sizeof(row_cell) * row->numcols + total);
+	copy->closed = 0;
+	copy->kind = ROW_COPY;
+	copy->cur = NULL;
+	copy->curref = LUA_NOREF;
+	copy->generation = 0;
+	copy->numcols = row->numcols;
+	row_modes (row, &copy->temporal, &copy->json);
+	copy->cells = (row_cell *)(copy + 1);
+	data = (char *)(copy->cells + row->numcols);
+	for (i = 0; i < row->numcols; i++) {
+		row_getcell (row, i, &cell);
+		if (cell.data != NULL) {
+			memcpy (data, cell.data, cell.length);
+			cell.data = data;
+			data += cell.length;
+		}
+		copy->cells[i] = cell;
+	}
+	luasql_setmeta (L, LUASQL_ROW_MYSQL);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, row->colindex);
+	copy->colindex = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+** Index a row by column position or name.
+*/
+static int row_index (lua_State *L) {
+	row_data *row = (row_data *)luaL_checkudata (L, 1, LUASQL_ROW_MYSQL);
+	lua_Integer i = 0;
+	if (lua_type (L, 2) == LUA_TNUMBER && lua_isinteger (L, 2))
+		i = lua_tointeger (L, 2);
+	else if (lua_type (L, 2) == LUA_TSTRING) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, row->colindex);
+		lua_pushvalue (L, 2);
+		lua_rawget (L, -2);
+		if (lua_isnil (L, -1)) {
+			/* not a column, maybe a method */
+			if (strcmp (lua_tostring (L, 2), "copy") == 0) {
+				lua_pushcfunction (L, row_copy);
+				return 1;
+			}
+			return 1;
+		}
+		i = lua_tointeger (L, -1);
+	}
+	if (i < 1 || i > row->numcols) {
+		lua_pushnil (L);
+		return 1;
+	}
+	if (row->kind != ROW_COPY)
+		row_checkvalid (L, row);
+	row_pushcolumn (L, row, (int)i - 1);
+	return 1;
+}
+
+
+static int row_len (lua_State *L) {
+	row_data *row = (row_data *)luaL_checkudata (L, 1, LUASQL_ROW_MYSQL);
+	lua_pushinteger (L, row->numcols);
+	return 1;
+}
+
+
+static int row_gc (lua_State *L) {
+	row_data *row = (row_data *)luaL_checkudata (L, 1, LUASQL_ROW_MYSQL);
+	if (row != NULL && !row->closed) {
+		row->closed = 1;
+		luaL_unref (L, LUA_REGISTRYINDEX, row->curref);
+		luaL_unref (L, LUA_REGISTRYINDEX, row->colindex);
+	}
+	return 0;
+}
+
+
+/*
+** Get the next result from multiple statements.
+** The cursor is closed when the next result set cannot be read.
+*/
+static int cur_next_result (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	MYSQL* con = cur->connp->my_conn;
+	int status;
+	if(mysql_more_results(con)){
+		if (cur->ra) {
+			ra_stop (cur->ra);
+			cur->ra = NULL;
+		}
+		mysql_free_result(cur->my_res);
+		cur->my_res = NULL;
+		cur->row = NULL;
+		cur->generation++; /* rows read so far pointed into the old result */
+		store_free(cur->store);
+		cur->store = NULL;
+		result_account(cur->connp, &cur->mem, &cur->disk, 0, 0);
+		status = mysql_next_result(con);
+		if(status == 0){
+			char errmsg[256] = "";
+			cur->my_res = cur->streaming ? mysql_use_result(con) :
+				conn_storeresult(cur->connp, &cur->store, errmsg, sizeof(errmsg));
+			if(cur->my_res != NULL){ /* the new result set has its own columns */
+				cur->numcols = (int)mysql_num_fields(cur->my_res);
+				luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
+				luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
+				luaL_unref(L, LUA_REGISTRYINDEX, cur->colindex);
+				cur->colnames = cur->coltypes = cur->colindex = LUA_NOREF;
+			}
+			if(cur->my_res != NULL && cur->ra_depth > 0){
+				cur->ra = ra_start(con, cur->my_res, cur->numcols, cur->ra_depth, cur->ra_batchrows);
+				if(cur->ra == NULL){
+					cur_nullify(L, cur);
+					lua_pushboolean(L, 0);
+					lua_pushinteger(L, -1);
+					lua_pushliteral(L, "could not start read-ahead worker");
+					return 3;
+				}
+			}
+			if(cur->my_res != NULL){
+				cur_account(cur);
+				lua_pushboolean(L, 1);
+				return 1;
+			}else{
+				lua_pushboolean(L, 0);
+				lua_pushinteger(L, mysql_errno(con));
+				lua_pushstring(L, errmsg[0] != '\0' ? errmsg : mysql_error(con));
+				cur_nullify(L, cur);
+				return 3;
+			}
+		}else{
+			cur_nullify(L, cur);
+			lua_pushboolean(L, 0);
+			lua_pushinteger(L, status);
+			switch(status){
+				case CR_COMMANDS_OUT_OF_SYNC:
+					lua_pushliteral(L, "CR_COMMANDS_OUT_OF_SYNC");
+				break;
+				case CR_SERVER_GONE_ERROR:
+					lua_pushliteral(L, "CR_SERVER_GONE_ERROR");
+				break;
+				case CR_SERVER_LOST:
+					lua_pushliteral(L, "CR_SERVER_LOST");
+				break;
+				case CR_UNKNOWN_ERROR:
+					lua_pushliteral(L, "CR_UNKNOWN_ERROR");
+				break;
+				default:
+					lua_pushliteral(L, "Unknown");
+			}
+			return 3;
+		}
+	}else{
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, -1);
+		return 2;
+	}
+}
+
+/*
+** Check if next result is available
+*/
+static int cur_has_next_result (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	lua_pushboolean(L, mysql_more_results(cur->connp->my_conn));
+	return 1;
+}
+
+
+/*
+** Choose how temporal columns are returned: "string" (the default),
+** "epoch" (seconds), "epoch_us" (microseconds) or "table".
+*/
+static int cur_settemporal (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	cur->temporal = (short)luaL_checkoption (L, 2, NULL, temporal_modes);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Turn decoding of JSON columns into Lua tables on or off.
+*/
+static int cur_setjson (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	cur->json = (short)lua_toboolean (L, 2);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Cursor object collector function
+*/
+static int cur_gc (lua_State *L) {
+	cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUASQL_CURSOR_MYSQL);
+	if (cur != NULL && !(cur->closed))
+		cur_nullify (L, cur);
+	return 0;
+}
+
+
+/*
+** Close the cursor on top of the stack.
+** Return 1
+*/
+static int cur_close (lua_State *L) {
+	cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUASQL_CURSOR_MYSQL);
+	luaL_argcheck (L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+	if (cur->closed) {
+		lua_pushboolean (L, 0);
+		lua_pushstring(L, "cursor is already closed");
+		return 2;
+	}
+	cur_nullify (L, cur);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+static int stmt_cur_gc (lua_State *L) {
+	stmt_cur_data *cur = (stmt_cur_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_CURSOR);
+	if (cur != NULL && !(cur->closed))
+		stmt_cur_nullify(cur);
+	if (cur != NULL) {
+		luaL_unref (L, LUA_REGISTRYINDEX, cur->colindex);
+		cur->colindex = LUA_NOREF;
+		stmt_cur_dropcolinfo (L, cur);
+		luaL_unref (L, LUA_REGISTRYINDEX, cur->stmt_ref);
+		cur->stmt_ref = LUA_NOREF;
+	}
+	return 0;
+}
+
+
+/*
+** Close the cursor on top of the stack.
+** Return 1
+*/
+static int stmt_cur_close (lua_State *L) {
+	stmt_cur_data *cur = (stmt_cur_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_CURSOR);
+	luaL_argcheck (L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
+	if (cur->closed) {
+		lua_pushboolean (L, 0);
+		lua_pushstring(L, "cursor is already closed");
+		return 2;
+	}
+	stmt_cur_nullify (cur);
+	stmt_cur_dropcolinfo (L, cur);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Pushes a column information table on top of the stack.
+** If the table isn't built yet, call the creator function and stores
+** a reference to it on the cursor structure.
+*/
+static void _pushtable (lua_State *L, cur_data *cur, size_t off) {
+	int *ref = (int *)cur + off / sizeof(int);
+
+	/* If colnames or coltypes do not exist, create both. */
+	if (*ref == LUA_NOREF)
+		create_colinfo(L, mysql_fetch_fields(cur->my_res), cur->numcols, &cur->colnames, &cur->coltypes);
+	
+	/* Pushes the right table (colnames or coltypes) */
+	lua_rawgeti (L, LUA_REGISTRYINDEX, *ref);
+}
+#define pushtable(L,c,m) (_pushtable(L,c,offsetof(cur_data,m)))
+
+
+/*
+** Return the list of field names.
+*/
+static int cur_getcolnames (lua_State *L) {
+	pushtable (L, getcursor(L), colnames);
+	return 1;
+}
+
+
+/*
+** Return the list of field types.
+*/
+static int cur_getcoltypes (lua_State *L) {
+	pushtable (L, getcursor(L), coltypes);
+	return 1;
+}
+
+
+/*
+** Push the number of rows.
+*/
+static int cur_numrows (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	if (cur->streaming)
+		return luasql_faildirect (L, "row count is not available on unbuffered cursors");
+	if (cur->store != NULL)
+		lua_pushinteger (L, (lua_Integer)cur->store->nrows);
+	else
+		lua_pushinteger (L, (lua_Number)mysql_num_rows (cur->my_res));
+	return 1;
+}
+
+
+/*
+** Seeks to an arbitrary row in a query result set.
+*/
+static int cur_seek (lua_State *L) {
+	cur_data *cur = getcursor (L);
+	lua_Integer rownum = luaL_checkinteger (L, 2);
+	if (cur->streaming)
+		return luasql_faildirect (L, "seek is not supported on unbuffered cursors");
+	cur->generation++;
+	if (cur->store != NULL)
+		store_seek (cur->store, rownum < 0 ? 0 : (uint64_t)rownum);
+	else
+		mysql_data_seek (cur->my_res, rownum);
+	return 0;
+}
+
+
+/*
+** Pushes a column information table of a statement cursor, building
+** both on first use.
+*/
+static void stmt_cur_pushcolinfo (lua_State *L, stmt_cur_data *cur, int types) {
+	if (cur->colnames == LUA_NOREF)
+		create_colinfo(L, cur->fields, cur->num_fields, &cur->colnames, &cur->coltypes);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, types ? cur->coltypes : cur->colnames);
+}
+
+
+/*
+** Return the list of field names of a statement cursor.
+*/
+static int stmt_cur_getcolnames (lua_State *L) {
+	stmt_cur_pushcolinfo (L, getstmtcursor (L), 0);
+	return 1;
+}
+
+
+/*
+** Return the list of field types of a statement cursor.
+*/
+static int stmt_cur_getcoltypes (lua_State *L) {
+	stmt_cur_pushcolinfo (L, getstmtcursor (L), 1);
+	return 1;
+}
+
+
+/*
+** Push the number of rows of the current result set.
+*/
+static int stmt_cur_numrows (lua_State *L) {
+	stmt_cur_data *cur = getstmtcursor (L);
+	if (cur->store != NULL)
+		lua_pushinteger (L, (lua_Integer)cur->store->nrows);
+	else
+		lua_pushinteger (L, (lua_Integer)mysql_stmt_num_rows (cur->stmt));
+	return 1;
+}
+
+
+/*
+** Seeks to an arbitrary row of the buffered result set.
+*/
+static int stmt_cur_seek (lua_State *L) {
+	stmt_cur_data *cur = getstmtcursor (L);
+	lua_Integer rownum = luaL_checkinteger (L, 2);
+	luaL_argcheck (L, rownum >= 0, 2, "row number must be non-negative");
+	cur->generation++;
+	if (cur->store != NULL)
+		store_seek (cur->store, (uint64_t)rownum);
+	else
+		mysql_stmt_data_seek (cur->stmt, (my_ulonglong)rownum);
+	return 0;
+}
+
+
+/*
+** Create a new Cursor object and push it on top of the stack.
+*/
+static int create_cursor (lua_State *L, conn_data *connp, int conn, MYSQL_RES *result, int cols, int streaming) {
+	cur_data *cur = (cur_data *)LUASQL_NEWUD(L, sizeof(cur_data));
+	luasql_setmeta (L, LUASQL_CURSOR_MYSQL);
+
+	/* fill in structure */
+	cur->closed = 0;
+	cur->conn = LUA_NOREF;
+	cur->numcols = cols;
+	cur->colnames = LUA_NOREF;
+	cur->coltypes = LUA_NOREF;
+	cur->my_res = result;
+	cur->my_conn = connp->my_conn;
+	cur->connp = connp;
+	connp->outstanding++;
+	cur->store = NULL;
+	cur->mem = 0;
+	cur->disk = 0;
+	cur->timeout_ms = 0;
+	cur->streaming = streaming;
+	cur->ra = NULL;
+	cur->ra_depth = 0;
+	cur->ra_batchrows = 0;
+	cur->row = NULL;
+	cur->lengths = NULL;
+	cur->generation = 0;
+	cur->colindex = LUA_NOREF;
+	cur->temporal = connp->temporal;
+	cur->json = connp->json;
+	connp->streaming = streaming;
+	lua_pushvalue (L, conn);
+	cur->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	return 1;
+}
+
+/*
+** Create a cursor on the result set the statement at stack index idx has
+** just produced.  It reads into the statement's buffers.
+*/
+static int create_stmt_cursor (lua_State *L, int idx, struct stmt_data *owner) {
+	MYSQL_STMT *stmt = owner->stmt;
+	stmt_cur_data *cur = (stmt_cur_data *)LUASQL_NEWUD(L, sizeof(stmt_cur_data));
+	luasql_setmeta (L, LUASQL_STATEMENT_CURSOR);
+
+	 cur->closed = 0;
+	 cur->generation = 0;
+	 cur->colindex = LUA_NOREF;
+	 cur->colnames = LUA_NOREF;
+	 cur->coltypes = LUA_NOREF;
+	 cur->stmt_ref = LUA_NOREF;
+	 cur->owner = owner;
+	 cur->temporal = owner->connp->temporal;
+	 cur->json = owner->connp->json;
+	 owner->cursor = cur;
+	 owner->connp->outstanding++;
+	 cur->stmt = stmt;
+	 cur->my_res = NULL;
+	 cur->fields = mysql_fetch_fields(owner->meta);
+	 cur->num_fields = owner->num_fields;
+	 cur->bind = owner->bind;
+	 cur->row_data = owner->row_data;
+	 cur->lengths = owner->lengths;
+	 cur->is_null = owner->is_null;
+	 cur->borrowed = 1;
+	 cur->store = NULL;
+	 cur->mem = 0;
+	 cur->disk = 0;
+
+	lua_pushvalue (L, idx);
+	cur->stmt_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	return 1;
+}
+
+
+static void params_free (conn_params *p) {
+	free (p->host);
+	free (p->user);
+	free (p->password);
+	free (p->db);
+	free (p->unix_socket);
+	free (p->ssl_ca);
+	free (p->ssl_capath);
+	free (p->ssl_cert);
+	free (p->ssl_key);
+	free (p->ssl_cipher);
+	free (p->tls_version);
+	memset (p, 0, sizeof(conn_params));
+}
+
+
+/*
+** Duplicate connection parameters.  Return 0 on success.
+*/
+static int params_copy (conn_params *dst, const conn_params *src) {
+#define DUPFIELD(f) dst->f = src->f ? strdup (src->f) : NULL; \
+	if (src->f && dst->f == NULL) goto nomem;
+	memset (dst, 0, sizeof(conn_params));
+	DUPFIELD (host);
+	DUPFIELD (user);
+	DUPFIELD (password);
+	DUPFIELD (db);
+	DUPFIELD (unix_socket);
+	DUPFIELD (ssl_ca);
+	DUPFIELD (ssl_capath);
+	DUPFIELD (ssl_cert);
+	DUPFIELD (ssl_key);
+	DUPFIELD (ssl_cipher);
+	DUPFIELD (tls_version);
+#undef DUPFIELD
+	dst->port = src->port;
+	dst->client_flag = src->client_flag;
+	dst->ssl_mode = src->ssl_mode;
+	dst->connect_timeout = src->connect_timeout;
+	dst->session_reuse = src->session_reuse;
+	dst->tls = src->tls;
+	return 0;
+nomem:
+	params_free (dst);
+	return -1;
+}
+
+
+
+
+/*
+** Key of the TLS sessions of the server p connects to with its TLS
+** settings, so that a session is never resumed under a different CA,
+** certificate or mode.  Each setting is written with its length to keep
+** the key unambiguous.  Return 0, or -1 if the key does not fit.
+*/
+static int tls_key (const conn_params *p, char *key, size_t size) {
+	const char *tls[] = {p->ssl_ca, p->ssl_capath, p->ssl_cert, p->ssl_key, p->ssl_cipher, p->tls_version};
+	size_t i, len;
+	int n = snprintf (key, size, "%s@%s:%u%s mode=%u", p->user ? p->user : "",
+		p->host ? p->host : "localhost", p->port, p->unix_socket ? p->unix_socket : "", p->ssl_mode);
+	for (i = 0; i < sizeof(tls) / sizeof(tls[0]) && n >= 0 && (size_t)n < size; i++) {
+		len = tls[i] ? strlen (tls[i]) : 0;
+		n += snprintf (key + n, size - n, " %zu:%s", len, tls[i] ? tls[i] : "");
+	}
+	return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+
+/*
+** Return a copy of the session cached under key, or NULL.
+*/
+static char *tls_lookup (tls_cache *cache, const char *key) {
+	tls_session *t;
+	char *data = NULL;
+	pthread_mutex_lock (&cache->lock);
+	for (t = cache->list; t != NULL; t = t->next)
+		if (strcmp (t->key, key) == 0) {
+			data = strdup (t->data);
+			break;
+		}
+	pthread_mutex_unlock (&cache->lock);
+	return data;
+}
+
+
+/*
+** Cache the session data under key, replacing any older one.
+*/
+static void tls_store (tls_cache *cache, const char *key, const char *data) {
+	tls_session *t;
+	char *copy = strdup (data);
+	if (copy == NULL)
+		return;
+	pthread_mutex_lock (&cache->lock);
+	for (t = cache->list; t != NULL && strcmp (t->key, key) != 0; t = t->next)
+		;
+	if (t == NULL && (t = (tls_session *)calloc (1, sizeof(tls_session))) != NULL) {
+		if ((t->key = strdup (key)) == NULL) {
+			free (t);
+			t = NULL;
+		}
+		else {
+			t->next = cache->list;
+			cache->list = t;
+		}
+	}
+	if (t != NULL) {
+		free (t->data);
+		t->data = copy;
+		copy = NULL;
+	}
+	pthread_mutex_unlock (&cache->lock);
+	free (copy);
+}
+
+
+static void tls_clear (tls_cache *cache) {
+	tls_session *t, *next;
+	pthread_mutex_lock (&cache->lock);
+	for (t = cache->list; t != NULL; t = next) {
+		next = t->next;
+		free (t->key);
+		free (t->data);
+		free (t);
+	}
+	cache->list = NULL;
+	pthread_mutex_unlock (&cache->lock);
+}
+
+
+/*
+** Set the TLS and timeout options of p on a new handle, with the
+** cached session to resume if there is one.  *session must be freed
+** after connecting.  Return 0, or the failing mysql_options status.
+*/
+static int params_options (MYSQL *my_conn, const conn_params *p, char **session) {
+	int status = 0;
+	*session = NULL;
+	if (p->connect_timeout > 0)
+		status |= mysql_options (my_conn, MYSQL_OPT_CONNECT_TIMEOUT, &p->connect_timeout);
+#if MYSQL_VERSION_ID >= 50711 && !defined(MARIADB_BASE_VERSION)
+	if (p->ssl_mode > 0)
+		status |= mysql_options (my_conn, MYSQL_OPT_SSL_MODE, &p->ssl_mode);
+	if (p->tls_version != NULL)
+		status |= mysql_options (my_conn, MYSQL_OPT_TLS_VERSION, p->tls_version);
+#endif
+	if (p->ssl_ca != NULL)
+		status |= mysql_options (my_conn, MYSQL_OPT_SSL_CA, p->ssl_ca);
+	if (p->ssl_capath != NULL)
+		status |= mysql_options (my_conn, MYSQL_OPT_SSL_CAPATH, p->ssl_capath);
+	if (p->ssl_cert != NULL)
+		status |= mysql_options (my_conn, MYSQL_OPT_SSL_CERT, p->ssl_cert);
+	if (p->ssl_key != NULL)
+		status |= mysql_options (my_conn, MYSQL_OPT_SSL_KEY, p->ssl_key);
+	if (p->ssl_cipher != NULL)
+		status |= mysql_options (my_conn, MYSQL_OPT_SSL_CIPHER, p->ssl_cipher);
+#if MYSQL_VERSION_ID >= 80029 && !defined(MARIADB_BASE_VERSION)
+	if (p->tls != NULL && p->session_reuse) {
+		char key[2048];
+		if (tls_key (p, key, sizeof(key)) == 0 && (*session = tls_lookup (p->tls, key)) != NULL)
+			mysql_options (my_conn, MYSQL_OPT_SSL_SESSION_DATA, *session);
+	}
+#endif
+	return status;
+}
+
+
+/*
+** Cache the TLS session of a new connection for the next one.
+*/
+static void params_keepsession (MYSQL *my_conn, const conn_params *p) {
+#if MYSQL_VERSION_ID >= 80029 && !defined(MARIADB_BASE_VERSION)
+	if (p->tls != NULL && p->session_reuse && mysql_get_ssl_cipher (my_conn) != NULL) {
+		char key[2048];
+		void *data = mysql_get_ssl_session_data (my_conn, 0, NULL);
+		if (data != NULL) {
+			if (tls_key (p, key, sizeof(key)) == 0)
+				tls_store (p->tls, key, (const char *)data);
+			mysql_free_ssl_session_data (my_conn, data);
+		}
+	}
+#else
+	(void)my_conn; (void)p;
+#endif
+}
+
+
+/*
+** Open a new MySQL connection.  On failure return NULL and leave the
+** reason in errmsg.
+*/
+static MYSQL *params_connect (const conn_params *p, char *errmsg, size_t errlen) {
+	MYSQL *my_conn = mysql_init (NULL);
+	char *session;
+	if (my_conn == NULL) {
+		strncpy (errmsg, "Out of memory.", errlen - 1);
+		return NULL;
+	}
+	if (params_options (my_conn, p, &session) != 0) {
+		strncpy (errmsg, "invalid TLS or timeout options", errlen - 1);
+		free (session);
+		mysql_close (my_conn);
+		return NULL;
+	}
+	if (!mysql_real_connect (my_conn, p->host, p->user, p->password,
+		p->db, p->port, p->unix_socket, p->client_flag))
+	{
+		strncpy (errmsg, mysql_error (my_conn), errlen - 1);
+		free (session);
+		mysql_close (my_conn); /* Close conn if connect failed */
+		return NULL;
+	}
+	free (session);
+	params_keepsession (my_conn, p);
+	return my_conn;
+}
+
+
+/*
+** Interrupt the statement the server runs as thread id with KILL QUERY
+** on the control connection of conn.  Unless connect is 0, it is opened
+** with the parameters of conn when first needed and once more if it was
+** lost.  Return 0, or -1 if the statement could not be interrupted.
+*/
+static int conn_killquery (conn_data *conn, unsigned long id, int connect) {
+	char errmsg[256] = "", sql[64];
+	int attempt;
+	snprintf (sql, sizeof(sql), "KILL QUERY %lu", id);
+	for (attempt = 0; attempt < 2; attempt++) {
+		unsigned int err;
+		if (conn->control == NULL && (!connect ||
+			(conn->control = params_connect (&conn->params, errmsg, sizeof(errmsg))) == NULL))
+			return -1;
+		if (mysql_query (conn->control, sql) == 0)
+			return 0;
+		err = mysql_errno (conn->control);
+		if (err != CR_SERVER_GONE_ERROR && err != CR_SERVER_LOST)
+			return -1;
+		mysql_close (conn->control);
+		conn->control = NULL;
+	}
+	return -1;
+}
+
+
+/*
+** Check that no unbuffered cursor is still reading from the connection.
+*/
+static void conn_checkfree (lua_State *L, conn_data *conn) {
+	if (conn->streaming) /* its reader may be using the handle in another thread */
+		luaL_error (L, LUASQL_PREFIX"connection is busy with an unbuffered cursor");
+}
+
+
+/*
+** Get a connection that can run a command now, reading away the result
+** sets a CALL left unread.
+*/
+static conn_data *getidleconnection (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	conn_checkfree (L, conn);
+	if (conn->pending != NULL) /* unread result sets of a CALL */
+		stmt_cur_drain (conn->pending);
+	return conn;
+}
+
+
+/*
+** Monotonic clock in milliseconds.
+*/
+static long long now_ms (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+** Deadlines of blocking calls, armed with watch_arm.  One thread,
+** started with the first deadline, sleeps until the earliest one and
+** interrupts the call with KILL QUERY, or shuts its socket down if that
+** fails.  It waits idle when no watch is left and is stopped and joined
+** by watch_stop when the library is released.  conn->my_conn is only
+** replaced under watch_lock.
+*/
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_cond = PTHREAD_COND_INITIALIZER;
+static watch *watch_list;
+static pthread_t watch_thread;
+static int watch_running;
+static int watch_stopping;
+
+
+/*
+** Interrupt the call of w.  Called and returns with watch_lock held.
+*/
+static void watch_fire (watch *w) {
+	conn_data *conn = w->conn;
+	unsigned long id = mysql_thread_id (conn->my_conn);
+	unsigned int epoch = conn->epoch;
+	int status;
+	atomic_store (&w->fired, 1);
+	w->firing = 1;
+	pthread_mutex_unlock (&watch_lock);
+	status = conn_killquery (conn, id, 1);
+	pthread_mutex_lock (&watch_lock);
+	if (status != 0 && conn->epoch == epoch) /* then the connection is given up */
+		shutdown (conn->my_conn->net.fd, SHUT_RDWR);
+	w->firing = 0;
+	pthread_cond_broadcast (&watch_cond);
+}
+
+
+static void *watch_worker (void *arg) {
+	(void)arg;
+	mysql_thread_init ();
+	pthread_mutex_lock (&watch_lock);
+	while (!watch_stopping) {
+		watch *w, *first = NULL;
+		long long now = now_ms ();
+		for (w = watch_list; w != NULL; w = w->next)
+			if (!atomic_load (&w->fired) && (first == NULL || w->deadline < first->deadline))
+				first = w;
+		if (first == NULL) /* idle, or all fired and waiting to be disarmed */
+			pthread_cond_wait (&watch_cond, &watch_lock);
+		else if (first->deadline > now) {
+			struct timespec ts;
+			long long wait = first->deadline - now;
+			clock_gettime (CLOCK_REALTIME, &ts);
+			ts.tv_sec += wait / 1000;
+			ts.tv_nsec += (wait % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait (&watch_cond, &watch_lock, &ts);
+		}
+		else
+			watch_fire (first);
+	}
+	pthread_mutex_unlock (&watch_lock);
+	mysql_thread_end ();
+	return NULL;
+}
+
+
+/*
+** Stop the watch thread, if it runs, and wait for it to exit.  Called
+** before the library is ended, when no call can be armed.
+*/
+static void watch_stop (void) {
+	int running;
+	pthread_mutex_lock (&watch_lock);
+	running = watch_running;
+	watch_stopping = 1;
+	pthread_cond_broadcast (&watch_cond);
+	pthread_mutex_unlock (&watch_lock);
+	if (running)
+		pthread_join (watch_thread, NULL);
+	pthread_mutex_lock (&watch_lock);
+	watch_running = 0;
+	watch_stopping = 0;
+	pthread_mutex_unlock (&watch_lock);
+}
+
+
+/*
+** Arm w for a call on conn that must end by deadline (from now_ms).
+** A deadline of 0, or a watch thread that cannot be started, leaves w
+** unarmed.
+*/
+static void watch_arm (watch *w, conn_data *conn, long long deadline) {
+	w->conn = NULL;
+	atomic_init (&w->fired, 0);
+	if (deadline == 0)
+		return;
+	w->deadline = deadline;
+	w->firing = 0;
+	pthread_mutex_lock (&watch_lock);
+	if (!watch_running)
+		watch_running = pthread_create (&watch_thread, NULL, watch_worker, NULL) == 0;
+	if (watch_running) {
+		w->conn = conn;
+		w->next = watch_list;
+		watch_list = w;
+		conn->watch = w;
+		pthread_cond_broadcast (&watch_cond);
+	}
+	pthread_mutex_unlock (&watch_lock);
+}
+
+
+/*
+** Disarm w, waiting for an interruption under way to finish.
+** Return 1 if the call was interrupted, 0 otherwise.
+*/
+static int watch_disarm (watch *w) {
+	watch **p;
+	if (w->conn == NULL)
+		return 0;
+	pthread_mutex_lock (&watch_lock);
+	while (w->firing)
+		pthread_cond_wait (&watch_cond, &watch_lock);
+	for (p = &watch_list; *p != w; p = &(*p)->next)
+		;
+	*p = w->next;
+	w->conn->watch = NULL;
+	w->conn = NULL;
+	pthread_mutex_unlock (&watch_lock);
+	return atomic_load (&w->fired);
+}
+
+
+/*
+** Deadline from now_ms () of a call limited to timeout ms, 0 for none.
+*/
+static long long deadline_after (lua_Integer timeout) {
+	return timeout > 0 ? now_ms () + timeout : 0;
+}
+
+
+/*
+** Check whether a call that failed with err ran out of time.
+*/
+static int timed_out (int fired, lua_Integer timeout, unsigned int err) {
+	return fired || (timeout > 0 && err == LUASQL_ER_QUERY_TIMEOUT);
+}
+
+
+/*
+** Open the autobatch transaction before a statement runs.
+** Return 0, or push nil and an error message and return 2.
+*/
+static int batch_begin (lua_State *L, conn_data *conn) {
+	if (conn->batch_rows == 0 || conn->batch_open)
+		return 0;
+	if (mysql_real_query (conn->my_conn, "START TRANSACTION", 17))
+		return luasql_failmsg (L, "error starting batch. MySQL: ", mysql_error (conn->my_conn));
+	conn->batch_open = 1;
+	conn->batch_pending = 0;
+	conn->batch_start = now_ms ();
+	return 0;
+}
+
+
+/*
+** Roll back the open batch after the statement in it failed and push
+** an error naming that statement.
+*/
+static int batch_abort (lua_State *L, conn_data *conn, const char *err, const char *m) {
+	if (!conn->batch_open)
+		return luasql_failmsg (L, err, m);
+	lua_pushnil (L);
+	lua_pushfstring (L, LUASQL_PREFIX"statement %d of batch failed, batch rolled back; %s%s",
+		conn->batch_pending + 1, err, m);
+	mysql_rollback (conn->my_conn);
+	conn->batch_open = 0;
+	conn->batch_pending = 0;
+	conn->stats.batch_rollbacks++;
+	return 2;
+}
+
+
+/*
+** Fail a call that ran out of time, rolling back the open batch.
+** Push nil, an error message and "timeout".
+*/
+static int conn_timedout (lua_State *L, conn_data *conn, lua_Integer timeout) {
+	char msg[64];
+	conn->stats.timeouts++;
+	snprintf (msg, sizeof(msg), "query timed out after %lld ms", (long long)timeout);
+	batch_abort (L, conn, "", msg);
+	lua_pushliteral (L, "timeout");
+	return 3;
+}
+
+
+/*
+** Commit the open batch.  Return the number of statements committed or
+** -1 with the batch rolled back and the error copied to errmsg.  An
+** error raised by the commit callback does not undo the commit: it is
+** kept for conn:stats() and the caller's results stand.
+*/
+static int batch_commit (lua_State *L, conn_data *conn, char *errmsg, size_t errlen) {
+	int n = conn->batch_pending;
+	if (!conn->batch_open)
+		return 0;
+	conn->batch_open = 0;
+	conn->batch_pending = 0;
+	if (mysql_commit (conn->my_conn)) {
+		strncpy (errmsg, mysql_error (conn->my_conn), errlen - 1);
+		mysql_rollback (conn->my_conn);
+		conn->stats.batch_rollbacks++;
+		return -1;
+	}
+	conn->stats.batch_commits++;
+	conn->stats.batch_statements += n;
+	conn->stats.last_batch = n;
+	if (conn->batch_report != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, conn->batch_report);
+		lua_pushinteger (L, n);
+		if (lua_pcall (L, 1, 0, 0) != LUA_OK) {
+			luaL_unref (L, LUA_REGISTRYINDEX, conn->batch_error);
+			conn->batch_error = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+	}
+	return n;
+}
+
+
+/*
+** Account for a statement that succeeded and commit the batch if it is
+** full or old enough.  nres results of the statement are on the stack;
+** if the commit fails they are replaced by nil and an error message.
+*/
+static int batch_step (lua_State *L, conn_data *conn, int nres) {
+	char errmsg[256] = "";
+	if (!conn->batch_open)
+		return nres;
+	conn->batch_pending++;
+	if (conn->streaming) /* cannot commit under an unbuffered cursor */
+		return nres;
+	if (conn->batch_pending < conn->batch_rows &&
+		(conn->batch_ms <= 0 || now_ms () - conn->batch_start < conn->batch_ms))
+		return nres;
+	if (batch_commit (L, conn, errmsg, sizeof(errmsg)) < 0) {
+		lua_pop (L, nres);
+		return luasql_failmsg (L, "error committing batch, batch rolled back. MySQL: ", errmsg);
+	}
+	return nres;
+}
+
+
+/*
+** Commit the open batch now.
+** Return the number of statements committed.
+*/
+static int conn_flush (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	char errmsg[256] = "";
+	int n = batch_commit (L, conn, errmsg, sizeof(errmsg));
+	if (n < 0)
+		return luasql_failmsg (L, "error committing batch, batch rolled back. MySQL: ", errmsg);
+	lua_pushinteger (L, n);
+	return 1;
+}
+
+
+/*
+** Group statements into transactions while autocommit is on.
+**     conn:autobatch{rows=N, next_after_ms=T, oncommit=function(n) end}
+** A batch is committed after N statements, by the first statement that
+** ends more than T milliseconds after it started, on flush() and on
+** close().  Nothing commits an idle batch: the driver only runs when it
+** is called, and the handle may not be used from another thread.
+** conn:autobatch(false) commits the open batch and turns batching off.
+*/
+static int conn_autobatch (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	char errmsg[256] = "";
+	int rows = 0, ms = 0;
+	if (lua_toboolean (L, 2)) {
+		luaL_checktype (L, 2, LUA_TTABLE);
+		rows = (int)opt_integer (L, 2, "rows", 1000);
+		ms = (int)opt_integer (L, 2, "next_after_ms", 0);
+		luaL_argcheck (L, rows > 0 && ms >= 0, 2, "invalid batch limits");
+		luaL_argcheck (L, conn->autocommit, 1, "autobatch requires autocommit");
+	}
+	if (batch_commit (L, conn, errmsg, sizeof(errmsg)) < 0)
+		return luasql_failmsg (L, "error committing batch, batch rolled back. MySQL: ", errmsg);
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->batch_report);
+	conn->batch_report = LUA_NOREF;
+	if (rows > 0) {
+		lua_getfield (L, 2, "oncommit");
+		if (lua_isfunction (L, -1))
+			conn->batch_report = luaL_ref (L, LUA_REGISTRYINDEX);
+		else
+			lua_pop (L, 1);
+	}
+	conn->batch_rows = rows;
+	conn->batch_ms = ms;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Return a table of connection counters.
+*/
+static int conn_getstats (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	lua_newtable (L);
+	lua_pushinteger (L, conn->stats.batch_commits);
+	lua_setfield (L, -2, "batch_commits");
+	lua_pushinteger (L, conn->stats.batch_statements);
+	lua_setfield (L, -2, "batch_statements");
+	lua_pushinteger (L, conn->stats.batch_rollbacks);
+	lua_setfield (L, -2, "batch_rollbacks");
+	lua_pushinteger (L, conn->stats.last_batch);
+	lua_setfield (L, -2, "last_batch");
+	lua_pushinteger (L, conn->batch_pending);
+	lua_setfield (L, -2, "batch_pending");
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->batch_error);
+	lua_setfield (L, -2, "oncommit_error");
+	lua_pushinteger (L, conn->stats.reconnects);
+	lua_setfield (L, -2, "reconnects");
+	lua_pushinteger (L, conn->stats.reprepares);
+	lua_setfield (L, -2, "reprepares");
+	lua_pushinteger (L, conn->stats.result_rebuilds);
+	lua_setfield (L, -2, "result_rebuilds");
+	lua_pushinteger (L, conn->stats.timeouts);
+	lua_setfield (L, -2, "timeouts");
+	lua_pushinteger (L, conn->stats.retries);
+	lua_setfield (L, -2, "retries");
+	lua_pushinteger (L, conn->outstanding);
+	lua_setfield (L, -2, "open_cursors");
+	lua_pushinteger (L, (lua_Integer)conn->result_mem);
+	lua_setfield (L, -2, "result_bytes");
+	lua_pushinteger (L, (lua_Integer)conn->result_disk);
+	lua_setfield (L, -2, "spilled_bytes");
+#if MYSQL_VERSION_ID >= 80029 && !defined(MARIADB_BASE_VERSION)
+	lua_pushboolean (L, mysql_get_ssl_cipher (conn->my_conn) != NULL &&
+		mysql_get_ssl_session_reused (conn->my_conn));
+	lua_setfield (L, -2, "tls_resumed");
+#endif
+	return 1;
+}
+
+
+/*
+** Limit the memory of each buffered result of the connection.  Past
+** the limit the query fails, or with mode "spill" the rows go to a
+** temporary file.  A limit of 0 removes it.
+*/
+static int conn_setresultlimit (lua_State *L) {
+	static const char *const modes[] = {"fail", "spill", NULL};
+	conn_data *conn = getconnection (L);
+	lua_Integer limit = luaL_checkinteger (L, 2);
+	luaL_argcheck (L, limit >= 0, 2, "limit must not be negative");
+	conn->max_result_bytes = (size_t)limit;
+	conn->spill = (short)luaL_checkoption (L, 3, "fail", modes);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Set the deadline, in milliseconds, of execute, prepare and the
+** fetches of streaming cursors when they are given no timeout_ms
+** option.  0 turns it off.
+*/
+static int conn_settimeout (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	lua_Integer ms = luaL_checkinteger (L, 2);
+	luaL_argcheck (L, ms >= 0, 2, "timeout must not be negative");
+	conn->timeout_ms = ms;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Turn transparent reconnection on or off.
+** With it on, a connection that lost the server is replaced by a new
+** one before the next statement, as long as no transaction was open.
+*/
+static int conn_setreconnect (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	conn->reconnect = (short)lua_toboolean (L, 2);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Check whether err means the server went away and the connection may
+** be replaced without losing work: no transaction, batch or unbuffered
+** cursor may be open on it.
+*/
+static int conn_lost (conn_data *conn, unsigned int err) {
+	if (err != CR_SERVER_GONE_ERROR && err != CR_SERVER_LOST)
+		return 0;
+	return conn->reconnect && conn->autocommit && !conn->batch_open &&
+		!conn->streaming && !(conn->my_conn->server_status & SERVER_STATUS_IN_TRANS);
+}
+
+
+/*
+** Replace the connection handle by a new one opened with the same
+** parameters.  Statements notice the new epoch and prepare themselves
+** again when they are next used.
+** Return 0, or -1 leaving the old handle in place and the error in errmsg.
+*/
+static int conn_reconnect (conn_data *conn, char *errmsg, size_t errlen) {
+	MYSQL *my_conn;
+	lib_thread (); /* the state may have moved to another thread */
+	my_conn = params_connect (&conn->params, errmsg, errlen);
+	if (my_conn == NULL)
+		return -1;
+	pthread_mutex_lock (&watch_lock);
+	mysql_close (conn->my_conn);
+	conn->my_conn = my_conn;
+	conn->epoch++;
+	pthread_mutex_unlock (&watch_lock);
+	conn->pending = NULL;
+	conn->max_packet = 0;
+	conn->stats.reconnects++;
+	return 0;
+}
+
+
+/*
+** Reconnect after a statement failed with err, if that is safe.
+** Return 1 if the statement should be run again (it only reads), 0
+** otherwise.
+*/
+static int conn_retry (conn_data *conn, unsigned int err, int idempotent) {
+	char errmsg[256] = "";
+	if (conn->watch != NULL && atomic_load (&conn->watch->fired)) /* out of time */
+		return 0;
+	if (!conn_lost (conn, err) || conn_reconnect (conn, errmsg, sizeof(errmsg)) != 0)
+		return 0;
+	if (!idempotent)
+		return 0;
+	conn->stats.retries++;
+	return 1;
+}
+
+
+/*
+** Skip the blanks and comments at p, and the opening parentheses too
+** if parens is set.
+*/
+static const char *sql_skipblank (const char *p, const char *end, int parens) {
+	while (p < end) {
+		if (isspace ((unsigned char)*p) || (parens && *p == '('))
+			p++;
+		else if (*p == '#' || (*p == '-' && p + 2 < end && p[1] == '-' && isspace ((unsigned char)p[2]))) {
+			while (p < end && *p != '\n')
+				p++;
+		}
+		else if (*p == '/' && p + 1 < end && p[1] == '*') {
+			for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++)
+				;
+			p += 2;
+		}
+		else
+			break;
+	}
+	return p;
+}
+
+
+/*
+** Check whether the word at p is the upper case keyword kw, in any case.
+*/
+static int sql_iskeyword (const char *p, const char *end, const char *kw) {
+	size_t n = strlen (kw);
+	size_t k = 0;
+	while (k < n && p + k < end && toupper ((unsigned char)p[k]) == kw[k])
+		k++;
+	return k == n && (p + n >= end || (!isalnum ((unsigned char)p[n]) && p[n] != '_'));
+}
+
+
+/*
+** Check whether a statement only reads, so running it twice is harmless.
+** Leading blanks, comments and parentheses are skipped.
+*/
+static int sql_is_read (const char *sql, size_t len) {
+	static const char *const reads[] = {"SELECT", "SHOW", "DESCRIBE", "DESC", "EXPLAIN", NULL};
+	const char *p = sql_skipblank (sql, sql + len, 1), *end = sql + len;
+	int i;
+	for (i = 0; reads[i] != NULL; i++)
+		if (sql_iskeyword (p, end, reads[i]))
+			return 1;
+	return 0;
+}
+
+
+/*
+** Add a MAX_EXECUTION_TIME hint of ms to a SELECT, so the server gives
+** it up by itself.  Statements with a hint of their own, other
+** statements and servers without the hint (MariaDB, MySQL before 5.7.8)
+** are left alone.  Return 1 with the new statement in b, or 0.
+*/
+static int sql_addtimehint (conn_data *conn, const char *sql, size_t len, lua_Integer ms, sqlbuf *b) {
+	const char *end = sql + len, *p = sql_skipblank (sql, end, 0), *q;
+	const char *info = mysql_get_server_info (conn->my_conn);
+	char hint[48];
+	if (ms <= 0 || !sql_iskeyword (p, end, "SELECT"))
+		return 0;
+	if (mysql_get_server_version (conn->my_conn) < 50708 || (info != NULL && strstr (info, "MariaDB") != NULL))
+		return 0;
+	for (q = sql; q < end; q++)
+		if (toupper ((unsigned char)*q) == 'M' && sql_iskeyword (q, end, "MAX_EXECUTION_TIME"))
+			return 0;
+	snprintf (hint, sizeof(hint), " /*+ MAX_EXECUTION_TIME(%lld) */", (long long)ms);
+	p += 6;
+	sqlbuf_add (b, sql, p - sql);
+	sqlbuf_add (b, hint, strlen (hint));
+	sqlbuf_add (b, p, end - p);
+	return 1;
+}
+
+
+/*
+** Push sql with the hint of sql_addtimehint and return it, or return
+** sql itself and push nothing if it gets no hint.
+*/
+static const char *sql_pushtimehint (lua_State *L, conn_data *conn, const char *sql, size_t *len, lua_Integer ms) {
+	sqlbuf b = {NULL, 0, 0, 0};
+	if (!sql_addtimehint (conn, sql, *len, ms, &b))
+		return sql;
+	if (!b.oom)
+		lua_pushlstring (L, b.data, b.len);
+	free (b.data);
+	if (b.oom)
+		luaL_error (L, LUASQL_PREFIX"could not allocate statement");
+	return lua_tolstring (L, -1, len);
+}
+
+
+/*
+** Run a query, reconnecting when the server went away and running it
+** again if it only reads.  Return 0, or -1 with the error in errmsg.
+*/
+static int conn_query (conn_data *conn, const char *sql, size_t len, char *errmsg, size_t errlen) {
+	if (mysql_real_query (conn->my_conn, sql, len) == 0)
+		return 0;
+	strncpy (errmsg, mysql_error (conn->my_conn), errlen - 1);
+	if (conn_retry (conn, mysql_errno (conn->my_conn), sql_is_read (sql, len)) != 1)
+		return -1;
+	if (mysql_real_query (conn->my_conn, sql, len) == 0)
+		return 0;
+	strncpy (errmsg, mysql_error (conn->my_conn), errlen - 1);
+	return -1;
+}
+
+
+/*
+** Prepare a statement handle on the connection.
+** Return it, or NULL with the error number in err and message in errmsg.
+*/
+static MYSQL_STMT *stmt_open (conn_data *conn, const char *sql, unsigned long len,
+	unsigned int *err, char *errmsg, size_t errlen) {
+	MYSQL_STMT *handle = mysql_stmt_init (conn->my_conn);
+	if (handle == NULL) {
+		*err = mysql_errno (conn->my_conn);
+		strncpy (errmsg, mysql_error (conn->my_conn), errlen - 1);
+		return NULL;
+	}
+	if (mysql_stmt_prepare (handle, sql, len) != 0) {
+		*err = mysql_stmt_errno (handle);
+		strncpy (errmsg, mysql_stmt_error (handle), errlen - 1);
+		mysql_stmt_close (handle);
+		return NULL;
+	}
+	return handle;
+}
+
+
+/*
+** Prepare the statement again on its connection, binding its parameters
+** again.  An open cursor on the old handle is closed.  Return 0, or -1
+** with the error in errmsg.
+*/
+static int stmt_reprepare (stmt_data *stmt, char *errmsg, size_t errlen) {
+	conn_data *conn = stmt->connp;
+	unsigned int err;
+	MYSQL_STMT *handle;
+	handle = stmt_open (conn, stmt->sql, stmt->sql_len, &err, errmsg, errlen);
+	if (handle == NULL)
+		return -1;
+	if (stmt->params_bound && mysql_stmt_bind_param (handle, stmt->params)) {
+		strncpy (errmsg, mysql_stmt_error (handle), errlen - 1);
+		mysql_stmt_close (handle);
+		return -1;
+	}
+	if (stmt->cursor != NULL)
+		stmt_cur_nullify (stmt->cursor);
+	stmt_dropresult (stmt);
+	mysql_stmt_close (stmt->stmt);
+	stmt->stmt = handle;
+	stmt->epoch = conn->epoch;
+	conn->stats.reprepares++;
+	return 0;
+}
+
+
+/*
+** Prepare the statement again if its connection was replaced since it
+** was prepared.  Return 0, or -1 with the error in errmsg.
+*/
+static int stmt_revalidate (stmt_data *stmt, char *errmsg, size_t errlen) {
+	if (stmt->epoch == stmt->connp->epoch)
+		return 0;
+	return stmt_reprepare (stmt, errmsg, errlen);
+}
+
+
+/*
+** Execute the statement, reconnecting when the server went away and
+** running it again if it only reads.  When the number of columns of the
+** result changed since the statement was prepared, it is prepared
+** again and run once more.  Return 0, or -1 with the error in errmsg.
+*/
+static int stmt_run (stmt_data *stmt, char *errmsg, size_t errlen) {
+	if (mysql_stmt_execute (stmt->stmt) == 0)
+		return 0;
+	strncpy (errmsg, mysql_stmt_error (stmt->stmt), errlen - 1);
+	if (mysql_stmt_errno (stmt->stmt) == CR_NEW_STMT_METADATA) {
+		if (stmt_reprepare (stmt, errmsg, errlen) != 0)
+			return -1;
+		if (mysql_stmt_execute (stmt->stmt) == 0)
+			return 0;
+		strncpy (errmsg, mysql_stmt_error (stmt->stmt), errlen - 1);
+		return -1;
+	}
+	if (conn_retry (stmt->connp, mysql_stmt_errno (stmt->stmt), sql_is_read (stmt->sql, stmt->sql_len)) != 1 ||
+		stmt_revalidate (stmt, errmsg, errlen) != 0)
+		return -1;
+	if (mysql_stmt_execute (stmt->stmt) == 0)
+		return 0;
+	strncpy (errmsg, mysql_stmt_error (stmt->stmt), errlen - 1);
+	return -1;
+}
+
+
+/*
+** Close a statement handle and free what the statement owns.
+*/
+static void stmt_release (lua_State *L, stmt_data *stmt) {
+    if (stmt->closed)
+        return;
+    if (stmt->cursor != NULL)
+        stmt_cur_nullify(stmt->cursor);
+    stmt_dropresult(stmt);
+    mysql_stmt_close(stmt->stmt);
+    stmt->closed = 1;
+    if (stmt->prev)
+        stmt->prev->next = stmt->next;
+    else
+        stmt->connp->stmts = stmt->next;
+    if (stmt->next)
+        stmt->next->prev = stmt->prev;
+    stmt->next = stmt->prev = NULL;
+    free(stmt->sql);
+    stmt->sql = NULL;
+
+    for (unsigned int i = 0; i < stmt->num_params; i++) {
+        if (stmt->params_data[i].str) {
+            free(stmt->params_data[i].str);
+            stmt->params_data[i].str = NULL;
+        }
+    }
+
+    free(stmt->params_data);
+    stmt->params_data = NULL;
+
+    free(stmt->params);
+    stmt->params = NULL;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, stmt->conn);
+    stmt->conn = LUA_NOREF;
+}
+
+
+static int conn_gc (lua_State *L) {
+	conn_data *conn=(conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_MYSQL);
+	while (conn != NULL && conn->stmts != NULL) /* handles die with the connection */
+		stmt_release (L, conn->stmts);
+	if (conn != NULL && conn->my_conn != NULL) { /* not closed by conn:close */
+		mysql_close (conn->my_conn);
+		conn->my_conn = NULL;
+	}
+	if (conn != NULL && conn->control != NULL) {
+		mysql_close (conn->control);
+		conn->control = NULL;
+	}
+	if (conn != NULL) {
+		/* Nullify structure fields. */
+		conn->closed = 1;
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->env);
+		conn->env = LUA_NOREF;
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->batch_report);
+		conn->batch_report = LUA_NOREF;
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->batch_error);
+		conn->batch_error = LUA_NOREF;
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->sqlcache);
+		conn->sqlcache = LUA_NOREF;
+		params_free (&conn->params);
+	}
+	return 0;
+}
+
+
+/*
+** Close a Connection object.
+*/
+static int conn_close (lua_State *L) {
+	conn_data *conn=(conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_MYSQL);
+	luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
+	if (conn->closed) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Connection is already closed");
+		return 2;
+	}
+	if (conn->streaming) { /* closing statements would race its reader */
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, "Connection is busy with an unbuffered cursor; close the cursor first");
+		return 2;
+	}
+	if (conn->batch_open) {
+		char errmsg[256] = "";
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->batch_error);
+		conn->batch_error = LUA_NOREF;
+		if (batch_commit (L, conn, errmsg, sizeof(errmsg)) < 0)
+			return luasql_failmsg (L, "error committing batch, batch rolled back. MySQL: ", errmsg);
+	}
+	
+	conn->closed = 1;
+	while (conn->stmts != NULL)
+		stmt_release (L, conn->stmts);
+	if (conn->outstanding == 0) { /* else open cursors may still read from it */
+		mysql_close (conn->my_conn);
+		conn->my_conn = NULL;
+	}
+	if (conn->control != NULL) {
+		mysql_close (conn->control);
+		conn->control = NULL;
+	}
+
+	lua_pushboolean (L, 1);
+	if (conn->batch_error != LUA_NOREF) { /* raised by the commit callback above */
+		lua_rawgeti (L, LUA_REGISTRYINDEX, conn->batch_error);
+		return 2;
+	}
+	return 1;
+}
+
+/*
+** Ping connection.
+*/
+static int conn_ping (lua_State *L) {
+	conn_data *conn=(conn_data *)luaL_checkudata(L, 1, LUASQL_CONNECTION_MYSQL);
+	luaL_argcheck (L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
+	if (conn->closed) {
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+	conn_checkfree (L, conn);
+	if (mysql_ping (conn->my_conn) == 0) {
+		lua_pushboolean (L, 1);
+		return 1;
+	} else if (conn_lost (conn, mysql_errno (conn->my_conn))) {
+		char errmsg[256] = "";
+		lua_pushboolean (L, conn_reconnect (conn, errmsg, sizeof(errmsg)) == 0);
+		return 1;
+	} else if (mysql_errno (conn->my_conn) == CR_SERVER_GONE_ERROR) {
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+	luaL_error(L, mysql_error(conn->my_conn));
+	return 0;
+}
+
+
+/*
+** Escape a string for a single quoted literal, straight into the Lua
+** string buffer.
+*/
+static int escape_string (lua_State *L) {
+	size_t size;
+	conn_data *conn = getconnection (L);
+	const char *from = luaL_checklstring (L, 2, &size);
+	conn_checkfree (L, conn);
+#if LUA_VERSION_NUM >= 502
+	luaL_Buffer b;
+	char *to = luaL_buffinitsize (L, &b, 2 * size + 1);
+	luaL_addsize (&b, escape_into (conn->my_conn, to, from, size, '\''));
+	luaL_pushresult (&b);
+#else /* buffers cannot be sized in advance */
+	char *to = (char *)lua_newuserdata (L, 2 * size + 1);
+	lua_pushlstring (L, to, escape_into (conn->my_conn, to, from, size, '\''));
+#endif
+	return 1;
+}
+
+/*
+** Copy sql to b replacing each ? outside quotes and comments by the
+** literal of the next argument, the first one at stack index first.
+** Return the number of placeholders found.
+*/
+static int sql_interpolate (lua_State *L, MYSQL *my_conn, const char *sql, size_t len,
+	int first, int nargs, sqlbuf *b) {
+	int backslash = !(my_conn->server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES);
+	const char *p = sql, *end = sql + len, *mark = sql;
+	int n = 0;
+	while (p < end) {
+		char c = *p;
+		if (c == '\'' || c == '"' || c == '`') {
+			for (p++; p < end; p++) {
+				if (*p == '\\' && backslash && c != '`')
+					p++;
+				else if (*p == c) {
+					if (p + 1 < end && p[1] == c)
+						p++; /* doubled quote */
+					else
+						break;
+				}
+			}
+			p++;
+		}
+		else if (c == '#' || (c == '-' && p + 2 < end && p[1] == '-' && isspace ((unsigned char)p[2]))) {
+			while (p < end && *p != '\n')
+				p++;
+		}
+		else if (c == '/' && p + 1 < end && p[1] == '*') {
+			for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++)
+				;
+			p += 2;
+		}
+		else if (c == '?') {
+			sqlbuf_add (b, mark, p - mark);
+			if (n < nargs)
+				sqlbuf_addvalue (b, my_conn, L, first + n);
+			n++;
+			mark = ++p;
+		}
+		else
+			p++;
+	}
+	sqlbuf_add (b, mark, end - mark);
+	return n;
+}
+
+
+static int conn_execcached (lua_State *L, conn_data *conn, const char *sql, size_t len, int first, int nargs, lua_Integer timeout);
+
+
+/*
+** Check that the table of execute options at idx has only option names
+** as keys, so that a value put in its place is reported.
+*/
+static void exec_checkoptions (lua_State *L, int idx) {
+	static const char *const names[] = {"stream", "readahead", "batchrows", "timeout_ms", NULL};
+	int i;
+	lua_pushnil (L);
+	while (lua_next (L, idx)) {
+		lua_pop (L, 1);
+		for (i = 0; names[i] != NULL; i++)
+			if (lua_type (L, -1) == LUA_TSTRING && strcmp (lua_tostring (L, -1), names[i]) == 0)
+				break;
+		if (names[i] == NULL)
+			luaL_argerror (L, idx, "unknown option; a table given as the first value needs options before it");
+	}
+}
+
+
+/*
+** Execute an SQL statement.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+** A table right after the statement is always its options, so a table
+** given as the first value needs options, even {}, before it:
+**     stream:    read rows with mysql_use_result instead of buffering them
+**     readahead: depth of the batch ring filled by a background reader
+**                (implies stream)
+**     batchrows: rows per read-ahead batch
+**     timeout_ms: deadline of the call, and of every fetch of a streaming
+**                cursor (defaults to conn:settimeout)
+** Values for ? placeholders follow the statement (and its options).
+*/
+static int conn_doexecute (lua_State *L, conn_data *conn) {
+	size_t st_len;
+	const char *statement = luaL_checklstring (L, 2, &st_len);
+	char errmsg[256] = "";
+	int hasopts = lua_istable (L, 3);
+	int opts = hasopts ? 3 : lua_gettop (L) + 1; /* none: the opt_ readers see no table */
+	int depth = (int)opt_integer (L, opts, "readahead", 0);
+	int batchrows = (int)opt_integer (L, opts, "batchrows", 256);
+	int streaming = depth > 0 || opt_boolean (L, opts, "stream", 0);
+	lua_Integer timeout = opt_integer (L, opts, "timeout_ms", conn->timeout_ms);
+	int first = hasopts ? 4 : 3;
+	int nargs = lua_gettop (L) >= first ? lua_gettop (L) - first + 1 : 0;
+	int i, n, fired;
+	watch w;
+	if (hasopts)
+		exec_checkoptions (L, 3);
+	luaL_argcheck (L, depth >= 0 && batchrows > 0, 3, "invalid read-ahead options");
+	luaL_argcheck (L, timeout >= 0, 3, "timeout must not be negative");
+	for (i = first; i < first + nargs; i++)
+		luaL_argcheck (L, sql_isliteral (L, i), i, "value cannot be a parameter");
+	if (nargs > 0) {
+		sqlbuf sql = {NULL, 0, 0, 0};
+		if (!streaming && conn->prepare_after > 0 &&
+			(n = conn_execcached (L, conn, statement, st_len, first, nargs, timeout)) >= 0)
+			return n;
+		n = sql_interpolate (L, conn->my_conn, statement, st_len, first, nargs, &sql);
+		if (!sql.oom)
+			lua_pushlstring (L, sql.data, sql.len);
+		free (sql.data);
+		if (sql.oom)
+			return luaL_error (L, LUASQL_PREFIX"could not allocate statement");
+		if (n != nargs)
+			return luaL_error (L, LUASQL_PREFIX"statement has %d placeholders but %d values were given",
+				n, nargs);
+		statement = lua_tolstring (L, -1, &st_len);
+	}
+	if (!streaming) /* the hint would also count the time spent between fetches */
+		statement = sql_pushtimehint (L, conn, statement, &st_len, timeout);
+	if (batch_begin (L, conn))
+		return 2;
+	watch_arm (&w, conn, deadline_after (timeout));
+	if (conn_query(conn, statement, st_len, errmsg, sizeof(errmsg))) {
+		/* error executing query */
+		if (timed_out (watch_disarm (&w), timeout, mysql_errno (conn->my_conn)))
+			return conn_timedout (L, conn, timeout);
+		return batch_abort(L, conn, "error executing query. MySQL: ", errmsg);
+	}
+	else
+	{
+		row_store *store = NULL;
+		MYSQL_RES *res = streaming ? mysql_use_result(conn->my_conn) :
+			conn_storeresult(conn, &store, errmsg, sizeof(errmsg));
+		unsigned int num_cols = mysql_field_count(conn->my_conn);
+
+		fired = watch_disarm (&w);
+		if (res == NULL && num_cols > 0 && timed_out (fired, timeout, mysql_errno (conn->my_conn)))
+			return conn_timedout (L, conn, timeout);
+		if (errmsg[0] != '\0') /* past max_result_bytes */
+			return batch_abort(L, conn, "error buffering result. ", errmsg);
+		if (res) { /* tuples returned */
+			create_cursor (L, conn, 1, res, num_cols, streaming);
+			((cur_data *)lua_touserdata (L, -1))->store = store;
+			((cur_data *)lua_touserdata (L, -1))->timeout_ms = timeout;
+			cur_account ((cur_data *)lua_touserdata (L, -1));
+			if (depth > 0) {
+				cur_data *cur = (cur_data *)lua_touserdata (L, -1);
+				cur->ra_depth = depth;
+				cur->ra_batchrows = batchrows;
+				cur->ra = ra_start (conn->my_conn, res, num_cols, depth, batchrows);
+				if (cur->ra == NULL) {
+					cur_nullify (L, cur);
+					return luasql_faildirect (L, "could not start read-ahead worker");
+				}
+			}
+			return batch_step (L, conn, 1);
+		}
+		else { /* mysql_use_result() returned nothing; should it have? */
+			if(num_cols == 0) { /* no tuples returned */
+            	/* query does not return data (it was not a SELECT) */
+				lua_pushinteger(L, mysql_affected_rows(conn->my_conn));
+				return batch_step (L, conn, 1);
+        	}
+			else /* mysql_use_result() should have returned data */
+				return batch_abort(L, conn, "error retrieving result. MySQL: ", mysql_error(conn->my_conn));
+		}
+	}
+}
+
+static int conn_execute (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	env_data *env = conn->envp;
+	prof_call pc;
+	prof_begin (L, env, "execute", &pc);
+	return prof_end (env, &pc, conn_doexecute (L, conn));
+}
+
+
+/*
+** Largest statement the server accepts, read once per connection.
+** Return 0 with the error in errmsg if it cannot be read.
+*/
+static unsigned long conn_maxpacket (conn_data *conn, char *errmsg, size_t errlen) {
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	if (conn->max_packet > 0)
+		return conn->max_packet;
+	if (conn_query (conn, "SELECT @@max_allowed_packet", 27, errmsg, errlen) != 0)
+		return 0;
+	if ((res = mysql_store_result (conn->my_conn)) == NULL) {
+		strncpy (errmsg, mysql_error (conn->my_conn), errlen - 1);
+		return 0;
+	}
+	if ((row = mysql_fetch_row (res)) != NULL && row[0] != NULL)
+		conn->max_packet = strtoul (row[0], NULL, 10);
+	mysql_free_result (res);
+	if (conn->max_packet == 0)
+		strncpy (errmsg, "max_allowed_packet is unknown", errlen - 1);
+	return conn->max_packet;
+}
+
+
+/*
+** Send the statement built so far and add up what it did.  *firstid
+** keeps the first id generated by any statement.
+*/
+static int insert_flush (conn_data *conn, sqlbuf *sql, const sqlbuf *tail,
+	lua_Integer *affected, lua_Integer *firstid, char *errmsg, size_t errlen) {
+	lua_Integer id;
+	sqlbuf_add (sql, tail->data, tail->len);
+	if (sql->oom)
+		return 0;
+	if (conn_query (conn, sql->data, sql->len, errmsg, errlen) != 0)
+		return -1;
+	*affected += (lua_Integer)mysql_affected_rows (conn->my_conn);
+	if (*firstid == 0 && (id = (lua_Integer)mysql_insert_id (conn->my_conn)) != 0)
+		*firstid = id;
+	sql->len = 0;
+	return 0;
+}
+
+
+/*
+** Insert many rows with multi-row INSERT statements.
+**     conn:insert(table, {col, ...}, {{v, ...}, ...}, {ignore=true, on_duplicate=...})
+** Values are written as literals of their Lua type; nil is NULL.
+** on_duplicate is either a list of columns to update from the new row
+** or the text of an ON DUPLICATE KEY UPDATE clause.  Rows are split
+** into as few statements as max_allowed_packet allows.
+** Return the number of affected rows and the AUTO_INCREMENT id of the
+** first row inserted (0 if none was generated), as LAST_INSERT_ID()
+** would for a single multi-row INSERT.
+*/
+static int conn_insert (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	size_t len;
+	const char *table = luaL_checklstring (L, 2, &len);
+	const char *s;
+	sqlbuf head = {NULL, 0, 0, 0}, tail = {NULL, 0, 0, 0};
+	sqlbuf row = {NULL, 0, 0, 0}, sql = {NULL, 0, 0, 0};
+	lua_Integer affected = 0, firstid = 0;
+	unsigned long limit;
+	char errmsg[256] = "";
+	int ncols, nrows, i, j, status = 0;
+	luaL_checktype (L, 3, LUA_TTABLE);
+	luaL_checktype (L, 4, LUA_TTABLE);
+	if (!lua_isnoneornil (L, 5))
+		luaL_checktype (L, 5, LUA_TTABLE);
+	ncols = (int)luaL_len (L, 3);
+	nrows = (int)luaL_len (L, 4);
+	luaL_argcheck (L, ncols > 0, 3, "no columns given");
+	for (i = 1; i <= ncols; i++) {
+		luaL_argcheck (L, lua_rawgeti (L, 3, i) == LUA_TSTRING, 3, "column names must be strings");
+		lua_pop (L, 1);
+	}
+	for (i = 1; i <= nrows; i++) {
+		luaL_argcheck (L, lua_rawgeti (L, 4, i) == LUA_TTABLE, 4, "rows must be tables");
+		for (j = 1; j <= ncols; j++) {
+			lua_rawgeti (L, -1, j);
+			if (!sql_isliteral (L, -1))
+				return luaL_error (L, LUASQL_PREFIX"row %d, column %d: cannot insert a %s",
+					i, j, luaL_typename (L, -1));
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+	}
+	if (nrows == 0) {
+		lua_pushinteger (L, 0);
+		lua_pushinteger (L, 0);
+		return 2;
+	}
+	if ((limit = conn_maxpacket (conn, errmsg, sizeof(errmsg))) == 0)
+		return luasql_failmsg (L, "error reading max_allowed_packet. MySQL: ", errmsg);
+
+	sqlbuf_addstr (&head, opt_boolean (L, 5, "ignore", 0) ? "INSERT IGNORE INTO " : "INSERT INTO ");
+	sqlbuf_addident (&head, table, len, 1);
+	for (i = 1; i <= ncols; i++) {
+		lua_rawgeti (L, 3, i);
+		s = lua_tolstring (L, -1, &len);
+		sqlbuf_add (&head, i == 1 ? " (" : ",", i == 1 ? 2 : 1);
+		sqlbuf_addident (&head, s, len, 0);
+		lua_pop (L, 1);
+	}
+	sqlbuf_addstr (&head, ") VALUES ");
+	if (lua_istable (L, 5)) {
+		lua_getfield (L, 5, "on_duplicate");
+		if (lua_type (L, -1) == LUA_TSTRING) {
+			sqlbuf_addstr (&tail, " ON DUPLICATE KEY UPDATE ");
+			sqlbuf_addstr (&tail, lua_tostring (L, -1));
+		}
+		else if (lua_istable (L, -1)) {
+			for (i = 1; lua_rawgeti (L, -1, i) == LUA_TSTRING; i++) {
+				s = lua_tolstring (L, -1, &len);
+				sqlbuf_addstr (&tail, i == 1 ? " ON DUPLICATE KEY UPDATE " : ",");
+				sqlbuf_addident (&tail, s, len, 0);
+				sqlbuf_addstr (&tail, "=VALUES(");
+				sqlbuf_addident (&tail, s, len, 0);
+				sqlbuf_addstr (&tail, ")");
+				lua_pop (L, 1);
+			}
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+	}
+	/* leave room for the packet header */
+	limit = limit > 1024 ? limit - 1024 : limit;
+
+	if (batch_begin (L, conn)) {
+		status = 2;
+		goto done;
+	}
+	for (i = 1; i <= nrows && status == 0; i++) {
+		row.len = 0;
+		lua_rawgeti (L, 4, i);
+		for (j = 1; j <= ncols; j++) {
+			sqlbuf_add (&row, j == 1 ? "(" : ",", 1);
+			lua_rawgeti (L, -1, j);
+			sqlbuf_addvalue (&row, conn->my_conn, L, -1);
+			lua_pop (L, 1);
+		}
+		sqlbuf_add (&row, ")", 1);
+		lua_pop (L, 1);
+		if (head.len + row.len + tail.len > limit) {
+			snprintf (errmsg, sizeof(errmsg), "row %d does not fit in max_allowed_packet (%lu bytes)",
+				i, limit);
+			status = -2;
+		}
+		else if (sql.len > 0 && sql.len + 1 + row.len + tail.len > limit)
+			status = insert_flush (conn, &sql, &tail, &affected, &firstid, errmsg, sizeof(errmsg));
+		if (status == 0) {
+			if (sql.len == 0)
+				sqlbuf_add (&sql, head.data, head.len);
+			else
+				sqlbuf_add (&sql, ",", 1);
+			sqlbuf_add (&sql, row.data, row.len);
+		}
+		if (head.oom || tail.oom || row.oom || sql.oom)
+			status = 1;
+	}
+	if (status == 0)
+		status = insert_flush (conn, &sql, &tail, &affected, &firstid, errmsg, sizeof(errmsg));
+	if (status == 0 && sql.oom)
+		status = 1;
+
+done:
+	free (head.data);
+	free (tail.data);
+	free (row.data);
+	free (sql.data);
+	if (status == 2)
+		return 2;
+	if (status == 1) {
+		lua_pop (L, batch_abort (L, conn, "", ""));
+		return luaL_error (L, LUASQL_PREFIX"could not allocate insert statement");
+	}
+	if (status == -2)
+		return batch_abort (L, conn, "error inserting rows: ", errmsg);
+	if (status < 0)
+		return batch_abort (L, conn, "error inserting rows. MySQL: ", errmsg);
+	lua_pushinteger (L, affected);
+	lua_pushinteger (L, firstid);
+	return batch_step (L, conn, 2);
+}
+
+
+/*
+** MD5 (RFC 1321), to hash rows the way the server's MD5() does.
+*/
+typedef struct {
+	uint32_t      state[4];
+	uint64_t      count;           /* bytes hashed */
+	unsigned char buf[64];
+} md5_ctx;
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_r[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+
+
+static void md5_block (uint32_t *s, const unsigned char *p) {
+	uint32_t a = s[0], b = s[1], c = s[2], d = s[3], w[16];
+	int i;
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[4*i] | (uint32_t)p[4*i+1] << 8 | (uint32_t)p[4*i+2] << 16 | (uint32_t)p[4*i+3] << 24;
+	for (i = 0; i < 64; i++) {
+		uint32_t f, t;
+		int g, r = md5_r[(i >> 4) * 4 + (i & 3)];
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		}
+		else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		}
+		else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		}
+		else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		f += a + md5_k[i] + w[g];
+		t = d;
+		d = c;
+		c = b;
+		b += (f << r) | (f >> (32 - r));
+		a = t;
+	}
+	s[0] += a;
+	s[1] += b;
+	s[2] += c;
+	s[3] += d;
+}
+
+
+static void md5_init (md5_ctx *m) {
+	m->state[0] = 0x67452301;
+	m->state[1] = 0xefcdab89;
+	m->state[2] = 0x98badcfe;
+	m->state[3] = 0x10325476;
+	m->count = 0;
+}
+
+
+static void md5_update (md5_ctx *m, const void *data, size_t n) {
+	const unsigned char *p = (const unsigned char *)data;
+	size_t used = (size_t)(m->count & 63);
+	m->count += n;
+	if (used > 0) {
+		size_t k = 64 - used < n ? 64 - used : n;
+		memcpy (m->buf + used, p, k);
+		p += k;
+		n -= k;
+		if (used + k < 64)
+			return;
+		md5_block (m->state, m->buf);
+	}
+	for (; n >= 64; p += 64, n -= 64)
+		md5_block (m->state, p);
+	memcpy (m->buf, p, n);
+}
+
+
+static void md5_final (md5_ctx *m, unsigned char *out) {
+	static const unsigned char pad[64] = {0x80};
+	unsigned char len[8];
+	uint64_t bits = m->count * 8;
+	int i;
+	for (i = 0; i < 8; i++)
+		len[i] = (unsigned char)(bits >> (8 * i));
+	md5_update (m, pad, 1 + ((119 - (m->count & 63)) & 63));
+	md5_update (m, len, 8);
+	for (i = 0; i < 16; i++)
+		out[i] = (unsigned char)(m->state[i / 4] >> (8 * (i % 4)));
+}
+
+
+/*
+** Text of the value at idx as the server returns it from the column it
+** was written to, for the Lua types that have one.  Floats use the
+** fewest digits that read back the same.  Return 0 for NULL.
+*/
+static int sync_text (lua_State *L, int idx, sqlbuf *b) {
+	char num[64];
+	size_t len;
+	const char *s;
+	MYSQL_TIME t;
+	int p;
+	b->len = 0;
+	switch (lua_type (L, idx)) {
+		case LUA_TTABLE:
+			if (temporal_tabletype (L, idx) == MYSQL_TYPE_NULL) {
+				json_encode (L, idx, b, 0);
+				return 1;
+			}
+			if (temporal_tovalue (L, idx, MYSQL_TYPE_NULL, &t) == MYSQL_TYPE_NULL)
+				return 0;
+			sqlbuf_add (b, num, temporal_format (&t, 7, num, sizeof(num)));
+			return 1;
+		case LUA_TBOOLEAN:
+			sqlbuf_add (b, lua_toboolean (L, idx) ? "1" : "0", 1);
+			return 1;
+		case LUA_TNUMBER:
+			if (lua_isinteger (L, idx))
+				snprintf (num, sizeof(num), "%lld", (long long)lua_tointeger (L, idx));
+			else {
+				double d = (double)lua_tonumber (L, idx);
+				for (p = 15; p < 17; p++) {
+					snprintf (num, sizeof(num), "%.*g", p, d);
+					if (strtod (num, NULL) == d)
+						break;
+				}
+				if (p == 17)
+					snprintf (num, sizeof(num), "%.17g", d);
+			}
+			sqlbuf_addstr (b, num);
+			return 1;
+		case LUA_TSTRING:
+			s = lua_tolstring (L, idx, &len);
+			sqlbuf_add (b, s, len);
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+
+/*
+** Append a key part to the lookup key of a row: its length and text.
+*/
+static void sync_addkey (sqlbuf *key, const char *s, size_t n) {
+	char len[24];
+	snprintf (len, sizeof(len), "%lu:", (unsigned long)n);
+	sqlbuf_addstr (key, len);
+	sqlbuf_add (key, s, n);
+}
+
+
+/*
+** Add the hash of one column value to a row hash.  The server computes
+** the same with IFNULL(MD5(col),'-') inside MD5(CONCAT(...)).
+*/
+static void sync_hashvalue (md5_ctx *row, const char *s, size_t n, int isnull) {
+	static const char hex[] = "0123456789abcdef";
+	unsigned char d[16];
+	char text[32];
+	md5_ctx m;
+	int i;
+	if (isnull) {
+		md5_update (row, "-", 1);
+		return;
+	}
+	md5_init (&m);
+	md5_update (&m, s, n);
+	md5_final (&m, d);
+	for (i = 0; i < 16; i++) {
+		text[2*i] = hex[d[i] >> 4];
+		text[2*i+1] = hex[d[i] & 15];
+	}
+	md5_update (row, text, 32);
+}
+
+
+static int sync_hexdigit (int c) {
+	return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+
+#define SYNC_UNSEEN  0   /* not read from the server: to upsert */
+#define SYNC_SAME    1   /* on the server as it is */
+#define SYNC_CHANGED 2   /* read with other values: to upsert */
+
+
+/*
+** Send the DELETE built so far.
+*/
+static int sync_delete (conn_data *conn, sqlbuf *sql, lua_Integer *deleted, char *errmsg, size_t errlen) {
+	sqlbuf_add (sql, ")", 1);
+	if (sql->oom)
+		return 0;
+	if (conn_query (conn, sql->data, sql->len, errmsg, errlen) != 0)
+		return -1;
+	*deleted += (lua_Integer)mysql_affected_rows (conn->my_conn);
+	sql->len = 0;
+	return 0;
+}
+
+
+/*
+** Send the upserts built so far and count the rows they inserted and
+** those that hit an existing key.  The server says which is which: a
+** row the read did not see (outside where) may still exist.
+*/
+static int sync_upsert (conn_data *conn, sqlbuf *sql, const sqlbuf *tail,
+	lua_Integer *inserted, lua_Integer *updated, char *errmsg, size_t errlen) {
+	lua_Integer affected = 0, id = 0;
+	long long records, dups;
+	const char *info;
+	if (insert_flush (conn, sql, tail, &affected, &id, errmsg, errlen) != 0)
+		return -1;
+	if (sql->oom) /* not sent */
+		return 0;
+	info = mysql_info (conn->my_conn); /* NULL for a single row */
+	if (info != NULL && sscanf (info, "Records: %lld Duplicates: %lld", &records, &dups) == 2) {
+		*inserted += records - dups;
+		*updated += dups;
+	}
+	else if (affected == 1) /* 1 for an insert, 2 or 0 for an update */
+		(*inserted)++;
+	else
+		(*updated)++;
+	return 0;
+}
+
+
+/*
+** Make a table hold exactly the given rows, writing only the difference.
+**     conn:sync(table, key, rows, {delete_missing=true, columns={...},
+**               where="...", chunk=5000})
+** key is a column name or a list of them; rows are tables from column
+** name to value.  The columns are the given ones or those of the first
+** row.  The table is read in key order, chunk rows at a time, as the
+** key and an MD5 of the other columns of each row; the incoming rows
+** are hashed the same way here.  Rows that are missing or differ are
+** upserted with multi-row INSERT ... ON DUPLICATE KEY UPDATE, and with
+** delete_missing, rows that are not given are deleted.  where limits
+** the rows read (and deleted); an upsert still updates a row with its
+** key outside where, and counts it as updated.
+** Return a table with the counts inserted, updated, deleted and
+** unchanged.
+*/
+static int conn_sync (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	size_t tlen, len;
+	const char *table = luaL_checklstring (L, 2, &tlen);
+	const char *s, *where;
+	sqlbuf head = {NULL, 0, 0, 0}, tail = {NULL, 0, 0, 0}, sql = {NULL, 0, 0, 0};
+	sqlbuf order = {NULL, 0, 0, 0}, key = {NULL, 0, 0, 0}, text = {NULL, 0, 0, 0}, last = {NULL, 0, 0, 0};
+	sqlbuf del = {NULL, 0, 0, 0}, row = {NULL, 0, 0, 0};
+	lua_Integer chunk, inserted = 0, updated = 0, deleted = 0, unchanged = 0;
+	unsigned long limit;
+	unsigned char (*digests)[16];
+	unsigned char *state;
+	char errmsg[256] = "", num[32];
+	int purge, nkeys, ncols, nrows, keys, cols, listed, index, i, j, status = 0;
+	luaL_checktype (L, 4, LUA_TTABLE);
+	if (!lua_isnoneornil (L, 5))
+		luaL_checktype (L, 5, LUA_TTABLE);
+	purge = opt_boolean (L, 5, "delete_missing", 0);
+	where = opt_string (L, 5, "where", NULL);
+	chunk = opt_integer (L, 5, "chunk", 5000);
+	luaL_argcheck (L, chunk > 0, 5, "chunk must be positive");
+	nrows = (int)luaL_len (L, 4);
+
+	lua_newtable (L); /* key names */
+	keys = lua_gettop (L);
+	if (lua_type (L, 3) == LUA_TSTRING) {
+		lua_pushvalue (L, 3);
+		lua_rawseti (L, keys, 1);
+	}
+	else {
+		luaL_argcheck (L, lua_istable (L, 3), 3, "key must be a column name or a list of them");
+		for (i = 1; lua_rawgeti (L, 3, i) != LUA_TNIL; i++) {
+			luaL_argcheck (L, lua_type (L, -1) == LUA_TSTRING, 3, "key column names must be strings");
+			lua_rawseti (L, keys, i);
+		}
+		lua_pop (L, 1);
+	}
+	nkeys = (int)lua_rawlen (L, keys);
+	luaL_argcheck (L, nkeys > 0, 3, "no key columns given");
+
+	/* columns: the key first, then the others */
+	lua_newtable (L);
+	cols = lua_gettop (L);
+	lua_newtable (L); /* names already listed */
+	listed = lua_gettop (L);
+	for (i = 1; i <= nkeys; i++) {
+		lua_rawgeti (L, keys, i);
+		lua_pushvalue (L, -1);
+		lua_rawseti (L, cols, i);
+		lua_pushboolean (L, 1);
+		lua_rawset (L, listed);
+	}
+	if (lua_istable (L, 5))
+		lua_getfield (L, 5, "columns");
+	else
+		lua_pushnil (L);
+	if (lua_istable (L, -1)) {
+		for (i = 1; lua_rawgeti (L, listed + 1, i) != LUA_TNIL; lua_pop (L, 1), i++)
+			luaL_argcheck (L, lua_type (L, -1) == LUA_TSTRING, 5, "column names must be strings");
+		lua_pop (L, 1);
+	}
+	else if (nrows > 0 && lua_rawgeti (L, 4, 1) == LUA_TTABLE) {
+		lua_newtable (L);
+		lua_pushnil (L);
+		for (i = 1; lua_next (L, listed + 2) != 0; ) {
+			lua_pop (L, 1);
+			if (lua_type (L, -1) == LUA_TSTRING) {
+				lua_pushvalue (L, -1);
+				lua_rawseti (L, listed + 3, i++);
+			}
+		}
+		lua_replace (L, listed + 1);
+	}
+	if (lua_istable (L, listed + 1)) {
+		for (i = 1; lua_rawgeti (L, listed + 1, i) != LUA_TNIL; i++) {
+			lua_pushvalue (L, -1);
+			if (lua_rawget (L, listed) == LUA_TNIL) {
+				lua_pushvalue (L, -2);
+				lua_rawseti (L, cols, (int)lua_rawlen (L, cols) + 1);
+				lua_pushvalue (L, -2);
+				lua_pushboolean (L, 1);
+				lua_rawset (L, listed);
+			}
+			lua_pop (L, 2);
+		}
+	}
+	lua_settop (L, cols);
+	ncols = (int)lua_rawlen (L, cols);
+
+	/* hash the incoming rows */
+	digests = (unsigned char (*)[16])LUASQL_NEWUD (L, (size_t)nrows * 16 + 1);
+	state = (unsigned char *)LUASQL_NEWUD (L, (size_t)nrows + 1);
+	lua_createtable (L, 0, nrows); /* lookup key -> row */
+	index = lua_gettop (L);
+	for (i = 1; i <= nrows; i++) {
+		md5_ctx m;
+		if (lua_rawgeti (L, 4, i) != LUA_TTABLE) {
+			free (key.data); free (text.data);
+			return luaL_argerror (L, 4, "rows must be tables");
+		}
+		key.len = 0;
+		md5_init (&m);
+		for (j = 1; j <= ncols; j++) {
+			int notnull;
+			lua_rawgeti (L, cols, j);
+			lua_rawget (L, -2);
+			if (!sql_isliteral (L, -1)) {
+				free (key.data); free (text.data);
+				lua_rawgeti (L, cols, j);
+				return luaL_error (L, LUASQL_PREFIX"row %d, column '%s': cannot write a %s",
+					i, lua_tostring (L, -1), luaL_typename (L, -2));
+			}
+			notnull = sync_text (L, -1, &text);
+			if (j <= nkeys) {
+				if (!notnull) {
+					free (key.data); free (text.data);
+					lua_rawgeti (L, cols, j);
+					return luaL_error (L, LUASQL_PREFIX"row %d: key column '%s' is missing or NULL",
+						i, lua_tostring (L, -1));
+				}
+				sync_addkey (&key, text.data, text.len);
+			}
+			else
+				sync_hashvalue (&m, text.data, text.len, !notnull);
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+		if (key.oom || text.oom) {
+			free (key.data); free (text.data);
+			return luaL_error (L, LUASQL_PREFIX"could not allocate row key");
+		}
+		md5_final (&m, digests[i-1]);
+		state[i-1] = SYNC_UNSEEN;
+		lua_pushlstring (L, key.data, key.len);
+		if (lua_rawget (L, index) != LUA_TNIL) {
+			free (key.data); free (text.data);
+			return luaL_error (L, LUASQL_PREFIX"rows %d and %d have the same key",
+				(int)lua_tointeger (L, -1), i);
+		}
+		lua_pop (L, 1);
+		lua_pushlstring (L, key.data, key.len);
+		lua_pushinteger (L, i);
+		lua_rawset (L, index);
+	}
+	free (text.data);
+	text.data = NULL;
+	if ((limit = conn_maxpacket (conn, errmsg, sizeof(errmsg))) == 0) {
+		free (key.data);
+		return luasql_failmsg (L, "error reading max_allowed_packet. MySQL: ", errmsg);
+	}
+	/* leave room for the packet header */
+	limit = limit > 1024 ? limit - 1024 : limit;
+
+	/* SELECT key, MD5(CONCAT(IFNULL(MD5(col),'-'), ...)) FROM table */
+	for (j = 1; j <= nkeys; j++) {
+		lua_rawgeti (L, cols, j);
+		s = lua_tolstring (L, -1, &len);
+		if (j > 1)
+			sqlbuf_add (&order, ",", 1);
+		sqlbuf_addident (&order, s, len, 0);
+		lua_pop (L, 1);
+	}
+	sqlbuf_addstr (&head, "SELECT ");
+	sqlbuf_add (&head, order.data, order.len);
+	sqlbuf_addstr (&head, ncols > nkeys ? ",MD5(CONCAT(" : ",MD5(''");
+	for (j = nkeys + 1; j <= ncols; j++) {
+		lua_rawgeti (L, cols, j);
+		s = lua_tolstring (L, -1, &len);
+		sqlbuf_addstr (&head, j > nkeys + 1 ? ",IFNULL(MD5(" : "IFNULL(MD5(");
+		sqlbuf_addident (&head, s, len, 0);
+		sqlbuf_addstr (&head, "),'-')");
+		lua_pop (L, 1);
+	}
+	sqlbuf_addstr (&head, ncols > nkeys ? ")) FROM " : ") FROM ");
+	sqlbuf_addident (&head, table, tlen, 1);
+	if (where != NULL) {
+		sqlbuf_addstr (&head, " WHERE (");
+		sqlbuf_addstr (&head, where);
+		sqlbuf_add (&head, ")", 1);
+	}
+
+	if (batch_begin (L, conn)) {
+		status = 2;
+		goto done;
+	}
+	for (;;) {
+		MYSQL_RES *res;
+		MYSQL_ROW r;
+		unsigned long *lengths;
+		lua_Integer nread = 0;
+		sql.len = 0;
+		sqlbuf_add (&sql, head.data, head.len);
+		if (last.len > 0) { /* after the last key read */
+			sqlbuf_addstr (&sql, where != NULL ? " AND (" : " WHERE (");
+			sqlbuf_add (&sql, order.data, order.len);
+			sqlbuf_addstr (&sql, ") > ");
+			sqlbuf_add (&sql, last.data, last.len);
+		}
+		sqlbuf_addstr (&sql, " ORDER BY ");
+		sqlbuf_add (&sql, order.data, order.len);
+		snprintf (num, sizeof(num), " LIMIT %lld", (long long)chunk);
+		sqlbuf_addstr (&sql, num);
+		if (head.oom || order.oom || sql.oom) {
+			status = 1;
+			break;
+		}
+		if (conn_query (conn, sql.data, sql.len, errmsg, sizeof(errmsg)) != 0) {
+			status = -1;
+			break;
+		}
+		if ((res = mysql_store_result (conn->my_conn)) == NULL) {
+			strncpy (errmsg, mysql_error (conn->my_conn), sizeof(errmsg) - 1);
+			status = -1;
+			break;
+		}
+		while (status == 0 && (r = mysql_fetch_row (res)) != NULL) {
+			unsigned char d[16];
+			const char *h = r[nkeys];
+			lengths = mysql_fetch_lengths (res);
+			nread++;
+			key.len = 0;
+			last.len = 0;
+			row.len = 0;
+			for (j = 0; j < nkeys; j++) {
+				const char *v = r[j] != NULL ? r[j] : "";
+				sync_addkey (&key, v, lengths[j]);
+				sqlbuf_add (&row, j == 0 ? "(" : ",", 1);
+				sqlbuf_addquoted (&row, conn->my_conn, v, lengths[j]);
+			}
+			sqlbuf_add (&row, ")", 1);
+			sqlbuf_add (&last, row.data, row.len);
+			if (key.oom || row.oom || last.oom) {
+				status = 1;
+				break;
+			}
+			for (j = 0; j < 16; j++)
+				d[j] = (unsigned char)(sync_hexdigit (h[2*j]) << 4 | sync_hexdigit (h[2*j+1]));
+			lua_pushlstring (L, key.data, key.len);
+			if (lua_rawget (L, index) != LUA_TNIL) {
+				i = (int)lua_tointeger (L, -1) - 1;
+				state[i] = memcmp (d, digests[i], 16) == 0 ? SYNC_SAME : SYNC_CHANGED;
+			}
+			else if (purge) {
+				if (del.len > 0 && del.len + 1 + row.len + 1 > limit)
+					status = sync_delete (conn, &del, &deleted, errmsg, sizeof(errmsg));
+				if (del.len == 0) {
+					sqlbuf_addstr (&del, "DELETE FROM ");
+					sqlbuf_addident (&del, table, tlen, 1);
+					sqlbuf_addstr (&del, " WHERE (");
+					sqlbuf_add (&del, order.data, order.len);
+					sqlbuf_addstr (&del, ") IN (");
+				}
+				else
+					sqlbuf_add (&del, ",", 1);
+				sqlbuf_add (&del, row.data, row.len);
+				if (del.oom)
+					status = 1;
+			}
+			lua_pop (L, 1);
+		}
+		mysql_free_result (res);
+		if (status != 0 || nread < chunk)
+			break;
+	}
+	if (status == 0 && del.len > 0)
+		status = sync_delete (conn, &del, &deleted, errmsg, sizeof(errmsg));
+
+	/* upsert the rows that are missing or differ */
+	sql.len = 0;
+	head.len = 0;
+	sqlbuf_addstr (&head, "INSERT INTO ");
+	sqlbuf_addident (&head, table, tlen, 1);
+	for (j = 1; j <= ncols; j++) {
+		lua_rawgeti (L, cols, j);
+		s = lua_tolstring (L, -1, &len);
+		sqlbuf_add (&head, j == 1 ? " (" : ",", j == 1 ? 2 : 1);
+		sqlbuf_addident (&head, s, len, 0);
+		if (j > nkeys) {
+			sqlbuf_addstr (&tail, j == nkeys + 1 ? " ON DUPLICATE KEY UPDATE " : ",");
+			sqlbuf_addident (&tail, s, len, 0);
+			sqlbuf_addstr (&tail, "=VALUES(");
+			sqlbuf_addident (&tail, s, len, 0);
+			sqlbuf_addstr (&tail, ")");
+		}
+		lua_pop (L, 1);
+	}
+	if (ncols == nkeys) { /* nothing to update but the key itself */
+		lua_rawgeti (L, cols, 1);
+		s = lua_tolstring (L, -1, &len);
+		sqlbuf_addstr (&tail, " ON DUPLICATE KEY UPDATE ");
+		sqlbuf_addident (&tail, s, len, 0);
+		sqlbuf_add (&tail, "=", 1);
+		sqlbuf_addident (&tail, s, len, 0);
+		lua_pop (L, 1);
+	}
+	sqlbuf_addstr (&head, ") VALUES ");
+	for (i = 1; i <= nrows && status == 0; i++) {
+		if (state[i-1] == SYNC_SAME) {
+			unchanged++;
+			continue;
+		}
+		row.len = 0;
+		lua_rawgeti (L, 4, i);
+		for (j = 1; j <= ncols; j++) {
+			sqlbuf_add (&row, j == 1 ? "(" : ",", 1);
+			lua_rawgeti (L, cols, j);
+			lua_rawget (L, -2);
+			sqlbuf_addvalue (&row, conn->my_conn, L, -1);
+			lua_pop (L, 1);
+		}
+		sqlbuf_add (&row, ")", 1);
+		lua_pop (L, 1);
+		if (head.len + row.len + tail.len > limit) {
+			snprintf (errmsg, sizeof(errmsg), "row %d does not fit in max_allowed_packet (%lu bytes)",
+				i, limit);
+			status = -2;
+		}
+		else if (sql.len > 0 && sql.len + 1 + row.len + tail.len > limit)
+			status = sync_upsert (conn, &sql, &tail, &inserted, &updated, errmsg, sizeof(errmsg));
+		if (status == 0) {
+			if (sql.len == 0)
+				sqlbuf_add (&sql, head.data, head.len);
+			else
+				sqlbuf_add (&sql, ",", 1);
+			sqlbuf_add (&sql, row.data, row.len);
+		}
+		if (head.oom || tail.oom || row.oom || sql.oom)
+			status = 1;
+	}
+	if (status == 0 && sql.len > 0)
+		status = sync_upsert (conn, &sql, &tail, &inserted, &updated, errmsg, sizeof(errmsg));
+	if (status == 0 && sql.oom)
+		status = 1;
+
+done:
+	free (head.data);
+	free (tail.data);
+	free (sql.data);
+	free (order.data);
+	free (key.data);
+	free (last.data);
+	free (del.data);
+	free (row.data);
+	if (status == 2)
+		return 2;
+	if (status == 1) {
+		lua_pop (L, batch_abort (L, conn, "", ""));
+		return luaL_error (L, LUASQL_PREFIX"could not allocate sync statement");
+	}
+	if (status == -2)
+		return batch_abort (L, conn, "error syncing rows: ", errmsg);
+	if (status < 0)
+		return batch_abort (L, conn, "error syncing rows. MySQL: ", errmsg);
+	lua_createtable (L, 0, 4);
+	lua_pushinteger (L, inserted);
+	lua_setfield (L, -2, "inserted");
+	lua_pushinteger (L, updated);
+	lua_setfield (L, -2, "updated");
+	lua_pushinteger (L, deleted);
+	lua_setfield (L, -2, "deleted");
+	lua_pushinteger (L, unchanged);
+	lua_setfield (L, -2, "unchanged");
+	return batch_step (L, conn, 1);
+}
+
+
+/*
+** Prepare sql on the connection and push a new statement object.
+** A statement of the connection's own cache (connidx 0) holds no
+** reference to the connection, which releases it when collected.
+** Preparing is given up after timeout ms if not 0.  No execution-time
+** hint is added: each execute has its own timeout, which the watchdog
+** enforces.
+** Return 1, or push nil and an error message (and "timeout") and
+** return 2 (or 3).
+*/
+static int create_statement (lua_State *L, conn_data *conn, int connidx, const char *sql, size_t sql_len, lua_Integer timeout) {
+    char errmsg[256] = "";
+    unsigned int err = 0;
+    int fired, n;
+    MYSQL_STMT *handle;
+    watch w;
+    watch_arm(&w, conn, deadline_after(timeout));
+    handle = stmt_open(conn, sql, sql_len, &err, errmsg, sizeof(errmsg));
+    if (handle == NULL && conn_retry(conn, err, 1) == 1)
+        handle = stmt_open(conn, sql, sql_len, &err, errmsg, sizeof(errmsg));
+    fired = watch_disarm(&w);
+    if (handle == NULL) {
+        if (timed_out(fired, timeout, err)) {
+            conn->stats.timeouts++;
+            lua_pushnil(L);
+            lua_pushfstring(L, LUASQL_PREFIX"prepare timed out after %d ms", (int)timeout);
+            lua_pushliteral(L, "timeout");
+            n = 3;
+        }
+        else
+            n = luasql_failmsg(L, "error preparing statement. MySQL: ", errmsg);
+        return n;
+    }
+
+    stmt_data *stmt = (stmt_data *)LUASQL_NEWUD(L, sizeof(stmt_data));
+    memset(stmt, 0, sizeof(stmt_data));
+    stmt->closed = 1;  /* until every field is set */
+    stmt->conn = LUA_NOREF;
+    luasql_setmeta(L, LUASQL_STATEMENT);
+
+    stmt->stmt = handle;
+    stmt->num_params = mysql_stmt_param_count(stmt->stmt);
+    stmt->params = (MYSQL_BIND *)calloc(stmt->num_params, sizeof(MYSQL_BIND));
+	stmt->params_data = (typeof(stmt->params_data))calloc(stmt->num_params, sizeof(*stmt->params_data));
+    stmt->sql = (char *)malloc(sql_len + 1);
+    if ((stmt->num_params > 0 && (stmt->params == NULL || stmt->params_data == NULL)) || stmt->sql == NULL) {
+        free(stmt->params); free(stmt->params_data); free(stmt->sql);
+        mysql_stmt_close(handle);
+        return luaL_error(L, LUASQL_PREFIX"could not allocate statement");
+    }
+    memcpy(stmt->sql, sql, sql_len + 1);
+    stmt->sql_len = sql_len;
+    stmt->closed = 0;
+    stmt->connp = conn;
+    stmt->epoch = conn->epoch;
+    stmt->next = conn->stmts;
+    if (conn->stmts)
+        conn->stmts->prev = stmt;
+    conn->stmts = stmt;
+    if (connidx != 0) {
+        lua_pushvalue(L, connidx);
+        stmt->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    return 1; // Return statement object
+}
+
+/*
+** Prepare a statement.  An optional table of options may follow:
+**     timeout_ms: deadline of preparing, and of a SELECT on the server
+**                 (defaults to conn:settimeout)
+*/
+static int conn_prepare(lua_State *L) {
+    conn_data *conn = getidleconnection(L);
+    size_t sql_len;
+    const char *sql = luaL_checklstring(L, 2, &sql_len);
+    lua_Integer timeout = opt_integer(L, 3, "timeout_ms", conn->timeout_ms);
+    prof_call pc;
+    luaL_argcheck(L, timeout >= 0, 3, "timeout must not be negative");
+    prof_begin(L, conn->envp, "prepare", &pc);
+    return prof_end(conn->envp, &pc, create_statement(L, conn, 1, sql, sql_len, timeout));
+}
+
+/*
+** Store the Lua value at arg as parameter index of the statement.
+** type is the temporal type the value stands for, or MYSQL_TYPE_NULL
+** to go by its Lua type (tables with date fields are temporal).
+** Return 0, or -1 if the value has no SQL counterpart.
+*/
+static int stmt_setparam (lua_State *L, stmt_data *stmt, int index, int arg, enum enum_field_types type) {
+    MYSQL_BIND *param = &stmt->params[index];
+    size_t len;
+    const char *s;
+
+    free(stmt->params_data[index].str);
+    stmt->params_data[index].str = NULL;
+    memset(param, 0, sizeof(MYSQL_BIND));
+    param->buffer_type = MYSQL_TYPE_NULL;
+    if (lua_type(L, arg) == LUA_TLIGHTUSERDATA && lua_touserdata(L, arg) == NULL)
+        return 0; /* JSON null */
+    if ((type == MYSQL_TYPE_JSON && !lua_isstring(L, arg)) ||
+        (type == MYSQL_TYPE_NULL && lua_istable(L, arg) && temporal_tabletype(L, arg) == MYSQL_TYPE_NULL)) {
+        sqlbuf json = {NULL, 0, 0, 0};
+        if (json_encode(L, arg, &json, 0) != 0 || json.oom) {
+            free(json.data);
+            return -1;
+        }
+        stmt->params_data[index].str = json.data;
+        stmt->params_data[index].size = json.len;
+        param->buffer_type = MYSQL_TYPE_STRING;
+        param->buffer = (void *)json.data;
+        param->buffer_length = json.len;
+        param->length = &stmt->params_data[index].size;
+        return 0;
+    }
+    if (type == MYSQL_TYPE_JSON) /* a string is taken as a JSON document */
+        type = MYSQL_TYPE_NULL;
+    if (!lua_isnil(L, arg) && (type != MYSQL_TYPE_NULL || lua_istable(L, arg))) {
+        type = temporal_tovalue(L, arg, type, &stmt->params_data[index].time);
+        if (type == MYSQL_TYPE_NULL)
+            return -1;
+        param->buffer_type = type;
+        param->buffer = &stmt->params_data[index].time;
+        param->buffer_length = sizeof(MYSQL_TIME);
+        return 0;
+    }
+    switch (lua_type(L, arg)) {
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, arg)) {
+                stmt->params_data[index].integer = (long long)lua_tointeger(L, arg);
+                param->buffer_type = MYSQL_TYPE_LONGLONG;
+                param->buffer = &stmt->params_data[index].integer;
+                param->buffer_length = sizeof(long long);
+            } else {
+                stmt->params_data[index].number = lua_tonumber(L, arg);
+                param->buffer_type = MYSQL_TYPE_DOUBLE;
+                param->buffer = &stmt->params_data[index].number;
+                param->buffer_length = sizeof(double);
+            }
+            break;
+        
+        case LUA_TSTRING:
+            s = lua_tolstring(L, arg, &len);
+            if ((stmt->params_data[index].str = (char *)malloc(len + 1)) == NULL)
+                return luaL_error(L, LUASQL_PREFIX"could not allocate parameter");
+            memcpy(stmt->params_data[index].str, s, len + 1);
+            stmt->params_data[index].size = len;
+            param->buffer_type = MYSQL_TYPE_STRING;
+            param->buffer = (void *)stmt->params_data[index].str;
+            param->buffer_length = len;
+            param->length = &stmt->params_data[index].size;
+            break;
+        
+        case LUA_TBOOLEAN:
+            stmt->params_data[index].boolean = lua_toboolean(L, arg);
+            param->buffer_type = MYSQL_TYPE_TINY;
+            param->buffer = &stmt->params_data[index].boolean;
+            param->buffer_length = sizeof(char);
+            break;
+        
+        case LUA_TNIL:
+            param->buffer_type = MYSQL_TYPE_NULL;
+            break;
+        
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/*
+** Optional third argument of stmt:bind, naming the temporal type a
+** number (epoch seconds), table or string stands for, or "json" to
+** encode any value as a JSON document.
+*/
+static const char *const bind_hints[] = {"auto", "datetime", "timestamp", "date", "time", "json", NULL};
+static const enum enum_field_types bind_types[] = {
+    MYSQL_TYPE_NULL, MYSQL_TYPE_DATETIME, MYSQL_TYPE_TIMESTAMP, MYSQL_TYPE_DATE, MYSQL_TYPE_TIME,
+    MYSQL_TYPE_JSON
+};
+
+static int stmt_bind(lua_State *L) {
+    stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT);
+    int index = luaL_checkinteger(L, 2) - 1;  // Convert Lua 1-based index to C 0-based index
+    char errmsg[256] = "";
+    luaL_argcheck(L, !stmt->closed, 1, "statement is finalized");
+    if (stmt_revalidate(stmt, errmsg, sizeof(errmsg)) != 0)
+        return luasql_failmsg(L, "error preparing statement again. MySQL: ", errmsg);
+    
+    if (index < 0 || index >= stmt->num_params) {
+        return luaL_error(L, "Invalid parameter index");
+    }
+
+    if (stmt_setparam(L, stmt, index, 3, bind_types[luaL_checkoption(L, 4, "auto", bind_hints)]) != 0)
+        return luasql_faildirect(L, "error executing query. Invalid parameter type");
+
+    if (mysql_stmt_bind_param(stmt->stmt, stmt->params))
+        return luasql_failmsg(L, "error executing query (stmt_bind_param). MySQL: ", mysql_stmt_error(stmt->stmt));
+    stmt->params_bound = 1;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/*
+** Execute the statement at stack index idx and push its cursor or
+** affected row count, giving it up after timeout ms if not 0.
+*/
+static int stmt_doexecute (lua_State *L, stmt_data *stmt, int idx, lua_Integer timeout) {
+	conn_data *conn = stmt->connp;
+	unsigned int num_cols;
+	char errmsg[256] = "";
+	long long deadline = deadline_after (timeout);
+	watch w;
+	if (conn->streaming)
+		return luaL_error (L, LUASQL_PREFIX"connection is busy with an unbuffered cursor");
+	if (conn->pending != NULL) /* unread result sets of a CALL */
+		stmt_cur_drain (conn->pending);
+	if (batch_begin (L, conn))
+		return 2;
+	if (stmt_revalidate(stmt, errmsg, sizeof(errmsg)) != 0)
+		return batch_abort(L, conn, "error preparing statement again. MySQL: ", errmsg);
+	if (stmt->cursor != NULL) /* the handle's previous result goes away */
+		stmt_cur_nullify(stmt->cursor);
+	watch_arm (&w, conn, deadline);
+	if (stmt_run(stmt, errmsg, sizeof(errmsg))) {
+		if (timed_out (watch_disarm (&w), timeout, mysql_stmt_errno (stmt->stmt)))
+			return conn_timedout (L, conn, timeout);
+		return batch_abort(L, conn, "error executing query (stmt_execute). MySQL: ", errmsg);
+	}
+	if (conn->max_result_bytes == 0 && mysql_stmt_store_result(stmt->stmt)) {
+		if (timed_out (watch_disarm (&w), timeout, mysql_stmt_errno (stmt->stmt)))
+			return conn_timedout (L, conn, timeout);
+		return batch_abort(L, conn, "error executing query (stmt_store_result). MySQL: ", mysql_stmt_error(stmt->stmt));
+	}
+	watch_disarm (&w);
+	num_cols = mysql_stmt_field_count(stmt->stmt);
+	if (num_cols > 0 && stmt_cacheresult(stmt) == 0) {
+		stmt_cur_data *cur;
+		create_stmt_cursor(L, idx, stmt);
+		cur = (stmt_cur_data *)lua_touserdata(L, -1);
+		if (conn->max_result_bytes == 0)
+			stmt_cur_account(cur);
+		else {
+			int status, fired;
+			watch_arm (&w, conn, deadline);
+			status = stmt_cur_spool(cur, errmsg, sizeof(errmsg));
+			fired = watch_disarm (&w);
+			if (status != 0) {
+				conn->pending = cur;  /* so the rest of a CALL is drained */
+				stmt_cur_nullify(cur);
+				if (timed_out (fired, timeout, mysql_stmt_errno (stmt->stmt)))
+					return conn_timedout (L, conn, timeout);
+				return batch_abort(L, conn, "error buffering result. ", errmsg);
+			}
+		}
+		if (mysql_more_results(conn->my_conn)) /* a CALL with more result sets */
+			conn->pending = cur;
+		return batch_step (L, conn, 1);
+	}
+
+	if(num_cols == 0) { /* no tuples returned */
+	/* query does not return data (it was not a SELECT) */
+		lua_pushinteger(L, mysql_stmt_affected_rows(stmt->stmt));
+		return batch_step (L, conn, 1);
+	} else { /* mysql_use_result() should have returned data */
+		return batch_abort(L, conn, "error retrieving result. MySQL: ", mysql_stmt_error(stmt->stmt));
+	}
+}
+
+/*
+** Execute the statement.  An optional table of options may follow:
+**     timeout_ms: deadline of the call (defaults to conn:settimeout)
+*/
+static int stmt_execute(lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT);
+	prof_call pc;
+	lua_Integer timeout;
+	luaL_argcheck (L, !stmt->closed, 1, "statement is finalized");
+	timeout = opt_integer (L, 2, "timeout_ms", stmt->connp->timeout_ms);
+	luaL_argcheck (L, timeout >= 0, 2, "timeout must not be negative");
+	prof_begin (L, stmt->connp->envp, "stmt.execute", &pc);
+	return prof_end (stmt->connp->envp, &pc, stmt_doexecute (L, stmt, 1, timeout));
+}
+
+static int stmt_finalize(lua_State *L) {
+    stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT);
+    stmt_release(L, stmt);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+** Make a new statement cache table, keeping only the prepared
+** statements of the old one: those with an open cursor, and others up
+** to half of SQLCACHE_MAX.  The rest are closed, so the next trim is
+** many queries away.  Counts of statements seen are dropped.
+*/
+static void conn_trimcache (lua_State *L, conn_data *conn) {
+	lua_newtable (L);
+	conn->sqlcache_size = 0;
+	if (conn->sqlcache != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, conn->sqlcache);
+		lua_pushnil (L);
+		while (lua_next (L, -2)) {
+			stmt_data *stmt = lua_type (L, -1) == LUA_TUSERDATA ?
+				(stmt_data *)lua_touserdata (L, -1) : NULL;
+			if (stmt != NULL && (conn->sqlcache_size < SQLCACHE_MAX / 2 || stmt->cursor != NULL)) {
+				lua_pushvalue (L, -2);
+				lua_insert (L, -2);
+				lua_rawset (L, -5);
+				conn->sqlcache_size++;
+			}
+			else {
+				if (stmt != NULL)
+					stmt_release (L, stmt);
+				lua_pop (L, 1);
+			}
+		}
+		lua_pop (L, 1);
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->sqlcache);
+	}
+	conn->sqlcache = luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
+
+/*
+** Count one more run of sql and return its prepared statement once it
+** has run prepare_after times, pushed on the stack.  Return NULL,
+** pushing nothing, while it should still be interpolated.
+*/
+static stmt_data *conn_cachedstmt (lua_State *L, conn_data *conn, const char *sql, size_t len) {
+	stmt_data *stmt;
+	lua_Integer seen = 0;
+	int n;
+	if (conn->sqlcache == LUA_NOREF || conn->sqlcache_size >= SQLCACHE_MAX)
+		conn_trimcache (L, conn);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->sqlcache);
+	lua_pushlstring (L, sql, len);
+	switch (lua_rawget (L, -2)) {
+		case LUA_TUSERDATA:
+			stmt = (stmt_data *)lua_touserdata (L, -1);
+			if (!stmt->closed) {
+				lua_remove (L, -2);
+				return stmt;
+			}
+			seen = conn->prepare_after; /* finalized: prepare it again */
+			break;
+		case LUA_TNUMBER:
+			seen = lua_tointeger (L, -1);
+			break;
+		case LUA_TBOOLEAN: /* could not be prepared */
+			lua_pop (L, 2);
+			return NULL;
+		default:
+			conn->sqlcache_size++;
+	}
+	lua_pop (L, 1);
+	lua_pushlstring (L, sql, len);
+	if (++seen < conn->prepare_after) {
+		lua_pushinteger (L, seen);
+		lua_rawset (L, -3);
+		lua_pop (L, 1);
+		return NULL;
+	}
+	if ((n = create_statement (L, conn, 0, sql, len, conn->timeout_ms)) != 1) {
+		lua_pop (L, n); /* nil and message */
+		lua_pushboolean (L, 0);
+		lua_rawset (L, -3);
+		lua_pop (L, 1);
+		return NULL;
+	}
+	stmt = (stmt_data *)lua_touserdata (L, -1);
+	lua_pushvalue (L, -1);
+	lua_insert (L, -4); /* statement, cache, key, statement */
+	lua_rawset (L, -3);
+	lua_pop (L, 1);
+	return stmt;
+}
+
+
+/*
+** Set how many times a query with parameters runs interpolated before
+** it is prepared on the server and the prepared statement is reused.
+** 0 turns the cache off and closes the statements in it.
+*/
+static int conn_setprepareafter (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	lua_Integer k = luaL_checkinteger (L, 2);
+	luaL_argcheck (L, k >= 0 && k <= INT_MAX, 2, "invalid count");
+	conn->prepare_after = (int)k;
+	if (k == 0 && conn->sqlcache != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, conn->sqlcache);
+		lua_pushnil (L);
+		while (lua_next (L, -2)) {
+			if (lua_type (L, -1) == LUA_TUSERDATA)
+				stmt_release (L, (stmt_data *)lua_touserdata (L, -1));
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->sqlcache);
+		conn->sqlcache = LUA_NOREF;
+		conn->sqlcache_size = 0;
+	}
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Set the temporal mode of cursors created from now on; see
+** cursor:settemporal.
+*/
+static int conn_settemporal (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	conn->temporal = (short)luaL_checkoption (L, 2, NULL, temporal_modes);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Set whether cursors created from now on decode JSON columns.
+*/
+static int conn_setjson (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	conn->json = (short)lua_toboolean (L, 2);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Run sql with the parameters at stack index first and up through a
+** statement of the cache.  Return the number of results pushed, or -1
+** if sql is not (yet) cached.
+*/
+static int conn_execcached (lua_State *L, conn_data *conn, const char *sql, size_t len, int first, int nargs, lua_Integer timeout) {
+	char errmsg[256] = "";
+	stmt_data *stmt = conn_cachedstmt (L, conn, sql, len);
+	int i;
+	if (stmt == NULL)
+		return -1;
+	if (stmt->num_params != (unsigned int)nargs)
+		return luaL_error (L, LUASQL_PREFIX"statement has %d placeholders but %d values were given",
+			(int)stmt->num_params, nargs);
+	if (stmt_revalidate (stmt, errmsg, sizeof(errmsg)) != 0)
+		return luasql_failmsg (L, "error preparing statement again. MySQL: ", errmsg);
+	for (i = 0; i < nargs; i++)
+		stmt_setparam (L, stmt, i, first + i, MYSQL_TYPE_NULL);
+	if (mysql_stmt_bind_param (stmt->stmt, stmt->params))
+		return luasql_failmsg (L, "error binding parameters. MySQL: ", mysql_stmt_error (stmt->stmt));
+	stmt->params_bound = 1;
+	return stmt_doexecute (L, stmt, lua_gettop (L), timeout);
+}
+
+
+/*
+** Produce the next page of a keyset pagination.  Upvalues: connection,
+** first page statement, next page statement, key names, parameters of
+** the base query, key values of the last row read (false when done)
+** and page size.
+*/
+static int paginate_next (lua_State *L) {
+	conn_data *conn = (conn_data *)lua_touserdata (L, lua_upvalueindex (1));
+	int nkeys = (int)lua_rawlen (L, lua_upvalueindex (4));
+	int nparams = (int)lua_rawlen (L, lua_upvalueindex (5));
+	lua_Integer page_size = lua_tointeger (L, lua_upvalueindex (7));
+	int after = lua_istable (L, lua_upvalueindex (6));
+	char errmsg[256] = "";
+	stmt_data *stmt;
+	int sidx, cidx, page, i, n;
+	if (lua_type (L, lua_upvalueindex (6)) == LUA_TBOOLEAN) /* no more pages */
+		return 0;
+	if (conn->closed)
+		return luaL_error (L, LUASQL_PREFIX"connection is closed");
+	lua_settop (L, 0);
+	lua_pushvalue (L, lua_upvalueindex (after ? 3 : 2));
+	sidx = lua_gettop (L);
+	stmt = (stmt_data *)lua_touserdata (L, sidx);
+	if (stmt->closed)
+		return luaL_error (L, LUASQL_PREFIX"statement is finalized");
+	if (stmt_revalidate (stmt, errmsg, sizeof(errmsg)) != 0)
+		return luasql_failmsg (L, "error preparing statement again. MySQL: ", errmsg);
+	for (i = 0; i < nparams + (after ? nkeys : 0); i++) {
+		if (i < nparams)
+			lua_rawgeti (L, lua_upvalueindex (5), i + 1);
+		else
+			lua_rawgeti (L, lua_upvalueindex (6), i - nparams + 1);
+		if (stmt_setparam (L, stmt, i, lua_gettop (L), MYSQL_TYPE_NULL) != 0)
+			return luasql_faildirect (L, "key value has no SQL counterpart");
+		lua_pop (L, 1);
+	}
+	if (mysql_stmt_bind_param (stmt->stmt, stmt->params))
+		return luasql_failmsg (L, "error binding parameters. MySQL: ", mysql_stmt_error (stmt->stmt));
+	stmt->params_bound = 1;
+	if ((n = stmt_doexecute (L, stmt, sidx, conn->timeout_ms)) != 1)
+		return n; /* nil and an error message */
+	if (!lua_isuserdata (L, -1))
+		return luaL_error (L, LUASQL_PREFIX"paginated query returned no result set");
+	cidx = lua_gettop (L);
+	lua_newtable (L);
+	page = lua_gettop (L);
+	for (n = 0; ; n++) {
+		lua_pushcfunction (L, stmt_cur_fetch);
+		lua_pushvalue (L, cidx);
+		lua_pushliteral (L, "a");
+		lua_call (L, 2, 1);
+		if (lua_isnil (L, -1))
+			break;
+		lua_rawseti (L, page, n + 1);
+	}
+	lua_pop (L, 1);
+	stmt_cur_nullify ((stmt_cur_data *)lua_touserdata (L, cidx));
+	if (n < page_size) {
+		lua_pushboolean (L, 0);
+		lua_replace (L, lua_upvalueindex (6));
+	}
+	else {
+		lua_rawgeti (L, page, n);
+		lua_createtable (L, nkeys, 0);
+		for (i = 1; i <= nkeys; i++) {
+			lua_rawgeti (L, lua_upvalueindex (4), i);
+			lua_gettable (L, -3);
+			if (lua_isnil (L, -1)) {
+				lua_rawgeti (L, lua_upvalueindex (4), i);
+				return luaL_error (L, LUASQL_PREFIX"key column '%s' is missing or NULL", lua_tostring (L, -1));
+			}
+			lua_rawseti (L, -2, i);
+		}
+		lua_replace (L, lua_upvalueindex (6));
+		lua_pop (L, 1);
+	}
+	if (n == 0)
+		return 0;
+	lua_pushvalue (L, page);
+	return 1;
+}
+
+
+/*
+** Iterate over the result of a query page by page, seeking each page
+** from the key of the last row of the previous one instead of skipping
+** rows with OFFSET.  The base query becomes a derived table, which the
+** server merges into the outer query so the key index is still used.
+*/
+static int conn_paginate (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	size_t len, klen;
+	const char *base = luaL_checklstring (L, 2, &len);
+	const char *k;
+	sqlbuf head = {NULL, 0, 0, 0}, order = {NULL, 0, 0, 0}, sql = {NULL, 0, 0, 0};
+	lua_Integer page_size;
+	int desc, nkeys, nparams, top, keys, i, n;
+	char limit[32];
+	stmt_data *first, *next;
+	luaL_checktype (L, 3, LUA_TTABLE);
+	top = lua_gettop (L);
+	nparams = top - 3;
+	page_size = opt_integer (L, 3, "page_size", 100);
+	desc = opt_boolean (L, 3, "desc", 0);
+	luaL_argcheck (L, page_size > 0, 3, "page_size must be positive");
+
+	lua_newtable (L); /* key names */
+	keys = lua_gettop (L);
+	lua_getfield (L, 3, "key");
+	if (lua_type (L, -1) == LUA_TSTRING)
+		lua_rawseti (L, keys, 1);
+	else {
+		luaL_argcheck (L, lua_istable (L, -1), 3, "key must be a column name or a list of them");
+		for (i = 1; lua_rawgeti (L, -1, i) != LUA_TNIL; i++) {
+			luaL_argcheck (L, lua_type (L, -1) == LUA_TSTRING, 3, "key column names must be strings");
+			lua_rawseti (L, keys, i);
+		}
+		lua_pop (L, 2);
+	}
+	nkeys = (int)lua_rawlen (L, keys);
+	luaL_argcheck (L, nkeys > 0, 3, "no key columns given");
+
+	while (len > 0 && (isspace ((unsigned char)base[len-1]) || base[len-1] == ';'))
+		len--;
+	sqlbuf_addstr (&head, "SELECT * FROM (");
+	sqlbuf_add (&head, base, len);
+	sqlbuf_addstr (&head, ") AS luasql_page");
+	sqlbuf_add (&sql, "(", 1);
+	for (i = 1; i <= nkeys; i++) {
+		lua_rawgeti (L, keys, i);
+		k = lua_tolstring (L, -1, &klen);
+		sqlbuf_addstr (&order, i == 1 ? " ORDER BY " : ", ");
+		sqlbuf_addident (&order, k, klen, 0);
+		if (desc)
+			sqlbuf_addstr (&order, " DESC");
+		if (i > 1)
+			sqlbuf_add (&sql, ",", 1);
+		sqlbuf_addident (&sql, k, klen, 0);
+		lua_pop (L, 1);
+	}
+	snprintf (limit, sizeof(limit), " LIMIT %lld", (long long)page_size);
+	sqlbuf_addstr (&order, limit);
+	sqlbuf_addstr (&sql, desc ? ") < (" : ") > (");
+	for (i = 1; i <= nkeys; i++)
+		sqlbuf_addstr (&sql, i == 1 ? "?" : ",?");
+	sqlbuf_add (&sql, ")", 1);
+	if (head.oom || order.oom || sql.oom) {
+		free (head.data); free (order.data); free (sql.data);
+		return luaL_error (L, LUASQL_PREFIX"could not allocate query");
+	}
+	lua_pushlstring (L, head.data, head.len);
+	lua_pushlstring (L, order.data, order.len);
+	lua_concat (L, 2); /* first page */
+	lua_pushlstring (L, head.data, head.len);
+	lua_pushliteral (L, " WHERE ");
+	lua_pushlstring (L, sql.data, sql.len);
+	lua_pushlstring (L, order.data, order.len);
+	lua_concat (L, 4); /* following pages */
+	free (head.data); free (order.data); free (sql.data);
+
+	lua_pushvalue (L, 1);
+	if ((n = create_statement (L, conn, 1, lua_tostring (L, keys + 1), lua_rawlen (L, keys + 1), conn->timeout_ms)) != 1)
+		return n;
+	first = (stmt_data *)lua_touserdata (L, -1);
+	if ((n = create_statement (L, conn, 1, lua_tostring (L, keys + 2), lua_rawlen (L, keys + 2), conn->timeout_ms)) != 1)
+		return n;
+	next = (stmt_data *)lua_touserdata (L, -1);
+	if (first->num_params != (unsigned int)nparams)
+		return luaL_error (L, LUASQL_PREFIX"query has %d placeholders but %d values were given",
+			(int)first->num_params, nparams);
+	if (next->num_params != (unsigned int)(nparams + nkeys))
+		return luaL_error (L, LUASQL_PREFIX"could not add the key predicate to the query");
+	lua_pushvalue (L, keys);
+	lua_createtable (L, nparams, 0);
+	for (i = 1; i <= nparams; i++) {
+		lua_pushvalue (L, 3 + i);
+		lua_rawseti (L, -2, i);
+	}
+	lua_pushnil (L);
+	lua_pushinteger (L, page_size);
+	lua_pushcclosure (L, paginate_next, 7);
+	return 1;
+}
+
+
+
+/*
+** Commit the current transaction.
+*/
+static int conn_commit (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	if (conn->batch_open) {
+		char errmsg[256] = "";
+		lua_pushboolean(L, batch_commit (L, conn, errmsg, sizeof(errmsg)) >= 0);
+		return 1;
+	}
+	lua_pushboolean(L, !mysql_commit(conn->my_conn));
+	return 1;
+}
+
+
+
+/*
+** Rollback the current transaction.
+*/
+static int conn_rollback (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	if (conn->batch_open) {
+		conn->batch_open = 0;
+		conn->batch_pending = 0;
+		conn->stats.batch_rollbacks++;
+	}
+	lua_pushboolean(L, !mysql_rollback(conn->my_conn));
+	return 1;
+}
+
+
+/*
+** Set "auto commit" property of the connection. Modes ON/OFF
+*/
+static int conn_setautocommit (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	char errmsg[256] = "";
+	if (batch_commit (L, conn, errmsg, sizeof(errmsg)) < 0)
+		return luasql_failmsg (L, "error committing batch, batch rolled back. MySQL: ", errmsg);
+	if (lua_toboolean (L, 2)) {
+		mysql_autocommit(conn->my_conn, 1); /* Set it ON */
+		conn->autocommit = 1;
+	}
+	else {
+		mysql_autocommit(conn->my_conn, 0);
+		conn->autocommit = 0;
+		conn->batch_rows = 0; /* batching needs autocommit */
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+
+/*
+** Get Last auto-increment id generated
+*/
+static int conn_getlastautoid (lua_State *L) {
+  conn_data *conn = getconnection(L);
+  conn_checkfree(L, conn);
+  lua_pushinteger(L, mysql_insert_id(conn->my_conn));
+  return 1;
+}
+
+/*
+** Create a new Connection object and push it on top of the stack.
+*/
+static int create_connection (lua_State *L, int env, MYSQL *const my_conn, const conn_params *params) {
+	conn_data *conn = (conn_data *)LUASQL_NEWUD(L, sizeof(conn_data));
+	memset (&conn->params, 0, sizeof(conn_params));
+	luasql_setmeta (L, LUASQL_CONNECTION_MYSQL);
+	/* fill in structure */
+	conn->closed = 0;
+	conn->env = LUA_NOREF;
+	conn->envp = NULL;
+	conn->my_conn = my_conn;
+	conn->streaming = 0;
+	conn->autocommit = 1;
+	conn->batch_rows = 0;
+	conn->batch_ms = 0;
+	conn->batch_pending = 0;
+	conn->batch_open = 0;
+	conn->batch_report = LUA_NOREF;
+	conn->batch_error = LUA_NOREF;
+	conn->reconnect = 0;
+	conn->epoch = 0;
+	conn->stmts = NULL;
+	conn->max_packet = 0;
+	conn->prepare_after = 0;
+	conn->sqlcache = LUA_NOREF;
+	conn->sqlcache_size = 0;
+	conn->temporal = TEMPORAL_STRING;
+	conn->json = 0;
+	conn->pending = NULL;
+	conn->outstanding = 0;
+	conn->max_result_bytes = 0;
+	conn->spill = 0;
+	conn->result_mem = 0;
+	conn->result_disk = 0;
+	conn->timeout_ms = 0;
+	conn->control = NULL;
+	conn->watch = NULL;
+	memset (&conn->stats, 0, sizeof(conn_stats));
+	if (params_copy (&conn->params, params) != 0) {
+		conn->closed = 1;
+		mysql_close (my_conn);
+		return luaL_error (L, LUASQL_PREFIX"could not allocate connection parameters");
+	}
+	conn->envp = (env_data *)lua_touserdata (L, env);
+	lua_pushvalue (L, env);
+	conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+** Read the parameters of env:connect given as a table.
+*/
+static void env_connectoptions (lua_State *L, int t, conn_params *p) {
+	static const char *const ssl_modes[] = {"disabled", "preferred", "required",
+		"verify_ca", "verify_identity", NULL};
+	const char *mode = opt_string (L, t, "ssl_mode", NULL);
+	p->db = (char *)opt_string (L, t, "database", NULL);
+	p->user = (char *)opt_string (L, t, "user", NULL);
+	p->password = (char *)opt_string (L, t, "password", NULL);
+	p->host = (char *)opt_string (L, t, "host", NULL);
+	p->port = (unsigned int)opt_integer (L, t, "port", 0);
+	p->unix_socket = (char *)opt_string (L, t, "socket", NULL);
+	p->client_flag = (unsigned long)opt_integer (L, t, "flags", 0);
+	p->ssl_ca = (char *)opt_string (L, t, "ssl_ca", NULL);
+	p->ssl_capath = (char *)opt_string (L, t, "ssl_capath", NULL);
+	p->ssl_cert = (char *)opt_string (L, t, "ssl_cert", NULL);
+	p->ssl_key = (char *)opt_string (L, t, "ssl_key", NULL);
+	p->ssl_cipher = (char *)opt_string (L, t, "ssl_cipher", NULL);
+	p->tls_version = (char *)opt_string (L, t, "tls_version", NULL);
+	p->connect_timeout = (unsigned int)opt_integer (L, t, "connect_timeout", 0);
+	p->session_reuse = (short)opt_boolean (L, t, "session_reuse", 1);
+	if (mode != NULL) {
+		int i;
+		for (i = 0; ssl_modes[i] != NULL && strcmp (ssl_modes[i], mode) != 0; i++)
+			;
+		if (ssl_modes[i] == NULL)
+			luaL_error (L, LUASQL_PREFIX"invalid ssl_mode '%s'", mode);
+#if MYSQL_VERSION_ID >= 50711 && !defined(MARIADB_BASE_VERSION)
+		p->ssl_mode = SSL_MODE_DISABLED + i;
+#else
+		luaL_error (L, LUASQL_PREFIX"ssl_mode needs a MySQL 5.7.11 or later client library");
+#endif
+	}
+}
+
+
+/*
+** Connects to a data source.
+**     param: one string for each connection parameter, said
+**     datasource, username, password, host and port; or a table with
+**     fields database, user, password, host, port, socket, flags and
+**     the TLS options.
+*/
+static int env_connect (lua_State *L) {
+	env_data *env = getenvironment(L); /* validade environment */
+	conn_params params;
+	MYSQL *conn;
+	char error_msg[256] = "";
+
+	if (lib_thread () != 0)
+		return luasql_faildirect (L, "could not initialize the MySQL client library for this thread");
+	memset (&params, 0, sizeof(params));
+	params.session_reuse = 1;
+	if (lua_istable (L, 2))
+		env_connectoptions (L, 2, &params);
+	else {
+		params.db = (char *)luaL_checkstring(L, 2);
+		params.user = (char *)luaL_optstring(L, 3, NULL);
+		params.password = (char *)luaL_optstring(L, 4, NULL);
+		params.host = (char *)luaL_optstring(L, 5, NULL);
+		params.port = (unsigned int)luaL_optinteger(L, 6, 0);
+		params.unix_socket = (char *)luaL_optstring(L, 7, NULL);
+		params.client_flag = (unsigned long)luaL_optinteger(L, 8, 0);
+	}
+	params.tls = &env->tls;
+	conn = params_connect (&params, error_msg, sizeof(error_msg));
+	if (conn == NULL)
+		return luasql_failmsg (L, "error connecting to database. MySQL: ", error_msg);
+	return create_connection(L, 1, conn, &params);
+}
+
+
+/*
+** Return the bytes of memory held by the buffered results of all open
+** cursors of the process, and the bytes they spilled to files.
+*/
+static int env_memory (lua_State *L) {
+	getenvironment (L);
+	lua_pushinteger (L, (lua_Integer)atomic_load (&result_mem_total));
+	lua_pushinteger (L, (lua_Integer)atomic_load (&result_disk_total));
+	return 2;
+}
+
+
+/*
+** Turn the call-site profiler on or off.
+**     env:setprofile(true, {depth=8, every=1})
+** depth is the number of Lua frames kept per call site; every samples one
+** call in that many.  Turning it on again keeps what was collected.
+*/
+static int env_setprofile (lua_State *L) {
+	env_data *env = getenvironment (L);
+	profiler *p = &env->prof;
+	int depth = (int)opt_integer (L, 3, "depth", 8);
+	int every = (int)opt_integer (L, 3, "every", 1);
+	luaL_argcheck (L, depth >= 1 && depth <= PROF_MAXDEPTH && every >= 1, 3, "invalid profile options");
+	p->on = (short)lua_toboolean (L, 2);
+	p->depth = depth;
+	p->every = every;
+	if (p->on && p->index == LUA_NOREF) {
+		lua_newtable (L);
+		p->index = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Return the profile as folded stacks, one line per call site and phase
+** with its microseconds, ready for flame graph tools; and a list of
+** {site=, calls=, client_us=, convert_us=, rows=, bytes=}.
+** With a true argument, the profile is cleared afterwards.
+*/
+static int env_profile (lua_State *L) {
+	env_data *env = getenvironment (L);
+	profiler *p = &env->prof;
+	sqlbuf folded = {NULL, 0, 0, 0};
+	char num[48];
+	int n = 0;
+	if (p->index != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, p->index);
+		lua_pushnil (L);
+		while (lua_next (L, -2)) {
+			prof_site *s = &p->sites[lua_tointeger (L, -1)];
+			size_t len;
+			const char *site = lua_tolstring (L, -2, &len);
+			if (s->client_ns / 1000 > 0) {
+				sqlbuf_add (&folded, site, len);
+				sqlbuf_add (&folded, num, snprintf (num, sizeof(num), ";client %lld\n", s->client_ns / 1000));
+			}
+			if (s->convert_ns / 1000 > 0) {
+				sqlbuf_add (&folded, site, len);
+				sqlbuf_add (&folded, num, snprintf (num, sizeof(num), ";convert %lld\n", s->convert_ns / 1000));
+			}
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+	}
+	if (folded.oom) {
+		free (folded.data);
+		return luaL_error (L, LUASQL_PREFIX"out of memory");
+	}
+	lua_pushlstring (L, folded.data ? folded.data : "", folded.len);
+	free (folded.data);
+	lua_createtable (L, p->nsites, 0);
+	if (p->index != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, p->index);
+		lua_pushnil (L);
+		while (lua_next (L, -2)) {
+			prof_site *s = &p->sites[lua_tointeger (L, -1)];
+			lua_createtable (L, 0, 6);
+			lua_pushvalue (L, -3);
+			lua_setfield (L, -2, "site");
+			lua_pushinteger (L, s->calls);
+			lua_setfield (L, -2, "calls");
+			lua_pushinteger (L, (lua_Integer)(s->client_ns / 1000));
+			lua_setfield (L, -2, "client_us");
+			lua_pushinteger (L, (lua_Integer)(s->convert_ns / 1000));
+			lua_setfield (L, -2, "convert_us");
+			lua_pushinteger (L, s->rows);
+			lua_setfield (L, -2, "rows");
+			lua_pushinteger (L, s->bytes);
+			lua_setfield (L, -2, "bytes");
+			lua_rawseti (L, -5, ++n);
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+	}
+	if (lua_toboolean (L, 2)) {
+		prof_reset (L, p);
+		if (p->on) {
+			lua_newtable (L);
+			p->index = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+	}
+	return 2;
+}
+
+
+/*
+** Check for valid router.
+*/
+static router_data *getrouter (lua_State *L) {
+	router_data *r = (router_data *)luaL_checkudata (L, 1, LUASQL_ROUTER_MYSQL);
+	luaL_argcheck (L, r != NULL, 1, "router expected");
+	luaL_argcheck (L, !r->closed, 1, "router is closed");
+	return r;
+}
+
+
+/*
+** Tell whether the connection is inside a transaction.  A closed
+** connection is not.
+*/
+static int conn_intrans (conn_data *conn) {
+	if (conn->closed)
+		return 0;
+	return conn->batch_open || !conn->autocommit ||
+		(conn->my_conn->server_status & SERVER_STATUS_IN_TRANS) != 0;
+}
+
+
+/*
+** Tell whether the statement locks the rows it reads.
+*/
+static int sql_locks_rows (const char *sql, size_t len) {
+	static const char *const locks[] = {"FOR UPDATE", "FOR SHARE", "LOCK IN SHARE MODE", NULL};
+	int i;
+	for (i = 0; locks[i] != NULL; i++) {
+		size_t n = strlen (locks[i]), p, j;
+		for (p = 0; p + n <= len; p++) {
+			for (j = 0; j < n && toupper ((unsigned char)sql[p + j]) == locks[i][j]; j++)
+				;
+			if (j == n)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+
+/*
+** Pick the healthy replica with the fewest open cursors, starting after
+** the last one picked so ties rotate.  Return its index, or -1.
+*/
+static int router_pick (router_data *r) {
+	int best = -1, i, k;
+	for (k = 0; k < r->nreplicas; k++) {
+		router_replica *rep;
+		i = (r->next + k) % r->nreplicas;
+		rep = &r->replicas[i];
+		if (!rep->healthy || rep->connp->closed || rep->connp->streaming)
+			continue;
+		if (best < 0 || rep->connp->outstanding < r->replicas[best].connp->outstanding)
+			best = i;
+	}
+	if (best >= 0)
+		r->next = (best + 1) % r->nreplicas;
+	return best;
+}
+
+
+/*
+** Run a query returning a single value and copy that value into buf.
+** Return 1 if it is not NULL, 0 if it is, or -1 on failure.
+*/
+static int conn_queryvalue (conn_data *conn, const char *sql, size_t len, char *buf, size_t size) {
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int status = -1;
+	if (conn->pending != NULL)
+		stmt_cur_drain (conn->pending);
+	if (mysql_real_query (conn->my_conn, sql, len) || (res = mysql_store_result (conn->my_conn)) == NULL)
+		return -1;
+	if ((row = mysql_fetch_row (res)) != NULL && mysql_num_fields (res) > 0) {
+		status = row[0] != NULL;
+		if (status)
+			snprintf (buf, size, "%s", row[0]);
+	}
+	mysql_free_result (res);
+	return status;
+}
+
+
+/*
+** Make the replica wait until it has applied the last write seen by the
+** router.  Return 1 if it did within the timeout, 0 if not.
+*/
+static int router_sync (router_data *r, router_replica *rep) {
+	sqlbuf sql = {NULL, 0, 0, 0};
+	char value[32];
+	int ok;
+	if (!r->read_your_writes || r->gtid == NULL)
+		return 1;
+	if (rep->synced != NULL && strcmp (rep->synced, r->gtid) == 0)
+		return 1;
+	snprintf (value, sizeof(value), ", %.3f)", r->gtid_timeout);
+	sqlbuf_addstr (&sql, "SELECT WAIT_FOR_EXECUTED_GTID_SET(");
+	sqlbuf_addquoted (&sql, rep->connp->my_conn, r->gtid, strlen (r->gtid));
+	sqlbuf_addstr (&sql, value);
+	ok = !sql.oom && conn_queryvalue (rep->connp, sql.data, sql.len, value, sizeof(value)) == 1 &&
+		strcmp (value, "0") == 0;
+	free (sql.data);
+	if (ok) {
+		free (rep->synced);
+		rep->synced = strdup (r->gtid);
+	}
+	return ok;
+}
+
+
+/*
+** Ask the primary to report the GTIDs of its own commits, again after
+** every reconnect.
+*/
+static void router_track (router_data *r) {
+	static const char sql[] = "SET SESSION session_track_gtids = OWN_GTID";
+	if (!r->read_your_writes || r->primaryp->closed || (r->track_epoch == r->primaryp->epoch + 1))
+		return;
+	r->tracking = mysql_real_query (r->primaryp->my_conn, sql, sizeof(sql) - 1) == 0;
+	r->track_epoch = r->primaryp->epoch + 1;
+}
+
+
+/*
+** Remember the GTIDs of what the primary just committed.  Without
+** session tracking, the whole executed set is read instead.
+*/
+static void router_wrote (router_data *r) {
+	const char *data;
+	size_t len;
+	char *gtid = NULL;
+	if (!r->read_your_writes || r->primaryp->closed || conn_intrans (r->primaryp))
+		return;
+	if (r->tracking) {
+		if (mysql_session_track_get_first (r->primaryp->my_conn, SESSION_TRACK_GTIDS, &data, &len) == 0 &&
+			(gtid = (char *)malloc (len + 1)) != NULL) {
+			memcpy (gtid, data, len);
+			gtid[len] = '\0';
+		}
+	}
+	else {
+		static const char sql[] = "SELECT @@GLOBAL.gtid_executed";
+		MYSQL_RES *res;
+		MYSQL_ROW row;
+		if (mysql_real_query (r->primaryp->my_conn, sql, sizeof(sql) - 1) == 0 &&
+			(res = mysql_store_result (r->primaryp->my_conn)) != NULL) {
+			if ((row = mysql_fetch_row (res)) != NULL && row[0] != NULL)
+				gtid = strdup (row[0]);
+			mysql_free_result (res);
+		}
+	}
+	if (gtid != NULL) {
+		free (r->gtid);
+		r->gtid = gtid;
+	}
+}
+
+
+/*
+** Replace argument 1 by the connection to run the call on: a replica
+** for reads outside a transaction, the primary for everything else.
+** Return whether the primary was chosen.
+*/
+static int router_route (lua_State *L, router_data *r, int read) {
+	int i;
+	if (read && !conn_intrans (r->primaryp) && (i = router_pick (r)) >= 0 &&
+		router_sync (r, &r->replicas[i])) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, r->replicas[i].conn);
+		lua_replace (L, 1);
+		return 0;
+	}
+	router_track (r);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, r->primary);
+	lua_replace (L, 1);
+	return 1;
+}
+
+
+static int router_execute (lua_State *L) {
+	router_data *r = getrouter (L);
+	size_t len;
+	const char *sql = luaL_checklstring (L, 2, &len);
+	int read = sql_is_read (sql, len) && !sql_locks_rows (sql, len);
+	int primary = router_route (L, r, read);
+	int n = conn_execute (L);
+	if (primary && !read && !lua_isnil (L, -n))
+		router_wrote (r);
+	return n;
+}
+
+
+static int router_prepare (lua_State *L) {
+	router_data *r = getrouter (L);
+	size_t len;
+	const char *sql = luaL_checklstring (L, 2, &len);
+	router_route (L, r, sql_is_read (sql, len) && !sql_locks_rows (sql, len));
+	return conn_prepare (L);
+}
+
+
+static int router_commit (lua_State *L) {
+	router_data *r = getrouter (L);
+	int n;
+	router_route (L, r, 0);
+	n = conn_commit (L);
+	if (lua_toboolean (L, -n))
+		router_wrote (r);
+	return n;
+}
+
+
+static int router_rollback (lua_State *L) {
+	router_route (L, getrouter (L), 0);
+	return conn_rollback (L);
+}
+
+
+static int router_setautocommit (lua_State *L) {
+	router_route (L, getrouter (L), 0);
+	return conn_setautocommit (L);
+}
+
+
+static int router_getlastautoid (lua_State *L) {
+	router_route (L, getrouter (L), 0);
+	return conn_getlastautoid (L);
+}
+
+
+/*
+** Return the primary connection, or replica i.
+*/
+static int router_conn (lua_State *L) {
+	router_data *r = getrouter (L);
+	lua_Integer i = luaL_optinteger (L, 2, 0);
+	luaL_argcheck (L, i >= 0 && i <= r->nreplicas, 2, "no such replica");
+	lua_rawgeti (L, LUA_REGISTRYINDEX, i == 0 ? r->primary : r->replicas[i-1].conn);
+	return 1;
+}
+
+
+/*
+** Read how many seconds the replica is behind its source.  Return the
+** lag, 0 for a server that replicates from nothing, or -1 when
+** replication is stopped or the query failed.
+*/
+static long long replica_lag (conn_data *conn) {
+	static const char *const queries[] = {"SHOW REPLICA STATUS", "SHOW SLAVE STATUS", NULL};
+	static const char *const columns[] = {"Seconds_Behind_Source", "Seconds_Behind_Master"};
+	MYSQL_RES *res = NULL;
+	MYSQL_ROW row;
+	MYSQL_FIELD *fields;
+	long long lag = -1;
+	int q, i, n;
+	if (conn->pending != NULL)
+		stmt_cur_drain (conn->pending);
+	for (q = 0; queries[q] != NULL && res == NULL; q++)
+		if (mysql_query (conn->my_conn, queries[q]) == 0)
+			res = mysql_store_result (conn->my_conn);
+	if (res == NULL)
+		return -1;
+	if ((row = mysql_fetch_row (res)) == NULL)
+		lag = 0;
+	else {
+		fields = mysql_fetch_fields (res);
+		n = (int)mysql_num_fields (res);
+		for (i = 0; i < n; i++)
+			if (strcmp (fields[i].name, columns[0]) == 0 || strcmp (fields[i].name, columns[1]) == 0) {
+				lag = row[i] != NULL ? atoll (row[i]) : -1;
+				break;
+			}
+	}
+	mysql_free_result (res);
+	return lag;
+}
+
+
+/*
+** Ping every replica and eject those that are down or lag more than
+** max_lag seconds; bring back those that recovered.  Return a table
+** with field primary set to the primary's ping result and, for each
+** replica, a table with fields healthy and lag.
+*/
+static int router_check (lua_State *L) {
+	router_data *r = getrouter (L);
+	int i;
+	lua_createtable (L, r->nreplicas, 1);
+	lua_pushcfunction (L, conn_ping);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, r->primary);
+	if (lua_pcall (L, 1, 1, 0) != LUA_OK) {
+		lua_pop (L, 1);
+		lua_pushboolean (L, 0);
+	}
+	lua_setfield (L, -2, "primary");
+	for (i = 0; i < r->nreplicas; i++) {
+		router_replica *rep = &r->replicas[i];
+		int alive;
+		lua_pushcfunction (L, conn_ping);
+		lua_rawgeti (L, LUA_REGISTRYINDEX, rep->conn);
+		alive = lua_pcall (L, 1, 1, 0) == LUA_OK && lua_toboolean (L, -1);
+		lua_pop (L, 1);
+		if (rep->connp->streaming) /* busy: keep what is known */
+			alive = rep->healthy;
+		else if (alive) {
+			rep->lag = replica_lag (rep->connp);
+			rep->healthy = rep->lag >= 0 && rep->lag <= r->max_lag;
+		}
+		else {
+			rep->lag = -1;
+			rep->healthy = 0;
+		}
+		if (!alive) {
+			free (rep->synced); /* a reconnected replica proves nothing */
+			rep->synced = NULL;
+		}
+		lua_createtable (L, 0, 2);
+		lua_pushboolean (L, rep->healthy);
+		lua_setfield (L, -2, "healthy");
+		lua_pushinteger (L, (lua_Integer)rep->lag);
+		lua_setfield (L, -2, "lag");
+		lua_rawseti (L, -2, i + 1);
+	}
+	return 1;
+}
+
+
+/*
+** Release the connections of a router; they stay open.
+*/
+static void router_release (lua_State *L, router_data *r) {
+	int i;
+	if (r->closed)
+		return;
+	r->closed = 1;
+	luaL_unref (L, LUA_REGISTRYINDEX, r->primary);
+	for (i = 0; i < r->nreplicas; i++) {
+		luaL_unref (L, LUA_REGISTRYINDEX, r->replicas[i].conn);
+		free (r->replicas[i].synced);
+	}
+	free (r->replicas);
+	free (r->gtid);
+	r->replicas = NULL;
+	r->gtid = NULL;
+	r->nreplicas = 0;
+}
+
+
+static int router_gc (lua_State *L) {
+	router_data *r = (router_data *)luaL_checkudata (L, 1, LUASQL_ROUTER_MYSQL);
+	if (r != NULL)
+		router_release (L, r);
+	return 0;
+}
+
+
+static int router_close (lua_State *L) {
+	router_data *r = (router_data *)luaL_checkudata (L, 1, LUASQL_ROUTER_MYSQL);
+	luaL_argcheck (L, r != NULL, 1, LUASQL_PREFIX"router expected");
+	if (r->closed) {
+		lua_pushboolean (L, 0);
+		lua_pushstring (L, "router is already closed");
+		return 2;
+	}
+	router_release (L, r);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Create a router over a primary connection and a list of replica
+** connections.  Options: read_your_writes, gtid_timeout (seconds) and
+** max_lag (seconds).
+*/
+static int env_router (lua_State *L) {
+	conn_data *primary;
+	router_data *r;
+	int n, i;
+	getenvironment (L);
+	primary = (conn_data *)luaL_checkudata (L, 2, LUASQL_CONNECTION_MYSQL);
+	luaL_argcheck (L, !primary->closed, 2, "connection is closed");
+	luaL_checktype (L, 3, LUA_TTABLE);
+	if (!lua_isnoneornil (L, 4))
+		luaL_checktype (L, 4, LUA_TTABLE);
+	n = (int)luaL_len (L, 3);
+	for (i = 1; i <= n; i++) {
+		conn_data *c;
+		lua_rawgeti (L, 3, i);
+		c = (conn_data *)luaL_testudata (L, -1, LUASQL_CONNECTION_MYSQL);
+		luaL_argcheck (L, c != NULL && !c->closed, 3, "replicas must be open connections");
+		lua_pop (L, 1);
+	}
+
+	r = (router_data *)LUASQL_NEWUD (L, sizeof(router_data));
+	memset (r, 0, sizeof(router_data));
+	r->closed = 1;  /* until every field is set */
+	luasql_setmeta (L, LUASQL_ROUTER_MYSQL);
+	r->read_your_writes = (short)opt_boolean (L, 4, "read_your_writes", 0);
+	r->gtid_timeout = (double)opt_number (L, 4, "gtid_timeout", 1);
+	luaL_argcheck (L, r->gtid_timeout >= 0 && r->gtid_timeout <= 86400, 4, "invalid gtid_timeout");
+	r->max_lag = (long long)opt_integer (L, 4, "max_lag", 30);
+	if (n > 0 && (r->replicas = (router_replica *)calloc (n, sizeof(router_replica))) == NULL)
+		return luaL_error (L, LUASQL_PREFIX"could not allocate router");
+	lua_pushvalue (L, 2);
+	r->primary = luaL_ref (L, LUA_REGISTRYINDEX);
+	r->primaryp = primary;
+	for (i = 0; i < n; i++) {
+		router_replica *rep = &r->replicas[i];
+		lua_rawgeti (L, 3, i + 1);
+		rep->connp = (conn_data *)lua_touserdata (L, -1);
+		rep->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+		rep->healthy = 1;
+		rep->lag = -1;
+	}
+	r->nreplicas = n;
+	r->closed = 0;
+	return 1;
+}
+
+
+/*
+** Scan worker: read one key range page by page, each page continuing
+** after the last key of the previous one.
+*/
+static void *scan_worker (void *arg) {
+	scan_part *part = (scan_part *)arg;
+	scan_data *scan = part->scan;
+	readahead_data *ra = &part->ra;
+	long long last = 0;
+	int first = 1;
+	mysql_thread_init ();
+	ra->my_conn = params_connect (&scan->params, ra->errmsg, sizeof(ra->errmsg));
+	if (ra->my_conn == NULL)
+		ra->my_errno = CR_UNKNOWN_ERROR;
+	while (ra->my_conn != NULL) {
+		row_batch *lastb = NULL;
+		long rows;
+		char *sql = sql_format ("SELECT _s.%s, %s FROM %s AS _s WHERE (%s) AND _s.%s %s %lld"
+			" AND _s.%s <= %lld ORDER BY _s.%s LIMIT %d",
+			scan->key, scan->columns, scan->table, scan->where,
+			scan->key, first ? ">=" : ">", first ? part->lo : last,
+			scan->key, part->hi, scan->key, scan->pagesize);
+		if (sql == NULL) {
+			ra->my_errno = CR_OUT_OF_MEMORY;
+			strcpy (ra->errmsg, "out of memory");
+			break;
+		}
+		if (mysql_real_query (ra->my_conn, sql, strlen (sql)) ||
+			(ra->res = mysql_use_result (ra->my_conn)) == NULL) {
+			ra->my_errno = mysql_errno (ra->my_conn);
+			strncpy (ra->errmsg, mysql_error (ra->my_conn), sizeof(ra->errmsg) - 1);
+			free (sql);
+			break;
+		}
+		free (sql);
+		rows = ra_pump (ra, &lastb);
+		mysql_free_result (ra->res);
+		ra->res = NULL;
+		if (ra->my_errno || atomic_load (&ra->cancel) || rows < scan->pagesize || lastb == NULL)
+			break;
+		/* the key is the first column of every row */
+		last = strtoll (lastb->cells[(lastb->nrows - 1) * ra->numcols], NULL, 10);
+		first = 0;
+	}
+	ra_finish (ra);
+	if (ra->my_conn != NULL)
+		mysql_close (ra->my_conn);
+	mysql_thread_end ();
+	return NULL;
+}
+
+
+static int scan_can_consume (void *arg) {
+	scan_data *scan = (scan_data *)arg;
+	int i;
+	for (i = 0; i < scan->nparts; i++)
+		if (!scan->parts[i].eof && ra_can_consume (&scan->parts[i].ra))
+			return 1;
+	return 0;
+}
+
+
+/*
+** Get the next row of a scan, in key order or from whichever partition
+** has one ready.  Return 1, 0 at the end or -1 on error.
+*/
+static int scan_nextrow (scan_data *scan, MYSQL_ROW *row, unsigned long **lengths, char *errmsg, size_t errlen) {
+	for (;;) {
+		int i, pending = 0;
+		for (i = 0; i < scan->nparts; i++) {
+			int k = (scan->current + i) % scan->nparts;
+			scan_part *part = &scan->parts[k];
+			int status;
+			if (part->eof)
+				continue;
+			status = ra_nextrow (&part->ra, row, lengths, scan->ordered);
+			if (status == 1) {
+				scan->current = k;
+				return 1;
+			}
+			if (status == 0) {
+				part->eof = 1;
+				continue;
+			}
+			if (status == -1) {
+				strncpy (errmsg, part->ra.errmsg, errlen - 1);
+				return -1;
+			}
+			pending = 1; /* RA_EMPTY */
+		}
+		if (!pending)
+			return 0;
+		sig_wait (&scan->sig, scan_can_consume, scan);
+	}
+}
+
+
+/*
+** Stop every partition and release the scan.
+*/
+static void scan_nullify (lua_State *L, scan_data *scan) {
+	int i;
+	scan->closed = 1;
+	for (i = 0; i < scan->nparts; i++)
+		atomic_store (&scan->parts[i].ra.cancel, 1);
+	sig_notify (&scan->sig);
+	for (i = 0; i < scan->nparts; i++) {
+		if (scan->parts[i].started)
+			pthread_join (scan->parts[i].ra.thread, NULL);
+		ra_release (&scan->parts[i].ra);
+	}
+	free (scan->parts);
+	sig_destroy (&scan->sig);
+	free (scan->table);
+	free (scan->key);
+	free (scan->columns);
+	free (scan->where);
+	params_free (&scan->params);
+	luaL_unref (L, LUA_REGISTRYINDEX, scan->colnames);
+	luaL_unref (L, LUA_REGISTRYINDEX, scan->env);
+	scan->env = LUA_NOREF;
+}
+
+
+/*
+** Iterator: return the next row of the scan as a table, or nil.
+*/
+static int scan_call (lua_State *L) {
+	scan_data *scan = (scan_data *)luaL_checkudata (L, 1, LUASQL_SCAN_MYSQL);
+	MYSQL_ROW row;
+	unsigned long *lengths;
+	char errmsg[256] = "";
+	int i, status;
+	luaL_argcheck (L, !scan->closed, 1, "scan is closed");
+	status = scan_nextrow (scan, &row, &lengths, errmsg, sizeof(errmsg));
+	if (status <= 0) {
+		scan_nullify (L, scan);
+		if (status < 0)
+			return luaL_error (L, LUASQL_PREFIX"error scanning table. MySQL: %s", errmsg);
+		lua_pushnil (L);
+		return 1;
+	}
+	lua_createtable (L, scan->named ? 0 : scan->numcols, scan->named ? scan->numcols : 0);
+	if (scan->named)
+		lua_rawgeti (L, LUA_REGISTRYINDEX, scan->colnames);
+	for (i = 0; i < scan->numcols; i++) {
+		/* skip the key column the workers page on */
+		if (scan->named) {
+			lua_rawgeti (L, -1, i+1);
+			pushvalue (L, row[i+1], lengths[i+1]);
+			lua_rawset (L, -4);
+		}
+		else {
+			pushvalue (L, row[i+1], lengths[i+1]);
+			lua_rawseti (L, -2, i+1);
+		}
+	}
+	if (scan->named)
+		lua_pop (L, 1);
+	return 1;
+}
+
+
+static int scan_gc (lua_State *L) {
+	scan_data *scan = (scan_data *)luaL_checkudata (L, 1, LUASQL_SCAN_MYSQL);
+	if (scan != NULL && !scan->closed)
+		scan_nullify (L, scan);
+	return 0;
+}
+
+
+static int scan_close (lua_State *L) {
+	scan_data *scan = (scan_data *)luaL_checkudata (L, 1, LUASQL_SCAN_MYSQL);
+	if (scan->closed) {
+		lua_pushboolean (L, 0);
+		lua_pushstring (L, "scan is already closed");
+		return 2;
+	}
+	scan_nullify (L, scan);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Run a small buffered query on the template connection.
+*/
+static MYSQL_RES *scan_query (MYSQL *my_conn, const char *sql) {
+	if (sql == NULL || mysql_real_query (my_conn, sql, strlen (sql)))
+		return NULL;
+	return mysql_store_result (my_conn);
+}
+
+
+/*
+** Parallel scan of a whole table over an integer key.
+**     env:scan(table, {connection=conn, key="id", partitions=N,
+**                      where=sql, columns=sql, ordered=bool,
+**                      pagesize=rows, readahead=batches,
+**                      batchrows=rows, mode="n"|"a"})
+** The key range MIN..MAX is split into N ranges, each read with keyset
+** pagination on a new connection opened with the parameters of conn.
+** Return an iterator object that yields one table per row.
+*/
+static int env_scan (lua_State *L) {
+	const char *table = luaL_checkstring (L, 2);
+	const char *key, *where, *columns, *mode;
+	int nparts, pagesize, depth, batchrows, ordered, numcols, i;
+	long long lo = 0, hi = 0;
+	unsigned long long span, step, rem;
+	conn_data *conn;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	MYSQL_FIELD *fields;
+	scan_data *scan;
+	char *sql, *end;
+	getenvironment (L);
+	luaL_checktype (L, 3, LUA_TTABLE);
+	lua_getfield (L, 3, "connection");
+	conn = (conn_data *)luaL_testudata (L, -1, LUASQL_CONNECTION_MYSQL);
+	luaL_argcheck (L, conn != NULL && !conn->closed, 3, "option 'connection' must be an open connection");
+	luaL_argcheck (L, !conn->streaming, 3, "connection is busy with an unbuffered cursor");
+	lua_pop (L, 1);
+	key = opt_string (L, 3, "key", NULL);
+	luaL_argcheck (L, key != NULL, 3, "option 'key' is required");
+	where = opt_string (L, 3, "where", "TRUE");
+	columns = opt_string (L, 3, "columns", "_s.*");
+	mode = opt_string (L, 3, "mode", "n");
+	ordered = opt_boolean (L, 3, "ordered", 0);
+	nparts = (int)opt_integer (L, 3, "partitions", 4);
+	pagesize = (int)opt_integer (L, 3, "pagesize", 10000);
+	depth = (int)opt_integer (L, 3, "readahead", 4);
+	batchrows = (int)opt_integer (L, 3, "batchrows", 256);
+	luaL_argcheck (L, nparts > 0 && pagesize > 0 && depth > 0 && batchrows > 0, 3, "invalid scan options");
+
+	/* key range */
+	sql = sql_format ("SELECT MIN(_s.%s), MAX(_s.%s) FROM %s AS _s WHERE (%s)", key, key, table, where);
+	res = scan_query (conn->my_conn, sql);
+	free (sql);
+	if (res == NULL)
+		return luasql_failmsg (L, "error reading key range. MySQL: ", mysql_error (conn->my_conn));
+	row = mysql_fetch_row (res);
+	if (row == NULL || row[0] == NULL || row[1] == NULL) {
+		nparts = 0; /* empty table */
+	}
+	else {
+		lo = strtoll (row[0], &end, 10);
+		if (*end == '\0')
+			hi = strtoll (row[1], &end, 10);
+		if (*end != '\0') {
+			mysql_free_result (res);
+			return luasql_faildirect (L, "scan key must be an integer column");
+		}
+	}
+	mysql_free_result (res);
+
+	/* column names */
+	sql = sql_format ("SELECT _s.%s, %s FROM %s AS _s LIMIT 0", key, columns, table);
+	res = scan_query (conn->my_conn, sql);
+	free (sql);
+	if (res == NULL)
+		return luasql_failmsg (L, "error reading columns. MySQL: ", mysql_error (conn->my_conn));
+	numcols = mysql_num_fields (res) - 1;
+	fields = mysql_fetch_fields (res);
+	lua_newtable (L);
+	for (i = 0; i < numcols; i++) {
+		lua_pushstring (L, fields[i+1].name);
+		lua_rawseti (L, -2, i+1);
+	}
+	mysql_free_result (res);
+
+	span = (unsigned long long)hi - (unsigned long long)lo + 1;
+	if (nparts > 0 && span != 0 && span < (unsigned long long)nparts)
+		nparts = (int)span;
+
+	scan = (scan_data *)LUASQL_NEWUD (L, sizeof(scan_data));
+	memset (scan, 0, sizeof(scan_data));
+	scan->closed = 1; /* until every field is set */
+	luasql_setmeta (L, LUASQL_SCAN_MYSQL);
+	lua_insert (L, -2);
+	scan->colnames = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_pushvalue (L, 1);
+	scan->env = luaL_ref (L, LUA_REGISTRYINDEX);
+	scan->numcols = numcols;
+	scan->ordered = ordered;
+	scan->named = strchr (mode, 'a') != NULL;
+	scan->pagesize = pagesize;
+	sig_init (&scan->sig);
+	scan->table = strdup (table);
+	scan->key = strdup (key);
+	scan->columns = strdup (columns);
+	scan->where = strdup (where);
+	scan->parts = (scan_part *)calloc (nparts > 0 ? nparts : 1, sizeof(scan_part));
+	if (scan->table == NULL || scan->key == NULL || scan->columns == NULL ||
+		scan->where == NULL || scan->parts == NULL ||
+		params_copy (&scan->params, &conn->params) != 0) {
+		scan_nullify (L, scan);
+		return luaL_error (L, LUASQL_PREFIX"could not allocate scan");
+	}
+	scan->closed = 0;
+	if (nparts == 0) /* nothing to read: the first call ends the scan */
+		return 1;
+
+	/* split lo..hi into nparts ranges and start one reader per range */
+	step = span == 0 ? ~0ULL / nparts : span / nparts;
+	rem = span == 0 ? 0 : span % nparts;
+	for (i = 0; i < nparts; i++) {
+		scan_part *part = &scan->parts[i];
+		unsigned long long size = step + ((unsigned long long)i < rem);
+		part->scan = scan;
+		part->lo = i == 0 ? lo : scan->parts[i-1].hi + 1;
+		part->hi = i == nparts - 1 ? hi : (long long)((unsigned long long)part->lo + size - 1);
+		if (ra_init (&part->ra, NULL, NULL, numcols + 1, depth, batchrows, &scan->sig) != 0) {
+			scan->nparts = i;
+			scan_nullify (L, scan);
+			return luaL_error (L, LUASQL_PREFIX"could not allocate scan");
+		}
+		scan->nparts = i + 1;
+		if (pthread_create (&part->ra.thread, NULL, scan_worker, part) == 0)
+			part->started = 1;
+		else {
+			part->ra.my_errno = CR_UNKNOWN_ERROR;
+			strcpy (part->ra.errmsg, "could not start scan worker");
+			ra_finish (&part->ra);
+		}
+	}
+	return 1;
+}
+
+
+#ifdef LUASQL_BINLOG
+/*
+** Binary log event types, and the size of the common event header.
+*/
+#define BINLOG_QUERY          2
+#define BINLOG_ROTATE         4
+#define BINLOG_FORMAT         15
+#define BINLOG_XID            16
+#define BINLOG_TABLE_MAP      19
+#define BINLOG_WRITE_ROWS_V1  23
+#define BINLOG_UPDATE_ROWS_V1 24
+#define BINLOG_DELETE_ROWS_V1 25
+#define BINLOG_HEARTBEAT      27
+#define BINLOG_WRITE_ROWS     30
+#define BINLOG_UPDATE_ROWS    31
+#define BINLOG_DELETE_ROWS    32
+#define BINLOG_GTID           33
+#define BINLOG_ANONYMOUS_GTID 34
+#define BINLOG_PARTIAL_UPDATE 39
+#define BINLOG_PAYLOAD        40
+#define BINLOG_HEARTBEAT_V2   41
+#define BINLOG_HEADER         19
+
+/* what an event means to the batch being collected */
+#define BINLOG_NEXT   0
+#define BINLOG_COMMIT 1
+#define BINLOG_IDLE   2
+
+#define BINLOG_MAXTABLES 1024  /* table maps kept before starting over */
+
+
+static uint64_t binlog_le (const unsigned char *p, int n) {
+	uint64_t v = 0;
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+static uint64_t binlog_be (const unsigned char *p, int n) {
+	uint64_t v = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+
+/*
+** Read a length-encoded integer.  Return the position after it, or
+** NULL if it runs past end.
+*/
+static const unsigned char *binlog_packed (const unsigned char *p, const unsigned char *end, uint64_t *v) {
+	int n;
+	if (p >= end)
+		return NULL;
+	n = *p < 251 ? 0 : *p == 252 ? 2 : *p == 253 ? 3 : *p == 254 ? 8 : -1;
+	if (n < 0 || end - p < n + 1)
+		return NULL;
+	*v = n == 0 ? *p : binlog_le (p + 1, n);
+	return p + n + 1;
+}
+
+
+/*
+** GTID sets.  The text form is uuid:1-5:7,uuid:1-3; the binary form sent
+** with COM_BINLOG_DUMP_GTID counts sources and intervals in 8 bytes and
+** stores each interval as its first and one past its last number.
+*/
+static void gtid_free (gtid_set *s) {
+	int i;
+	for (i = 0; i < s->n; i++)
+		free (s->sources[i].iv);
+	free (s->sources);
+	s->sources = NULL;
+	s->n = s->size = 0;
+}
+
+static gtid_source *gtid_getsource (gtid_set *s, const unsigned char *uuid) {
+	gtid_source *src;
+	int i;
+	for (i = 0; i < s->n; i++)
+		if (memcmp (s->sources[i].uuid, uuid, 16) == 0)
+			return &s->sources[i];
+	if (s->n == s->size) {
+		int size = s->size ? s->size * 2 : 4;
+		gtid_source *sources = (gtid_source *)realloc (s->sources, size * sizeof(gtid_source));
+		if (sources == NULL)
+			return NULL;
+		s->sources = sources;
+		s->size = size;
+	}
+	src = &s->sources[s->n++];
+	memcpy (src->uuid, uuid, 16);
+	src->n = src->size = 0;
+	src->iv = NULL;
+	return src;
+}
+
+
+/*
+** Add the transactions start..end-1 of a source, merging intervals.
+** Return 0, or -1 if out of memory.
+*/
+static int gtid_add (gtid_set *s, const unsigned char *uuid, int64_t start, int64_t end) {
+	gtid_source *src = gtid_getsource (s, uuid);
+	int i = 0, j;
+	if (src == NULL)
+		return -1;
+	while (i < src->n && src->iv[2*i+1] < start)
+		i++;
+	for (j = i; j < src->n && src->iv[2*j] <= end; j++) {
+		if (src->iv[2*j] < start)
+			start = src->iv[2*j];
+		if (src->iv[2*j+1] > end)
+			end = src->iv[2*j+1];
+	}
+	if (j == i) {
+		if (src->n == src->size) {
+			int size = src->size ? src->size * 2 : 4;
+			int64_t *iv = (int64_t *)realloc (src->iv, size * 2 * sizeof(int64_t));
+			if (iv == NULL)
+				return -1;
+			src->iv = iv;
+			src->size = size;
+		}
+		memmove (&src->iv[2*i+2], &src->iv[2*i], (src->n - i) * 2 * sizeof(int64_t));
+		src->n++;
+	}
+	else {
+		memmove (&src->iv[2*i+2], &src->iv[2*j], (src->n - j) * 2 * sizeof(int64_t));
+		src->n -= j - i - 1;
+	}
+	src->iv[2*i] = start;
+	src->iv[2*i+1] = end;
+	return 0;
+}
+
+
+/*
+** Parse the text form of a GTID set.  Return 0, or -1 if it is invalid
+** (tagged GTIDs included) or memory runs out.
+*/
+static int gtid_parse (gtid_set *s, const char *p) {
+	while (*p != '\0') {
+		unsigned char uuid[16];
+		int digits = 0;
+		while (isspace ((unsigned char)*p) || *p == ',')
+			p++;
+		if (*p == '\0')
+			break;
+		memset (uuid, 0, sizeof(uuid));
+		for (; *p != '\0' && *p != ':'; p++) {
+			int d;
+			if (*p == '-')
+				continue;
+			if (!isxdigit ((unsigned char)*p) || digits == 32)
+				return -1;
+			d = isdigit ((unsigned char)*p) ? *p - '0' : (tolower ((unsigned char)*p) - 'a' + 10);
+			uuid[digits / 2] |= (unsigned char)(digits % 2 ? d : d << 4);
+			digits++;
+		}
+		if (digits != 32 || *p != ':')
+			return -1;
+		while (*p == ':') {
+			char *end;
+			long long a, b;
+			a = strtoll (p + 1, &end, 10);
+			if (end == p + 1 || a <= 0)
+				return -1;
+			b = a;
+			if (*end == '-') {
+				p = end;
+				b = strtoll (p + 1, &end, 10);
+				if (end == p + 1 || b < a)
+					return -1;
+			}
+			if (gtid_add (s, uuid, a, b + 1) != 0)
+				return -1;
+			p = end;
+		}
+		while (isspace ((unsigned char)*p))
+			p++;
+		if (*p != ',' && *p != '\0')
+			return -1;
+	}
+	return 0;
+}
+
+
+static void gtid_adduuid (sqlbuf *b, const unsigned char *uuid) {
+	static const char hex[] = "0123456789abcdef";
+	char text[36];
+	int i, k = 0;
+	for (i = 0; i < 16; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			text[k++] = '-';
+		text[k++] = hex[uuid[i] >> 4];
+		text[k++] = hex[uuid[i] & 0xF];
+	}
+	sqlbuf_add (b, text, sizeof(text));
+}
+
+static void gtid_format (const gtid_set *s, sqlbuf *b) {
+	char num[48];
+	int i, k;
+	for (i = 0; i < s->n; i++) {
+		const gtid_source *src = &s->sources[i];
+		if (src->n == 0)
+			continue;
+		if (b->len > 0)
+			sqlbuf_add (b, ",", 1);
+		gtid_adduuid (b, src->uuid);
+		for (k = 0; k < src->n; k++) {
+			int64_t a = src->iv[2*k], e = src->iv[2*k+1] - 1;
+			if (a == e)
+				snprintf (num, sizeof(num), ":%lld", (long long)a);
+			else
+				snprintf (num, sizeof(num), ":%lld-%lld", (long long)a, (long long)e);
+			sqlbuf_addstr (b, num);
+		}
+	}
+}
+
+static size_t gtid_encodedsize (const gtid_set *s) {
+	size_t size = 8;
+	int i;
+	for (i = 0; i < s->n; i++)
+		size += 16 + 8 + (size_t)s->sources[i].n * 16;
+	return size;
+}
+
+static void gtid_put8 (unsigned char **p, uint64_t v) {
+	int i;
+	for (i = 0; i < 8; i++)
+		*(*p)++ = (unsigned char)(v >> (8 * i));
+}
+
+static void binlog_encodegtids (MYSQL_RPL *rpl, unsigned char *p) {
+	const gtid_set *s = (const gtid_set *)rpl->gtid_set_arg;
+	int i, k;
+	gtid_put8 (&p, (uint64_t)s->n);
+	for (i = 0; i < s->n; i++) {
+		const gtid_source *src = &s->sources[i];
+		memcpy (p, src->uuid, 16);
+		p += 16;
+		gtid_put8 (&p, (uint64_t)src->n);
+		for (k = 0; k < 2 * src->n; k++)
+			gtid_put8 (&p, (uint64_t)src->iv[k]);
+	}
+}
+
+
+/*
+** Unpack the packed integer forms the server uses for DATETIME and TIME
+** values: the date and time fields above 24 bits of microseconds.
+*/
+static void binlog_datetime (int64_t packed, MYSQL_TIME *t) {
+	int64_t ymdhms = packed / (1LL << 24), ymd = ymdhms >> 17, ym = ymd >> 5;
+	int64_t hms = ymdhms % (1 << 17);
+	memset (t, 0, sizeof(MYSQL_TIME));
+	t->second_part = (unsigned long)(packed % (1LL << 24));
+	t->year = (unsigned int)(ym / 13);
+	t->month = (unsigned int)(ym % 13);
+	t->day = (unsigned int)(ymd % 32);
+	t->hour = (unsigned int)(hms >> 12);
+	t->minute = (unsigned int)((hms >> 6) % 64);
+	t->second = (unsigned int)(hms % 64);
+	t->time_type = MYSQL_TIMESTAMP_DATETIME;
+}
+
+static void binlog_time (int64_t packed, MYSQL_TIME *t) {
+	int64_t hms;
+	memset (t, 0, sizeof(MYSQL_TIME));
+	if (packed < 0) {
+		t->neg = 1;
+		packed = -packed;
+	}
+	hms = packed >> 24;
+	t->second_part = (unsigned long)(packed % (1LL << 24));
+	t->hour = (unsigned int)((hms >> 12) % (1 << 10));
+	t->minute = (unsigned int)((hms >> 6) % 64);
+	t->second = (unsigned int)(hms % 64);
+	t->time_type = MYSQL_TIMESTAMP_TIME;
+}
+
+
+/*
+** Write a DECIMAL in the server's binary format as text.  Return the
+** bytes it takes, or -1 if it runs past end or is too wide.
+*/
+static int binlog_decimal (const unsigned char *p, const unsigned char *end, int precision, int scale, char *out, size_t size) {
+	static const int dig2bytes[10] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4};
+	unsigned char d[40];
+	int intg = precision - scale, n, i, k = 0, len = 0, started = 0;
+	int intg0 = intg / 9, intg0x = intg % 9, frac0 = scale / 9, frac0x = scale % 9;
+	if (intg < 0 || precision > 65)
+		return -1;
+	n = intg0 * 4 + dig2bytes[intg0x] + frac0 * 4 + dig2bytes[frac0x];
+	if (n == 0 || end - p < n)
+		return -1;
+	memcpy (d, p, n);
+	if (!(d[0] & 0x80)) {
+		for (i = 0; i < n; i++)
+			d[i] = (unsigned char)~d[i];
+		len += snprintf (out + len, size - len, "-");
+	}
+	d[0] ^= 0x80;
+	if (intg0x > 0) {
+		unsigned long v = (unsigned long)binlog_be (d, dig2bytes[intg0x]);
+		k = dig2bytes[intg0x];
+		if (v != 0) {
+			len += snprintf (out + len, size - len, "%lu", v);
+			started = 1;
+		}
+	}
+	for (i = 0; i < intg0; i++, k += 4) {
+		unsigned long v = (unsigned long)binlog_be (d + k, 4);
+		if (started)
+			len += snprintf (out + len, size - len, "%09lu", v);
+		else if (v != 0) {
+			len += snprintf (out + len, size - len, "%lu", v);
+			started = 1;
+		}
+	}
+	if (!started)
+		len += snprintf (out + len, size - len, "0");
+	if (scale > 0) {
+		len += snprintf (out + len, size - len, ".");
+		for (i = 0; i < frac0; i++, k += 4)
+			len += snprintf (out + len, size - len, "%09lu", (unsigned long)binlog_be (d + k, 4));
+		if (frac0x > 0)
+			len += snprintf (out + len, size - len, "%0*lu", frac0x,
+				(unsigned long)binlog_be (d + k, dig2bytes[frac0x]));
+	}
+	return n;
+}
+
+
+/*
+** Read the variable-length size of a binary JSON string.
+*/
+static const unsigned char *binlog_jsonlen (const unsigned char *p, const unsigned char *end, uint64_t *len) {
+	int i;
+	*len = 0;
+	for (i = 0; i < 5; i++) {
+		if (p >= end)
+			return NULL;
+		*len |= (uint64_t)(*p & 0x7F) << (7 * i);
+		if ((*p++ & 0x80) == 0)
+			return (uint64_t)(end - p) >= *len ? p : NULL;
+	}
+	return NULL;
+}
+
+static int binlog_jsonvalue (sqlbuf *out, int type, const unsigned char *p, const unsigned char *end, int depth);
+
+/*
+** Write a binary JSON object or array, whose counts and offsets take
+** 2 bytes in the small format and 4 in the large one, as JSON text.
+*/
+static int binlog_jsoncontainer (sqlbuf *out, const unsigned char *obj, const unsigned char *end, int object, int large, int depth) {
+	int w = large ? 4 : 2;
+	size_t keyentry = object ? w + 2 : 0, valentry = 1 + w;
+	uint64_t count, size, i;
+	if (depth >= JSON_MAXDEPTH || end - obj < 2 * w)
+		return -1;
+	count = binlog_le (obj, w);
+	size = binlog_le (obj + w, w);
+	if (size > (uint64_t)(end - obj) || 2 * w + count * (keyentry + valentry) > size)
+		return -1;
+	end = obj + size;
+	json_put (out, object ? "{" : "[", 1);
+	for (i = 0; i < count; i++) {
+		const unsigned char *entry = obj + 2 * w + count * keyentry + i * valentry;
+		int type = entry[0];
+		if (i > 0)
+			json_put (out, ",", 1);
+		if (object) {
+			const unsigned char *key = obj + 2 * w + i * keyentry;
+			uint64_t off = binlog_le (key, w), len = binlog_le (key + w, 2);
+			if (off + len > size)
+				return -1;
+			json_putstring (out, (const char *)obj + off, (size_t)len);
+			json_put (out, ":", 1);
+		}
+		if (type == 0x04 || type == 0x05 || type == 0x06 || (large && (type == 0x07 || type == 0x08))) {
+			/* small scalars are stored in the entry itself */
+			if (binlog_jsonvalue (out, type, entry + 1, entry + 1 + w, depth + 1) != 0)
+				return -1;
+		}
+		else {
+			uint64_t off = binlog_le (entry + 1, w);
+			if (off >= size || binlog_jsonvalue (out, type, obj + off, end, depth + 1) != 0)
+				return -1;
+		}
+	}
+	json_put (out, object ? "}" : "]", 1);
+	return 0;
+}
+
+
+/*
+** Write one binary JSON value of the given type as JSON text.  Values
+** of other SQL types inside the document are written as strings, except
+** decimals.  Return 0, or -1 if the document is malformed.
+*/
+static int binlog_jsonvalue (sqlbuf *out, int type, const unsigned char *p, const unsigned char *end, int depth) {
+	char num[128];
+	uint64_t v, len;
+	double d;
+	int n;
+	MYSQL_TIME t;
+	switch (type) {
+		case 0x00: case 0x01: case 0x02: case 0x03:
+			return binlog_jsoncontainer (out, p, end, type <= 0x01, type & 1, depth);
+		case 0x04:
+			if (end - p < 1 || *p > 2)
+				return -1;
+			if (*p == 0)
+				json_put (out, "null", 4);
+			else if (*p == 1)
+				json_put (out, "true", 4);
+			else
+				json_put (out, "false", 5);
+			return 0;
+		case 0x05: case 0x06: case 0x07: case 0x08: case 0x09: case 0x0a:
+			n = type <= 0x06 ? 2 : type <= 0x08 ? 4 : 8;
+			if (end - p < n)
+				return -1;
+			v = binlog_le (p, n);
+			if (type == 0x05)
+				n = snprintf (num, sizeof(num), "%d", (int)(int16_t)v);
+			else if (type == 0x07)
+				n = snprintf (num, sizeof(num), "%ld", (long)(int32_t)v);
+			else if (type == 0x09)
+				n = snprintf (num, sizeof(num), "%lld", (long long)(int64_t)v);
+			else
+				n = snprintf (num, sizeof(num), "%llu", (unsigned long long)v);
+			json_put (out, num, n);
+			return 0;
+		case 0x0b:
+			if (end - p < 8)
+				return -1;
+			v = binlog_le (p, 8);
+			memcpy (&d, &v, sizeof(d));
+			json_put (out, num, snprintf (num, sizeof(num), "%.17g", d));
+			return 0;
+		case 0x0c:
+			if ((p = binlog_jsonlen (p, end, &len)) == NULL)
+				return -1;
+			json_putstring (out, (const char *)p, (size_t)len);
+			return 0;
+		case 0x0f:
+			if (end - p < 1)
+				return -1;
+			type = *p;
+			if ((p = binlog_jsonlen (p + 1, end, &len)) == NULL)
+				return -1;
+			if (type == MYSQL_TYPE_NEWDECIMAL && len >= 2 &&
+				binlog_decimal (p + 2, p + len, p[0], p[1], num, sizeof(num)) > 0) {
+				json_put (out, num, strlen (num));
+				return 0;
+			}
+			if (len == 8 && (type == MYSQL_TYPE_DATE || type == MYSQL_TYPE_DATETIME ||
+				type == MYSQL_TYPE_TIMESTAMP || type == MYSQL_TYPE_TIME)) {
+				if (type == MYSQL_TYPE_TIME)
+					binlog_time ((int64_t)binlog_le (p, 8), &t);
+				else
+					binlog_datetime ((int64_t)binlog_le (p, 8), &t);
+				if (type == MYSQL_TYPE_DATE)
+					t.time_type = MYSQL_TIMESTAMP_DATE;
+				json_putstring (out, num, temporal_format (&t, 7, num, sizeof(num)));
+				return 0;
+			}
+			json_putstring (out, (const char *)p, (size_t)len);
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+
+static int is_numeric_column (int type) {
+	switch (type) {
+		case MYSQL_TYPE_TINY: case MYSQL_TYPE_SHORT: case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG: case MYSQL_TYPE_LONGLONG: case MYSQL_TYPE_NEWDECIMAL:
+		case MYSQL_TYPE_FLOAT: case MYSQL_TYPE_DOUBLE:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+
+/*
+** Push the value of a column of a row image.  Return the bytes it
+** takes, or -1 if it runs past end or its type is not known.
+*/
+static int binlog_value (lua_State *L, binlog_data *b, int type, unsigned int meta, int unsig,
+		const unsigned char *p, const unsigned char *end) {
+	char buf[128];
+	MYSQL_TIME t;
+	uint64_t v;
+	int n, fsp;
+	size_t len;
+	if (type == MYSQL_TYPE_STRING && meta >= 256) {
+		/* CHAR, ENUM and SET share this type; the real one is in meta */
+		unsigned int byte0 = meta >> 8, byte1 = meta & 0xFF;
+		if ((byte0 & 0x30) != 0x30) {
+			meta = byte1 | (((byte0 & 0x30) ^ 0x30) << 4);
+			type = byte0 | 0x30;
+		}
+		else {
+			meta = byte1;
+			type = byte0;
+		}
+	}
+	memset (&t, 0, sizeof(t));
+	switch (type) {
+		case MYSQL_TYPE_TINY: case MYSQL_TYPE_SHORT: case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG: case MYSQL_TYPE_LONGLONG:
+			n = type == MYSQL_TYPE_TINY ? 1 : type == MYSQL_TYPE_SHORT ? 2 :
+				type == MYSQL_TYPE_INT24 ? 3 : type == MYSQL_TYPE_LONG ? 4 : 8;
+			if (end - p < n)
+				return -1;
+			v = binlog_le (p, n);
+			if (!unsig && n < 8 && (v >> (8 * n - 1)) & 1)
+				v |= ~0ULL << (8 * n);
+			if (unsig && n == 8 && v > (uint64_t)LUA_MAXINTEGER)
+				lua_pushlstring (L, buf, snprintf (buf, sizeof(buf), "%llu", (unsigned long long)v));
+			else
+				lua_pushinteger (L, (lua_Integer)(int64_t)v);
+			return n;
+		case MYSQL_TYPE_FLOAT: {
+			float f;
+			uint32_t u;
+			if (end - p < 4)
+				return -1;
+			u = (uint32_t)binlog_le (p, 4);
+			memcpy (&f, &u, sizeof(f));
+			lua_pushnumber (L, (lua_Number)f);
+			return 4;
+		}
+		case MYSQL_TYPE_DOUBLE: {
+			double d;
+			if (end - p < 8)
+				return -1;
+			v = binlog_le (p, 8);
+			memcpy (&d, &v, sizeof(d));
+			lua_pushnumber (L, (lua_Number)d);
+			return 8;
+		}
+		case MYSQL_TYPE_NEWDECIMAL:
+			n = binlog_decimal (p, end, meta >> 8, meta & 0xFF, buf, sizeof(buf));
+			if (n > 0)
+				lua_pushstring (L, buf);
+			return n;
+		case MYSQL_TYPE_YEAR:
+			if (end - p < 1)
+				return -1;
+			lua_pushinteger (L, *p == 0 ? 0 : 1900 + *p);
+			return 1;
+		case MYSQL_TYPE_DATE: case MYSQL_TYPE_NEWDATE:
+			if (end - p < 3)
+				return -1;
+			v = binlog_le (p, 3);
+			t.day = (unsigned int)(v & 31);
+			t.month = (unsigned int)((v >> 5) & 15);
+			t.year = (unsigned int)(v >> 9);
+			t.time_type = MYSQL_TIMESTAMP_DATE;
+			push_temporal (L, &t, b->temporal, 0);
+			return 3;
+		case MYSQL_TYPE_TIME: {
+			long hms;
+			if (end - p < 3)
+				return -1;
+			v = binlog_le (p, 3);
+			hms = (long)(v & 0x800000 ? (int64_t)(v | ~0xFFFFFFULL) : (int64_t)v);
+			t.neg = hms < 0;
+			if (hms < 0)
+				hms = -hms;
+			t.hour = (unsigned int)(hms / 10000);
+			t.minute = (unsigned int)(hms / 100 % 100);
+			t.second = (unsigned int)(hms % 100);
+			t.time_type = MYSQL_TIMESTAMP_TIME;
+			push_temporal (L, &t, b->temporal, 0);
+			return 3;
+		}
+		case MYSQL_TYPE_DATETIME:
+			if (end - p < 8)
+				return -1;
+			v = binlog_le (p, 8);
+			t.year = (unsigned int)(v / 10000000000ULL);
+			t.month = (unsigned int)(v / 100000000 % 100);
+			t.day = (unsigned int)(v / 1000000 % 100);
+			t.hour = (unsigned int)(v / 10000 % 100);
+			t.minute = (unsigned int)(v / 100 % 100);
+			t.second = (unsigned int)(v % 100);
+			t.time_type = MYSQL_TIMESTAMP_DATETIME;
+			push_temporal (L, &t, b->temporal, 0);
+			return 8;
+		case MYSQL_TYPE_TIMESTAMP: case MYSQL_TYPE_TIMESTAMP2:
+			fsp = type == MYSQL_TYPE_TIMESTAMP2 ? (int)meta : 0;
+			n = 4 + (fsp + 1) / 2;
+			if (end - p < n)
+				return -1;
+			v = type == MYSQL_TYPE_TIMESTAMP2 ? binlog_be (p, 4) : binlog_le (p, 4);
+			if (v != 0) {
+				/* stored in UTC */
+				civil_from_days ((long long)(v / 86400), &t);
+				t.hour = (unsigned int)(v % 86400 / 3600);
+				t.minute = (unsigned int)(v % 3600 / 60);
+				t.second = (unsigned int)(v % 60);
+			}
+			if (fsp > 0)
+				t.second_part = (unsigned long)(binlog_be (p + 4, n - 4) * (fsp <= 2 ? 10000 : fsp <= 4 ? 100 : 1));
+			t.time_type = MYSQL_TIMESTAMP_DATETIME;
+			push_temporal (L, &t, b->temporal, fsp);
+			return n;
+		case MYSQL_TYPE_DATETIME2: {
+			int64_t intpart;
+			fsp = (int)meta;
+			n = 5 + (fsp + 1) / 2;
+			if (end - p < n)
+				return -1;
+			intpart = (int64_t)binlog_be (p, 5) - 0x8000000000LL;
+			v = fsp > 0 ? binlog_be (p + 5, n - 5) * (fsp <= 2 ? 10000 : fsp <= 4 ? 100 : 1) : 0;
+			binlog_datetime (intpart * (1LL << 24) + (int64_t)v, &t);
+			push_temporal (L, &t, b->temporal, fsp);
+			return n;
+		}
+		case MYSQL_TYPE_TIME2: {
+			int64_t intpart, frac, packed;
+			fsp = (int)meta;
+			n = 3 + (fsp + 1) / 2;
+			if (end - p < n)
+				return -1;
+			intpart = (int64_t)binlog_be (p, 3) - 0x800000;
+			if (fsp >= 5)
+				packed = (int64_t)binlog_be (p, 6) - 0x800000000000LL;
+			else {
+				frac = fsp > 0 ? (int64_t)binlog_be (p + 3, n - 3) : 0;
+				if (intpart < 0 && frac != 0) {
+					/* negative values borrow from the fraction */
+					intpart++;
+					frac -= fsp <= 2 ? 0x100 : 0x10000;
+				}
+				packed = intpart * (1LL << 24) + frac * (fsp <= 2 ? 10000 : 100);
+			}
+			binlog_time (packed, &t);
+			push_temporal (L, &t, b->temporal, fsp);
+			return n;
+		}
+		case MYSQL_TYPE_BIT:
+			n = (int)((meta >> 8) + ((meta & 0xFF) != 0));
+			if (n > 8 || end - p < n)
+				return -1;
+			lua_pushinteger (L, (lua_Integer)binlog_be (p, n));
+			return n;
+		case MYSQL_TYPE_ENUM: case MYSQL_TYPE_SET:
+			n = (int)(meta & 0xFF);
+			if (n < 1 || n > 8 || end - p < n)
+				return -1;
+			lua_pushinteger (L, (lua_Integer)binlog_le (p, n));
+			return n;
+		case MYSQL_TYPE_VARCHAR: case MYSQL_TYPE_VAR_STRING: case MYSQL_TYPE_STRING:
+			n = meta < 256 ? 1 : 2;
+			break;
+		case MYSQL_TYPE_BLOB: case MYSQL_TYPE_TINY_BLOB: case MYSQL_TYPE_MEDIUM_BLOB:
+		case MYSQL_TYPE_LONG_BLOB: case MYSQL_TYPE_GEOMETRY: case MYSQL_TYPE_JSON:
+			n = (int)meta;
+			if (n < 1 || n > 4)
+				return -1;
+			break;
+		default:
+			return -1;
+	}
+	/* length-prefixed values */
+	if (end - p < n)
+		return -1;
+	len = (size_t)binlog_le (p, n);
+	if ((size_t)(end - p - n) < len)
+		return -1;
+	if (type == MYSQL_TYPE_JSON) {
+		sqlbuf text = {NULL, 0, 0, 0};
+		int status = 0;
+		if (len == 0)
+			sqlbuf_add (&text, "null", 4);
+		else
+			status = binlog_jsonvalue (&text, p[n], p + n + 1, p + n + len, 0);
+		if (status != 0 || text.oom) {
+			free (text.data);
+			return -1;
+		}
+		if (b->json)
+			json_decode (L, text.data, text.len);
+		else
+			lua_pushlstring (L, text.data, text.len);
+		free (text.data);
+	}
+	else
+		lua_pushlstring (L, (const char *)p + n, len);
+	return n + (int)len;
+}
+
 
-    lua_pushboolean(L, 1);
-    return 1;
+static void binlog_freetable (binlog_table *t) {
+	int i;
+	if (t->colnames != NULL)
+		for (i = 0; i < t->ncols; i++)
+			free (t->colnames[i]);
+	free (t->colnames);
+	free (t->schema);
+	free (t->name);
+	free (t->types);
+	free (t->meta);
+	free (t->unsig);
+	memset (t, 0, sizeof(binlog_table));
+}
+
+static binlog_table *binlog_findtable (binlog_data *b, uint64_t id) {
+	int i;
+	for (i = 0; i < b->ntables; i++)
+		if (b->tables[i].id == id)
+			return &b->tables[i];
+	return NULL;
 }
 
 
+/*
+** Check whether the query text of an event is exactly the given word.
+*/
+static int binlog_isword (const unsigned char *sql, size_t len, const char *word) {
+	size_t i;
+	if (len != strlen (word))
+		return 0;
+	for (i = 0; i < len; i++)
+		if (toupper (sql[i]) != word[i])
+			return 0;
+	return 1;
+}
 
-static int stmt_execute(lua_State *L) {
-	stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT);
-	MYSQL_RES * res;
-	MYSQL_FIELD *fields;
-	unsigned int num_cols;
-	if (mysql_stmt_execute(stmt->stmt)) {
 
-		printf("[ERROR] mysql_stmt_execute() failed: %s\n", mysql_stmt_error(stmt->stmt));
-		int n = luasql_failmsg(L, "error executing query (stmt_execute). MySQL: ", mysql_stmt_error(stmt->stmt));
-		return n;
-	}
-	if (mysql_stmt_store_result(stmt->stmt)) {
-		int n = luasql_failmsg(L, "error executing query (stmt_store_result). MySQL: ", mysql_stmt_error(stmt->stmt));
-		return n;
+/*
+** Check a table against the tables option: "schema.table" or
+** "schema.*" must be in it.
+*/
+static int binlog_wanted (lua_State *L, binlog_data *b, const char *schema, const char *name) {
+	int wanted;
+	if (b->filter == LUA_NOREF)
+		return 1;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, b->filter);
+	lua_pushfstring (L, "%s.%s", schema, name);
+	lua_rawget (L, -2);
+	lua_pushfstring (L, "%s.*", schema);
+	lua_rawget (L, -3);
+	wanted = lua_toboolean (L, -1) || lua_toboolean (L, -2);
+	lua_pop (L, 3);
+	return wanted;
+}
+
+
+/*
+** Remember the columns of a table from a table map event.  Return 0, or
+** -1 if the event is malformed or memory runs out.
+*/
+static int binlog_tablemap (lua_State *L, binlog_data *b, const unsigned char *p, const unsigned char *end) {
+	int idlen = b->posthdr[BINLOG_TABLE_MAP - 1] == 6 ? 4 : 6;
+	const unsigned char *schema, *name, *types, *meta, *metaend;
+	size_t schemalen, namelen;
+	uint64_t id, ncols, metalen, i;
+	binlog_table *t;
+	if (end - p < b->posthdr[BINLOG_TABLE_MAP - 1] + 1)
+		return -1;
+	id = binlog_le (p, idlen);
+	p += b->posthdr[BINLOG_TABLE_MAP - 1];
+	schemalen = *p++;
+	schema = p;
+	if ((size_t)(end - p) < schemalen + 2)
+		return -1;
+	p += schemalen + 1;
+	namelen = *p++;
+	name = p;
+	if ((size_t)(end - p) < namelen + 1)
+		return -1;
+	p += namelen + 1;
+	if ((p = binlog_packed (p, end, &ncols)) == NULL || ncols > 4096 || (uint64_t)(end - p) < ncols)
+		return -1;
+	types = p;
+	p += ncols;
+	if ((p = binlog_packed (p, end, &metalen)) == NULL || (uint64_t)(end - p) < metalen + (ncols + 7) / 8)
+		return -1;
+	meta = p;
+	metaend = p + metalen;
+	p = metaend + (ncols + 7) / 8; /* skip the nullable bitmap */
+
+	if ((t = binlog_findtable (b, id)) != NULL)
+		binlog_freetable (t);
+	else {
+		if (b->ntables == BINLOG_MAXTABLES) {
+			for (i = 0; i < (uint64_t)b->ntables; i++)
+				binlog_freetable (&b->tables[i]);
+			b->ntables = 0;
+		}
+		if (b->tables == NULL &&
+			(b->tables = (binlog_table *)calloc (BINLOG_MAXTABLES, sizeof(binlog_table))) == NULL)
+			return -1;
+		t = &b->tables[b->ntables++];
 	}
-	res = mysql_stmt_result_metadata(stmt->stmt);
-	num_cols = mysql_stmt_field_count(stmt->stmt);
-	fields = mysql_fetch_fields(res);
-	if (res) {
-		return create_stmt_cursor(L, stmt->stmt, res, num_cols, fields);
+	t->id = id;
+	t->ncols = (int)ncols;
+	t->schema = (char *)malloc (schemalen + 1);
+	t->name = (char *)malloc (namelen + 1);
+	t->types = (unsigned char *)malloc (ncols + 1);
+	t->meta = (unsigned int *)calloc (ncols + 1, sizeof(unsigned int));
+	t->unsig = (unsigned char *)calloc (ncols + 1, 1);
+	if (t->schema == NULL || t->name == NULL || t->types == NULL || t->meta == NULL || t->unsig == NULL)
+		return -1;
+	memcpy (t->schema, schema, schemalen);
+	t->schema[schemalen] = '\0';
+	memcpy (t->name, name, namelen);
+	t->name[namelen] = '\0';
+	memcpy (t->types, types, ncols);
+
+	/* per-type metadata, 0 to 2 bytes per column */
+	for (i = 0; i < ncols; i++) {
+		int size;
+		switch (types[i]) {
+			case MYSQL_TYPE_FLOAT: case MYSQL_TYPE_DOUBLE: case MYSQL_TYPE_BLOB:
+			case MYSQL_TYPE_GEOMETRY: case MYSQL_TYPE_JSON: case MYSQL_TYPE_TIMESTAMP2:
+			case MYSQL_TYPE_DATETIME2: case MYSQL_TYPE_TIME2:
+				size = 1;
+				break;
+			case MYSQL_TYPE_VARCHAR: case MYSQL_TYPE_VAR_STRING: case MYSQL_TYPE_BIT:
+			case MYSQL_TYPE_NEWDECIMAL: case MYSQL_TYPE_STRING:
+			case MYSQL_TYPE_ENUM: case MYSQL_TYPE_SET:
+				size = 2;
+				break;
+			default:
+				size = 0;
+		}
+		if (metaend - meta < size)
+			return -1;
+		if (size == 1)
+			t->meta[i] = meta[0];
+		else if (size == 2 && (types[i] == MYSQL_TYPE_VARCHAR || types[i] == MYSQL_TYPE_VAR_STRING ||
+			types[i] == MYSQL_TYPE_BIT))
+			t->meta[i] = meta[0] | (meta[1] << 8);
+		else if (size == 2)
+			t->meta[i] = (meta[0] << 8) | meta[1];
+		meta += size;
 	}
 
-	if(num_cols == 0) { /* no tuples returned */
-	/* query does not return data (it was not a SELECT) */
-		lua_pushinteger(L, mysql_stmt_affected_rows(stmt->stmt));
-		return 1;
-	} else { /* mysql_use_result() should have returned data */
-		return luasql_failmsg(L, "error retrieving result. MySQL: ", mysql_stmt_error(stmt->stmt));
+	/* optional metadata: signedness and, with FULL row metadata, names */
+	while (p < end) {
+		int field = *p++;
+		uint64_t len;
+		const unsigned char *q;
+		if ((p = binlog_packed (p, end, &len)) == NULL || (uint64_t)(end - p) < len)
+			return -1;
+		q = p;
+		p += len;
+		if (field == 1) {
+			int bit = 0;
+			for (i = 0; i < ncols; i++) {
+				if (!is_numeric_column (types[i]))
+					continue;
+				if (bit / 8 < (int)len)
+					t->unsig[i] = (q[bit / 8] >> (7 - bit % 8)) & 1;
+				bit++;
+			}
+		}
+		else if (field == 4) {
+			if ((t->colnames = (char **)calloc (ncols, sizeof(char *))) == NULL)
+				return -1;
+			for (i = 0; i < ncols && q < p; i++) {
+				uint64_t n;
+				if ((q = binlog_packed (q, p, &n)) == NULL || (uint64_t)(p - q) < n ||
+					(t->colnames[i] = (char *)malloc (n + 1)) == NULL)
+					return -1;
+				memcpy (t->colnames[i], q, n);
+				t->colnames[i][n] = '\0';
+				q += n;
+			}
+			if (i < ncols) {
+				for (i = 0; i < ncols; i++)
+					free (t->colnames[i]);
+				free (t->colnames);
+				t->colnames = NULL;
+			}
+		}
 	}
+	t->wanted = (short)binlog_wanted (L, b, t->schema, t->name);
+	return 0;
 }
 
-static int stmt_finalize(lua_State *L) {
-    stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT);
 
-    if (!stmt->closed) {
-        mysql_stmt_close(stmt->stmt);
-        stmt->closed = 1;
+/*
+** Push a row image: a table of the columns present in it, keyed by name
+** when the server sends names and by position otherwise.  SQL NULL is
+** mysql.null, so that it differs from a column left out of the image.
+** Return the position after the image, or NULL if it is malformed.
+*/
+static const unsigned char *binlog_image (lua_State *L, binlog_data *b, binlog_table *t, int ncols,
+		const unsigned char *present, const unsigned char *p, const unsigned char *end) {
+	const unsigned char *nulls = p;
+	int i, k, count = 0;
+	for (i = 0; i < ncols; i++)
+		count += (present[i / 8] >> (i % 8)) & 1;
+	if (end - p < (count + 7) / 8)
+		return NULL;
+	p += (count + 7) / 8;
+	lua_createtable (L, t->colnames ? 0 : ncols, t->colnames ? count : 0);
+	for (i = 0, k = 0; i < ncols; i++) {
+		if (!((present[i / 8] >> (i % 8)) & 1))
+			continue;
+		if ((nulls[k / 8] >> (k % 8)) & 1)
+			lua_pushlightuserdata (L, NULL);
+		else {
+			int n = binlog_value (L, b, t->types[i], t->meta[i], t->unsig[i], p, end);
+			if (n < 0) {
+				lua_pop (L, 1);
+				return NULL;
+			}
+			p += n;
+		}
+		k++;
+		if (t->colnames != NULL) {
+			lua_pushstring (L, t->colnames[i]);
+			lua_insert (L, -2);
+			lua_rawset (L, -3);
+		}
+		else
+			lua_rawseti (L, -2, i + 1);
+	}
+	return p;
+}
+
 
-        for (unsigned int i = 0; i < stmt->num_params; i++) {
-            if (stmt->params_data[i].str) {
-                free(stmt->params_data[i].str);
-                stmt->params_data[i].str = NULL;
-            }
-        }
+/*
+** Push a change: op, schema, table and the GTID and time of its
+** transaction.
+*/
+static void binlog_change (lua_State *L, binlog_data *b, const char *op, const char *schema,
+		const char *table, uint32_t when) {
+	lua_createtable (L, 0, 7);
+	lua_pushstring (L, op);
+	lua_setfield (L, -2, "op");
+	lua_pushstring (L, schema);
+	lua_setfield (L, -2, "schema");
+	if (table != NULL) {
+		lua_pushstring (L, table);
+		lua_setfield (L, -2, "table");
+	}
+	if (b->hasgtid) {
+		sqlbuf gtid = {NULL, 0, 0, 0};
+		char num[32];
+		gtid_adduuid (&gtid, b->uuid);
+		snprintf (num, sizeof(num), ":%lld", (long long)b->gno);
+		sqlbuf_addstr (&gtid, num);
+		if (!gtid.oom) {
+			lua_pushlstring (L, gtid.data, gtid.len);
+			lua_setfield (L, -2, "gtid");
+		}
+		free (gtid.data);
+	}
+	lua_pushinteger (L, (lua_Integer)when);
+	lua_setfield (L, -2, "timestamp");
+}
 
-        free(stmt->params_data);
-        stmt->params_data = NULL;
 
-        free(stmt->params);
-        stmt->params = NULL;
+/*
+** Decode a rows event into one change per row, appended to the batch at
+** index batch after *n changes.  Return 0, or -1 if it is malformed.
+*/
+static int binlog_rows (lua_State *L, binlog_data *b, int type, uint32_t when,
+		const unsigned char *p, const unsigned char *end, int batch, int *n) {
+	int v2 = type >= BINLOG_WRITE_ROWS;
+	int op = v2 ? type - BINLOG_WRITE_ROWS : type - BINLOG_WRITE_ROWS_V1;
+	int hdr = b->posthdr[type - 1], idlen = hdr == 6 ? 4 : 6;
+	static const char *const ops[] = {"insert", "update", "delete"};
+	const unsigned char *before, *after = NULL;
+	uint64_t id, ncols;
+	binlog_table *t;
+	if (end - p < idlen + 2)
+		return -1;
+	id = binlog_le (p, idlen);
+	p += idlen + 2;
+	if (v2) {
+		/* extra row data, whose length counts its own 2 bytes */
+		uint64_t extra;
+		if (end - p < 2 || (extra = binlog_le (p, 2)) < 2 || (uint64_t)(end - p) < extra)
+			return -1;
+		p += extra;
+	}
+	if ((t = binlog_findtable (b, id)) == NULL)
+		return -1;
+	if (!t->wanted)
+		return 0;
+	if ((p = binlog_packed (p, end, &ncols)) == NULL || ncols > (uint64_t)t->ncols ||
+		(uint64_t)(end - p) < (ncols + 7) / 8 * (op == 1 ? 2 : 1))
+		return -1;
+	before = p;
+	p += (ncols + 7) / 8;
+	if (op == 1) {
+		after = p;
+		p += (ncols + 7) / 8;
+	}
+	while (p < end) {
+		binlog_change (L, b, ops[op], t->schema, t->name, when);
+		p = binlog_image (L, b, t, (int)ncols, before, p, end);
+		if (p == NULL) {
+			lua_pop (L, 1);
+			return -1;
+		}
+		lua_setfield (L, -2, op == 0 ? "after" : "before");
+		if (op == 1) {
+			if ((p = binlog_image (L, b, t, (int)ncols, after, p, end)) == NULL) {
+				lua_pop (L, 1);
+				return -1;
+			}
+			lua_setfield (L, -2, "after");
+		}
+		lua_rawseti (L, batch, ++(*n));
+	}
+	return 0;
+}
 
-        luaL_unref(L, LUA_REGISTRYINDEX, stmt->conn);
-    }
 
-    lua_pushboolean(L, 1);
-    return 1;
+/*
+** Close the transaction being read: its GTID joins the executed set and
+** its end becomes the position to resume from.
+*/
+static int binlog_commit (binlog_data *b, uint32_t logpos) {
+	if (b->hasgtid && b->gtids && gtid_add (&b->executed, b->uuid, b->gno, b->gno + 1) != 0)
+		return -1;
+	if (logpos != 0 && b->file != NULL) {
+		if (b->commitfile == NULL || strcmp (b->commitfile, b->file) != 0) {
+			free (b->commitfile);
+			if ((b->commitfile = strdup (b->file)) == NULL)
+				return -1;
+		}
+		b->commitpos = logpos;
+	}
+	b->intrx = 0;
+	b->hasgtid = 0;
+	return 0;
 }
 
 
 /*
-** Commit the current transaction.
+** Handle one event.  Changes of the open transaction are appended to the
+** batch at index batch after the first *n.  Return BINLOG_NEXT,
+** BINLOG_COMMIT, BINLOG_IDLE or -1 on error, with a message in errmsg.
 */
-static int conn_commit (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	lua_pushboolean(L, !mysql_commit(conn->my_conn));
-	return 1;
+static int binlog_event (lua_State *L, binlog_data *b, const unsigned char *ev, size_t len,
+		int batch, int *n, int committed, char *errmsg, size_t errlen) {
+	const unsigned char *p = ev + BINLOG_HEADER, *end;
+	uint32_t when, logpos;
+	int type;
+	if (len < BINLOG_HEADER + (size_t)b->checksum) {
+		snprintf (errmsg, errlen, "truncated binlog event");
+		return -1;
+	}
+	when = (uint32_t)binlog_le (ev, 4);
+	type = ev[4];
+	logpos = (uint32_t)binlog_le (ev + 13, 4);
+	end = ev + len - b->checksum;
+	switch (type) {
+		case BINLOG_FORMAT:
+			/* version, server version, time and header length precede the post-header lengths */
+			if (end - p > 57) {
+				size_t count = (size_t)(end - p - 57);
+				memcpy (b->posthdr, p + 57, count < sizeof(b->posthdr) ? count : sizeof(b->posthdr));
+			}
+			return BINLOG_NEXT;
+		case BINLOG_ROTATE:
+			if (end - p >= 8) {
+				char *file = (char *)malloc (end - p - 8 + 1);
+				if (file == NULL)
+					break;
+				memcpy (file, p + 8, end - p - 8);
+				file[end - p - 8] = '\0';
+				free (b->file);
+				b->file = file;
+				if (b->commitfile == NULL && (b->commitfile = strdup (file)) != NULL)
+					b->commitpos = binlog_le (p, 8);
+			}
+			return BINLOG_NEXT;
+		case BINLOG_GTID:
+			if (end - p < 25)
+				break;
+			memcpy (b->uuid, p + 1, 16);
+			b->gno = (int64_t)binlog_le (p + 17, 8);
+			b->hasgtid = 1;
+			return BINLOG_NEXT;
+		case BINLOG_ANONYMOUS_GTID:
+			b->hasgtid = 0;
+			return BINLOG_NEXT;
+		case BINLOG_TABLE_MAP:
+			if (binlog_tablemap (L, b, p, end) != 0)
+				break;
+			return BINLOG_NEXT;
+		case BINLOG_WRITE_ROWS_V1: case BINLOG_UPDATE_ROWS_V1: case BINLOG_DELETE_ROWS_V1:
+		case BINLOG_WRITE_ROWS: case BINLOG_UPDATE_ROWS: case BINLOG_DELETE_ROWS:
+			if (binlog_rows (L, b, type, when, p, end, batch, n) != 0)
+				break;
+			return BINLOG_NEXT;
+		case BINLOG_XID:
+			if (binlog_commit (b, logpos) != 0)
+				break;
+			return BINLOG_COMMIT;
+		case BINLOG_QUERY: {
+			int hdr = b->posthdr[BINLOG_QUERY - 1];
+			const unsigned char *db, *sql;
+			size_t dblen, sqllen, skip;
+			if (hdr < 13 || end - p < hdr)
+				break;
+			dblen = p[8];
+			skip = hdr + (size_t)binlog_le (p + 11, 2); /* status variables */
+			if ((size_t)(end - p) < skip + dblen + 1)
+				break;
+			p += skip;
+			db = p;
+			sql = p + dblen + 1;
+			sqllen = (size_t)(end - sql);
+			if (binlog_isword (sql, sqllen, "BEGIN")) {
+				b->intrx = 1;
+				return BINLOG_NEXT;
+			}
+			if (binlog_isword (sql, sqllen, "ROLLBACK")) {
+				/* drop what the transaction wrote to non-transactional tables */
+				while (*n > committed) {
+					lua_pushnil (L);
+					lua_rawseti (L, batch, (*n)--);
+				}
+				b->intrx = 0;
+				b->hasgtid = 0;
+				return BINLOG_NEXT;
+			}
+			if (b->intrx && !binlog_isword (sql, sqllen, "COMMIT"))
+				return BINLOG_NEXT; /* statement-based changes are not decoded */
+			if (!b->intrx && b->filter == LUA_NOREF) {
+				/* a statement on its own: DDL */
+				lua_pushlstring (L, (const char *)db, dblen);
+				binlog_change (L, b, "ddl", lua_tostring (L, -1), NULL, when);
+				lua_pushlstring (L, (const char *)sql, sqllen);
+				lua_setfield (L, -2, "query");
+				lua_rawseti (L, batch, ++(*n));
+				lua_pop (L, 1);
+			}
+			if (binlog_commit (b, logpos) != 0)
+				break;
+			return BINLOG_COMMIT;
+		}
+		case BINLOG_HEARTBEAT: case BINLOG_HEARTBEAT_V2:
+			return BINLOG_IDLE;
+		case BINLOG_PARTIAL_UPDATE:
+			snprintf (errmsg, errlen, "partial JSON updates are not supported;"
+				" set binlog_row_value_options to ''");
+			return -1;
+		case BINLOG_PAYLOAD:
+			snprintf (errmsg, errlen, "compressed transactions are not supported;"
+				" turn binlog_transaction_compression off");
+			return -1;
+		default:
+			return BINLOG_NEXT;
+	}
+	snprintf (errmsg, errlen, "malformed binlog event of type %d at %s:%lu", type,
+		b->file ? b->file : "?", (unsigned long)logpos);
+	return -1;
 }
 
 
+static binlog_data *getbinlog (lua_State *L) {
+	binlog_data *b = (binlog_data *)luaL_checkudata (L, 1, LUASQL_BINLOG_MYSQL);
+	luaL_argcheck (L, b != NULL, 1, LUASQL_PREFIX"binlog stream expected");
+	luaL_argcheck (L, !b->closed, 1, LUASQL_PREFIX"binlog stream is closed");
+	return b;
+}
+
 
 /*
-** Rollback the current transaction.
+** Return the next batch of changes: an array of whole transactions,
+** returned once it holds at least `batch` changes, once idle_ms have
+** passed since its first transaction or once the server has gone idle.
+** Return nil when the server ends the stream, or nil and a message on
+** error.
 */
-static int conn_rollback (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	lua_pushboolean(L, !mysql_rollback(conn->my_conn));
+static int binlog_next (lua_State *L) {
+	binlog_data *b = getbinlog (L);
+	char errmsg[256] = "";
+	int batch, n = 0, committed = 0, status = BINLOG_NEXT;
+	long long since = 0;               /* now_ms () at the first commit */
+	if (b->error != NULL)
+		return luasql_failmsg (L, "error reading binlog. MySQL: ", b->error);
+	if (b->ended) {
+		lua_pushnil (L);
+		return 1;
+	}
+	lua_newtable (L);
+	batch = lua_gettop (L);
+	for (;;) {
+		if (mysql_binlog_fetch (b->my_conn, &b->rpl)) {
+			snprintf (errmsg, sizeof(errmsg), "%s", mysql_error (b->my_conn));
+			status = -1;
+			break;
+		}
+		if (b->rpl.size == 0) {
+			status = -2; /* end of stream */
+			break;
+		}
+		/* skip the OK byte before the event */
+		status = binlog_event (L, b, b->rpl.buffer + 1, b->rpl.size - 1, batch, &n, committed,
+			errmsg, sizeof(errmsg));
+		if (status < 0)
+			break;
+		if (status == BINLOG_COMMIT && committed == 0 && n > 0)
+			since = now_ms ();
+		if (status == BINLOG_COMMIT)
+			committed = n;
+		/* a steady trickle never lets the heartbeat through */
+		if ((status == BINLOG_COMMIT && committed >= b->batch) ||
+			(status == BINLOG_IDLE && committed > 0 && !b->intrx) ||
+			(committed > 0 && !b->intrx && now_ms () - since >= b->idle_ms))
+			break;
+	}
+	/* changes of a transaction cut short are read again on resume */
+	while (n > committed) {
+		lua_pushnil (L);
+		lua_rawseti (L, batch, n--);
+	}
+	if (status == -2)
+		b->ended = 1;
+	if (status == -1 && committed > 0)
+		b->error = strdup (errmsg);
+	else if (status == -1)
+		return luasql_failmsg (L, "error reading binlog. MySQL: ", errmsg);
+	else if (status == -2 && committed == 0)
+		lua_pushnil (L);
 	return 1;
 }
 
 
 /*
-** Set "auto commit" property of the connection. Modes ON/OFF
+** Return where to resume from: {gtid_set=, file=, position=} after the
+** last transaction returned.  gtid_set is absent when the stream was
+** opened from a file and position.
 */
-static int conn_setautocommit (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	if (lua_toboolean (L, 2)) {
-		mysql_autocommit(conn->my_conn, 1); /* Set it ON */
+static int binlog_position (lua_State *L) {
+	binlog_data *b = getbinlog (L);
+	lua_createtable (L, 0, 3);
+	if (b->gtids) {
+		sqlbuf text = {NULL, 0, 0, 0};
+		gtid_format (&b->executed, &text);
+		if (text.oom) {
+			free (text.data);
+			return luaL_error (L, LUASQL_PREFIX"out of memory");
+		}
+		lua_pushlstring (L, text.data ? text.data : "", text.len);
+		lua_setfield (L, -2, "gtid_set");
+		free (text.data);
 	}
-	else {
-		mysql_autocommit(conn->my_conn, 0);
+	if (b->commitfile != NULL) {
+		lua_pushstring (L, b->commitfile);
+		lua_setfield (L, -2, "file");
+		lua_pushinteger (L, (lua_Integer)b->commitpos);
+		lua_setfield (L, -2, "position");
 	}
-	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int binlog_settemporal (lua_State *L) {
+	binlog_data *b = getbinlog (L);
+	b->temporal = (short)luaL_checkoption (L, 2, NULL, temporal_modes);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+static int binlog_setjson (lua_State *L) {
+	binlog_data *b = getbinlog (L);
+	b->json = (short)lua_toboolean (L, 2);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+static void binlog_nullify (lua_State *L, binlog_data *b) {
+	int i;
+	b->closed = 1;
+	if (b->dumping)
+		mysql_binlog_close (b->my_conn, &b->rpl);
+	b->dumping = 0;
+	if (b->my_conn != NULL)
+		mysql_close (b->my_conn);
+	b->my_conn = NULL;
+	for (i = 0; i < b->ntables; i++)
+		binlog_freetable (&b->tables[i]);
+	free (b->tables);
+	b->tables = NULL;
+	b->ntables = 0;
+	gtid_free (&b->executed);
+	free (b->file);
+	free (b->commitfile);
+	free (b->error);
+	b->file = b->commitfile = b->error = NULL;
+	luaL_unref (L, LUA_REGISTRYINDEX, b->filter);
+	luaL_unref (L, LUA_REGISTRYINDEX, b->env);
+	b->filter = b->env = LUA_NOREF;
+}
+
+static int binlog_gc (lua_State *L) {
+	binlog_data *b = (binlog_data *)luaL_checkudata (L, 1, LUASQL_BINLOG_MYSQL);
+	if (b != NULL && !b->closed)
+		binlog_nullify (L, b);
+	return 0;
+}
+
+static int binlog_close (lua_State *L) {
+	binlog_data *b = (binlog_data *)luaL_checkudata (L, 1, LUASQL_BINLOG_MYSQL);
+	if (b->closed) {
+		lua_pushboolean (L, 0);
+		lua_pushstring (L, "binlog stream is already closed");
+		return 2;
+	}
+	binlog_nullify (L, b);
+	lua_pushboolean (L, 1);
 	return 1;
 }
 
 
 /*
-** Get Last auto-increment id generated
+** Prepare the dedicated connection and start the dump: announce the
+** checksum algorithm, ask for heartbeats after idle_ms of silence and
+** pick the starting point.  Return 0, or -1 with a message in errmsg.
 */
-static int conn_getlastautoid (lua_State *L) {
-  conn_data *conn = getconnection(L);
-  lua_pushinteger(L, mysql_insert_id(conn->my_conn));
-  return 1;
+static int binlog_start (binlog_data *b, unsigned int server_id, const char *gtids,
+		const char *file, uint64_t position, long long idle_ms, char *errmsg, size_t errlen) {
+	MYSQL *my_conn = b->my_conn;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	char sql[160];
+	if ((res = scan_query (my_conn, "SELECT @@GLOBAL.binlog_checksum")) == NULL)
+		goto fail;
+	row = mysql_fetch_row (res);
+	b->checksum = row != NULL && row[0] != NULL && strcmp (row[0], "NONE") != 0 ? 4 : 0;
+	mysql_free_result (res);
+	snprintf (sql, sizeof(sql), "SET @source_binlog_checksum = @@GLOBAL.binlog_checksum,"
+		" @master_binlog_checksum = @@GLOBAL.binlog_checksum");
+	if (mysql_real_query (my_conn, sql, strlen (sql)))
+		goto fail;
+	snprintf (sql, sizeof(sql), "SET @source_heartbeat_period = %lld, @master_heartbeat_period = %lld",
+		idle_ms * 1000000, idle_ms * 1000000);
+	if (mysql_real_query (my_conn, sql, strlen (sql)))
+		goto fail;
+
+	if (gtids == NULL && file == NULL) {
+		/* from now on: after the executed set, or the current position */
+		if ((res = scan_query (my_conn, "SELECT @@GLOBAL.gtid_mode, @@GLOBAL.gtid_executed")) == NULL)
+			goto fail;
+		if ((row = mysql_fetch_row (res)) != NULL && row[0] != NULL && strcmp (row[0], "ON") == 0 &&
+			row[1] != NULL) {
+			b->gtids = 1;
+			if (gtid_parse (&b->executed, row[1]) != 0) {
+				mysql_free_result (res);
+				snprintf (errmsg, errlen, "could not read the executed GTID set");
+				return -1;
+			}
+		}
+		mysql_free_result (res);
+		if (!b->gtids) {
+			if ((res = scan_query (my_conn, "SHOW BINARY LOG STATUS")) == NULL &&
+				(res = scan_query (my_conn, "SHOW MASTER STATUS")) == NULL)
+				goto fail;
+			if ((row = mysql_fetch_row (res)) == NULL || row[0] == NULL || row[1] == NULL) {
+				mysql_free_result (res);
+				snprintf (errmsg, errlen, "binary logging is disabled");
+				return -1;
+			}
+			b->file = strdup (row[0]);
+			position = strtoull (row[1], NULL, 10);
+			mysql_free_result (res);
+		}
+	}
+	else if (gtids != NULL) {
+		b->gtids = 1;
+		if (gtid_parse (&b->executed, gtids) != 0) {
+			snprintf (errmsg, errlen, "invalid GTID set");
+			return -1;
+		}
+	}
+	else
+		b->file = strdup (file);
+	if (!b->gtids && b->file == NULL) {
+		snprintf (errmsg, errlen, "out of memory");
+		return -1;
+	}
+
+	memset (&b->rpl, 0, sizeof(MYSQL_RPL));
+	b->rpl.server_id = server_id;
+	if (b->gtids) {
+		b->rpl.flags = MYSQL_RPL_GTID;
+		b->rpl.start_position = 4;
+		b->rpl.gtid_set_encoded_size = gtid_encodedsize (&b->executed);
+		b->rpl.fix_gtid_set = binlog_encodegtids;
+		b->rpl.gtid_set_arg = &b->executed;
+	}
+	else {
+		b->rpl.file_name = b->file;
+		b->rpl.file_name_length = strlen (b->file);
+		b->rpl.start_position = position;
+		b->commitfile = strdup (b->file);
+		b->commitpos = position;
+	}
+	if (mysql_binlog_open (my_conn, &b->rpl))
+		goto fail;
+	b->dumping = 1;
+	return 0;
+fail:
+	snprintf (errmsg, errlen, "%s", mysql_error (my_conn));
+	return -1;
 }
+#endif
+
 
 /*
-** Create a new Connection object and push it on top of the stack.
+** Stream row changes from the binary log of a server.
+**     env:binlog_stream{connection=conn, server_id=N,
+**                       gtid_set=text | file=name, position=n,
+**                       tables={"db.t", "db.*", ...},
+**                       batch=changes, idle_ms=ms}
+** A new connection is opened with the parameters of conn and registered
+** as a replica with the given server_id.  Without gtid_set or file the
+** stream starts at the current end of the log.
 */
-static int create_connection (lua_State *L, int env, MYSQL *const my_conn) {
-	conn_data *conn = (conn_data *)LUASQL_NEWUD(L, sizeof(conn_data));
-	luasql_setmeta (L, LUASQL_CONNECTION_MYSQL);
-	/* fill in structure */
-	conn->closed = 0;
-	conn->env = LUA_NOREF;
-	conn->my_conn = my_conn;
-	lua_pushvalue (L, env);
-	conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
+static int env_binlog (lua_State *L) {
+#ifdef LUASQL_BINLOG
+	conn_data *conn;
+	binlog_data *b;
+	const char *gtids, *file;
+	lua_Integer server_id, position, batch, idle_ms;
+	char errmsg[256] = "";
+	int n, i;
+	getenvironment (L);
+	luaL_checktype (L, 2, LUA_TTABLE);
+	lua_getfield (L, 2, "connection");
+	conn = (conn_data *)luaL_testudata (L, -1, LUASQL_CONNECTION_MYSQL);
+	luaL_argcheck (L, conn != NULL && !conn->closed, 2, "option 'connection' must be an open connection");
+	lua_pop (L, 1);
+	server_id = opt_integer (L, 2, "server_id", 0);
+	luaL_argcheck (L, server_id > 0 && server_id <= 0xFFFFFFFFLL, 2, "option 'server_id' must be a positive 32-bit integer");
+	gtids = opt_string (L, 2, "gtid_set", NULL);
+	file = opt_string (L, 2, "file", NULL);
+	luaL_argcheck (L, gtids == NULL || file == NULL, 2, "options 'gtid_set' and 'file' exclude each other");
+	position = opt_integer (L, 2, "position", 4);
+	batch = opt_integer (L, 2, "batch", 100);
+	idle_ms = opt_integer (L, 2, "idle_ms", 500);
+	luaL_argcheck (L, position >= 4 && batch > 0 && idle_ms > 0, 2, "invalid binlog stream options");
+
+	b = (binlog_data *)LUASQL_NEWUD (L, sizeof(binlog_data));
+	memset (b, 0, sizeof(binlog_data));
+	b->closed = 1; /* until every field is set */
+	b->filter = b->env = LUA_NOREF;
+	luasql_setmeta (L, LUASQL_BINLOG_MYSQL);
+	lua_pushvalue (L, 1);
+	b->env = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_getfield (L, 2, "tables");
+	if (lua_istable (L, -1)) {
+		/* the list becomes a set */
+		n = (int)luaL_len (L, -1);
+		lua_createtable (L, 0, n);
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti (L, -2, i);
+			lua_pushboolean (L, 1);
+			lua_rawset (L, -3);
+		}
+		b->filter = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	lua_pop (L, 1);
+	b->batch = (int)batch;
+	b->idle_ms = idle_ms;
+	b->temporal = conn->temporal;
+	b->json = conn->json;
+	/* table maps and rows v2 until the format description says otherwise */
+	memset (b->posthdr, 0, sizeof(b->posthdr));
+	b->posthdr[BINLOG_QUERY - 1] = 13;
+	b->posthdr[BINLOG_TABLE_MAP - 1] = 8;
+	for (i = BINLOG_WRITE_ROWS_V1; i <= BINLOG_DELETE_ROWS_V1; i++)
+		b->posthdr[i - 1] = 8;
+	for (i = BINLOG_WRITE_ROWS; i <= BINLOG_DELETE_ROWS; i++)
+		b->posthdr[i - 1] = 10;
+
+	lib_thread ();
+	b->my_conn = params_connect (&conn->params, errmsg, sizeof(errmsg));
+	if (b->my_conn == NULL ||
+		binlog_start (b, (unsigned int)server_id, gtids, file, (uint64_t)position, idle_ms,
+			errmsg, sizeof(errmsg)) != 0) {
+		binlog_nullify (L, b);
+		return luasql_failmsg (L, "error opening binlog stream. MySQL: ", errmsg);
+	}
+	b->closed = 0;
 	return 1;
+#else
+	return luasql_faildirect (L, "binlog streams need the MySQL 8.0 client library");
+#endif
 }
 
 
+#ifdef LUASQL_MULTIPLEX
 /*
-** Connects to a data source.
-**     param: one string for each connection parameter, said
-**     datasource, username, password, host and port.
+** Read the result of query #i of env:multiplex, whose connections and
+** result list are at stack indices conns and results, and store its
+** entry at position pos of the list.  When the query could not be
+** sent, sent is 0 and the entry holds the error.
 */
-static int env_connect (lua_State *L) {
-	const char *sourcename = luaL_checkstring(L, 2);
-	const char *username = luaL_optstring(L, 3, NULL);
-	const char *password = luaL_optstring(L, 4, NULL);
-	const char *host = luaL_optstring(L, 5, NULL);
-	const int port = luaL_optinteger(L, 6, 0);
-	const char *unix_socket = luaL_optstring(L, 7, NULL);
-	const long client_flag = (long)luaL_optinteger(L, 8, 0);
-	MYSQL *conn;
-	getenvironment(L); /* validade environment */
+static void mux_read (lua_State *L, mux_query *q, int i, int sent, int conns, int results, int pos) {
+	conn_data *conn = q[i].conn;
+	MYSQL_RES *res = NULL;
+	row_store *store = NULL;
+	char errmsg[256] = "";
+	int ok = sent && mysql_read_query_result (conn->my_conn) == 0;
+	unsigned int cols = ok ? mysql_field_count (conn->my_conn) : 0;
+	if (!ok)
+		strncpy (errmsg, mysql_error (conn->my_conn), sizeof(errmsg) - 1);
+	else if (cols > 0 && (res = conn_storeresult (conn, &store, errmsg, sizeof(errmsg))) == NULL &&
+		errmsg[0] == '\0')
+		strncpy (errmsg, mysql_error (conn->my_conn), sizeof(errmsg) - 1);
+	while (ok && mysql_more_results (conn->my_conn) && mysql_next_result (conn->my_conn) == 0)
+		mysql_free_result (mysql_store_result (conn->my_conn));  /* only the first result is kept */
+	lua_createtable (L, 0, 4);
+	lua_pushinteger (L, i + 1);
+	lua_setfield (L, -2, "index");
+	lua_pushinteger (L, now_ms () - q[i].start);
+	lua_setfield (L, -2, "ms");
+	if (q[i].killed) {
+		if (res != NULL)
+			mysql_free_result (res);
+		store_free (store);
+		lua_pushboolean (L, 1);
+		lua_setfield (L, -2, "timeout");
+		lua_pushliteral (L, "query timed out");
+		lua_setfield (L, -2, "error");
+	}
+	else if (errmsg[0] != '\0') {
+		lua_pushstring (L, errmsg);
+		lua_setfield (L, -2, "error");
+	}
+	else if (res != NULL) {
+		cur_data *cur;
+		lua_rawgeti (L, conns, i + 1);
+		create_cursor (L, conn, lua_gettop (L), res, (int)cols, 0);
+		cur = (cur_data *)lua_touserdata (L, -1);
+		cur->store = store;
+		cur_account (cur);
+		lua_setfield (L, -3, "cursor");
+		lua_pop (L, 1);
+	}
+	else {
+		lua_pushinteger (L, (lua_Integer)mysql_affected_rows (conn->my_conn));
+		lua_setfield (L, -2, "affected");
+	}
+	lua_rawseti (L, results, pos);
+}
+#endif
 
-	/* Try to init the connection object. */
-	conn = mysql_init(NULL);
-	if (conn == NULL)
-		return luasql_faildirect(L, "error connecting: Out of memory.");
 
-	if (!mysql_real_connect(conn, host, username, password, 
-		sourcename, port, unix_socket, client_flag))
-	{
-		char error_msg[100];
-		strncpy (error_msg,  mysql_error(conn), 99);
-		mysql_close (conn); /* Close conn if connect failed */
-		return luasql_failmsg (L, "error connecting to database. MySQL: ", error_msg);
+/*
+** env:multiplex(conns, queries [, {order="request"|"completion",
+**                                  timeout_ms=ms}])
+** Send queries[i] on conns[i], all at once, and wait for their results
+** on one epoll set.  A query may be {sql, timeout_ms=ms}.  Return a
+** list of {index=i, ms=elapsed, cursor=c | affected=n | error=msg,
+** timeout=true}, in request or completion order.  Queries past their
+** timeout are interrupted with KILL QUERY from a second connection,
+** opened before any query is sent.
+*/
+static int env_multiplex (lua_State *L) {
+#ifdef LUASQL_MULTIPLEX
+	mux_query *q;
+	struct epoll_event ev, events[64];
+	const char *order;
+	lua_Integer timeout;
+	int n, i, j, ep, inflight = 0, done = 0, completion, results;
+	getenvironment (L);
+	luaL_checktype (L, 2, LUA_TTABLE);
+	luaL_checktype (L, 3, LUA_TTABLE);
+	n = (int)lua_rawlen (L, 3);
+	luaL_argcheck (L, (int)lua_rawlen (L, 2) == n, 2, "one connection per query expected");
+	order = opt_string (L, 4, "order", "request");
+	completion = strcmp (order, "completion") == 0;
+	luaL_argcheck (L, completion || strcmp (order, "request") == 0, 4, "order must be 'request' or 'completion'");
+	timeout = opt_integer (L, 4, "timeout_ms", 0);
+	luaL_argcheck (L, timeout >= 0, 4, "invalid timeout");
+	q = (mux_query *)lua_newuserdata (L, (n > 0 ? n : 1) * sizeof(mux_query));
+	for (i = 0; i < n; i++) {
+		lua_rawgeti (L, 2, i + 1);
+		q[i].conn = (conn_data *)luaL_testudata (L, -1, LUASQL_CONNECTION_MYSQL);
+		if (q[i].conn == NULL || q[i].conn->closed)
+			return luaL_error (L, LUASQL_PREFIX"connection #%d is not an open connection", i + 1);
+		if (q[i].conn->streaming)
+			return luaL_error (L, LUASQL_PREFIX"connection #%d is busy with an unbuffered cursor", i + 1);
+		for (j = 0; j < i; j++)
+			if (q[j].conn == q[i].conn)
+				return luaL_error (L, LUASQL_PREFIX"connection #%d is given twice", i + 1);
+		lua_pop (L, 1);
+		q[i].timeout = timeout;
+		q[i].killed = 0;
+		lua_rawgeti (L, 3, i + 1);
+		if (lua_istable (L, -1)) {
+			q[i].timeout = opt_integer (L, lua_gettop (L), "timeout_ms", timeout);
+			lua_rawgeti (L, -1, 1);
+			lua_remove (L, -2);  /* the string stays anchored in the query table */
+		}
+		if (lua_type (L, -1) != LUA_TSTRING)
+			return luaL_error (L, LUASQL_PREFIX"query #%d must be a string or {sql, timeout_ms=ms}", i + 1);
+		q[i].sql = lua_tolstring (L, -1, &q[i].len);
+		lua_pop (L, 1);
+	}
+	if ((ep = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+		return luasql_faildirect (L, "could not create an epoll set");
+	/* no connect may hold up the loop: KILL QUERY needs the control connections now */
+	for (i = 0; i < n; i++) {
+		conn_data *conn = q[i].conn;
+		char errmsg[256];
+		if (q[i].timeout > 0 && conn->control == NULL)
+			conn->control = params_connect (&conn->params, errmsg, sizeof(errmsg));
+	}
+	lua_createtable (L, n, 0);
+	results = lua_gettop (L);
+	for (i = 0; i < n; i++) {
+		conn_data *conn = q[i].conn;
+		if (conn->pending != NULL) /* unread result sets of a CALL */
+			stmt_cur_drain (conn->pending);
+		q[i].start = now_ms ();
+		q[i].deadline = q[i].timeout > 0 ? q[i].start + q[i].timeout : 0;
+		ev.events = EPOLLIN;
+		ev.data.u32 = (uint32_t)i;
+		if (mysql_send_query (conn->my_conn, q[i].sql, (unsigned long)q[i].len) != 0)
+			mux_read (L, q, i, 0, 2, results, completion ? ++done : i + 1);
+		else if (epoll_ctl (ep, EPOLL_CTL_ADD, conn->my_conn->net.fd, &ev) != 0)
+			mux_read (L, q, i, 1, 2, results, completion ? ++done : i + 1);  /* waits for it */
+		else
+			inflight++;
+	}
+	while (inflight > 0) {
+		long long now = now_ms (), wait = -1;
+		int k;
+		for (i = 0; i < n; i++) {
+			if (q[i].deadline == 0 || q[i].killed)
+				continue;
+			if (q[i].deadline <= now) {
+				q[i].killed = 1;
+				if (conn_killquery (q[i].conn, mysql_thread_id (q[i].conn->my_conn), 0) != 0) /* then the connection is given up */
+					shutdown (q[i].conn->my_conn->net.fd, SHUT_RDWR);
+			}
+			else if (wait < 0 || q[i].deadline - now < wait)
+				wait = q[i].deadline - now;
+		}
+		k = epoll_wait (ep, events, 64, wait > INT_MAX ? INT_MAX : (int)wait);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k < 0) { /* read what is left without waiting for readiness */
+			for (i = 0; i < n; i++)
+				if (epoll_ctl (ep, EPOLL_CTL_DEL, q[i].conn->my_conn->net.fd, NULL) == 0)
+					mux_read (L, q, i, 1, 2, results, completion ? ++done : i + 1);
+			break;
+		}
+		for (j = 0; j < k; j++) {
+			i = (int)events[j].data.u32;
+			epoll_ctl (ep, EPOLL_CTL_DEL, q[i].conn->my_conn->net.fd, NULL);
+			mux_read (L, q, i, 1, 2, results, completion ? ++done : i + 1);
+			inflight--;
+		}
 	}
-	return create_connection(L, 1, conn);
+	close (ep);
+	return 1;
+#else
+	return luasql_faildirect (L, "multiplexing needs Linux epoll");
+#endif
 }
 
 
@@ -906,6 +9645,15 @@ static int env_connect (lua_State *L) {
 static int env_gc (lua_State *L) {
 	env_data *env= (env_data *)luaL_checkudata (L, 1, LUASQL_ENVIRONMENT_MYSQL);	if (env != NULL && !(env->closed))
 		env->closed = 1;
+	if (env != NULL) {
+		tls_clear (&env->tls);
+		env->prof.on = 0;
+		prof_reset (L, &env->prof);
+		if (env->lib) {
+			env->lib = 0;
+			lib_release ();
+		}
+	}
 	return 0;
 }
 
@@ -921,7 +9669,7 @@ static int env_close (lua_State *L) {
 		lua_pushstring(L, "env is already closed");
 		return 2;
 	}
-	mysql_library_end();
+	/* the library is released when the last connection let go of env */
 	env->closed = 1;
 	lua_pushboolean (L, 1);
 	return 1;
@@ -937,6 +9685,13 @@ static void create_metatables (lua_State *L) {
 		{"__close", env_gc},
         {"close", env_close},
         {"connect", env_connect},
+		{"scan", env_scan},
+		{"router", env_router},
+		{"binlog_stream", env_binlog},
+		{"multiplex", env_multiplex},
+		{"memory", env_memory},
+		{"setprofile", env_setprofile},
+		{"profile", env_profile},
 		{NULL, NULL},
 	};
     struct luaL_Reg connection_methods[] = {
@@ -951,6 +9706,18 @@ static void create_metatables (lua_State *L) {
         {"setautocommit", conn_setautocommit},
 		{"getlastautoid", conn_getlastautoid},
 		{"prepare", conn_prepare},
+		{"autobatch", conn_autobatch},
+		{"flush", conn_flush},
+		{"stats", conn_getstats},
+		{"setreconnect", conn_setreconnect},
+		{"insert", conn_insert},
+		{"sync", conn_sync},
+		{"setprepareafter", conn_setprepareafter},
+		{"settemporal", conn_settemporal},
+		{"setjson", conn_setjson},
+		{"paginate", conn_paginate},
+		{"setresultlimit", conn_setresultlimit},
+		{"settimeout", conn_settimeout},
 		{NULL, NULL},
     };
     struct luaL_Reg cursor_methods[] = {
@@ -960,10 +9727,14 @@ static void create_metatables (lua_State *L) {
         {"getcolnames", cur_getcolnames},
         {"getcoltypes", cur_getcoltypes},
         {"fetch", cur_fetch},
+		{"export", cur_export},
+		{"rowhandle", cur_rowhandle},
         {"numrows", cur_numrows},
         {"seek", cur_seek},
 		{"nextresult", cur_next_result},
 		{"hasnextresult", cur_has_next_result},
+		{"settemporal", cur_settemporal},
+		{"setjson", cur_setjson},
 		{NULL, NULL},
     };
 	struct luaL_Reg statement_methods[] = {
@@ -974,12 +9745,62 @@ static void create_metatables (lua_State *L) {
         {"finalize", stmt_finalize},
         {NULL, NULL}
     };
+	struct luaL_Reg scan_methods[] = {
+		{"__gc", scan_gc},
+		{"__close", scan_gc},
+		{"__call", scan_call},
+		{"close", scan_close},
+		{NULL, NULL}
+	};
+	struct luaL_Reg row_methods[] = {
+		{"__gc", row_gc},
+		{"__len", row_len},
+		{"copy", row_copy},
+		{NULL, NULL}
+	};
+	struct luaL_Reg router_methods[] = {
+		{"__gc", router_gc},
+		{"__close", router_gc},
+		{"close", router_close},
+		{"execute", router_execute},
+		{"prepare", router_prepare},
+		{"commit", router_commit},
+		{"rollback", router_rollback},
+		{"setautocommit", router_setautocommit},
+		{"getlastautoid", router_getlastautoid},
+		{"conn", router_conn},
+		{"check", router_check},
+		{NULL, NULL}
+	};
+#ifdef LUASQL_BINLOG
+	struct luaL_Reg binlog_methods[] = {
+		{"__gc", binlog_gc},
+		{"__close", binlog_gc},
+		{"__call", binlog_next},
+		{"next", binlog_next},
+		{"position", binlog_position},
+		{"settemporal", binlog_settemporal},
+		{"setjson", binlog_setjson},
+		{"close", binlog_close},
+		{NULL, NULL}
+	};
+#endif
 	struct luaL_Reg statement_cursor_methods[] = {
 		{"__gc", stmt_cur_gc},
 		{"__close", stmt_cur_gc},
 		{"close", stmt_cur_close},
 		{"fields", stmt_cur_fields},
 		{"fetch", stmt_cur_fetch},
+		{"export", stmt_cur_export},
+		{"rowhandle", stmt_cur_rowhandle},
+		{"settemporal", stmt_cur_settemporal},
+		{"setjson", stmt_cur_setjson},
+		{"nextresult", stmt_cur_nextresult},
+		{"getcolnames", stmt_cur_getcolnames},
+		{"getcoltypes", stmt_cur_getcoltypes},
+		{"numrows", stmt_cur_numrows},
+		{"seek", stmt_cur_seek},
+		{"hasnextresult", stmt_cur_hasnextresult},
         {NULL, NULL}
     };
 
@@ -988,7 +9809,18 @@ static void create_metatables (lua_State *L) {
 	luasql_createmeta (L, LUASQL_CURSOR_MYSQL, cursor_methods);
 	luasql_createmeta(L, LUASQL_STATEMENT, statement_methods);
 	luasql_createmeta(L, LUASQL_STATEMENT_CURSOR, statement_cursor_methods);
-	lua_pop (L, 5);
+	luasql_createmeta(L, LUASQL_SCAN_MYSQL, scan_methods);
+	luasql_createmeta(L, LUASQL_ROUTER_MYSQL, router_methods);
+	luasql_createmeta(L, LUASQL_ROW_MYSQL, row_methods);
+	/* rows are indexed by column, not through their methods table */
+	lua_pushliteral (L, "__index");
+	lua_pushcfunction (L, row_index);
+	lua_rawset (L, -3);
+	lua_pop (L, 8);
+#ifdef LUASQL_BINLOG
+	luasql_createmeta (L, LUASQL_BINLOG_MYSQL, binlog_methods);
+	lua_pop (L, 1);
+#endif
 }
 
 
@@ -1000,6 +9832,15 @@ static int create_environment (lua_State *L) {
 	luasql_setmeta (L, LUASQL_ENVIRONMENT_MYSQL);
 
 	/* fill in structure */
+	env->closed = 1;  /* until the library is set up */
+	env->lib = 0;
+	pthread_mutex_init (&env->tls.lock, NULL);
+	env->tls.list = NULL;
+	memset (&env->prof, 0, sizeof(profiler));
+	env->prof.index = LUA_NOREF;
+	if (lib_acquire () != 0)
+		return luaL_error (L, LUASQL_PREFIX"could not initialize the MySQL client library");
+	env->lib = 1;
 	env->closed = 0;
 	return 1;
 }
@@ -1009,9 +9850,44 @@ static int create_environment (lua_State *L) {
 ** Creates the metatables for the objects and registers the
 ** driver open method.
 */
+/*
+** Set up the client library for the calling thread.  Environments and
+** connections do it on their own; this lets a host prepare its worker
+** threads up front.
+*/
+static int driver_thread_init (lua_State *L) {
+	lua_pushboolean (L, lib_thread () == 0);
+	return 1;
+}
+
+
+/*
+** Release the client library state of the calling thread before the
+** thread exits; it is released at exit otherwise.
+*/
+static int driver_thread_end (lua_State *L) {
+	lib_thread_end ();
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Monotonic time in seconds, for timing calls: unlike os.time it has
+** sub-second resolution, and unlike os.clock it counts waiting.
+*/
+static int driver_clock (lua_State *L) {
+	lua_pushnumber (L, (lua_Number)now_ns () / 1e9);
+	return 1;
+}
+
+
 LUASQL_API int luaopen_luasql_mysql (lua_State *L) { 
 	struct luaL_Reg driver[] = {
 		{"mysql", create_environment},
+		{"thread_init", driver_thread_init},
+		{"thread_end", driver_thread_end},
+		{"clock", driver_clock},
 		{NULL, NULL},
 	};
 	create_metatables (L);
@@ -1025,6 +9901,8 @@ lua_pushliteral (L, MARIADB_CLIENT_VERSION_STR);
 lua_pushliteral (L, MYSQL_SERVER_VERSION);
 #endif
     lua_settable (L, -3);
+	lua_pushlightuserdata (L, NULL); /* JSON null */
+	lua_setfield (L, -2, "null");
 	return 1;
 }
 
@@ -3,6 +3,7 @@
 ** See Copyright Notice in license.html
 */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "lua.h"
@@ -78,6 +79,51 @@ void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 	}
 	lua_pop(L, nup);	/* remove upvalues */
 }
+
+
+/*
+** Whether the value is a number without a fraction that fits in a
+** lua_Integer.
+*/
+LUASQL_API int luasql_isinteger (lua_State *L, int idx) {
+	lua_Number n;
+	if (lua_type(L, idx) != LUA_TNUMBER)
+		return 0;
+	n = lua_tonumber(L, idx);
+	return n == (lua_Number)(lua_Integer)n;
+}
+
+
+/*
+** Push the number written in s and return the length of s plus one,
+** or push nothing and return 0 if s is not a number.
+*/
+LUASQL_API size_t luasql_stringtonumber (lua_State *L, const char *s) {
+	char *end;
+	lua_Number n = strtod(s, &end);
+	if (end == s || *end != '\0')
+		return 0;
+	lua_pushnumber(L, n);
+	return (size_t)(end - s) + 1;
+}
+
+
+/*
+** Adapted from Lua 5.2.0
+*/
+LUASQL_API void *luasql_testudata (lua_State *L, int ud, const char *tname) {
+	void *p = lua_touserdata(L, ud);
+	if (p != NULL) {
+		if (lua_getmetatable(L, ud)) {
+			luaL_getmetatable(L, tname);
+			if (!lua_rawequal(L, -1, -2))
+				p = NULL;
+			lua_pop(L, 2);
+			return p;
+		}
+	}
+	return NULL;
+}
 #endif
 
 /*
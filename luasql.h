@@ -39,6 +39,42 @@ LUASQL_API void luasql_set_info (lua_State *L);
 
 #if !defined LUA_VERSION_NUM || LUA_VERSION_NUM==501
 void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup);
+
+/*
+** Lua 5.3 API used by the drivers, for Lua 5.1 and LuaJIT.  Numbers are
+** doubles there: an integer is a number without a fraction.
+*/
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+#define LUA_MAXINTEGER PTRDIFF_MAX
+#ifndef LUAMOD_API
+#define LUAMOD_API LUALIB_API
+#endif
+
+#define lua_rawlen(L, i) lua_objlen (L, (i))
+#define luaL_len(L, i) ((lua_Integer)lua_objlen (L, (i)))
+#define lua_absindex(L, i) \
+	((i) > 0 || (i) <= LUA_REGISTRYINDEX ? (i) : lua_gettop (L) + (i) + 1)
+
+/* these return the type of the value pushed since Lua 5.3 */
+#define lua_rawgeti(L, i, n) (lua_rawgeti (L, (i), (n)), lua_type (L, -1))
+#define lua_rawget(L, i) (lua_rawget (L, (i)), lua_type (L, -1))
+#define lua_getfield(L, i, k) (lua_getfield (L, (i), (k)), lua_type (L, -1))
+#define lua_gettable(L, i) (lua_gettable (L, (i)), lua_type (L, -1))
+
+/* an open io library file: FILE ** in Lua 5.1, IOFileUD in LuaJIT */
+typedef struct luaL_Stream { FILE *f; } luaL_Stream;
+
+#define lua_isinteger(L, i) luasql_isinteger (L, (i))
+#define lua_stringtonumber(L, s) luasql_stringtonumber (L, (s))
+#define luaL_testudata(L, i, t) luasql_testudata (L, (i), (t))
+LUASQL_API int luasql_isinteger (lua_State *L, int idx);
+LUASQL_API size_t luasql_stringtonumber (lua_State *L, const char *s);
+LUASQL_API void *luasql_testudata (lua_State *L, int idx, const char *tname);
 #endif
 
 /* Driver initialization functions prototypes */
@@ -0,0 +1,229 @@
+-- Row access for JIT compiled fetch loops.
+--
+--   local rows = require("mysql_ffi")
+--   for row in rows.each(cur) do
+--       local id, price, name = row:integer(1), row:number(2), row:string(3)
+--   end
+--
+-- Under LuaJIT the cursor is moved and read through the driver's C ABI
+-- with the FFI, so the loop makes no Lua C API call per row and can be
+-- compiled.  Under PUC Lua, or when the ABI cannot be loaded, the same
+-- interface runs on cur:fetch.
+local driver = require("mysql")
+
+local M = {}
+
+local ABI_VERSION = 1
+local STMT_CURSOR = 1
+
+local ok, ffi = pcall(require, "ffi")
+local C
+if ok then
+    ffi.cdef[[
+    typedef struct {
+        int            numcols;
+        unsigned int   generation;
+        char         **data;
+        unsigned long *lengths;
+        bool          *is_null;
+    } luasql_mysql_row;
+    typedef struct {
+        int year, month, day, hour, minute, second;
+        long microsecond;
+        int neg;
+    } luasql_mysql_time;
+    int luasql_mysql_ffi_version(void);
+    int luasql_mysql_next(void *cur, int kind, luasql_mysql_row *row);
+    int luasql_mysql_coltype(void *cur, int kind, int i);
+    int luasql_mysql_integer(void *cur, int kind, int i, long long *v);
+    int luasql_mysql_number(void *cur, int kind, int i, double *v);
+    int luasql_mysql_temporal(void *cur, int kind, int i, luasql_mysql_time *v);
+    ]]
+    -- The driver is already loaded; this finds the same library.
+    local path = package.searchpath("mysql", package.cpath)
+    ok, C = pcall(ffi.load, path)
+    ok = ok and C.luasql_mysql_ffi_version() == ABI_VERSION
+end
+
+-- True when rows are read through the FFI.
+M.ffi = ok and true or false
+M.driver = driver
+
+if M.ffi then
+    local Row = {}
+    Row.__index = Row
+
+    function Row:count()
+        return self.view.numcols
+    end
+
+    function Row:isnull(i)
+        local v = self.view
+        if v.is_null ~= nil then
+            return v.is_null[i - 1]
+        end
+        return v.data[i - 1] == nil
+    end
+
+    -- Pointer to the bytes of column i and their length, valid until the
+    -- cursor moves, or nil for NULL.
+    function Row:bytes(i)
+        if self:isnull(i) then
+            return nil
+        end
+        return self.view.data[i - 1], tonumber(self.view.lengths[i - 1])
+    end
+
+    function Row:string(i)
+        if self:isnull(i) then
+            return nil
+        end
+        return ffi.string(self.view.data[i - 1], self.view.lengths[i - 1])
+    end
+
+    function Row:int64(i)
+        if C.luasql_mysql_integer(self.handle, self.kind, i - 1, self.int) == 1 then
+            return self.int[0]
+        end
+    end
+
+    function Row:integer(i)
+        if C.luasql_mysql_integer(self.handle, self.kind, i - 1, self.int) == 1 then
+            return tonumber(self.int[0])
+        end
+    end
+
+    function Row:number(i)
+        if C.luasql_mysql_number(self.handle, self.kind, i - 1, self.num) == 1 then
+            return self.num[0]
+        end
+    end
+
+    -- Date or time of column i, with fields year .. microsecond and neg.
+    -- The value is reused by the next call.
+    function Row:time(i)
+        if C.luasql_mysql_temporal(self.handle, self.kind, i - 1, self.tm) == 1 then
+            return self.tm
+        end
+    end
+
+    function Row:coltype(i)
+        return C.luasql_mysql_coltype(self.handle, self.kind, i - 1)
+    end
+
+    -- Iterate over the rows of a cursor of either kind.  The same row
+    -- object is returned each time and reads the current row.  The
+    -- cursor is closed at the end.
+    function M.each(cur)
+        local handle, kind = cur:rowhandle()
+        local row = setmetatable({
+            cursor = cur,  -- keeps the cursor alive
+            handle = ffi.cast("void *", handle),
+            kind = kind,
+            view = ffi.new("luasql_mysql_row"),
+            int = ffi.new("long long[1]"),
+            num = ffi.new("double[1]"),
+            tm = ffi.new("luasql_mysql_time"),
+        }, Row)
+        return function()
+            local status = C.luasql_mysql_next(row.handle, kind, row.view)
+            if status > 0 then
+                return row
+            end
+            cur:close()
+            if status < 0 then
+                error("error fetching row", 2)
+            end
+            return nil
+        end
+    end
+else
+    local Row = {}
+    Row.__index = Row
+
+    function Row:count()
+        return self.numcols
+    end
+
+    function Row:isnull(i)
+        return self.values[i] == nil
+    end
+
+    function Row:bytes(i)
+        local v = self:string(i)
+        if v ~= nil then
+            return v, #v
+        end
+    end
+
+    function Row:string(i)
+        local v = self.values[i]
+        if v ~= nil then
+            return tostring(v)
+        end
+    end
+
+    function Row:integer(i)
+        local v = tonumber(self.values[i])
+        if v ~= nil and v == math.floor(v) then
+            return math.tointeger and math.tointeger(v) or v
+        end
+    end
+
+    Row.int64 = Row.integer
+
+    function Row:number(i)
+        return tonumber(self.values[i])
+    end
+
+    function Row:time(i)
+        local v = self.values[i]
+        if type(v) == "table" then
+            return v
+        end
+        if type(v) ~= "string" then
+            return nil
+        end
+        local t = {year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0, microsecond = 0, neg = 0}
+        local y, mo, d, rest = v:match("^(%d%d%d%d)%-(%d%d)%-(%d%d)(.*)$")
+        if y then
+            t.year, t.month, t.day = tonumber(y), tonumber(mo), tonumber(d)
+            rest = rest:match("^[ T](.*)$")
+        else
+            rest = v
+        end
+        if rest then
+            local neg, h, mi, s, f = rest:match("^(%-?)(%d+):(%d%d):(%d%d)%.?(%d*)$")
+            if not h then
+                return nil
+            end
+            t.neg = neg == "-" and 1 or 0
+            t.hour, t.minute, t.second = tonumber(h), tonumber(mi), tonumber(s)
+            t.microsecond = tonumber((f .. "000000"):sub(1, 6))
+        end
+        return t
+    end
+
+    function M.each(cur)
+        local _, kind = cur:rowhandle()
+        local row = setmetatable({values = {}, numcols = #cur:getcolnames()}, Row)
+        return function()
+            local values, err
+            if kind == STMT_CURSOR then
+                values, err = cur:fetch("n")
+            else
+                values, err = cur:fetch({}, "n")
+            end
+            if values == nil then
+                if err ~= nil then
+                    error(err, 2)
+                end
+                return nil
+            end
+            row.values = values
+            return row
+        end
+    end
+end
+
+return M
@@ -0,0 +1,69 @@
+-- Binlog stream: insert, update, delete and DDL events, and resuming
+-- from position().  Needs binlog_format=ROW and replication privileges.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... lua binlog.lua
+local mysql = require("mysql")
+local env = mysql.mysql()
+local db = os.getenv("MYSQL_DB") or "kct"
+local conn = assert(env:connect(db, os.getenv("MYSQL_USER") or "root",
+    os.getenv("MYSQL_PASSWORD") or "", os.getenv("MYSQL_HOST") or "localhost"))
+
+assert(conn:execute("DROP TABLE IF EXISTS binlog_t"))
+
+local function open(from)
+    local opts = {connection = conn, server_id = 4242, batch = 100, idle_ms = 200}
+    for k, v in pairs(from or {}) do
+        opts[k] = v
+    end
+    return assert(env:binlog_stream(opts))
+end
+
+-- Read batches until n changes of binlog_t (or its DDL) have arrived.
+local function collect(stream, n)
+    local got = {}
+    while #got < n do
+        local changes = assert(stream())
+        for _, c in ipairs(changes) do
+            if c.schema == db and (c.table == "binlog_t" or (c.op == "ddl" and c.query:find("binlog_t"))) then
+                got[#got + 1] = c
+            end
+        end
+    end
+    return got
+end
+
+-- Row images are keyed by name with binlog_row_metadata=FULL, else by number.
+local function col(row, name, i)
+    local v = row[name]
+    if v == nil then
+        v = row[i]
+    end
+    return v
+end
+
+local stream = open()
+assert(conn:execute("CREATE TABLE binlog_t (id INT PRIMARY KEY, v VARCHAR(10))"))
+assert(conn:execute("INSERT INTO binlog_t VALUES (1, 'a'), (2, 'b')"))
+assert(conn:execute("UPDATE binlog_t SET v = 'c' WHERE id = 2"))
+assert(conn:execute("DELETE FROM binlog_t WHERE id = 1"))
+
+local got = collect(stream, 5)
+assert(got[1].op == "ddl" and got[1].query:find("CREATE TABLE"), "DDL event missing")
+assert(got[2].op == "insert" and col(got[2].after, "id", 1) == 1 and got[2].before == nil)
+assert(got[3].op == "insert" and col(got[3].after, "v", 2) == "b")
+assert(got[4].op == "update" and col(got[4].before, "v", 2) == "b" and col(got[4].after, "v", 2) == "c")
+assert(got[5].op == "delete" and col(got[5].before, "id", 1) == 1 and got[5].after == nil)
+
+-- A new stream opened at position() sees only what came after it.
+local pos = stream:position()
+assert(pos.gtid_set or (pos.file and pos.position), "position() is empty")
+assert(stream:close())
+assert(conn:execute("INSERT INTO binlog_t VALUES (3, 'd')"))
+stream = open(pos.gtid_set and {gtid_set = pos.gtid_set} or {file = pos.file, position = pos.position})
+got = collect(stream, 1)
+assert(got[1].op == "insert" and col(got[1].after, "id", 1) == 3, "resumed at the wrong place")
+assert(stream:close())
+
+assert(conn:execute("DROP TABLE binlog_t"))
+conn:close()
+env:close()
+print("binlog: ok")
@@ -0,0 +1,41 @@
+-- Micro-benchmark of conn:escape on 1 KB to 10 MB inputs.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... lua escape_bench.lua
+local mysql = require("mysql")
+local env = mysql.mysql()
+local conn = assert(env:connect(os.getenv("MYSQL_DB") or "kct", os.getenv("MYSQL_USER") or "root",
+    os.getenv("MYSQL_PASSWORD") or "", os.getenv("MYSQL_HOST") or "localhost"))
+
+-- Text with one byte to escape every `every` bytes.
+local function payload(size, every)
+    if not every then
+        return string.rep("a", size)
+    end
+    local chunk = string.rep("a", every - 1) .. "'"
+    return string.rep(chunk, size // every + 1):sub(1, size)
+end
+
+local sizes = {1024, 16 * 1024, 256 * 1024, 1024 * 1024, 10 * 1024 * 1024}
+local mixes = {{"plain", nil}, {"1 in 100", 100}, {"1 in 4", 4}}
+
+print(string.format("%-10s %10s %10s", "input", "mix", "MB/s"))
+for _, size in ipairs(sizes) do
+    for _, mix in ipairs(mixes) do
+        local s = payload(size, mix[2])
+        local rounds = math.max(1, (64 * 1024 * 1024) // size)
+        local start = os.clock()
+        for _ = 1, rounds do
+            conn:escape(s)
+        end
+        local elapsed = os.clock() - start
+        print(string.format("%-10d %10s %10.0f", size, mix[1], size * rounds / elapsed / 1e6))
+    end
+end
+
+-- The escaped text must round-trip through the server.
+local s = payload(4096, 7) .. "\0\n\r\\\"\26"
+local cur = assert(conn:execute("SELECT '" .. conn:escape(s) .. "'"))
+assert(cur:fetch() == s)
+cur:close()
+
+conn:close()
+env:close()
@@ -0,0 +1,50 @@
+-- Reads the same rows through mysql_ffi from a plain and a prepared cursor.
+-- Under LuaJIT the FFI path must be the one used.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... luajit ffi_rows.lua
+local mysql = require("mysql")
+local rows = require("mysql_ffi")
+local env = mysql.mysql()
+local conn = assert(env:connect(os.getenv("MYSQL_DB") or "kct", os.getenv("MYSQL_USER") or "root",
+    os.getenv("MYSQL_PASSWORD") or "", os.getenv("MYSQL_HOST") or "localhost"))
+
+if jit then
+    assert(rows.ffi, "mysql.so was not built against LuaJIT; the FFI path is not used")
+end
+print("ffi: " .. tostring(rows.ffi))
+
+assert(conn:execute("DROP TABLE IF EXISTS ffi_rows_t"))
+assert(conn:execute("CREATE TABLE ffi_rows_t (id BIGINT PRIMARY KEY, price DOUBLE, name VARCHAR(20), " ..
+    "created DATETIME(6))"))
+assert(conn:execute("INSERT INTO ffi_rows_t VALUES (1, 2.5, 'one', '2024-05-01 12:30:45.000123'), " ..
+    "(2, NULL, NULL, NULL), (9007199254740993, -1, 'big', '1999-12-31 23:59:59')"))
+
+local query = "SELECT id, price, name, created FROM ffi_rows_t ORDER BY id"
+
+local function check(cur)
+    local seen = {}
+    for row in rows.each(cur) do
+        assert(row:count() == 4)
+        seen[#seen + 1] = row:integer(1)
+        if row:integer(1) == 1 then
+            assert(row:number(2) == 2.5 and row:string(3) == "one")
+            local t = row:time(4)
+            assert(t.year == 2024 and t.month == 5 and t.day == 1 and t.hour == 12)
+            assert(t.minute == 30 and t.second == 45 and t.microsecond == 123)
+        elseif row:integer(1) == 2 then
+            assert(row:isnull(2) and row:isnull(3) and row:isnull(4))
+            assert(row:number(2) == nil and row:string(3) == nil)
+        else
+            assert(tostring(row:int64(1)):match("9007199254740993"), "64-bit id lost")
+            assert(row:number(2) == -1 and row:string(3) == "big")
+        end
+    end
+    assert(#seen == 3 and seen[1] == 1 and seen[2] == 2)
+end
+
+check(assert(conn:execute(query)))
+check(assert(conn:prepare(query)):execute())
+
+assert(conn:execute("DROP TABLE ffi_rows_t"))
+conn:close()
+env:close()
+print("ffi_rows: ok")
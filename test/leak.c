@@ -0,0 +1,74 @@
+/*
+** Leak check: prepares a statement, runs it many times, changes the
+** shape of its result halfway and closes everything.  The result
+** buffers must be built once per shape, and LeakSanitizer must find
+** nothing when the Lua state is closed.
+**
+** Build mysql.so and this test with -fsanitize=address and run:
+**   cc -g -fsanitize=address -o leak leak.c -llua
+**   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... ./leak 1000
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+static const char *script =
+	"local db, user, password, host, iterations = ...\n"
+	"local driver = require('mysql')\n"
+	"local env = driver.mysql()\n"
+	"local conn = assert(env:connect(db, user, password, host))\n"
+	"assert(conn:execute('DROP TABLE IF EXISTS leak_t'))\n"
+	"assert(conn:execute('CREATE TABLE leak_t (id INT PRIMARY KEY, v TEXT)'))\n"
+	"assert(conn:execute(\"INSERT INTO leak_t VALUES (1, REPEAT('x', 5000)), (2, 'y')\"))\n"
+	"local stmt = assert(conn:prepare('SELECT * FROM leak_t WHERE id <= ?'))\n"
+	"local function run(n, ncols)\n"
+	"  for i = 1, n do\n"
+	"    stmt:bind(1, 2)\n"
+	"    local cur = assert(stmt:execute())\n"
+	"    local row = cur:fetch()\n"
+	"    assert(#row == ncols and #row[2] == 5000)\n"
+	"    assert(cur:fetch()[2] == 'y')\n"
+	"    cur:close()\n"
+	"  end\n"
+	"end\n"
+	"run(iterations, 2)\n"
+	"assert(conn:stats().result_rebuilds == 1)\n"
+	"assert(conn:execute('ALTER TABLE leak_t ADD COLUMN w INT NOT NULL DEFAULT 7'))\n"
+	"run(iterations, 3)\n"
+	"assert(conn:stats().result_rebuilds == 2)\n"
+	"local cur = assert(stmt:execute())\n"
+	"cur = nil\n"
+	"collectgarbage()\n"
+	"stmt:finalize()\n"
+	"assert(conn:execute('DROP TABLE leak_t'))\n"
+	"conn:close()\n"
+	"env:close()\n";
+
+static const char *env_or (const char *name, const char *def) {
+	const char *v = getenv (name);
+	return v != NULL ? v : def;
+}
+
+int main (int argc, char **argv) {
+	lua_State *L = luaL_newstate ();
+	int failed = 0;
+	luaL_openlibs (L);
+	if (luaL_loadstring (L, script) != LUA_OK)
+		failed = 1;
+	else {
+		lua_pushstring (L, env_or ("MYSQL_DB", "kct"));
+		lua_pushstring (L, env_or ("MYSQL_USER", "root"));
+		lua_pushstring (L, env_or ("MYSQL_PASSWORD", ""));
+		lua_pushstring (L, env_or ("MYSQL_HOST", "localhost"));
+		lua_pushinteger (L, argc > 1 ? atoi (argv[1]) : 500);
+		failed = lua_pcall (L, 5, 0, 0) != LUA_OK;
+	}
+	if (failed)
+		fprintf (stderr, "%s\n", lua_tostring (L, -1));
+	lua_close (L);
+	printf ("leak check: %s\n", failed ? "failed" : "ok");
+	return failed;
+}
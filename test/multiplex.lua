@@ -0,0 +1,45 @@
+-- Fan-out with env:multiplex: a fast query, a slow one and one stopped
+-- by its timeout, in completion order, within about the slowest time.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... lua multiplex.lua
+local mysql = require("mysql")
+local env = mysql.mysql()
+
+local function connect()
+    return assert(env:connect(os.getenv("MYSQL_DB") or "kct", os.getenv("MYSQL_USER") or "root",
+        os.getenv("MYSQL_PASSWORD") or "", os.getenv("MYSQL_HOST") or "localhost"))
+end
+
+local conns = {connect(), connect(), connect()}
+
+local start = mysql.clock()
+local results = env:multiplex(conns, {
+    "SELECT 1",
+    "SELECT SLEEP(0.5)",
+    -- runs for minutes unless stopped
+    {"SELECT BENCHMARK(1000000000, MD5('luasql'))", timeout_ms = 200},
+}, {order = "completion"})
+local elapsed = mysql.clock() - start
+
+assert(#results == 3)
+assert(results[1].index == 1 and tonumber(results[1].cursor:fetch()) == 1)
+assert(results[2].index == 3 and results[2].timeout and results[2].error, "the timed out query did not end first")
+assert(results[2].ms >= 200 and results[2].ms < 500, "timed out after " .. results[2].ms .. " ms")
+assert(results[3].index == 2 and tonumber(results[3].cursor:fetch()) == 0)
+assert(results[3].ms >= 500)
+-- the queries ran side by side, not one after the other
+assert(elapsed < 0.9, string.format("took %.3f s", elapsed))
+results[1].cursor:close()
+results[3].cursor:close()
+
+-- Request order, and every connection still works, the killed one too.
+results = env:multiplex(conns, {"SELECT 1", "SELECT 2", "SELECT 3"})
+for i, r in ipairs(results) do
+    assert(r.index == i and tonumber(r.cursor:fetch()) == i, r.error)
+    r.cursor:close()
+end
+
+for _, conn in ipairs(conns) do
+    conn:close()
+end
+env:close()
+print(string.format("multiplex: ok (%.0f ms for a 500 ms query)", elapsed * 1000))
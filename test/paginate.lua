@@ -0,0 +1,43 @@
+-- Pages through a table of 25 rows, 10 at a time, on a two-column key.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... lua paginate.lua
+local mysql = require("mysql")
+local env = mysql.mysql()
+local conn = assert(env:connect(os.getenv("MYSQL_DB") or "kct", os.getenv("MYSQL_USER") or "root",
+    os.getenv("MYSQL_PASSWORD") or "", os.getenv("MYSQL_HOST") or "localhost"))
+
+assert(conn:execute("DROP TABLE IF EXISTS paginate_t"))
+assert(conn:execute("CREATE TABLE paginate_t (grp INT, id INT, name VARCHAR(20), PRIMARY KEY (grp, id))"))
+for i = 1, 25 do
+    assert(conn:execute("INSERT INTO paginate_t VALUES (?, ?, ?)", i % 3, i, "row" .. i))
+end
+
+local function collect(opts, ...)
+    local sizes, seen = {}, {}
+    for page in conn:paginate("SELECT grp, id, name FROM paginate_t WHERE id > ?", opts, ...) do
+        sizes[#sizes + 1] = #page
+        for _, row in ipairs(page) do
+            assert(row.name == "row" .. row.id)
+            seen[#seen + 1] = row.grp * 100 + row.id
+        end
+    end
+    return sizes, seen
+end
+
+local sizes, seen = collect({key = {"grp", "id"}, page_size = 10}, 0)
+assert(#sizes == 3 and sizes[1] == 10 and sizes[2] == 10 and sizes[3] == 5)
+assert(#seen == 25)
+for i = 2, #seen do
+    assert(seen[i] > seen[i - 1], "rows out of key order")
+end
+
+-- Descending, with the query's own placeholder narrowing it to 20 rows.
+sizes, seen = collect({key = {"grp", "id"}, page_size = 10, desc = true}, 5)
+assert(#sizes == 2 and sizes[1] == 10 and sizes[2] == 10)
+for i = 2, #seen do
+    assert(seen[i] < seen[i - 1], "rows out of key order")
+end
+
+assert(conn:execute("DROP TABLE paginate_t"))
+conn:close()
+env:close()
+print("paginate: ok")
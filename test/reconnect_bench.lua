@@ -0,0 +1,57 @@
+-- Benchmark of TLS connect latency with and without session resumption.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... MYSQL_SSL_CA=ca.pem lua reconnect_bench.lua
+-- Without MYSQL_SSL_CA the server certificate is not verified (ssl_mode "required").
+local mysql = require("mysql")
+local env = mysql.mysql()
+
+local function params(reuse)
+    return {
+        database = os.getenv("MYSQL_DB") or "kct", user = os.getenv("MYSQL_USER") or "root",
+        password = os.getenv("MYSQL_PASSWORD") or "", host = os.getenv("MYSQL_HOST") or "localhost",
+        ssl_mode = os.getenv("MYSQL_SSL_CA") and "verify_ca" or "required",
+        ssl_ca = os.getenv("MYSQL_SSL_CA"), session_reuse = reuse,
+    }
+end
+
+local rounds = 200
+
+-- Connect and disconnect `rounds` times; return wall and client CPU
+-- milliseconds per connect and how many connects resumed a session.
+local function run(reuse)
+    local resumed = 0
+    local wall, cpu = mysql.clock(), os.clock()
+    for _ = 1, rounds do
+        local conn = assert(env:connect(params(reuse)))
+        if conn:stats().tls_resumed then
+            resumed = resumed + 1
+        end
+        conn:close()
+    end
+    wall, cpu = mysql.clock() - wall, os.clock() - cpu
+    return wall * 1000 / rounds, cpu * 1000 / rounds, resumed
+end
+
+-- Fill the session cache first, so the first resumed round is not a full handshake.
+assert(env:connect(params(true))):close()
+
+print(string.format("%-14s %10s %10s %8s", "session_reuse", "wall ms", "cpu ms", "resumed"))
+for _, reuse in ipairs({false, true}) do
+    local wall, cpu, resumed = run(reuse)
+    print(string.format("%-14s %10.2f %10.3f %8d", tostring(reuse), wall, cpu, resumed))
+    if reuse then
+        assert(resumed > 0, "no TLS session was resumed; needs a MySQL 8.0.29 or later client")
+    else
+        assert(resumed == 0)
+    end
+end
+
+-- A different CA must not resume the sessions cached above.
+if os.getenv("MYSQL_SSL_CA") then
+    local p = params(true)
+    p.ssl_mode, p.ssl_ca = "required", nil
+    local conn = assert(env:connect(p))
+    assert(not conn:stats().tls_resumed, "session resumed under different TLS settings")
+    conn:close()
+end
+
+env:close()
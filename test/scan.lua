@@ -0,0 +1,44 @@
+-- Parallel scan of a table of 1000 rows, and of an empty one.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... lua scan.lua
+local mysql = require("mysql")
+local env = mysql.mysql()
+local conn = assert(env:connect(os.getenv("MYSQL_DB") or "kct", os.getenv("MYSQL_USER") or "root",
+    os.getenv("MYSQL_PASSWORD") or "", os.getenv("MYSQL_HOST") or "localhost"))
+
+assert(conn:execute("DROP TABLE IF EXISTS scan_t"))
+assert(conn:execute("CREATE TABLE scan_t (id INT PRIMARY KEY, v INT)"))
+
+local function count(opts)
+    opts.connection, opts.key, opts.mode = conn, "id", "a"
+    local n, sum = 0, 0
+    for row in env:scan("scan_t", opts) do
+        n = n + 1
+        sum = sum + tonumber(row.v)
+    end
+    return n, sum
+end
+
+-- An empty table, and a filter that matches nothing, end at once.
+assert(count({partitions = 4}) == 0)
+
+for i = 1, 1000 do
+    assert(conn:execute("INSERT INTO scan_t VALUES (?, ?)", i, i * 2))
+end
+assert(count({partitions = 4, where = "v < 0"}) == 0)
+
+local n, sum = count({partitions = 4, pagesize = 64})
+assert(n == 1000 and sum == 1000 * 1001, "rows lost or repeated")
+
+-- More partitions than keys, and ordered output.
+local last = 0
+for row in env:scan("scan_t", {connection = conn, key = "id", partitions = 8, ordered = true,
+        where = "id <= 5", mode = "a"}) do
+    assert(tonumber(row.id) == last + 1, "rows out of key order")
+    last = last + 1
+end
+assert(last == 5)
+
+assert(conn:execute("DROP TABLE scan_t"))
+conn:close()
+env:close()
+print("scan: ok")
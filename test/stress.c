@@ -0,0 +1,98 @@
+/*
+** Stress test: N threads, each with its own Lua state, environment and
+** M connections, running conn:execute and stmt:execute in a loop.
+**
+** Build next to mysql.so and run:
+**   cc -O2 -o stress stress.c -llua -lpthread
+**   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... ./stress 16 4 500
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+static const char *script =
+	"local db, user, password, host, nconns, iterations = ...\n"
+	"local driver = require('mysql')\n"
+	"local env = driver.mysql()\n"
+	"local conns = {}\n"
+	"for i = 1, nconns do\n"
+	"  conns[i] = assert(env:connect(db, user, password, host))\n"
+	"end\n"
+	"for n = 1, iterations do\n"
+	"  local conn = conns[n % nconns + 1]\n"
+	"  local cur = assert(conn:execute('SELECT ? + 1, REPEAT(?, 10)', n, 'x'))\n"
+	"  local a, b = cur:fetch()\n"
+	"  assert(tonumber(a) == n + 1 and #b == 10)\n"
+	"  cur:close()\n"
+	"  local stmt = assert(conn:prepare('SELECT ? * 2'))\n"
+	"  stmt:bind(1, n)\n"
+	"  local scur = assert(stmt:execute())\n"
+	"  local row = scur:fetch()\n"
+	"  assert(tonumber(row[1]) == n * 2)\n"
+	"  scur:close()\n"
+	"  stmt:finalize()\n"
+	"end\n"
+	"for _, conn in ipairs(conns) do conn:close() end\n"
+	"env:close()\n"
+	"driver.thread_end()\n";
+
+static const char *db, *user, *password, *host;
+static int nconns, iterations;
+
+static const char *env_or (const char *name, const char *def) {
+	const char *v = getenv (name);
+	return v != NULL ? v : def;
+}
+
+static void *worker (void *arg) {
+	lua_State *L = luaL_newstate ();
+	int *failed = (int *)arg;
+	luaL_openlibs (L);
+	if (luaL_loadstring (L, script) != LUA_OK) {
+		fprintf (stderr, "%s\n", lua_tostring (L, -1));
+		*failed = 1;
+	}
+	else {
+		lua_pushstring (L, db);
+		lua_pushstring (L, user);
+		lua_pushstring (L, password);
+		lua_pushstring (L, host);
+		lua_pushinteger (L, nconns);
+		lua_pushinteger (L, iterations);
+		if (lua_pcall (L, 6, 0, 0) != LUA_OK) {
+			fprintf (stderr, "%s\n", lua_tostring (L, -1));
+			*failed = 1;
+		}
+	}
+	lua_close (L);
+	return NULL;
+}
+
+int main (int argc, char **argv) {
+	int nthreads = argc > 1 ? atoi (argv[1]) : 8;
+	pthread_t *threads;
+	int *failed, i, errors = 0;
+	nconns = argc > 2 ? atoi (argv[2]) : 4;
+	iterations = argc > 3 ? atoi (argv[3]) : 200;
+	db = env_or ("MYSQL_DB", "kct");
+	user = env_or ("MYSQL_USER", "root");
+	password = env_or ("MYSQL_PASSWORD", "");
+	host = env_or ("MYSQL_HOST", "localhost");
+	threads = (pthread_t *)calloc (nthreads, sizeof(pthread_t));
+	failed = (int *)calloc (nthreads, sizeof(int));
+	for (i = 0; i < nthreads; i++)
+		pthread_create (&threads[i], NULL, worker, &failed[i]);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join (threads[i], NULL);
+		errors += failed[i];
+	}
+	printf ("%d threads x %d connections x %d iterations: %d failed\n",
+		nthreads, nconns, iterations, errors);
+	free (threads);
+	free (failed);
+	return errors != 0;
+}
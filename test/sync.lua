@@ -0,0 +1,71 @@
+-- conn:sync: unchanged, changed, missing and deleted rows, a where
+-- clause, and a composite key, across chunk boundaries.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... lua sync.lua
+local mysql = require("mysql")
+local env = mysql.mysql()
+local conn = assert(env:connect(os.getenv("MYSQL_DB") or "kct", os.getenv("MYSQL_USER") or "root",
+    os.getenv("MYSQL_PASSWORD") or "", os.getenv("MYSQL_HOST") or "localhost"))
+
+local function counts(r, inserted, updated, deleted, unchanged)
+    assert(r.inserted == inserted and r.updated == updated and r.deleted == deleted and
+        r.unchanged == unchanged, string.format("inserted %d, updated %d, deleted %d, unchanged %d",
+        r.inserted, r.updated, r.deleted, r.unchanged))
+end
+
+-- The table's rows as "key=value" text, in key order.
+local function dump(sql)
+    local cur, out = assert(conn:execute(sql)), {}
+    local row = cur:fetch({}, "n")
+    while row do
+        out[#out + 1] = table.concat(row, "=")
+        row = cur:fetch(row, "n")
+    end
+    cur:close()
+    return table.concat(out, " ")
+end
+
+assert(conn:execute("DROP TABLE IF EXISTS sync_t"))
+assert(conn:execute("CREATE TABLE sync_t (id INT PRIMARY KEY, region VARCHAR(8), v INT)"))
+assert(conn:execute([[INSERT INTO sync_t VALUES (1, 'EU', 10), (2, 'EU', 20), (3, 'EU', 30),
+    (4, 'US', 40), (5, 'US', 50)]]))
+
+-- 1 unchanged, 2 changed, 6 missing; 3, 4 and 5 are not given.
+local rows = {
+    {id = 1, region = "EU", v = 10},
+    {id = 2, region = "EU", v = 21},
+    {id = 6, region = "EU", v = 60},
+}
+counts(assert(conn:sync("sync_t", "id", rows, {chunk = 2})), 1, 1, 0, 1)
+assert(dump("SELECT id, v FROM sync_t ORDER BY id") == "1=10 2=21 3=30 4=40 5=50 6=60")
+counts(assert(conn:sync("sync_t", "id", rows, {delete_missing = true, chunk = 2})), 0, 0, 3, 3)
+assert(dump("SELECT id, v FROM sync_t ORDER BY id") == "1=10 2=21 6=60")
+
+-- where limits the rows read and deleted.  Row 7 outside it is updated,
+-- not inserted, and row 8 outside it is not deleted.
+assert(conn:execute("INSERT INTO sync_t VALUES (7, 'US', 70), (8, 'US', 80)"))
+rows = {
+    {id = 1, region = "EU", v = 10},
+    {id = 7, region = "US", v = 71},
+}
+counts(assert(conn:sync("sync_t", "id", rows, {delete_missing = true, where = "region = 'EU'"})), 0, 1, 2, 1)
+assert(dump("SELECT id, v FROM sync_t ORDER BY id") == "1=10 7=71 8=80")
+
+-- A composite key, with columns listed explicitly.
+assert(conn:execute("DROP TABLE IF EXISTS sync_c"))
+assert(conn:execute("CREATE TABLE sync_c (a INT, b VARCHAR(8), v INT, PRIMARY KEY (a, b))"))
+assert(conn:execute("INSERT INTO sync_c VALUES (1, 'x', 1), (1, 'y', 2), (2, 'x', 3)"))
+rows = {
+    {a = 1, b = "x", v = 1},
+    {a = 1, b = "y", v = 5},
+    {a = 2, b = "y", v = 6},
+}
+local opts = {delete_missing = true, columns = {"v"}, chunk = 1}
+counts(assert(conn:sync("sync_c", {"a", "b"}, rows, opts)), 1, 1, 1, 1)
+assert(dump("SELECT a, b, v FROM sync_c ORDER BY a, b") == "1=x=1 1=y=5 2=y=6")
+counts(assert(conn:sync("sync_c", {"a", "b"}, rows, opts)), 0, 0, 0, 3)
+
+assert(conn:execute("DROP TABLE sync_t"))
+assert(conn:execute("DROP TABLE sync_c"))
+conn:close()
+env:close()
+print("sync: ok")
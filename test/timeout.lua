@@ -0,0 +1,52 @@
+-- Per-call timeouts: the watchdog stops a slow query with KILL QUERY
+-- and the connection stays usable.
+--   MYSQL_DB=kct MYSQL_USER=root MYSQL_PASSWORD=... lua timeout.lua
+local mysql = require("mysql")
+local env = mysql.mysql()
+local conn = assert(env:connect(os.getenv("MYSQL_DB") or "kct", os.getenv("MYSQL_USER") or "root",
+    os.getenv("MYSQL_PASSWORD") or "", os.getenv("MYSQL_HOST") or "localhost"))
+
+-- Runs for minutes unless stopped; a killed BENCHMARK fails the query.
+local slow = "SELECT BENCHMARK(1000000000, MD5('luasql'))"
+
+local function still_usable()
+    local cur = assert(conn:execute("SELECT 1"))
+    assert(tonumber(cur:fetch()) == 1)
+    cur:close()
+end
+
+local start = os.clock()
+local cur, err, kind = conn:execute(slow, {timeout_ms = 200})
+assert(cur == nil and kind == "timeout", tostring(err))
+assert(err:match("timed out after 200 ms"), err)
+assert(conn:stats().timeouts == 1)
+still_usable()
+
+-- The connection's default applies to calls without the option.
+conn:settimeout(200)
+cur, err, kind = conn:execute(slow)
+assert(cur == nil and kind == "timeout", tostring(err))
+assert(conn:stats().timeouts == 2)
+still_usable()
+
+-- A prepared statement takes its timeout from each execute, not from
+-- the one in force when it was prepared.
+local stmt = assert(conn:prepare("SELECT SLEEP(0.5)"))
+conn:settimeout(0)
+cur = assert(stmt:execute({timeout_ms = 0}))
+assert(tonumber(cur:fetch()) == 0, "SLEEP was cut short by the server")
+cur:close()
+local ok
+ok, err, kind = stmt:execute({timeout_ms = 100})
+if ok then -- a stopped SLEEP returns 1 instead of failing
+    assert(tonumber(ok:fetch()) == 1)
+    ok:close()
+else
+    assert(kind == "timeout", tostring(err))
+end
+stmt:close()
+still_usable()
+print(string.format("timeout: ok (%.2f s of client CPU)", os.clock() - start))
+
+conn:close()
+env:close()